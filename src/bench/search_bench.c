@@ -0,0 +1,216 @@
+/* search_bench.c: matching search keys against the library */
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <time.h>
+
+# include "../sharedlib/fold.h"
+# include "../playlist/songtable.h"
+# include "../playlist/wordindex.h"
+# include "../playlist/query.h"
+# include "../playlist/suggest.h"
+# include "../playlist/playlist.h"
+# include "../playlist/shards.h"
+# include "../playlist/orders.h"
+
+# define SONGS   1000000
+# define ROOT    "/tmp"
+# define ROUNDS  5
+
+/* each key, as it used to be matched and as it is matched now */
+static struct {
+  char *encoded, *folded;
+} keys [] = {
+  {"Venue", "venue"},                                 /* every song */
+  {"Number%20123456", "number 123456"},               /* a single song */
+  {"Bj%C3%B6rk", "bjork"},                            /* no song */
+  {NULL, NULL}
+};
+
+/* boolean queries, run through the word index */
+static char *queries [] = {
+  "artist 0042 venue",                        /* 250 songs */
+  "\"song title number 123456\"",             /* one song, a phrase */
+  "0042 \"album 07\" OR \"album 08\" -03",       /* a phrase or another */
+  "0001 OR 0002 OR 0003 \"album 03\"",
+  NULL
+};
+
+/* prefixes completed, as they are typed */
+static char *prefixes [] = {"a", "artist 004", "li", "venu", "zzz", NULL};
+
+/* full scans, run serially, in shards and with the library's orders */
+static struct {
+  char *key;
+  int sort, limit;
+} scans [] = {
+  {"", SORT_PATH, 50},                                /* every song, a page */
+  {"", SORT_PATH, -1},                                /* every song, sorted */
+  {"123456", SORT_NONE, -1},                          /* a single song */
+  {"venue", SORT_NONE, 50},                           /* every song */
+  {"venue", SORT_PATH, 50},                           /* every song, ranked */
+  {"bj%C3%B6rk", SORT_PATH, 50},                      /* no song */
+  {NULL, 0, 0}
+};
+
+static void
+__song_path (char *path, int i)
+{
+  sprintf (path, ROOT "/Artist %04d/Album %02d - Live at Venue/%02d - Song"
+           " Title Number %d.mp3", i / 250, (i / 12) % 21, i % 12 + 1, i);
+  return;
+}
+
+static double
+__seconds (struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start -> tv_sec)
+         + (now.tv_nsec - start -> tv_nsec) / 1e9;
+}
+
+/* run a scan, a checksum of the songs returned (in order) */
+static double
+__scan (songtable table, int i, long *sum)
+{
+  struct SearchOptions opts = {scans [i] . sort, 0, 0, scans [i] . limit};
+  struct timespec start;
+  searchiter iter;
+  int round, song, n;
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (round = 0; round < ROUNDS; round ++) {
+    if (search_open (table, scans [i] . key, &opts, &iter) < 0)
+      return -1;
+    for (*sum = n = 0; (song = search_next (iter)) >= 0; )
+      *sum = *sum * 31 + song + ++ n;
+    search_close (iter);
+  }
+  return __seconds (&start) / ROUNDS;
+}
+
+/* usage: search_bench [scanning threads, default one per cpu but one] */
+int
+main (int argc, char *argv [])
+{
+  char *kernels [] = {"scalar", "sse4.2", "avx2", NULL}, path [256], *text;
+  struct timespec start;
+  songtable table;
+  wordindex words;
+  query q;
+  suggest completions;
+  int i, k, round, song, matches, len, *result, *rank, found [SUGGEST_MAX];
+  long sum, sums [8];
+  double took, serial [8];
+
+  if ((table = songtable_init (ROOT)) == NULL) {
+    perror ("songtable_init");
+    return 1;
+  }
+  for (i = 0; i < SONGS; i ++) {
+    __song_path (path, i);
+    songtable_add (table, path);
+  }
+  songtable_seal (table, 0);
+  printf ("songs: %d, best kernel: %s\n", SONGS, fold_kernel_name ());
+
+  for (k = 0; keys [k] . encoded != NULL; k ++) {
+    printf ("key \"%s\":\n", keys [k] . folded);
+
+    /* before: a case sensitive strstr over the url encoded path */
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    for (round = 0; round < ROUNDS; round ++)
+      for (song = matches = 0; song < SONGS; song ++)
+        matches += strstr (songtable_client_path (table, song),
+                           keys [k] . encoded) != NULL;
+    took = __seconds (&start) / ROUNDS;
+    printf ("  %-8s %7d matches, %7.2f ms, %5.1f ns/song\n", "strstr",
+            matches, took * 1e3, took * 1e9 / SONGS);
+
+    for (i = 0; kernels [i] != NULL; i ++) {
+      if (fold_kernel (kernels [i]) < 0)
+        continue;
+      clock_gettime (CLOCK_MONOTONIC, &start);
+      for (round = 0; round < ROUNDS; round ++)
+        for (song = matches = 0; song < SONGS; song ++) {
+          text = songtable_folded_path (table, song, &len);
+          matches += fold_find (text, len, keys [k] . folded,
+                                strlen (keys [k] . folded)) >= 0;
+        }
+      took = __seconds (&start) / ROUNDS;
+      printf ("  %-8s %7d matches, %7.2f ms, %5.1f ns/song\n", kernels [i],
+              matches, took * 1e3, took * 1e9 / SONGS);
+    }
+  }
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  if ((words = wordindex_build (table)) == NULL) {
+    perror ("wordindex_build");
+    return 1;
+  }
+  printf ("word index: %zu bytes, built in %.2fs\n", wordindex_bytes (words),
+          __seconds (&start));
+  for (k = 0; queries [k] != NULL; k ++) {
+    q = query_parse (queries [k]);
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    for (round = 0; round < ROUNDS; round ++) {
+      matches = query_run (q, words, table, &result);
+      free (result);
+    }
+    took = __seconds (&start) / ROUNDS;
+    printf ("query %-32s %7d matches, %7.3f ms\n", queries [k], matches,
+            took * 1e3);
+    query_free (q);
+  }
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  if ((completions = suggest_build (table, words)) == NULL) {
+    perror ("suggest_build");
+    return 1;
+  }
+  printf ("completions: %zu bytes, built in %.2fs\n",
+          suggest_bytes (completions), __seconds (&start));
+  for (k = 0; prefixes [k] != NULL; k ++) {
+    clock_gettime (CLOCK_MONOTONIC, &start);
+    for (round = 0; round < 100000; round ++)
+      matches = suggest_lookup (completions, prefixes [k], found,
+                                SUGGEST_MAX);
+    took = __seconds (&start) / 100000;
+    printf ("suggest %-12s %2d completions, %6.3f us, first: %s\n",
+            prefixes [k], matches, took * 1e6,
+            matches ? suggest_text (completions, found [0]) : "-");
+  }
+  suggest_free (completions);
+
+  /* the same scans, serially and then in shards (once the pool runs) */
+  for (i = 0; scans [i] . key != NULL; i ++)
+    serial [i] = __scan (table, i, &sums [i]);
+  shards_init (argc > 1 ? atoi (argv [1]) : 0);
+  printf ("scans, serial and in %d shards:\n", shards_count (SONGS));
+  for (i = 0; scans [i] . key != NULL; i ++) {
+    took = __scan (table, i, &sum);
+    printf ("  %-18s sort %d %7.2f ms %7.2f ms  %s\n",
+            *scans [i] . key ? scans [i] . key : "(every song)",
+            scans [i] . sort, serial [i] * 1e3, took * 1e3,
+            sum == sums [i] ? "same songs" : "DIFFERENT SONGS");
+  }
+
+  /* and once the library's path order is built */
+  songtable_set_orders (table, orders_init (table));
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  orders_get (songtable_orders (table), SORT_PATH, &rank);
+  printf ("path order: built in %.2fs, then:\n", __seconds (&start));
+  for (i = 0; scans [i] . key != NULL; i ++) {
+    took = __scan (table, i, &sum);
+    printf ("  %-18s sort %d %7.2f ms  %s\n",
+            *scans [i] . key ? scans [i] . key : "(every song)",
+            scans [i] . sort, took * 1e3,
+            sum == sums [i] ? "same songs" : "DIFFERENT SONGS");
+  }
+
+  wordindex_free (words);
+  songtable_free (table);
+  return 0;
+}
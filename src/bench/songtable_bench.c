@@ -0,0 +1,111 @@
+/* songtable_bench.c: memory footprint of the music library */
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <malloc.h>
+# include <time.h>
+
+# include "../sharedlib/url_codec.h"
+# include "../playlist/songtable.h"
+
+# define SONGS   1000000
+# define ROOT    "/tmp"
+
+/* the library as it was kept before: a list of separately allocated songs */
+struct OldSong {
+  char *client_path, *server_path, *content_type;
+  void *tags;
+};
+struct OldNode {
+  void *data;
+  struct OldNode *next, *previous;
+};
+
+static void
+__song_path (char *path, int i)
+{
+  sprintf (path, ROOT "/Artist %04d/Album %02d - Live at Venue/%02d - Song"
+           " Title Number %d.mp3", i / 250, (i / 12) % 21, i % 12 + 1, i);
+  return;
+}
+
+static double
+__seconds (struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start -> tv_sec)
+         + (now.tv_nsec - start -> tv_nsec) / 1e9;
+}
+
+/* replicate the old per song allocations, return the heap bytes they took */
+static size_t
+__old_layout (void)
+{
+  struct OldNode head = {NULL, NULL, NULL}, *node;
+  struct OldSong *song;
+  size_t before;
+  char path [256];
+  int i, len;
+
+  before = mallinfo2 () . uordblks;
+  for (i = 0; i < SONGS; i ++) {
+    __song_path (path, i);
+    song = malloc (sizeof (struct OldSong));
+    len = strlen (path + strlen (ROOT));
+    song -> client_path = NULL;
+    do {
+      if (song -> client_path != NULL)
+        free (song -> client_path);
+      len += 5;
+      song -> client_path = calloc (len, sizeof (char));
+    } while (url_encode (path + strlen (ROOT), song -> client_path, len, 1)
+             < 0);
+    song -> server_path = strdup (path);
+    song -> content_type = strdup ("audio/mpeg");
+    song -> tags = NULL;
+    node = malloc (sizeof (struct OldNode));
+    node -> data = song;
+    node -> next = head . next;
+    head . next = node;
+  }
+  return mallinfo2 () . uordblks - before;
+}
+
+int
+main (void)
+{
+  struct timespec start;
+  songtable table;
+  char path [256];
+  size_t old;
+  int i, found = 0;
+
+  old = __old_layout ();
+  printf ("songs: %d\n", SONGS);
+  printf ("list of songs: %10zu bytes, %6.1f bytes/song\n",
+          old, (double) old / SONGS);
+
+  if ((table = songtable_init (ROOT)) == NULL) {
+    perror ("songtable_init");
+    return 1;
+  }
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (i = 0; i < SONGS; i ++) {
+    __song_path (path, i);
+    songtable_add (table, path);
+  }
+  songtable_seal (table, 0);
+  printf ("song table:    %10zu bytes, %6.1f bytes/song (built in %.2fs)\n",
+          songtable_bytes (table), (double) songtable_bytes (table) / SONGS,
+          __seconds (&start));
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (i = 0; i < SONGS; i += 7)
+    found += songtable_find (table, songtable_client_path (table, i)) == i;
+  printf ("lookups:       %d in %.3fs\n", found, __seconds (&start));
+
+  songtable_free (table);
+  return 0;
+}
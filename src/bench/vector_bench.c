@@ -0,0 +1,148 @@
+/* vector_bench.c: vector against dhlist, at a few sizes */
+# include <stdio.h>
+# include <stdlib.h>
+# include <time.h>
+
+# include "../sharedlib/dhlist.h"
+# include "../sharedlib/vector.h"
+
+  /* items handled per operation and size, over all rounds */
+# define WORK 10000000
+
+static int sizes [] = {10, 1000, 1000000, 0};
+static volatile long sink;  /* keeps the results from being optimised out */
+
+static double
+__seconds (struct timespec *start)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - start -> tv_sec)
+         + (now.tv_nsec - start -> tv_nsec) / 1e9;
+}
+
+static int
+__odd (void *item)
+{
+  return (long) item & 1;
+}
+
+static int
+__differ (void *item, void *key)
+{
+  return item != key;
+}
+
+/* ns per item of each operation, over a list and a vector of n items */
+static void
+__bench (int n)
+{
+  struct timespec start;
+  dhlist list, copy, cur;
+  vector v, vcopy;
+  int rounds = WORK / n, round, i;
+  long sum = 0;
+  double took [2][5];
+
+  /* build: append n items, then delete */
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (round = 0; round < rounds; round ++) {
+    dhlist_init (&list);
+    for (i = 0; i < n; i ++)
+      dhlist_append (list, (void *) (long) i);
+    dhlist_delete (list);
+  }
+  took [0][0] = __seconds (&start);
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (round = 0; round < rounds; round ++) {
+    vector_init (&v);
+    for (i = 0; i < n; i ++)
+      vector_append (v, (void *) (long) i);
+    vector_delete (v);
+  }
+  took [1][0] = __seconds (&start);
+
+  dhlist_init (&list);
+  vector_init (&v);
+  for (i = 0; i < n; i ++) {
+    dhlist_append (list, (void *) (long) i);
+    vector_append (v, (void *) (long) i);
+  }
+
+  /* walk: sum the items */
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (round = 0; round < rounds; round ++)
+    for (cur = dhlist_first (list); cur != dhlist_end (list);
+         cur = dhlist_next (cur))
+      sum += (long) dhlist_data (cur);
+  took [0][1] = __seconds (&start);
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (round = 0; round < rounds; round ++)
+    for (i = 0; i < vector_length (v); i ++)
+      sum += (long) vector_get (v, i);
+  took [1][1] = __seconds (&start);
+
+  /* find: the last item */
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (round = 0; round < rounds; round ++)
+    sum += dhlist_find (list, (void *) (long) (n - 1), __differ) != NULL;
+  took [0][2] = __seconds (&start);
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (round = 0; round < rounds; round ++)
+    sum += vector_find (v, (void *) (long) (n - 1), __differ);
+  took [1][2] = __seconds (&start);
+
+  /* subset: the odd items */
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (round = 0; round < rounds; round ++) {
+    copy = dhlist_subset (list, __odd);
+    sum += dhlist_length (copy);
+    dhlist_delete (copy);
+  }
+  took [0][3] = __seconds (&start);
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (round = 0; round < rounds; round ++) {
+    vcopy = vector_subset (v, __odd);
+    sum += vector_length (vcopy);
+    vector_delete (vcopy);
+  }
+  took [1][3] = __seconds (&start);
+
+  /* copy */
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (round = 0; round < rounds; round ++) {
+    dhlist_copy (&copy, list);
+    dhlist_delete (copy);
+  }
+  took [0][4] = __seconds (&start);
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  for (round = 0; round < rounds; round ++) {
+    vector_copy (&vcopy, v);
+    vector_delete (vcopy);
+  }
+  took [1][4] = __seconds (&start);
+
+  dhlist_delete (list);
+  vector_delete (v);
+
+  printf ("%8d items   ", n);
+  for (i = 0; i < 5; i ++)
+    printf ("%7.2f %6.2f", took [0][i] * 1e9 / WORK, took [1][i] * 1e9 / WORK);
+  printf ("\n");
+  sink = sum;
+  return;
+}
+
+int
+main (void)
+{
+  int i;
+
+  printf ("ns per item, dhlist then vector:\n");
+  printf ("                   %14s%14s%14s%14s%14s\n", "build", "walk", "find",
+          "subset", "copy");
+  for (i = 0; sizes [i] != 0; i ++)
+    __bench (sizes [i]);
+  return 0;
+}
@@ -6,57 +6,266 @@
 # include <errno.h>
 # include <limits.h>
 # include <signal.h>
+# include <pthread.h>
+# include <time.h>
+# include <sys/types.h>
+# include <sys/wait.h>
 
 # include "mserrors.h"
-# include "../sharedlib/dhlist.h"
+# include "../playlist/songtable.h"
 # include "../playlist/playlist.h"
+# include "../playlist/tags.h"
+# include "../playlist/shards.h"
+# include "../playlist/seek.h"
 # include "../network/serve.h"
+# include "../network/plcache.h"
+# include "../network/fullpl.h"
+# include "../network/songcache.h"
+# include "../network/fdcache.h"
+# include "../network/prefetch.h"
+# include "../network/radio.h"
+# include "../network/cluster.h"
+# include "../network/edge.h"
+# include "../network/upgrade.h"
 
 # define DEFAULT_THREAD_NUM 15
+# define TAG_THREAD_NUM      4
+# define PLCACHE_SIZE       (16 * 1024 * 1024)
+# define SONGCACHE_SIZE     (64 * 1024 * 1024)
+# define FDCACHE_FILES      256
+# define EDGE_DISK          (1024 * 1024 * 1024)
 
 int    listenfd   = -1;   /* descriptor of the listening socket */
-dhlist library    = NULL; /* music library */
+pid_t *workers    = NULL; /* prefork mode: the master's worker processes */
+int    nworkers   = 0;
+int    upgradefd  = -1;   /* -U: where the server upgraded hands over */
 
 /* server will stop when a SIGINT is received */
 void
 stop_serving (int signal)
 {
+  int i;
+
   if (signal == SIGINT) {
     if (listenfd > -1) close (listenfd);
+    for (i = 0; i < nworkers; i ++)
+      if (workers [i] > 0) kill (workers [i], SIGINT);
     fprintf (stdout, "Going down for maintenance!\n");
     exit (EXIT_SUCCESS);
   }
   return;
 }
 
+/*
+ * a worker process: serves clients with its own pool of threads, out of
+ * the library the master built. caches are its own, each given a share
+ * of the memory the server would use for them. told to by the master
+ * (SIGUSR2), it finishes its streams and exits.
+ */
+static void
+__worker (int thread_num, int worker_num)
+{
+  pthread_t *thread_pool;
+  sigset_t set;
+  int sig;
+
+  sigemptyset (&set);
+  sigaddset (&set, SIGUSR2);
+  pthread_sigmask (SIG_BLOCK, &set, NULL);
+  if (plcache_init (PLCACHE_SIZE / worker_num) != MSE_OK
+      || songcache_init (SONGCACHE_SIZE / worker_num) != MSE_OK
+      || fdcache_init (FDCACHE_FILES) != MSE_OK
+      || fullpl_init () != MSE_OK
+      || prefetch_init () != MSE_OK
+      || cluster_start () != MSE_OK
+      || create_threadpool (&thread_pool, thread_num) != MSE_OK) {
+    MSperror ("Unable to start worker");
+    exit (EXIT_FAILURE);
+  }
+  if (shards_init (0) != MSE_OK)
+    MSperror ("Unable to start the library scanning threads");
+  while (sigwait (&set, &sig))
+    ;
+  network_drain (thread_pool, thread_num);
+  exit (EXIT_SUCCESS);
+}
+
+/*
+ * have a new build of the server take over: it is handed the listening
+ * socket, and the songs of the library if it is built
+ */
+static int
+__handover (char **argv)
+{
+  int libfd;
+
+  if (library_save (&libfd) != MSE_OK)
+    MSperror ("Unable to save the library");
+  if (upgrade_start (argv, listenfd, libfd) != MSE_OK) {
+    if (libfd >= 0) close (libfd);
+    return MS_errno;
+  }
+  if (libfd >= 0) close (libfd);
+  fprintf (stdout, "Upgraded, finishing the streams left.\n");
+  return MSE_OK;
+}
+
+/*
+ * serve with the pool of threads until SIGUSR2 has a new build of the
+ * server take over; then finish the streams left and exit
+ */
+static void
+__serve (char **argv, pthread_t *thread_pool, int thread_num)
+{
+  sigset_t set;
+  int sig;
+
+  sigemptyset (&set);
+  sigaddset (&set, SIGUSR2);
+  for (; ;) {
+    if (sigwait (&set, &sig))
+      continue;
+    if (__handover (argv) != MSE_OK) {
+      MSperror ("Unable to upgrade");
+      continue;
+    }
+    network_drain (thread_pool, thread_num);
+    exit (EXIT_SUCCESS);
+  }
+}
+
+/* fork the i-th worker */
+static int
+__spawn (int i, int thread_num)
+{
+  pid_t pid;
+  int worker_num;
+
+  fflush (stdout); /* or the child would print it again */
+  if ((pid = fork ()) < 0)
+    return (MS_errno = MSE_FORK);
+  if (pid == 0) {
+    worker_num = nworkers;
+    nworkers = 0; /* its siblings are not its own to stop */
+    __worker (thread_num, worker_num);
+  }
+  workers [i] = pid;
+  return MSE_OK;
+}
+
+/*
+ * prefork mode: fork nworkers workers over the built library, then
+ * replace any worker that dies. once a new build of the server took
+ * over (SIGUSR2), workers are told to finish their streams, and the
+ * master exits with the last of them. never returns.
+ */
+static void
+__prefork (char **argv, int thread_num)
+{
+  sigset_t set;
+  time_t *born;
+  pid_t pid;
+  int i, sig, status, draining = 0;
+
+  if ((workers = (pid_t *) calloc (nworkers, sizeof (pid_t))) == NULL
+      || (born = (time_t *) calloc (nworkers, sizeof (time_t))) == NULL) {
+    MS_errno = MSE_NOMEM;
+    MSperror ("Unable to start workers");
+    exit (EXIT_FAILURE);
+  }
+  /*
+   * the master waits for SIGUSR2 and for workers exiting alike: both are
+   * kept blocked, so that neither is missed while the other is handled
+   */
+  sigemptyset (&set);
+  sigaddset (&set, SIGUSR2);
+  sigaddset (&set, SIGCHLD);
+  pthread_sigmask (SIG_BLOCK, &set, NULL);
+  for (i = 0; i < nworkers; i ++) {
+    born [i] = time (NULL);
+    if (__spawn (i, thread_num) != MSE_OK) {
+      MSperror ("Unable to start workers");
+      stop_serving (SIGINT);
+    }
+  }
+  if (upgradefd >= 0 && upgrade_ready (upgradefd) != MSE_OK)
+    MSperror ("Unable to take over the old server");
+
+  for (; ;) {
+    if (sigwait (&set, &sig))
+      continue;
+    if (sig == SIGUSR2 && !draining) {
+      if (__handover (argv) != MSE_OK)
+        MSperror ("Unable to upgrade");
+      else {
+        draining = nworkers;
+        for (i = 0; i < nworkers; i ++)
+          if (workers [i] > 0) kill (workers [i], SIGUSR2);
+      }
+    }
+    /* one SIGCHLD may stand for several workers */
+    while ((pid = waitpid (-1, &status, WNOHANG)) > 0) {
+      for (i = 0; i < nworkers && workers [i] != pid; i ++)
+        ;
+      if (i == nworkers)
+        continue;
+      if (draining) { /* not replaced: the new server serves */
+        workers [i] = 0;
+        if (!-- draining)
+          exit (EXIT_SUCCESS);
+        continue;
+      }
+      if (WIFSIGNALED (status))
+        fprintf (stderr, "[--] Worker %d killed by signal %d, respawning.\n",
+                 (int) pid, WTERMSIG (status));
+      else
+        fprintf (stderr,
+                 "[--] Worker %d exited with status %d, respawning.\n",
+                 (int) pid, WEXITSTATUS (status));
+      /* do not spin on a worker failing as soon as it starts */
+      if (time (NULL) - born [i] < 1)
+        sleep (1);
+      born [i] = time (NULL);
+      workers [i] = 0;
+      while (__spawn (i, thread_num) != MSE_OK) {
+        MSperror ("Unable to respawn a worker");
+        sleep (1);
+      }
+    }
+  }
+}
+
 int main (int argc, char *argv[])
 {
-  char *musicdir = NULL, *endptr;
-  int portid = 0, option, thread_num = -1;
+  char *musicdir = NULL, *seekdir = NULL, *radiodir = NULL, *nodes = NULL;
+  char *origin = NULL, *endptr;
+  int portid = 0, option, thread_num = -1, worker_num = 0, huge = 0;
+  int libfd = -1;
   pthread_t *thread_pool;
+  songtable songs, tagged;
+  sigset_t set;
 
   MS_errno = MSE_OK;
   MS_pthread_errno = 0;
 
-  if (argc < 5 || argc > 7) {
+  /* SIGUSR2 (upgrade) is waited for by the main thread, none other */
+  sigemptyset (&set);
+  sigaddset (&set, SIGUSR2);
+  pthread_sigmask (SIG_BLOCK, &set, NULL);
+
+  if (argc < 5 || argc > 20) {
     MShelp (argv [0]);
     exit (EXIT_FAILURE);
   }
-  if (!dhlist_init (&library)) {
-    MS_errno = MSE_NOMEM;
-    MSperror ("Library initialisation failed");
-    exit (EXIT_FAILURE);
-  }
 
   /* read options */
-  while ((option = getopt (argc, argv, "p:d:t:h")) != -1)
+  while ((option = getopt (argc, argv, "p:d:t:w:s:r:c:e:U:Hh")) != -1)
     switch (option) {
     case 'p': /* port option */
       if (portid) { /* if port option was re used */
         MS_errno = MSE_OPTIONAGAIN;
         MSperror ("Environment initialisation failed");
         if (musicdir != NULL) free (musicdir);
-        dhlist_delete (library);
         exit (EXIT_FAILURE);
       }
       portid = strtol (optarg, &endptr, 10);
@@ -66,7 +275,6 @@ int main (int argc, char *argv[])
         MS_errno = MSE_INVALIDPORTNUM;
         MSperror ("Environment initialisation failed");
         if (musicdir != NULL) free (musicdir);
-        dhlist_delete (library);
         exit (EXIT_FAILURE);
       }
       break;
@@ -75,13 +283,11 @@ int main (int argc, char *argv[])
         MS_errno = MSE_OPTIONAGAIN;
         MSperror ("Environment initialisation failed");
         if (musicdir != NULL) free (musicdir);
-        dhlist_delete (library);
         exit (EXIT_FAILURE);
       }
       if ((musicdir = strdup (optarg)) == NULL) {
         MS_errno = MSE_NOMEM;
         MSperror ("Environment initialisation failed");
-        dhlist_delete (library);
         exit (EXIT_FAILURE);
       }
       if (musicdir [strlen (musicdir) - 1] == '/')
@@ -96,54 +302,199 @@ int main (int argc, char *argv[])
         MS_errno = MSE_INVALIDTHREADNUM;
         MSperror ("Environment initialisation failed");
         if (musicdir != NULL) free (musicdir);
-        dhlist_delete (library);
         exit (EXIT_FAILURE);
       }
       break;
+    case 'w': /* prefork workers option */
+      worker_num = strtol (optarg, &endptr, 10);
+      if (worker_num < 1 || optarg == endptr || *endptr != '\0') {
+        MS_errno = MSE_INVALIDWORKERNUM;
+        MSperror ("Environment initialisation failed");
+        if (musicdir != NULL) free (musicdir);
+        exit (EXIT_FAILURE);
+      }
+      break;
+    case 's': /* seek index directory option */
+      if (seekdir != NULL) {
+        MS_errno = MSE_OPTIONAGAIN;
+        MSperror ("Environment initialisation failed");
+        if (musicdir != NULL) free (musicdir);
+        exit (EXIT_FAILURE);
+      }
+      seekdir = optarg;
+      break;
+    case 'r': /* radio stations directory option */
+      if (radiodir != NULL) {
+        MS_errno = MSE_OPTIONAGAIN;
+        MSperror ("Environment initialisation failed");
+        if (musicdir != NULL) free (musicdir);
+        exit (EXIT_FAILURE);
+      }
+      radiodir = optarg;
+      break;
+    case 'c': /* cluster nodes option */
+      if (nodes != NULL) {
+        MS_errno = MSE_OPTIONAGAIN;
+        MSperror ("Environment initialisation failed");
+        if (musicdir != NULL) free (musicdir);
+        exit (EXIT_FAILURE);
+      }
+      nodes = optarg;
+      break;
+    case 'e': /* origin server option, of an edge */
+      if (origin != NULL) {
+        MS_errno = MSE_OPTIONAGAIN;
+        MSperror ("Environment initialisation failed");
+        if (musicdir != NULL) free (musicdir);
+        exit (EXIT_FAILURE);
+      }
+      origin = optarg;
+      break;
+    case 'U': /* upgrade option, given by the server taken over */
+      upgradefd = strtol (optarg, &endptr, 10);
+      if (upgradefd < 0 || optarg == endptr || *endptr != '\0') {
+        MS_errno = MSE_UPGRADE;
+        MSperror ("Environment initialisation failed");
+        if (musicdir != NULL) free (musicdir);
+        exit (EXIT_FAILURE);
+      }
+      break;
+    case 'H': /* huge pages option */
+      huge = 1;
+      break;
     case 'h': /* help option */
       MShelp (argv [0]);
       exit (EXIT_SUCCESS);
     default:
       if (musicdir != NULL) free (musicdir);
-      dhlist_delete (library);
       MS_errno = MSE_UNKNOWNOPTION;
       exit (EXIT_FAILURE);
     }
 
-  /* initialise music library */
-  if (build_library (musicdir, library) != MSE_OK) {
-    MSperror ("Unable to build music library");
+  /* initialise music library; an edge has none, musicdir is where it
+     keeps the songs of its origin */
+  if (musicdir == NULL || portid == 0
+      || (origin != NULL && (worker_num || nodes != NULL))) {
+    MShelp (argv [0]);
+    if (musicdir != NULL) free (musicdir);
+    exit (EXIT_FAILURE);
+  }
+  if (origin != NULL ? edge_init (origin, musicdir, EDGE_DISK) != MSE_OK
+                     : library_init (musicdir) != MSE_OK) {
+    MSperror (origin != NULL ? "Edge initialisation failed"
+                             : "Library initialisation failed");
     free (musicdir);
-    dhlist_delete (library);
     exit (EXIT_FAILURE);
   }
   free (musicdir);
+  /* in a cluster, only the songs of this node's part are kept */
+  if (cluster_init (nodes) != MSE_OK) {
+    MSperror ("Environment initialisation failed");
+    exit (EXIT_FAILURE);
+  }
+  if (cluster_nodes ())
+    library_partition (&cluster_keep);
+
+  /*
+   * rendered playlists are kept around for popular searches, as are the
+   * songs played most and the files of those played lately, and the
+   * whole library's playlist is rendered ahead of time (by each worker,
+   * if any). an edge only keeps playlists.
+   */
+  if ((!worker_num && plcache_init (PLCACHE_SIZE) != MSE_OK)
+      || (!worker_num && origin == NULL
+          && (songcache_init (SONGCACHE_SIZE) != MSE_OK
+              || fdcache_init (FDCACHE_FILES) != MSE_OK
+              || fullpl_init () != MSE_OK
+              || prefetch_init () != MSE_OK
+              || cluster_start () != MSE_OK))) {
+    MSperror ("Unable to initialise environment");
+    exit (EXIT_FAILURE);
+  }
+
+  /* seek indexes of songs are kept in memory, and in seekdir if given */
+  if (seek_init (seekdir) != MSE_OK) {
+    MSperror ("Unable to initialise environment");
+    exit (EXIT_FAILURE);
+  }
+  /* and radio stations' playlists in radiodir */
+  if (radio_init (radiodir) != MSE_OK) {
+    MSperror ("Unable to initialise environment");
+    exit (EXIT_FAILURE);
+  }
 
   /* handle signals */
   if (signal (SIGPIPE, SIG_IGN) == SIG_ERR
       || signal (SIGINT, stop_serving) == SIG_ERR) {
     MS_errno = MSE_SIGNAL;
     MSperror ("Unable to initialise environment");
-    dhlist_delete (library);
     exit (EXIT_FAILURE);
   }
-  /* start listening to the specified port */
-  if ((listenfd = network_init (portid)) < 0) {
+  /* start listening to the specified port, or take over the socket (and
+     maybe the library) of the server this one upgrades */
+  if (upgradefd >= 0 ? upgrade_receive (upgradefd, &listenfd, &libfd)
+                       != MSE_OK
+                     : (listenfd = network_init (portid)) < 0) {
     MSperror ("Unable to get online");
-    dhlist_delete (library);
     exit (EXIT_FAILURE);
   }
   
   /* create the threapool that will serve any clients */
   if (thread_num < 0) thread_num = DEFAULT_THREAD_NUM;
-  if (create_threadpool (&thread_pool, thread_num) != MSE_OK) {
+  if (!worker_num && create_threadpool (&thread_pool, thread_num) != MSE_OK) {
     MSperror ("Unable to receive incoming connections");
     close (listenfd);
-    dhlist_delete (library);
     exit (EXIT_FAILURE);
   }
+  /* the old server may stop accepting connections now */
+  if (!worker_num && upgradefd >= 0 && upgrade_ready (upgradefd) != MSE_OK)
+    MSperror ("Unable to take over the old server");
+  /* an edge is all set: it has no library to build */
+  if (origin != NULL)
+    __serve (argv, thread_pool, thread_num);
+
+  /* scans of large libraries are spread over the cpus, searches are
+     scanned serially if that fails */
+  if (shards_init (0) != MSE_OK)
+    MSperror ("Unable to start the library scanning threads");
+
+  /*
+   * clients are served while the library is scanned: they see it grow,
+   * and songs not found yet are looked up on the disk. in prefork mode
+   * they wait for the workers, started once the library is complete.
+   * a server upgrading another takes its songs over instead.
+   */
+  if ((libfd >= 0 ? library_restore (libfd, huge) : build_library (huge))
+      != MSE_OK) {
+    MSperror ("Unable to build music library");
+    close (listenfd);
+    exit (EXIT_FAILURE);
+  }
+
+  /*
+   * read song metadata in the background, the library is built for good.
+   * the threads read it for as long as they run: it is held (tagged) for
+   * as long as the server runs.
+   */
+  tagged = library_acquire ();
+  if (tags_extract (tagged, TAG_THREAD_NUM) != MSE_OK)
+    MSperror ("Unable to read song metadata");
+
+  /*
+   * workers share the library as the master leaves it, never changing it
+   * afterwards: it is complete with its metadata and sorted every way.
+   */
+  if (worker_num) {
+    songs = library_acquire ();
+    while (!tags_complete (songs))
+      usleep (100000);
+    library_release (songs);
+    if (library_presort () != MSE_OK)
+      MSperror ("Unable to sort the library");
+    nworkers = worker_num;
+    __prefork (argv, thread_num);
+  }
 
   /* job's done */
-  for (; ;)
-    pause ();
+  __serve (argv, thread_pool, thread_num);
 }
@@ -3,10 +3,15 @@
 # include <string.h>
 # include "mserrors.h"
 
+__thread int MS_errno;
+__thread int MS_pthread_errno;
+
 void
 MShelp (char *prog)
 {
-  fprintf (stderr, "usage: %s -p portnum -d musicdir [-t threadnum]\n", prog);
+  fprintf (stderr, "usage: %s -p portnum -d musicdir [-t threadnum] "
+                   "[-w workers] [-s seekdir] [-r radiodir] "
+                   "[-c self,node,...] [-e origin] [-H]\n", prog);
   return;
 }
 
@@ -24,6 +29,7 @@ MSperror (char *errmsg)
   case MSE_WRITERESPONSE:
   case MSE_SIGNAL:
   case MSE_SETSOCKOPT:
+  case MSE_FORK:
     fprintf (stderr, "[--] ");
     perror (errmsg);
     break;
@@ -42,6 +48,22 @@ MSperror (char *errmsg)
     fprintf (stderr, "[--] %s%sInvalid threadpool specifier.\n", 
 	     errmsg == NULL ? "": errmsg, errmsg == NULL ? "": ": ");
     break;
+  case MSE_INVALIDWORKERNUM:
+    fprintf (stderr, "[--] %s%sInvalid worker specifier.\n", 
+	     errmsg == NULL ? "": errmsg, errmsg == NULL ? "": ": ");
+    break;
+  case MSE_INVALIDNODES:
+    fprintf (stderr, "[--] %s%sInvalid cluster node list.\n", 
+	     errmsg == NULL ? "": errmsg, errmsg == NULL ? "": ": ");
+    break;
+  case MSE_INVALIDORIGIN:
+    fprintf (stderr, "[--] %s%sInvalid origin server.\n", 
+	     errmsg == NULL ? "": errmsg, errmsg == NULL ? "": ": ");
+    break;
+  case MSE_UPGRADE:
+    fprintf (stderr, "[--] %s%sThe new server did not start.\n", 
+	     errmsg == NULL ? "": errmsg, errmsg == NULL ? "": ": ");
+    break;
   case MSE_UNKNOWNOPTION:
     fprintf (stderr, "[--] %s%sUnknown option.\n", 
 	     errmsg == NULL ? "": errmsg, errmsg == NULL ? "": ": ");
@@ -1,8 +1,9 @@
 # ifndef __MUZIQ_STREAMER_ERRORS__
 # define __MUZIQ_STREAMER_ERRORS__
 
-int MS_errno;
-int MS_pthread_errno;
+  /* each thread has its own */
+extern __thread int MS_errno;
+extern __thread int MS_pthread_errno;
 
 void MSperror (char *);
 void MShelp   (char *);
@@ -25,6 +26,11 @@ void MShelp   (char *);
 # define MSE_SIGNAL           -610
 # define MSE_UNKNOWNOPTION    -987
 # define MSE_SETSOCKOPT      -1597
+# define MSE_FORK            -2584
+# define MSE_INVALIDWORKERNUM -4181
+# define MSE_INVALIDNODES     -6765
+# define MSE_INVALIDORIGIN   -10946
+# define MSE_UPGRADE         -17711
 
 # endif
 
@@ -0,0 +1,449 @@
+/* cluster.c: the library sharded over several servers */
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <unistd.h>
+# include <pthread.h>
+
+# include "../sharedlib/fold.h"
+# include "../sharedlib/url_codec.h"
+# include "../playlist/songtable.h"
+# include "../playlist/playlist.h"
+# include "../playlist/tags.h"
+# include "../playlist/query.h"
+# include "../mstream/mserrors.h"
+# include "fetch.h"
+# include "cluster.h"
+
+  /* points of each node on the ring */
+# define CLUSTER_VNODES  256
+  /* seconds between two fetches of the digests of the other nodes */
+# define CLUSTER_POLL    5
+# define CLUSTER_ADDRLEN 256
+
+# define DIGEST_BITS  (CLUSTER_DIGEST * 8)
+# define DIGEST_SHIFT 13  /* 32 - log2 (DIGEST_BITS) */
+
+/*
+ * a node, as host:port. down: it could not be reached the last time its
+ * digest was fetched, digest: the last one it sent, NULL if none yet.
+ */
+struct ClusterNode {
+  char           addr [CLUSTER_ADDRLEN];
+  unsigned char *digest;
+  int            down;
+};
+
+/* a point of the ring, owning the hashes up to it */
+struct RingPoint {
+  unsigned int hash;
+  int          node;
+};
+
+static struct ClusterNode nodes [CLUSTER_NODES];
+static struct RingPoint ring [CLUSTER_NODES * CLUSTER_VNODES];
+static int nnodes = 0, self = 0;
+
+static pthread_mutex_t cluster_lock = PTHREAD_MUTEX_INITIALIZER;
+  /* the digest of the local library, and the generation it was made of */
+static pthread_mutex_t digest_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char *digest = NULL;
+static unsigned int digested = 0;
+
+/*
+ * 32 bit fnv-1a, mixed (murmur3's finalizer) so that names differing in
+ * their last bytes only, as ring points & songs of an album do, spread
+ * over the whole ring
+ */
+static unsigned int
+__hash (char *str)
+{
+  unsigned int hash = 2166136261u;
+
+  while (*str)
+    hash = (hash ^ (unsigned char) *str ++) * 16777619u;
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+static int
+__node_cmp (const void *a, const void *b)
+{
+  return strcmp (((struct ClusterNode *) a) -> addr,
+                 ((struct ClusterNode *) b) -> addr);
+}
+
+static int
+__point_cmp (const void *a, const void *b)
+{
+  const struct RingPoint *pa = a, *pb = b;
+
+  if (pa -> hash != pb -> hash)
+    return pa -> hash < pb -> hash ? -1 : 1;
+  return pa -> node - pb -> node;
+}
+
+/*
+ * read the nodes of the cluster, "host:port" separated by commas, this
+ * server first. every node must be given the same ones. they are kept
+ * sorted, so that all of them see the same order.
+ */
+int
+cluster_init (char *list)
+{
+  char selfaddr [CLUSTER_ADDRLEN], name [CLUSTER_ADDRLEN + 16], *end, *colon;
+  int i, j, len;
+
+  if (list == NULL)
+    return MSE_OK;
+  for (nnodes = 0; *list; nnodes ++) {
+    if ((end = strchr (list, ',')) == NULL)
+      end = list + strlen (list);
+    len = end - list;
+    if (nnodes == CLUSTER_NODES || len == 0 || len >= CLUSTER_ADDRLEN)
+      return (MS_errno = MSE_INVALIDNODES);
+    memcpy (nodes [nnodes] . addr, list, len);
+    nodes [nnodes] . addr [len] = '\0';
+    if ((colon = strrchr (nodes [nnodes] . addr, ':')) == NULL
+        || colon == nodes [nnodes] . addr || colon [1] == '\0'
+        || strspn (colon + 1, "0123456789") != strlen (colon + 1))
+      return (MS_errno = MSE_INVALIDNODES);
+    for (i = 0; i < nnodes; i ++)
+      if (!strcmp (nodes [i] . addr, nodes [nnodes] . addr))
+        return (MS_errno = MSE_INVALIDNODES);
+    list = *end ? end + 1 : end;
+  }
+  if (nnodes == 0)
+    return (MS_errno = MSE_INVALIDNODES);
+
+  strcpy (selfaddr, nodes [0] . addr);
+  qsort (nodes, nnodes, sizeof (struct ClusterNode), &__node_cmp);
+  for (i = 0; i < nnodes; i ++) {
+    if (!strcmp (nodes [i] . addr, selfaddr))
+      self = i;
+    for (j = 0; j < CLUSTER_VNODES; j ++) {
+      snprintf (name, sizeof (name), "%s#%d", nodes [i] . addr, j);
+      ring [i * CLUSTER_VNODES + j] . hash = __hash (name);
+      ring [i * CLUSTER_VNODES + j] . node = i;
+    }
+  }
+  qsort (ring, nnodes * CLUSTER_VNODES, sizeof (struct RingPoint),
+         &__point_cmp);
+  return MSE_OK;
+}
+
+/* the number of nodes, 0 if this server is on its own */
+int
+cluster_nodes (void)
+{
+  return nnodes;
+}
+
+int
+cluster_self (void)
+{
+  return self;
+}
+
+/* the address (host:port) of a node */
+char *
+cluster_node (int node)
+{
+  return nodes [node] . addr;
+}
+
+/* the node a song belongs to, by its path relative to the music directory */
+int
+cluster_owner (char *path)
+{
+  unsigned int hash = __hash (path);
+  int lo = 0, hi = nnodes * CLUSTER_VNODES;
+
+  if (nnodes == 0)
+    return 0;
+  /* the first point at or after the hash, wrapping around */
+  while (lo < hi)
+    if (ring [(lo + hi) / 2] . hash < hash) lo = (lo + hi) / 2 + 1;
+    else hi = (lo + hi) / 2;
+  return ring [lo % (nnodes * CLUSTER_VNODES)] . node;
+}
+
+/* whether a song (path relative to the music directory) is this node's */
+int
+cluster_keep (char *path)
+{
+  return cluster_owner (path) == self;
+}
+
+/* the two bits of a trigram in a digest */
+static inline unsigned int
+__bit1 (unsigned char *t)
+{
+  return ((t [0] << 16 | t [1] << 8 | t [2]) * 2654435761u) >> DIGEST_SHIFT;
+}
+
+static inline unsigned int
+__bit2 (unsigned char *t)
+{
+  return ((t [0] << 16 | t [1] << 8 | t [2]) * 2246822519u) >> DIGEST_SHIFT;
+}
+
+/* set the bits of the trigrams of some folded text */
+static void
+__digest_text (unsigned char *bits, char *text, int len)
+{
+  unsigned char *t = (unsigned char *) text;
+  int i;
+
+  for (i = 0; i + 3 <= len; i ++) {
+    bits [__bit1 (t + i) / 8] |= 1 << (__bit1 (t + i) % 8);
+    bits [__bit2 (t + i) / 8] |= 1 << (__bit2 (t + i) % 8);
+  }
+  return;
+}
+
+/*
+ * a copy of the digest of the local library, made again whenever it
+ * changed. *bits is NULL while the library (or its metadata) is still
+ * being read: the digest would leave out songs searches may find soon.
+ */
+int
+cluster_digest (unsigned char **bits)
+{
+  struct LibraryProgress progress;
+  unsigned int generation;
+  songtable songs;
+  unsigned char *made;
+  char *text;
+  int i, len;
+
+  *bits = NULL;
+  pthread_mutex_lock (&digest_lock);
+  if (digest == NULL || digested != library_generation ()) {
+    generation = library_generation ();
+    library_progress (&progress);
+    songs = library_acquire ();
+    if (!progress.ready || !tags_complete (songs)) {
+      library_release (songs);
+      pthread_mutex_unlock (&digest_lock);
+      return MSE_OK;
+    }
+    if ((made = (unsigned char *) calloc (CLUSTER_DIGEST, 1)) == NULL) {
+      library_release (songs);
+      pthread_mutex_unlock (&digest_lock);
+      return (MS_errno = MSE_NOMEM);
+    }
+    for (i = 0; i < songtable_length (songs); i ++) {
+      text = songtable_folded_path (songs, i, &len);
+      __digest_text (made, text, len);
+      text = tags_folded (songtable_tags (songs, i), -1, &len);
+      __digest_text (made, text, len);
+    }
+    library_release (songs);
+    if (digest != NULL) free (digest);
+    digest = made;
+    digested = generation;
+  }
+  if ((*bits = (unsigned char *) malloc (CLUSTER_DIGEST)) != NULL)
+    memcpy (*bits, digest, CLUSTER_DIGEST);
+  pthread_mutex_unlock (&digest_lock);
+  return *bits == NULL ? (MS_errno = MSE_NOMEM) : MSE_OK;
+}
+
+/*
+ * whether a node may have matches for a (url encoded) search key, as far
+ * as its digest tells: every trigram of a plain key must be in it. keys
+ * the digest cannot rule out (fuzzy, boolean or short ones) may match.
+ */
+int
+cluster_may_match (int node, char *key)
+{
+  unsigned char *bits;
+  char *decoded, *value, *colon;
+  int i, len, field, may = 1;
+
+  if (key == NULL || *key == '\0'
+      || (decoded = (char *) calloc (strlen (key) + 1, sizeof (char))) == NULL)
+    return 1;
+  if (url_decode (key, decoded, strlen (key) + 1, 0) < 0
+      || decoded [0] == '~') {
+    free (decoded);
+    return 1;
+  }
+  /* as searches read it: "field:" scopes it, unscoped words are queries */
+  value = decoded;
+  if ((colon = strchr (decoded, ':')) != NULL) {
+    *colon = '\0';
+    field = !strcmp (decoded, "path") || tags_field_id (decoded) >= 0;
+    *colon = ':';
+    if (field)
+      value = colon + 1;
+  }
+  if (value == decoded && query_wanted (decoded)) {
+    free (decoded);
+    return 1;
+  }
+  len = fold_text (value, value, strlen (value) + 1);
+
+  pthread_mutex_lock (&cluster_lock);
+  if ((bits = nodes [node] . digest) != NULL && len >= 3)
+    for (i = 0; i + 3 <= len && may; i ++)
+      may = (bits [__bit1 ((unsigned char *) value + i) / 8]
+             & 1 << (__bit1 ((unsigned char *) value + i) % 8))
+            && (bits [__bit2 ((unsigned char *) value + i) / 8]
+                & 1 << (__bit2 ((unsigned char *) value + i) % 8));
+  pthread_mutex_unlock (&cluster_lock);
+  free (decoded);
+  return may;
+}
+
+/*
+ * get a resource of a node: its status code, and its body (*body is NULL
+ * if there was none). the node is asked for it under its own address, so
+ * that the playlists it renders point at it.
+ */
+int
+cluster_fetch (int node, char *resource, int *status, char **body,
+               size_t *length)
+{
+  struct FetchReply reply;
+
+  if (fetch_get (nodes [node] . addr, resource, nodes [node] . addr, &reply,
+                 body, length) != MSE_OK)
+    return MS_errno;
+  *status = reply.status;
+  return MSE_OK;
+}
+
+/* fetch the digests of the other nodes, every CLUSTER_POLL seconds */
+static void *
+__poller (void *arg)
+{
+  char *body;
+  size_t length;
+  int i, status, down;
+
+  for (; ;) {
+    for (i = 0; i < nnodes; i ++) {
+      if (i == self)
+        continue;
+      down = cluster_fetch (i, "/cluster/digest", &status, &body, &length)
+             != MSE_OK;
+      if (!down && (status != 200 || length != CLUSTER_DIGEST)) {
+        if (body != NULL) free (body);
+        body = NULL; /* not complete yet: it may have any song */
+      }
+      pthread_mutex_lock (&cluster_lock);
+      if (nodes [i] . digest != NULL)
+        free (nodes [i] . digest);
+      nodes [i] . digest = (unsigned char *) body;
+      nodes [i] . down = down;
+      pthread_mutex_unlock (&cluster_lock);
+    }
+    sleep (CLUSTER_POLL);
+  }
+  return NULL;
+}
+
+/* start fetching the digests of the other nodes, if there are any */
+int
+cluster_start (void)
+{
+  pthread_attr_t attr;
+  pthread_t tid;
+
+  if (nnodes < 2)
+    return MSE_OK;
+  if ((MS_pthread_errno = pthread_attr_init (&attr))
+      || (MS_pthread_errno =
+            pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED))
+      || (MS_pthread_errno = pthread_create (&tid, &attr, &__poller, NULL))) {
+    pthread_attr_destroy (&attr);
+    return (MS_errno = MSE_PTHREAD);
+  }
+  pthread_attr_destroy (&attr);
+  return MSE_OK;
+}
+
+/* a node asked for a resource, by a thread of its own */
+struct Gathering {
+  int        node;
+  char      *resource;
+  pthread_t  tid;
+  int        started, answered;
+  char      *body;
+  size_t     length;
+};
+
+static void *
+__gather (void *arg)
+{
+  struct Gathering *g = (struct Gathering *) arg;
+  int status;
+
+  if (cluster_fetch (g -> node, g -> resource, &status, &g -> body,
+                     &g -> length) != MSE_OK)
+    return NULL;
+  /* 404: nothing matched there */
+  g -> answered = status == 200 || status == 404;
+  if (status != 200 && g -> body != NULL) {
+    free (g -> body);
+    g -> body = NULL;
+  }
+  return NULL;
+}
+
+/*
+ * ask the other nodes for a resource at once, but those whose digest
+ * rules out matches for the (url encoded) search key and those found
+ * down lately. bodies [node] & lengths [node] are set to what each one
+ * sent back (NULL for this node, and those that have nothing). returns
+ * the number of nodes that answered (those skipped and this one count),
+ * or an error.
+ */
+int
+cluster_gather (char *resource, char *key, char **bodies, size_t *lengths)
+{
+  struct Gathering *g;
+  int i, down, answered = 1;
+
+  if ((g = (struct Gathering *) calloc (nnodes, sizeof (struct Gathering)))
+      == NULL)
+    return (MS_errno = MSE_NOMEM);
+  for (i = 0; i < nnodes; i ++) {
+    bodies [i] = NULL;
+    lengths [i] = 0;
+    if (i == self)
+      continue;
+    pthread_mutex_lock (&cluster_lock);
+    down = nodes [i] . down;
+    pthread_mutex_unlock (&cluster_lock);
+    if (down)
+      continue;
+    if (!cluster_may_match (i, key)) {
+      answered ++;
+      continue;
+    }
+    g [i] . node = i;
+    g [i] . resource = resource;
+    /* on its own if no thread is to be had */
+    if (!(g [i] . started = !pthread_create (&g [i] . tid, NULL, &__gather,
+                                             &g [i])))
+      __gather (&g [i]);
+  }
+  for (i = 0; i < nnodes; i ++) {
+    if (g [i] . started)
+      pthread_join (g [i] . tid, NULL);
+    if (g [i] . answered) {
+      answered ++;
+      bodies [i] = g [i] . body;
+      lengths [i] = g [i] . length;
+    }
+  }
+  free (g);
+  return answered;
+}
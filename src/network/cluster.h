@@ -0,0 +1,32 @@
+# ifndef __CLUSTER_LIB__
+# define __CLUSTER_LIB__
+
+# include <stddef.h>
+
+/*
+ * a cluster of servers (-c self,node,...), each holding the songs of its
+ * part of the library: songs go to the nodes by consistent hashing of
+ * their paths. nodes tell each other what their songs look like with a
+ * digest (a bloom filter of the trigrams of their folded paths & tags),
+ * so that searches of the whole cluster ask only the nodes that may have
+ * matches.
+ */
+
+  /* bytes of a digest */
+# define CLUSTER_DIGEST (64 * 1024)
+  /* nodes at most */
+# define CLUSTER_NODES  64
+
+int    cluster_init      (char *);
+int    cluster_start     (void);
+int    cluster_nodes     (void);
+int    cluster_self      (void);
+char*  cluster_node      (int);
+int    cluster_owner     (char *);
+int    cluster_keep      (char *);
+int    cluster_digest    (unsigned char **);
+int    cluster_may_match (int, char *);
+int    cluster_fetch     (int, char *, int *, char **, size_t *);
+int    cluster_gather    (char *, char *, char **, size_t *);
+
+# endif
@@ -0,0 +1,142 @@
+/* concat.c: songs chained into a single stream */
+# include <stdlib.h>
+# include <string.h>
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <sys/sendfile.h>
+
+# include "../mstream/mserrors.h"
+# include "../playlist/seek.h"
+# include "fdcache.h"
+# include "concat.h"
+
+/* a song of the stream: the bytes of its file from start to end */
+struct ConcatPart {
+  int    song;
+  off_t  start, end;
+};
+
+/*
+ * the parts of a stream, and where each of them begins in it: at[i] is
+ * the sum of the lengths of the parts before i, at[count] the length.
+ * songs are opened as they are sent, through the fd cache.
+ */
+struct Concat {
+  songtable          songs;
+  struct ConcatPart *parts;
+  off_t             *at;
+  int                count;
+};
+
+/*
+ * the stream of count songs of songs (held until concat_close), of type
+ * content (audio/mpeg or audio/ogg): songs of other types and missing
+ * files are left out. NULL if there is no memory.
+ */
+concat
+concat_open (songtable songs, int *list, int count, char *content)
+{
+  concat c;
+  struct ConcatPart *part;
+  struct stat st;
+  opensong open;
+  int i;
+
+  if (count > CONCAT_SONGS)
+    count = CONCAT_SONGS;
+  if ((c = (concat) calloc (1, sizeof (struct Concat))) == NULL
+      || (c -> parts = (struct ConcatPart *)
+                         malloc ((count + 1) * sizeof (struct ConcatPart)))
+           == NULL
+      || (c -> at = (off_t *) malloc ((count + 1) * sizeof (off_t))) == NULL) {
+    if (c != NULL && c -> parts != NULL) free (c -> parts);
+    if (c != NULL) free (c);
+    MS_errno = MSE_NOMEM;
+    return NULL;
+  }
+  c -> songs = songtable_hold (songs);
+  c -> at [0] = 0;
+  for (i = 0; i < count; i ++) {
+    if (strcmp (songtable_content (songs, list [i]), content)
+        || (open = fdcache_open (songs, list [i])) == NULL)
+      continue;
+    part = &c -> parts [c -> count];
+    part -> song = list [i];
+    if (fstat (fdcache_fd (open), &st) < 0) {
+      fdcache_release (open);
+      continue;
+    }
+    if (!strcmp (content, "audio/mpeg"))
+      seek_mpeg_frames (fdcache_fd (open), st.st_size, &part -> start,
+                        &part -> end);
+    else {
+      part -> start = 0;
+      part -> end = st.st_size;
+    }
+    fdcache_release (open);
+    c -> at [c -> count + 1] = c -> at [c -> count] + part -> end
+                               - part -> start;
+    c -> count ++;
+  }
+  return c;
+}
+
+off_t
+concat_length (concat c)
+{
+  return c -> at [c -> count];
+}
+
+int
+concat_songs (concat c)
+{
+  return c -> count;
+}
+
+/*
+ * send the bytes of the stream from "from" up to "to" (included), out of
+ * the files straight to the socket, from offsets of its own: the files
+ * are shared with other streams.
+ */
+int
+concat_send (int connfd, concat c, off_t from, off_t to)
+{
+  struct ConcatPart *part;
+  opensong open;
+  off_t offset, end;
+  ssize_t sent;
+  int i, lo = 0, hi = c -> count;
+
+  /* the part "from" falls in */
+  while (hi - lo > 1)
+    if (c -> at [(lo + hi) / 2] <= from) lo = (lo + hi) / 2;
+    else hi = (lo + hi) / 2;
+
+  for (i = lo; i < c -> count && c -> at [i] <= to; i ++) {
+    part = &c -> parts [i];
+    offset = part -> start + (from > c -> at [i] ? from - c -> at [i] : 0);
+    end = part -> start + (to < c -> at [i + 1] ? to + 1 - c -> at [i]
+                                                : c -> at [i + 1] - c -> at [i]);
+    if ((open = fdcache_open (c -> songs, part -> song)) == NULL)
+      return (MS_errno = MSE_OS);
+    while (offset < end)
+      if ((sent = sendfile (connfd, fdcache_fd (open), &offset,
+                            end - offset)) <= 0) {
+        fdcache_release (open);
+        /* a file that shrank meanwhile is as bad */
+        return (MS_errno = sent < 0 ? MSE_WRITERESPONSE : MSE_OS);
+      }
+    fdcache_release (open);
+  }
+  return MSE_OK;
+}
+
+void
+concat_close (concat c)
+{
+  songtable_free (c -> songs);
+  free (c -> parts);
+  free (c -> at);
+  free (c);
+  return;
+}
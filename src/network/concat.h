@@ -0,0 +1,23 @@
+# ifndef __CONCAT_LIB__
+# define __CONCAT_LIB__
+
+# include <sys/types.h>
+# include "../playlist/songtable.h"
+
+/*
+ * songs sent back to back as one stream, so that a whole playlist plays
+ * off a single request. only formats whose streams may be chained are:
+ * mp3s, without their tags, and ogg files as they are.
+ */
+typedef struct Concat *concat;
+
+  /* songs chained at most */
+# define CONCAT_SONGS 1000
+
+concat concat_open   (songtable, int *, int, char *);
+off_t  concat_length (concat);
+int    concat_songs  (concat);
+int    concat_send   (int, concat, off_t, off_t);
+void   concat_close  (concat);
+
+# endif
@@ -0,0 +1,615 @@
+/* edge.c: the songs of an origin server, cached on the disk */
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <time.h>
+# include <unistd.h>
+# include <fcntl.h>
+# include <dirent.h>
+# include <pthread.h>
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <sys/sendfile.h>
+
+# include "../sharedlib/strmod.h"
+# include "../mstream/mserrors.h"
+# include "fetch.h"
+# include "edge.h"
+
+# define EDGE_BUCKETS 4096
+  /* bytes written to the disk at once */
+# define EDGE_CHUNK   (64 * 1024)
+
+  /* state of a song */
+# define EDGE_STOPPED  0  /* none or part of it on the disk, not fetched */
+# define EDGE_STARTING 1  /* asked for, the origin did not answer yet */
+# define EDGE_FILLING  2  /* arriving */
+# define EDGE_COMPLETE 3
+# define EDGE_MISSING  4  /* the origin has no such song */
+
+/*
+ * a song of the origin, in a file named after the hash of its path
+ * (with a ".part" suffix until it is whole). songs live in a hash table
+ * and in an lru list, and are reference counted: their file is kept
+ * open (fd) while they are referenced, and songs are only let go of
+ * when they are not.
+ */
+struct EdgeSong {
+  unsigned long long  hash;
+  char               *path;     /* client path, NULL until asked for */
+  int                 state;
+  int                 fd;
+  off_t               length;   /* -1 until known */
+  off_t               filled;   /* bytes on the disk */
+  off_t               charged;  /* of them, counted against the budget */
+  int                 refs;
+  time_t              used;
+  edgesong            chain;    /* next song of the bucket */
+  edgesong            newer, older;
+};
+
+static pthread_mutex_t edge_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  edge_cond = PTHREAD_COND_INITIALIZER;
+
+static edgesong *table = NULL;
+static edgesong  newest = NULL, oldest = NULL;
+static char     *origin = NULL;
+static int       cachefd = -1;
+static size_t    budget = 0;
+static struct EdgeStats stats;
+
+/* 64 bit fnv-1a */
+static unsigned long long
+__hash (char *path)
+{
+  unsigned long long hash = 14695981039346656037ull;
+
+  while (*path)
+    hash = (hash ^ (unsigned char) *path ++) * 1099511628211ull;
+  return hash;
+}
+
+/* the name of the file of a song, whole or not */
+static void
+__name (edgesong s, int part, char *name)
+{
+  sprintf (name, part ? "%016llx.part" : "%016llx", s -> hash);
+  return;
+}
+
+/* the song of a hash, NULL if there is none (lock held) */
+static edgesong
+__find (unsigned long long hash)
+{
+  edgesong s;
+
+  for (s = table [hash % EDGE_BUCKETS]; s != NULL; s = s -> chain)
+    if (s -> hash == hash)
+      return s;
+  return NULL;
+}
+
+/* a new song, in the table but not in the lru list (lock held) */
+static edgesong
+__add (unsigned long long hash)
+{
+  edgesong s;
+
+  if ((s = (edgesong) calloc (1, sizeof (struct EdgeSong))) == NULL)
+    return NULL;
+  s -> hash = hash;
+  s -> fd = -1;
+  s -> length = -1;
+  s -> chain = table [hash % EDGE_BUCKETS];
+  table [hash % EDGE_BUCKETS] = s;
+  return s;
+}
+
+/* put a song at the recent end of the lru list (lock held) */
+static void
+__link (edgesong s)
+{
+  s -> older = newest;
+  s -> newer = NULL;
+  if (newest != NULL) newest -> newer = s;
+  else oldest = s;
+  newest = s;
+  return;
+}
+
+static void
+__unlink (edgesong s)
+{
+  if (s -> newer != NULL) s -> newer -> older = s -> older;
+  else newest = s -> older;
+  if (s -> older != NULL) s -> older -> newer = s -> newer;
+  else oldest = s -> newer;
+  return;
+}
+
+/* forget about an unreferenced song, and remove its file (lock held) */
+static void
+__remove (edgesong s)
+{
+  edgesong *link;
+  char name [32];
+
+  for (link = &table [s -> hash % EDGE_BUCKETS]; *link != s;
+       link = &(*link) -> chain)
+    ;
+  *link = s -> chain;
+  __unlink (s);
+  __name (s, 0, name);
+  unlinkat (cachefd, name, 0);
+  __name (s, 1, name);
+  unlinkat (cachefd, name, 0);
+  if (s -> state == EDGE_COMPLETE)
+    stats.songs --;
+  stats.used -= s -> charged;
+  if (s -> path != NULL) free (s -> path);
+  free (s);
+  return;
+}
+
+/* remove the songs least recently used until the disk budget is met */
+static void
+__evict (void)
+{
+  edgesong s, next;
+
+  for (s = oldest; stats.used > budget && s != NULL; s = next) {
+    next = s -> newer;
+    if (!s -> refs
+        && (s -> state == EDGE_COMPLETE || s -> state == EDGE_STOPPED))
+      __remove (s);
+  }
+  return;
+}
+
+/*
+ * drop a reference to a song (lock held). songs the origin has not, or
+ * whose fetch failed with nothing on the disk to resume from, are let
+ * go of with their last reference.
+ */
+static void
+__put (edgesong s)
+{
+  if (-- s -> refs)
+    return;
+  if (s -> fd >= 0) {
+    close (s -> fd);
+    s -> fd = -1;
+  }
+  if (s -> state == EDGE_MISSING
+      || (s -> state == EDGE_STOPPED && !s -> filled))
+    __remove (s);
+  return;
+}
+
+static int
+__used_cmp (const void *a, const void *b)
+{
+  time_t ua = (*(edgesong *) a) -> used, ub = (*(edgesong *) b) -> used;
+
+  return ua < ub ? -1 : ua > ub;
+}
+
+/*
+ * pass songs on from origin (host:port), keeping up to bytes of them in
+ * cachedir. songs left there by an earlier run are taken up again, those
+ * fetched in part to be resumed where they stopped.
+ */
+int
+edge_init (char *server, char *cachedir, size_t bytes)
+{
+  DIR *dir;
+  struct dirent *entry;
+  struct stat st;
+  edgesong s, *found = NULL, *grown;
+  unsigned long long hash;
+  char name [32];
+  int i, n = 0, size = 0, part;
+
+  if (strrchr (server, ':') == NULL)
+    return (MS_errno = MSE_INVALIDORIGIN);
+  if ((origin = strdup (server)) == NULL
+      || (table = (edgesong *) calloc (EDGE_BUCKETS, sizeof (edgesong)))
+         == NULL)
+    return (MS_errno = MSE_NOMEM);
+  budget = bytes;
+  if ((cachefd = open (cachedir, O_RDONLY | O_DIRECTORY)) < 0
+      || (i = dup (cachefd)) < 0)
+    return (MS_errno = MSE_OS);
+  if ((dir = fdopendir (i)) == NULL) {
+    close (i);
+    return (MS_errno = MSE_OS);
+  }
+
+  while ((entry = readdir (dir)) != NULL) {
+    if (strspn (entry -> d_name, "0123456789abcdef") != 16
+        || (strcmp (entry -> d_name + 16, "")
+            && strcmp (entry -> d_name + 16, ".part"))
+        || fstatat (cachefd, entry -> d_name, &st, 0) < 0
+        || !S_ISREG (st.st_mode))
+      continue;
+    part = entry -> d_name [16] != '\0';
+    hash = strtoull (entry -> d_name, NULL, 16);
+    if ((s = __find (hash)) != NULL) { /* whole & in part: whole it is */
+      if (!part) {
+        stats.used += st.st_size - s -> charged;
+        stats.songs ++;
+        s -> state = EDGE_COMPLETE;
+        s -> filled = s -> charged = s -> length = st.st_size;
+        s -> used = st.st_mtime;
+      }
+      __name (s, 1, name);
+      unlinkat (cachefd, name, 0);
+      continue;
+    }
+    if (n == size) {
+      size = size ? 2 * size : 256;
+      if ((grown = (edgesong *) realloc (found, size * sizeof (edgesong)))
+          == NULL) {
+        closedir (dir);
+        free (found);
+        return (MS_errno = MSE_NOMEM);
+      }
+      found = grown;
+    }
+    if ((s = __add (hash)) == NULL) {
+      closedir (dir);
+      free (found);
+      return (MS_errno = MSE_NOMEM);
+    }
+    found [n ++] = s;
+    s -> state = part ? EDGE_STOPPED : EDGE_COMPLETE;
+    s -> filled = s -> charged = st.st_size;
+    if (!part) {
+      s -> length = st.st_size;
+      stats.songs ++;
+    }
+    s -> used = st.st_mtime;
+    stats.used += st.st_size;
+  }
+  closedir (dir);
+
+  /* the lru list as the files were last written */
+  if (n)
+    qsort (found, n, sizeof (edgesong), &__used_cmp);
+  for (i = 0; i < n; i ++)
+    __link (found [i]);
+  if (found != NULL) free (found);
+  __evict ();
+  return MSE_OK;
+}
+
+/* the origin server, NULL if this server is not an edge */
+char *
+edge_origin (void)
+{
+  return origin;
+}
+
+/* ask addr for a song, from some byte on */
+static int
+__ask (char *addr, char *path, off_t from, struct FetchReply *reply)
+{
+  char *request;
+  int err;
+
+  if ((request = from ? Sprintf ("GET %s HTTP/1.0\r\nHost: %s\r\n"
+                                 "Range: bytes=%llu-\r\n\r\n", path, addr,
+                                 (unsigned long long) from)
+                      : Sprintf ("GET %s HTTP/1.0\r\nHost: %s\r\n\r\n",
+                                 path, addr)) == NULL)
+    return (MS_errno = MSE_NOMEM);
+  err = fetch_open (addr, request, reply);
+  free (request);
+  return err == MSE_OK ? MSE_OK : MS_errno;
+}
+
+/*
+ * ask the origin for a song, from some byte on. a redirection (to the
+ * node of a cluster the song belongs to) is followed once.
+ */
+static int
+__request (char *path, off_t from, struct FetchReply *reply)
+{
+  char location [sizeof (reply -> location)], *host, *slash;
+
+  if (__ask (origin, path, from, reply) != MSE_OK)
+    return MS_errno;
+  if ((reply -> status != 301 && reply -> status != 302
+       && reply -> status != 307)
+      || strncmp (reply -> location, "http://", strlen ("http://")))
+    return MSE_OK;
+  strcpy (location, reply -> location);
+  host = location + strlen ("http://");
+  if ((slash = strchr (host, '/')) == NULL)
+    return MSE_OK;
+  fetch_close (reply);
+  /* the host is moved a byte back, to end it before the path */
+  memmove (host - 1, host, slash - host);
+  slash [-1] = '\0';
+  return __ask (host - 1, slash, from, reply);
+}
+
+/*
+ * the fetcher of a song: it is written to its file as it arrives, from
+ * where an earlier fetch stopped if the origin serves ranges. the song
+ * is renamed once it is whole.
+ */
+static void *
+__fill (void *arg)
+{
+  edgesong s = (edgesong) arg;
+  struct FetchReply reply;
+  char name [32], whole [32], *buffer = NULL;
+  off_t from, length;
+  ssize_t got = -1, put;
+  int fd, state = EDGE_STOPPED, i;
+
+  pthread_mutex_lock (&edge_lock);
+  from = s -> filled;
+  pthread_mutex_unlock (&edge_lock);
+  __name (s, 1, name);
+  __name (s, 0, whole);
+  if ((fd = openat (cachefd, name, O_RDWR | O_CREAT, 0644)) < 0
+      || (buffer = (char *) malloc (EDGE_CHUNK)) == NULL
+      || __request (s -> path, from, &reply) != MSE_OK) {
+    if (fd >= 0) close (fd);
+    goto Stop;
+  }
+  if (reply.status == 206 && from && reply.first == from)
+    length = reply.total;
+  else if (reply.status == 200) { /* all of it, again */
+    from = 0;
+    length = reply.length;
+  }
+  else if (reply.status == 416 && from && reply.total == from) {
+    /* the part was whole already, it only was not renamed */
+    fetch_close (&reply);
+    pthread_mutex_lock (&edge_lock);
+    if (s -> fd >= 0)
+      close (fd);
+    else
+      s -> fd = fd;
+    pthread_mutex_unlock (&edge_lock);
+    if (!renameat (cachefd, name, cachefd, whole))
+      state = EDGE_COMPLETE;
+    goto Stop;
+  }
+  else {
+    if (reply.status == 404)
+      state = EDGE_MISSING;
+    else if (reply.status == 416) { /* the part is not of this song */
+      ftruncate (fd, 0);
+      pthread_mutex_lock (&edge_lock);
+      s -> filled = 0;
+      pthread_mutex_unlock (&edge_lock);
+    }
+    fetch_close (&reply);
+    close (fd);
+    goto Stop;
+  }
+
+  /* readers send the file out of the song's descriptor */
+  pthread_mutex_lock (&edge_lock);
+  if (s -> fd >= 0) {
+    close (fd);
+    fd = s -> fd;
+  }
+  else
+    s -> fd = fd;
+  s -> filled = from;
+  s -> length = length;
+  s -> state = EDGE_FILLING;
+  stats.filling ++;
+  pthread_cond_broadcast (&edge_cond);
+  pthread_mutex_unlock (&edge_lock);
+
+  while ((got = fetch_read (&reply, buffer, EDGE_CHUNK)) > 0) {
+    for (i = 0; i < got; i += put)
+      if ((put = pwrite (fd, buffer + i, got - i, from + i)) <= 0)
+        break;
+    if (i < got) {
+      got = -1;
+      break;
+    }
+    from += got;
+    pthread_mutex_lock (&edge_lock);
+    s -> filled = from;
+    stats.fetched += got;
+    pthread_cond_broadcast (&edge_cond);
+    pthread_mutex_unlock (&edge_lock);
+  }
+  fetch_close (&reply);
+  if (!got && (length < 0 || from == length)) {
+    ftruncate (fd, from);
+    if (!renameat (cachefd, name, cachefd, whole))
+      state = EDGE_COMPLETE;
+  }
+  pthread_mutex_lock (&edge_lock);
+  stats.filling --;
+  pthread_mutex_unlock (&edge_lock);
+
+ Stop:
+  if (buffer != NULL) free (buffer);
+  pthread_mutex_lock (&edge_lock);
+  s -> state = state;
+  if (state == EDGE_COMPLETE) {
+    s -> length = s -> filled;
+    stats.songs ++;
+  }
+  stats.used += s -> filled - s -> charged;
+  s -> charged = s -> filled;
+  s -> used = time (NULL);
+  pthread_cond_broadcast (&edge_cond);
+  __put (s);
+  __evict ();
+  pthread_mutex_unlock (&edge_lock);
+  return NULL;
+}
+
+/*
+ * a song of the origin, by its client path: *song is NULL if the origin
+ * has none. songs not on the disk are fetched, and songs being fetched
+ * are shared with whoever asked for them first; either way this returns
+ * once the origin answered.
+ */
+int
+edge_open (char *path, edgesong *song)
+{
+  pthread_attr_t attr;
+  pthread_t tid;
+  edgesong s;
+  int err = MSE_OK;
+
+  *song = NULL;
+  pthread_mutex_lock (&edge_lock);
+  if ((s = __find (__hash (path))) == NULL) {
+    if ((s = __add (__hash (path))) == NULL) {
+      pthread_mutex_unlock (&edge_lock);
+      return (MS_errno = MSE_NOMEM);
+    }
+    __link (s);
+  }
+  if (s -> path == NULL && (s -> path = strdup (path)) == NULL) {
+    pthread_mutex_unlock (&edge_lock);
+    return (MS_errno = MSE_NOMEM);
+  }
+  s -> refs ++;
+  __unlink (s);
+  __link (s);
+
+  switch (s -> state) {
+  case EDGE_COMPLETE:
+    stats.hits ++;
+    break;
+  case EDGE_STARTING:
+  case EDGE_FILLING:
+    stats.shared ++;
+    break;
+  default: /* fetched by a thread of its own, holding a reference */
+    stats.misses ++;
+    s -> state = EDGE_STARTING;
+    s -> refs ++;
+    if ((MS_pthread_errno = pthread_attr_init (&attr))
+        || (MS_pthread_errno =
+              pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED))
+        || (MS_pthread_errno = pthread_create (&tid, &attr, &__fill, s))) {
+      s -> state = EDGE_STOPPED;
+      s -> refs --;
+      err = MSE_PTHREAD;
+    }
+    pthread_attr_destroy (&attr);
+  }
+
+  while (s -> state == EDGE_STARTING)
+    pthread_cond_wait (&edge_cond, &edge_lock);
+  if (err == MSE_OK && s -> state == EDGE_STOPPED) /* it could not start */
+    err = MSE_SOCKET;
+  if (err != MSE_OK || s -> state == EDGE_MISSING)
+    __put (s);
+  else
+    *song = s;
+  pthread_mutex_unlock (&edge_lock);
+  return err == MSE_OK ? MSE_OK : (MS_errno = err);
+}
+
+/* whether a song is on the disk, whole */
+int
+edge_complete (edgesong s)
+{
+  int complete;
+
+  pthread_mutex_lock (&edge_lock);
+  complete = s -> state == EDGE_COMPLETE;
+  pthread_mutex_unlock (&edge_lock);
+  return complete;
+}
+
+/* wait until a song is whole, an error if its fetch stopped before */
+int
+edge_wait (edgesong s)
+{
+  int state;
+
+  pthread_mutex_lock (&edge_lock);
+  while (s -> state == EDGE_STARTING || s -> state == EDGE_FILLING)
+    pthread_cond_wait (&edge_cond, &edge_lock);
+  state = s -> state;
+  pthread_mutex_unlock (&edge_lock);
+  return state == EDGE_COMPLETE ? MSE_OK : (MS_errno = MSE_SOCKET);
+}
+
+/* a descriptor of its own of a whole song */
+int
+edge_file (edgesong s)
+{
+  char name [32];
+
+  __name (s, 0, name);
+  return openat (cachefd, name, O_RDONLY);
+}
+
+/* the length of a song, -1 if the origin did not tell */
+off_t
+edge_length (edgesong s)
+{
+  off_t length;
+
+  pthread_mutex_lock (&edge_lock);
+  length = s -> length;
+  pthread_mutex_unlock (&edge_lock);
+  return length;
+}
+
+/*
+ * send the bytes of a song from "from" up to "to" (included, -1 for all
+ * of it), out of its file as they arrive from the origin
+ */
+int
+edge_send (int connfd, edgesong s, off_t from, off_t to)
+{
+  off_t offset = from, filled, end;
+  ssize_t sent;
+  int state, fd;
+
+  while (to < 0 || offset <= to) {
+    pthread_mutex_lock (&edge_lock);
+    while ((s -> state == EDGE_STARTING || s -> state == EDGE_FILLING)
+           && s -> filled <= offset)
+      pthread_cond_wait (&edge_cond, &edge_lock);
+    filled = s -> filled;
+    state = s -> state;
+    fd = s -> fd;
+    pthread_mutex_unlock (&edge_lock);
+    if (filled <= offset) /* all sent, or the fetch stopped short */
+      return state == EDGE_COMPLETE && to < 0 ? MSE_OK
+             : (MS_errno = MSE_OS);
+    end = to >= 0 && to < filled ? to + 1 : filled;
+    while (offset < end)
+      if ((sent = sendfile (connfd, fd, &offset, end - offset)) <= 0)
+        return (MS_errno = sent < 0 ? MSE_WRITERESPONSE : MSE_OS);
+  }
+  return MSE_OK;
+}
+
+void
+edge_release (edgesong s)
+{
+  pthread_mutex_lock (&edge_lock);
+  __put (s);
+  pthread_mutex_unlock (&edge_lock);
+  return;
+}
+
+void
+edge_stats (struct EdgeStats *st)
+{
+  pthread_mutex_lock (&edge_lock);
+  *st = stats;
+  pthread_mutex_unlock (&edge_lock);
+  return;
+}
@@ -0,0 +1,35 @@
+# ifndef __EDGE_LIB__
+# define __EDGE_LIB__
+
+# include <stddef.h>
+# include <sys/types.h>
+
+/*
+ * an edge server (-e origin): it has no library of its own but passes
+ * requests on to another server, the origin. songs fetched from it are
+ * kept on the disk, in the directory given with -d, and sent to the
+ * clients as they arrive. concurrent requests of a song being fetched
+ * share the same fetch.
+ */
+typedef struct EdgeSong *edgesong;
+
+struct EdgeStats {
+  int                songs;     /* on the disk, whole */
+  int                filling;   /* being fetched */
+  unsigned long long used;      /* bytes on the disk */
+  unsigned long      hits, misses, shared;
+  unsigned long long fetched;   /* bytes from the origin */
+};
+
+int    edge_init     (char *, char *, size_t);
+char*  edge_origin   (void);
+int    edge_open     (char *, edgesong *);
+int    edge_complete (edgesong);
+int    edge_wait     (edgesong);
+int    edge_file     (edgesong);
+off_t  edge_length   (edgesong);
+int    edge_send     (int, edgesong, off_t, off_t);
+void   edge_release  (edgesong);
+void   edge_stats    (struct EdgeStats *);
+
+# endif
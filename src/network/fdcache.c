@@ -0,0 +1,218 @@
+/* fdcache.c: song files kept open, keyed by their index in the library */
+# include <stdlib.h>
+# include <string.h>
+# include <unistd.h>
+# include <time.h>
+# include <pthread.h>
+# include <sys/types.h>
+# include <sys/stat.h>
+
+# include "../mstream/mserrors.h"
+# include "fdcache.h"
+
+# define FDCACHE_BUCKETS 256
+  /* seconds a file is trusted to be the song's before it is looked at */
+# define FDCACHE_CHECK   2
+
+/*
+ * an open song file. entries live in a hash table and in an lru list, and
+ * are reference counted so that a file stays open while it is streamed
+ * after its entry was evicted. an entry out of the table is closed with
+ * its last reference. a file replaced or removed on the disk is told by
+ * its inode, size & time, checked every FDCACHE_CHECK seconds at most.
+ */
+struct OpenSong {
+  int       song;
+  int       fd;
+  dev_t     dev;
+  ino_t     ino;
+  off_t     size;
+  time_t    mtime;
+  time_t    checked;
+  int       refs;
+  int       linked;       /* still in the table */
+  opensong  chain;        /* next entry of the bucket */
+  opensong  newer, older; /* lru list */
+};
+
+static pthread_mutex_t fdcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static opensong *table = NULL;
+static opensong  newest = NULL, oldest = NULL;
+static int       limit = 0, count = 0;
+
+int
+fdcache_init (int files)
+{
+  if ((table = (opensong *) calloc (FDCACHE_BUCKETS, sizeof (opensong)))
+      == NULL)
+    return (MS_errno = MSE_NOMEM);
+  limit = files;
+  return MSE_OK;
+}
+
+static void
+__destroy (opensong entry)
+{
+  close (entry -> fd);
+  free (entry);
+  return;
+}
+
+/* take an entry off the table and the lru list (lock held) */
+static void
+__unlink (opensong entry)
+{
+  opensong *link;
+
+  for (link = &table [entry -> song % FDCACHE_BUCKETS]; *link != entry;
+       link = &(*link) -> chain)
+    ;
+  *link = entry -> chain;
+  if (entry -> newer != NULL) entry -> newer -> older = entry -> older;
+  else newest = entry -> older;
+  if (entry -> older != NULL) entry -> older -> newer = entry -> newer;
+  else oldest = entry -> newer;
+  entry -> linked = 0;
+  count --;
+  if (!entry -> refs)
+    __destroy (entry);
+  return;
+}
+
+/* put an entry at the front of the lru list (lock held) */
+static void
+__link (opensong entry)
+{
+  entry -> older = newest;
+  entry -> newer = NULL;
+  if (newest != NULL) newest -> newer = entry;
+  else oldest = entry;
+  newest = entry;
+  return;
+}
+
+/* the entry of song, held and made the newest, NULL if none (lock held) */
+static opensong
+__hold (int song)
+{
+  opensong entry;
+
+  for (entry = table [song % FDCACHE_BUCKETS]; entry != NULL;
+       entry = entry -> chain)
+    if (entry -> song == song)
+      break;
+  if (entry == NULL)
+    return NULL;
+  entry -> refs ++;
+  if (entry != newest) {
+    entry -> newer -> older = entry -> older;
+    if (entry -> older != NULL) entry -> older -> newer = entry -> newer;
+    else oldest = entry -> newer;
+    __link (entry);
+  }
+  return entry;
+}
+
+/*
+ * the file of song in songs, opened if it was not open already, held
+ * until fdcache_release. NULL if it cannot be opened.
+ */
+opensong
+fdcache_open (songtable songs, int song)
+{
+  opensong entry, held;
+  struct stat st;
+  time_t now = time (NULL);
+  int fd, check = 0;
+
+  pthread_mutex_lock (&fdcache_lock);
+  if ((entry = __hold (song)) != NULL
+      && now >= entry -> checked + FDCACHE_CHECK) {
+    entry -> checked = now; /* by this thread alone */
+    check = 1;
+  }
+  pthread_mutex_unlock (&fdcache_lock);
+  if (check
+      && (songtable_stat (songs, song, &st) < 0
+          || st.st_dev != entry -> dev || st.st_ino != entry -> ino
+          || st.st_size != entry -> size || st.st_mtime != entry -> mtime)) {
+    /* replaced or removed since: streams of the old file keep it */
+    pthread_mutex_lock (&fdcache_lock);
+    if (entry -> linked)
+      __unlink (entry);
+    pthread_mutex_unlock (&fdcache_lock);
+    fdcache_release (entry);
+    entry = NULL;
+  }
+  if (entry != NULL)
+    return entry;
+
+  /* open it without holding the lock */
+  if ((fd = songtable_open (songs, song)) < 0)
+    return NULL;
+  if ((entry = (opensong) malloc (sizeof (struct OpenSong))) == NULL) {
+    close (fd);
+    return NULL;
+  }
+  if (fstat (fd, &st) < 0)
+    memset (&st, 0, sizeof (st)); /* looked at again on its next use */
+  entry -> song = song;
+  entry -> fd = fd;
+  entry -> dev = st.st_dev;
+  entry -> ino = st.st_ino;
+  entry -> size = st.st_size;
+  entry -> mtime = st.st_mtime;
+  entry -> checked = now;
+  entry -> refs = 1;
+  entry -> linked = 0;
+
+  pthread_mutex_lock (&fdcache_lock);
+  if (limit <= 0) {
+    pthread_mutex_unlock (&fdcache_lock);
+    return entry; /* not kept: closed once released */
+  }
+  if ((held = __hold (song)) != NULL) { /* opened by another meanwhile */
+    pthread_mutex_unlock (&fdcache_lock);
+    __destroy (entry);
+    return held;
+  }
+  while (count >= limit)
+    __unlink (oldest);
+  entry -> linked = 1;
+  entry -> chain = table [song % FDCACHE_BUCKETS];
+  table [song % FDCACHE_BUCKETS] = entry;
+  __link (entry);
+  count ++;
+  pthread_mutex_unlock (&fdcache_lock);
+  return entry;
+}
+
+int
+fdcache_fd (opensong entry)
+{
+  return entry -> fd;
+}
+
+/* drop a reference taken by fdcache_open */
+void
+fdcache_release (opensong entry)
+{
+  pthread_mutex_lock (&fdcache_lock);
+  if (!-- entry -> refs && !entry -> linked)
+    __destroy (entry);
+  pthread_mutex_unlock (&fdcache_lock);
+  return;
+}
+
+/* how many files are kept open */
+int
+fdcache_count (void)
+{
+  int n;
+
+  pthread_mutex_lock (&fdcache_lock);
+  n = count;
+  pthread_mutex_unlock (&fdcache_lock);
+  return n;
+}
@@ -0,0 +1,20 @@
+# ifndef __FD_CACHE_LIB__
+# define __FD_CACHE_LIB__
+
+# include "../playlist/songtable.h"
+
+/*
+ * song files are kept open once opened, so that songs played often are
+ * not opened again for every request (a round trip each on nfs). the
+ * streams of a song share its descriptor, reading at their own offsets.
+ * files replaced or removed on the disk are let go of, once noticed.
+ */
+typedef struct OpenSong *opensong;
+
+int      fdcache_init    (int);
+opensong fdcache_open    (songtable, int);
+int      fdcache_fd      (opensong);
+void     fdcache_release (opensong);
+int      fdcache_count   (void);
+
+# endif
@@ -0,0 +1,242 @@
+/* fetch.c: a client of other servers */
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <strings.h>
+# include <errno.h>
+# include <unistd.h>
+# include <fcntl.h>
+# include <poll.h>
+# include <sys/types.h>
+# include <sys/socket.h>
+# include <sys/time.h>
+# include <netdb.h>
+
+# include "../sharedlib/strmod.h"
+# include "../mstream/mserrors.h"
+# include "fetch.h"
+
+  /* bytes of status line & headers at most */
+# define FETCH_HEAD 8192
+
+/* connect to host:port, giving up after FETCH_TIMEOUT seconds */
+static int
+__connect (char *addr)
+{
+  struct addrinfo hints, *res, *ai;
+  struct pollfd pfd;
+  struct timeval tv;
+  socklen_t errlen;
+  char *host, *port;
+  int fd = -1, err;
+
+  if ((host = strdup (addr)) == NULL)
+    return -1;
+  if ((port = strrchr (host, ':')) == NULL) {
+    free (host);
+    return -1;
+  }
+  *port ++ = '\0';
+  memset (&hints, 0, sizeof (hints));
+  hints.ai_socktype = SOCK_STREAM;
+  err = getaddrinfo (host, port, &hints, &res);
+  free (host);
+  if (err)
+    return -1;
+  for (ai = res; ai != NULL; ai = ai -> ai_next) {
+    if ((fd = socket (ai -> ai_family, ai -> ai_socktype | SOCK_NONBLOCK,
+                      ai -> ai_protocol)) < 0)
+      continue;
+    if (connect (fd, ai -> ai_addr, ai -> ai_addrlen) == 0)
+      break;
+    if (errno == EINPROGRESS) {
+      pfd.fd = fd;
+      pfd.events = POLLOUT;
+      errlen = sizeof (err);
+      if (poll (&pfd, 1, FETCH_TIMEOUT * 1000) == 1
+          && !getsockopt (fd, SOL_SOCKET, SO_ERROR, &err, &errlen) && !err)
+        break;
+    }
+    close (fd);
+    fd = -1;
+  }
+  freeaddrinfo (res);
+  if (fd < 0)
+    return -1;
+  tv.tv_sec = FETCH_TIMEOUT;
+  tv.tv_usec = 0;
+  fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) & ~O_NONBLOCK);
+  setsockopt (fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof (tv));
+  setsockopt (fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof (tv));
+  return fd;
+}
+
+/* copy the value of a header line into value (of size bytes) */
+static void
+__header_value (char *line, char *value, size_t size)
+{
+  size_t len;
+
+  while (*line == ' ')
+    line ++;
+  if ((len = strcspn (line, "\r\n")) >= size)
+    len = size - 1;
+  memcpy (value, line, len);
+  value [len] = '\0';
+  return;
+}
+
+/*
+ * send a request (whole, headers & all) to host:port and read the
+ * status & headers of the response. the body is then read with
+ * fetch_read, and the reply let go of with fetch_close.
+ */
+int
+fetch_open (char *addr, char *request, struct FetchReply *reply)
+{
+  char *line, *end, *next, value [64];
+  size_t len = 0;
+  ssize_t got;
+
+  memset (reply, 0, sizeof (struct FetchReply));
+  reply -> length = reply -> first = reply -> total = -1;
+  if ((reply -> buffer = (char *) malloc (FETCH_HEAD + 1)) == NULL)
+    return (MS_errno = MSE_NOMEM);
+  if ((reply -> fd = __connect (addr)) < 0) {
+    free (reply -> buffer);
+    return (MS_errno = MSE_SOCKET);
+  }
+  if (send (reply -> fd, request, strlen (request), MSG_NOSIGNAL)
+      != (ssize_t) strlen (request)) {
+    fetch_close (reply);
+    return (MS_errno = MSE_WRITERESPONSE);
+  }
+
+  /* the headers end with an empty line, the body may follow at once */
+  do {
+    if (len == FETCH_HEAD
+        || (got = recv (reply -> fd, reply -> buffer + len, FETCH_HEAD - len,
+                        0)) <= 0) {
+      fetch_close (reply);
+      return (MS_errno = MSE_READREQUEST);
+    }
+    len += got;
+    reply -> buffer [len] = '\0';
+  } while ((end = strstr (reply -> buffer, "\r\n\r\n")) == NULL);
+  if (strncmp (reply -> buffer, "HTTP/1.", strlen ("HTTP/1."))
+      || end - reply -> buffer < 12) {
+    fetch_close (reply);
+    return (MS_errno = MSE_READREQUEST);
+  }
+  reply -> status = atoi (reply -> buffer + strlen ("HTTP/1.x "));
+  *end = '\0';
+  for (line = strstr (reply -> buffer, "\r\n"); line != NULL; line = next) {
+    line += strlen ("\r\n");
+    next = strstr (line, "\r\n");
+    if (!strncasecmp (line, "Content-Type:", strlen ("Content-Type:")))
+      __header_value (line + strlen ("Content-Type:"), reply -> type,
+                      sizeof (reply -> type));
+    else if (!strncasecmp (line, "Location:", strlen ("Location:")))
+      __header_value (line + strlen ("Location:"), reply -> location,
+                      sizeof (reply -> location));
+    else if (!strncasecmp (line, "Content-Length:",
+                           strlen ("Content-Length:"))) {
+      __header_value (line + strlen ("Content-Length:"), value,
+                      sizeof (value));
+      reply -> length = strtoll (value, NULL, 10);
+    }
+    else if (!strncasecmp (line, "Content-Range:",
+                           strlen ("Content-Range:"))) {
+      __header_value (line + strlen ("Content-Range:"), value,
+                      sizeof (value));
+      if (!strncmp (value, "bytes ", strlen ("bytes "))
+          && strchr (value, '/') != NULL) {
+        if (value [strlen ("bytes ")] != '*') /* "*" for a 416 */
+          reply -> first = strtoll (value + strlen ("bytes "), NULL, 10);
+        reply -> total = strtoll (strchr (value, '/') + 1, NULL, 10);
+      }
+    }
+  }
+  reply -> at = end + strlen ("\r\n\r\n") - reply -> buffer;
+  reply -> buffered = len;
+  return MSE_OK;
+}
+
+/* read some of the body of a reply, 0 once it is all read */
+ssize_t
+fetch_read (struct FetchReply *reply, char *data, size_t size)
+{
+  size_t len;
+
+  if (reply -> at < reply -> buffered) {
+    len = reply -> buffered - reply -> at;
+    if (len > size)
+      len = size;
+    memcpy (data, reply -> buffer + reply -> at, len);
+    reply -> at += len;
+    return len;
+  }
+  return recv (reply -> fd, data, size, 0);
+}
+
+void
+fetch_close (struct FetchReply *reply)
+{
+  close (reply -> fd);
+  free (reply -> buffer);
+  return;
+}
+
+/*
+ * get a resource of host:port, asked for under host (so that playlists
+ * rendered there point at it), as a whole: its body (NULL if it had
+ * none) is read until the server closes the connection.
+ */
+int
+fetch_get (char *addr, char *resource, char *host, struct FetchReply *reply,
+           char **body, size_t *length)
+{
+  char *request, *grown;
+  size_t size = 0;
+  ssize_t got;
+
+  *body = NULL;
+  *length = 0;
+  if ((request = Sprintf ("GET %s HTTP/1.0\r\nHost: %s\r\n\r\n", resource,
+                          host)) == NULL)
+    return (MS_errno = MSE_NOMEM);
+  if (fetch_open (addr, request, reply) != MSE_OK) {
+    free (request);
+    return MS_errno;
+  }
+  free (request);
+
+  for (; ;) {
+    if (*length + BUFSIZ + 1 > size) {
+      size = size ? 2 * size : 4 * BUFSIZ;
+      if ((grown = (char *) realloc (*body, size)) == NULL) {
+        if (*body != NULL) free (*body);
+        *body = NULL;
+        fetch_close (reply);
+        return (MS_errno = MSE_NOMEM);
+      }
+      *body = grown;
+    }
+    if ((got = fetch_read (reply, *body + *length, size - *length - 1)) <= 0)
+      break;
+    *length += got;
+  }
+  fetch_close (reply);
+  if (got < 0) {
+    free (*body);
+    *body = NULL;
+    *length = 0;
+    return (MS_errno = MSE_READREQUEST);
+  }
+  (*body) [*length] = '\0';
+  if (!*length) {
+    free (*body);
+    *body = NULL;
+  }
+  return MSE_OK;
+}
@@ -0,0 +1,32 @@
+# ifndef __FETCH_LIB__
+# define __FETCH_LIB__
+
+# include <stddef.h>
+# include <sys/types.h>
+
+/*
+ * http/1.0 requests to other servers (nodes of a cluster, the origin of
+ * an edge), "host:port". responses are read as they come: first their
+ * status & headers, then their body.
+ */
+struct FetchReply {
+  int     fd;
+  int     status;
+  char    type [64];        /* Content-Type, "" if none */
+  char    location [256];   /* Location, "" if none */
+  off_t   length;           /* Content-Length, -1 if none */
+  off_t   first, total;     /* of a Content-Range, -1 if none */
+  char   *buffer;           /* body bytes read along the headers */
+  size_t  buffered, at;
+};
+
+  /* seconds a server is given to connect, and then for each read */
+# define FETCH_TIMEOUT 2
+
+int     fetch_open  (char *, char *, struct FetchReply *);
+ssize_t fetch_read  (struct FetchReply *, char *, size_t);
+void    fetch_close (struct FetchReply *);
+int     fetch_get   (char *, char *, char *, struct FetchReply *, char **,
+                     size_t *);
+
+# endif
@@ -0,0 +1,255 @@
+/* fullpl.c: the playlist of the whole library, rendered ahead per host */
+# define _GNU_SOURCE
+# include <stdlib.h>
+# include <string.h>
+# include <errno.h>
+# include <time.h>
+# include <unistd.h>
+# include <pthread.h>
+# include <sys/mman.h>
+
+# include "../mstream/mserrors.h"
+# include "../playlist/songtable.h"
+# include "../playlist/playlist.h"
+# include "fullpl.h"
+
+  /* hosts the playlist is kept for, others get it rendered as it is sent */
+# define FULLPL_HOSTS 16
+  /* seconds between two looks for a grown library */
+# define FULLPL_POLL  1
+  /* bytes rendered before each write to the memory file */
+# define FULLPL_BATCH 65536
+
+/*
+ * a rendered playlist: a memory file, sent with sendfile by as many
+ * responses as need it, and closed along with the last of them. the
+ * library only grows, by songs appended to it, so the number of songs
+ * tells which library a playlist lists.
+ */
+struct FullPlaylist {
+  int     fd;
+  size_t  length;
+  int     songs;
+  int     refs;
+};
+
+/* a host the playlist was asked under, and its latest playlist */
+struct FullHost {
+  char   *host;
+  fullpl  body;     /* NULL until first rendered */
+};
+
+static pthread_mutex_t fullpl_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  fullpl_cond = PTHREAD_COND_INITIALIZER;
+static struct FullHost hosts [FULLPL_HOSTS];
+static int nhosts = 0, wanted = 0;
+
+/* render one playlist line at buf, return its length (0: no room) */
+size_t
+fullpl_line (char *buf, size_t room, char *host, songtable songs, int song)
+{
+  char *path = songtable_client_path (songs, song);
+  size_t hostlen = strlen (host), pathlen = strlen (path);
+
+  if (strlen ("http://") + hostlen + pathlen + 1 > room)
+    return 0;
+  memcpy (buf, "http://", strlen ("http://"));
+  buf += strlen ("http://");
+  memcpy (buf, host, hostlen);
+  memcpy (buf + hostlen, path, pathlen);
+  buf [hostlen + pathlen] = '\n';
+  return strlen ("http://") + hostlen + pathlen + 1;
+}
+
+/* write onto fd "bytes" bytes of "buffer" */
+static int
+__write (int fd, char *buffer, size_t bytes)
+{
+  ssize_t written;
+
+  while (bytes > 0) {
+    if ((written = write (fd, buffer, bytes)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return (MS_errno = MSE_OS);
+    }
+    buffer += written;
+    bytes -= written;
+  }
+  return MSE_OK;
+}
+
+/* the playlist of every song under host, NULL on failure */
+static fullpl
+__render (char *host, songtable songs)
+{
+  fullpl body;
+  char *batch;
+  size_t len = 0, line;
+  int song, count = songtable_length (songs);
+
+  if ((body = (fullpl) calloc (1, sizeof (struct FullPlaylist))) == NULL
+      || (batch = (char *) malloc (FULLPL_BATCH)) == NULL) {
+    if (body != NULL) free (body);
+    MS_errno = MSE_NOMEM;
+    return NULL;
+  }
+  if ((body -> fd = memfd_create ("playlist", MFD_CLOEXEC)) < 0) {
+    MS_errno = MSE_OS;
+    goto ErrorEpilogue;
+  }
+  for (song = 0; song < count; song ++) {
+    if (!(line = fullpl_line (batch + len, FULLPL_BATCH - len, host,
+                              songs, song))) {
+      if (__write (body -> fd, batch, len) != MSE_OK)
+        goto ErrorEpilogue;
+      body -> length += len;
+      len = 0;
+      /* a single line longer than a batch is skipped, as streams do */
+      line = fullpl_line (batch, FULLPL_BATCH, host, songs, song);
+    }
+    len += line;
+  }
+  if (__write (body -> fd, batch, len) != MSE_OK)
+    goto ErrorEpilogue;
+  body -> length += len;
+  body -> songs = count;
+  body -> refs = 1;
+  free (batch);
+  return body;
+
+ ErrorEpilogue:
+  if (body -> fd >= 0) close (body -> fd);
+  free (body);
+  free (batch);
+  return NULL;
+}
+
+/* drop a reference to a playlist (lock held) */
+static void
+__drop (fullpl body)
+{
+  if (-- body -> refs)
+    return;
+  close (body -> fd);
+  free (body);
+  return;
+}
+
+/*
+ * the renderer: whenever asked to, or every FULLPL_POLL seconds, bring
+ * the playlist of every host up to the library.
+ */
+static void *
+__renderer (void *arg)
+{
+  struct timespec until;
+  songtable songs;
+  fullpl body;
+  int i, n;
+
+  for (; ;) {
+    pthread_mutex_lock (&fullpl_lock);
+    if (!wanted) {
+      clock_gettime (CLOCK_REALTIME, &until);
+      until.tv_sec += FULLPL_POLL;
+      pthread_cond_timedwait (&fullpl_cond, &fullpl_lock, &until);
+    }
+    wanted = 0;
+    n = nhosts;
+    pthread_mutex_unlock (&fullpl_lock);
+
+    songs = library_acquire ();
+    for (i = 0; i < n; i ++) {
+      /* only this thread replaces bodies: no need to lock to look */
+      if (hosts [i] . body != NULL
+          && hosts [i] . body -> songs == songtable_length (songs))
+        continue;
+      if ((body = __render (hosts [i] . host, songs)) == NULL)
+        continue; /* the playlist is streamed meanwhile */
+      pthread_mutex_lock (&fullpl_lock);
+      if (hosts [i] . body != NULL)
+        __drop (hosts [i] . body);
+      hosts [i] . body = body;
+      pthread_mutex_unlock (&fullpl_lock);
+    }
+    library_release (songs);
+  }
+  return NULL;
+}
+
+/* start the renderer thread */
+int
+fullpl_init (void)
+{
+  pthread_attr_t attr;
+  pthread_t tid;
+
+  if ((MS_pthread_errno = pthread_attr_init (&attr))
+      || (MS_pthread_errno =
+            pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED))
+      || (MS_pthread_errno = pthread_create (&tid, &attr, &__renderer, NULL))) {
+    pthread_attr_destroy (&attr);
+    return (MS_errno = MSE_PTHREAD);
+  }
+  pthread_attr_destroy (&attr);
+  return MSE_OK;
+}
+
+/*
+ * the playlist of songs, the whole library, under host (held until
+ * fullpl_release). NULL if it is not rendered yet, or was rendered from
+ * an older library: the renderer is woken up to see to it, and the
+ * caller renders the playlist on its own meanwhile.
+ */
+fullpl
+fullpl_lookup (char *host, songtable songs)
+{
+  fullpl body = NULL;
+  int i;
+
+  pthread_mutex_lock (&fullpl_lock);
+  for (i = 0; i < nhosts && strcmp (hosts [i] . host, host); i ++)
+    ;
+  if (i == nhosts) {
+    if (nhosts == FULLPL_HOSTS
+        || (hosts [nhosts] . host = strdup (host)) == NULL) {
+      pthread_mutex_unlock (&fullpl_lock);
+      return NULL;
+    }
+    nhosts ++;
+  }
+  if (hosts [i] . body != NULL
+      && hosts [i] . body -> songs == songtable_length (songs)) {
+    body = hosts [i] . body;
+    body -> refs ++;
+  }
+  else {
+    wanted = 1;
+    pthread_cond_signal (&fullpl_cond);
+  }
+  pthread_mutex_unlock (&fullpl_lock);
+  return body;
+}
+
+int
+fullpl_fd (fullpl body)
+{
+  return body -> fd;
+}
+
+size_t
+fullpl_length (fullpl body)
+{
+  return body -> length;
+}
+
+/* drop a reference taken by fullpl_lookup */
+void
+fullpl_release (fullpl body)
+{
+  pthread_mutex_lock (&fullpl_lock);
+  __drop (body);
+  pthread_mutex_unlock (&fullpl_lock);
+  return;
+}
@@ -0,0 +1,21 @@
+# ifndef __FULL_PLAYLIST_LIB__
+# define __FULL_PLAYLIST_LIB__
+
+# include <stddef.h>
+# include "../playlist/songtable.h"
+
+/*
+ * the playlist of the whole library, the most expensive one to render,
+ * is rendered ahead of time for each host it is asked under and kept in
+ * memory files, to be sent without copying.
+ */
+typedef struct FullPlaylist *fullpl;
+
+int    fullpl_init    (void);
+fullpl fullpl_lookup  (char *, songtable);
+int    fullpl_fd      (fullpl);
+size_t fullpl_length  (fullpl);
+void   fullpl_release (fullpl);
+size_t fullpl_line    (char *, size_t, char *, songtable, int);
+
+# endif
@@ -1,45 +1,115 @@
 /* http.c: request handlers based on http */
 # include <stdio.h>
 # include <string.h>
+# include <strings.h>
 # include <stdlib.h>
 # include <unistd.h>
+# include <errno.h>
 # include <sys/types.h>
 # include <sys/stat.h>
 # include <fcntl.h>
+# include <limits.h>
+# include <time.h>
+# include <sys/sendfile.h>
+# include <sys/socket.h>
+# include <netdb.h>
 
-# include "../sharedlib/dhlist.h"
+# include "../sharedlib/vector.h"
 # include "../sharedlib/strmod.h"
 # include "../sharedlib/url_codec.h"
 # include "../playlist/playlist.h"
-# include "../playlist/spack.h"
+# include "../playlist/songtable.h"
+# include "../playlist/suggest.h"
+# include "../playlist/folders.h"
+# include "../playlist/seek.h"
 # include "../mstream/mserrors.h"
+# include "plcache.h"
+# include "fullpl.h"
+# include "songcache.h"
+# include "fdcache.h"
+# include "prefetch.h"
+# include "radio.h"
+# include "concat.h"
+# include "cluster.h"
+# include "fetch.h"
+# include "edge.h"
 # include "http.h"
 
 # define BUFFERSIZE 512
+  /* bytes the kernel is told to read ahead of a song sent, at first & most */
+# define READAHEAD_MIN (128 * 1024)
+# define READAHEAD_MAX (4 * 1024 * 1024)
+  /* songs played once let go of what they sent every that many bytes */
+# define DROP_BEHIND   (1024 * 1024)
+  /* playlists are sent in batches of that many bytes */
+# define PLAYLIST_BATCH 65536
+  /* seconds an edge keeps the playlists of its origin */
+# define EDGE_TTL 60
 
 # define __REQUESTED_SONG__     1
 # define __REQUESTED_PLAYLIST__ 2
+# define __REQUESTED_STATUS__   3
+# define __REQUESTED_SUGGEST__  4
+# define __REQUESTED_BROWSE__   5
+# define __REQUESTED_RADIO__    6
+# define __REQUESTED_CONCAT__   7
+# define __REQUESTED_DIGEST__   8
 
-typedef enum {RESPONSE_FD = 0, RESPONSE_PL, RESPONSE_NO} restype;
-
-extern dhlist library;
+typedef enum {RESPONSE_FD = 0, RESPONSE_PL, RESPONSE_STREAM, RESPONSE_TEXT,
+              RESPONSE_FULL, RESPONSE_CACHED, RESPONSE_RADIO,
+              RESPONSE_CONCAT, RESPONSE_DIGEST, RESPONSE_EDGE,
+              RESPONSE_NO} restype;
 
 struct HTTP_Request {
   char   *command,  /* the command of the request (eg GET, etc) */
          *resource, /* the resource requested */
          *version;  /* HTTP version used */
-  dhlist  headers;  /* request headers */
+  vector  headers;  /* request headers */
+  char    peer [64]; /* numeric address of the client, or "" */
 };
 
 struct HTTP_Response {
   char    *version,       /* HTTP version used */
           *response_code; /* the response code (eg 200 OK, etc) */
-  dhlist   headers;       /* response headers */
-  void    *body;          /* body of the response (song, playlist) */
-  restype  type;          /* body type: playlist, song or nothing */
-  int      length;        /* if body is a playlist specify its length */
+  vector   headers;       /* response headers */
+  void    *body;          /* body of the response (song, playlist, text) */
+  restype  type;          /* body type: playlist, song, text or nothing */
+};
+
+/*
+ * a song file sent as its first "header" bytes, then from "start" up to
+ * "end" (excluded).
+ * songs played once are dropped from the page cache as they are sent.
+ * files of the library are kept open by the fd cache (open), and may be
+ * streamed by others at the same time. a song let into the song cache
+ * is copied into its entry (fill) as it is sent.
+ */
+struct SongFile {
+  int       fd;
+  opensong  open;
+  off_t     header, start, end;
+  int       oneshot;
+  songbody  fill;
+};
+
+
+/* a listener tuning in to a station, icy: metadata was asked for */
+struct RadioTuning {
+  station  s;
+  int      icy;
 };
 
+/* songs chained into one stream, sent from "from" up to "to" (included) */
+struct ConcatStream {
+  concat  c;
+  off_t   from, to;
+};
+
+/* a song of the origin of an edge, sent as it arrives ("to" -1: all) */
+struct EdgeStream {
+  edgesong  s;
+  off_t     from, to;
+};
 
   /* set/unset if previous segment of request ended in CRLF or not */
 static short int previous_crlf = 0;
@@ -84,19 +154,19 @@ __request_format (HTTPRequest *request, char *strreq, int reqlen)
   if ((*request = (HTTPRequest) malloc (sizeof (struct HTTP_Request))) == NULL)
     return (MS_errno = MSE_NOMEM);
 
-  if (!dhlist_init (&(*request) -> headers)) {
+  if (!vector_init (&(*request) -> headers)) {
     free (*request);
     return (MS_errno = MSE_NOMEM);
   }
   if (((*request) -> command = parse_string (&cursor, ' ')) == NULL) {
-    dhlist_delete ((*request) -> headers);
+    vector_delete ((*request) -> headers);
     free (*request);
     return (MS_errno = MSE_NOMEM);
   }
 
   if (((*request) -> resource = parse_string (&cursor, ' ')) == NULL) {
     free ((*request) -> command);
-    dhlist_delete ((*request) -> headers);
+    vector_delete ((*request) -> headers);
     free (*request);
     return (MS_errno = MSE_NOMEM);
   }
@@ -104,7 +174,7 @@ __request_format (HTTPRequest *request, char *strreq, int reqlen)
   if (((*request) -> version = parse_string (&cursor, '\r')) == NULL) {
     free ((*request) -> resource);
     free ((*request) -> command);
-    dhlist_delete ((*request) -> headers);
+    vector_delete ((*request) -> headers);
     free (*request);
     return (MS_errno = MSE_NOMEM);
   }
@@ -112,11 +182,11 @@ __request_format (HTTPRequest *request, char *strreq, int reqlen)
   while ((head = parse_string (&cursor, '\r')) != (char *) -1) {
     if (!strcmp (head, "\n")) continue;
     if (head == NULL
-        || !dhlist_append ((*request) -> headers, head)) {
+        || !vector_append ((*request) -> headers, head)) {
       free ((*request) -> version);
       free ((*request) -> resource);
       free ((*request) -> command);
-      dhlist_delete ((*request) -> headers);
+      vector_delete ((*request) -> headers);
       free (*request);
       return (MS_errno = MSE_NOMEM);
     }
@@ -132,6 +202,8 @@ read_request (int connfd, HTTPRequest *request)
 {
   char buffer [BUFFERSIZE], *total, *old = NULL;
   size_t bytes_read, total_bytes = 0;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
 
   memset (buffer, '\0', BUFFERSIZE);
 
@@ -158,8 +230,14 @@ read_request (int connfd, HTTPRequest *request)
     free (total);
     return MS_errno;
   }
-
   free (total);
+
+  /* who asked, to tell which playlist the songs it asks for are from */
+  addrlen = sizeof (struct sockaddr_storage);
+  if (getpeername (connfd, (struct sockaddr *) &addr, &addrlen) < 0
+      || getnameinfo ((struct sockaddr *) &addr, addrlen, (*request) -> peer,
+                      sizeof ((*request) -> peer), NULL, 0, NI_NUMERICHOST))
+    (*request) -> peer [0] = '\0';
   return MSE_OK;
 }
 
@@ -203,34 +281,34 @@ __response_init (HTTPResponse *response, char *rcode, char *content_type)
     free (*response);
     return (MS_errno = MSE_NOMEM);
   }
-  if (!dhlist_init (&((*response) -> headers))) {
+  if (!vector_init (&((*response) -> headers))) {
     free ((*response) -> version);
     free ((*response) -> response_code);
     free (*response);
     return (MS_errno = MSE_NOMEM);
   }
   if ((head = strdup ("Server: muZiqStreamer v0.9")) == NULL
-      || !dhlist_append ((*response) -> headers, head)) {
+      || !vector_append ((*response) -> headers, head)) {
     free ((*response) -> version);
     free ((*response) -> response_code);
-    dhlist_delete ((*response) -> headers);
+    vector_delete ((*response) -> headers);
     free (*response);
     return (MS_errno = MSE_NOMEM);
   }
   if ((head = strdup ("Connection: close")) == NULL
-      || !dhlist_append ((*response) -> headers, head)) {
+      || !vector_append ((*response) -> headers, head)) {
     free ((*response) -> version);
     free ((*response) -> response_code);
-    dhlist_delete ((*response) -> headers);
+    vector_delete ((*response) -> headers);
     free (*response);
     return (MS_errno = MSE_NOMEM);
   }
   if (content_type != NULL 
       && ((head = Sprintf ("Content-Type: %s", content_type)) == NULL
-          || !dhlist_append ((*response) -> headers, head))) {
+          || !vector_append ((*response) -> headers, head))) {
     free ((*response) -> version);
     free ((*response) -> response_code);
-    dhlist_delete ((*response) -> headers);
+    vector_delete ((*response) -> headers);
     free (*response);
     return (MS_errno = MSE_NOMEM);
   }     
@@ -238,40 +316,204 @@ __response_init (HTTPResponse *response, char *rcode, char *content_type)
   return MSE_OK;
 }
 
-/* decide if client requested a song or a playlist */
+/*
+ * decide if client requested a song, a playlist, a folder, completions
+ * of a prefix, a radio station, the server's status or (another node of
+ * its cluster) the digest of its songs. anything after a
+ * '?' (never part of an encoded client path) is returned as the query.
+ * the songs of a search may be asked for as a single stream of mp3s or
+ * oggs, by their suffix: *song is set to their type then.
+ */
 static int
-__request_search (char *resource, char **song, char **search)
+__request_search (char *resource, char **song, char **search, char **query)
 {
-  char *str;
+  char *str, *path;
+
+  *query = NULL;
+  if ((path = strdup (resource)) == NULL)
+    return (MS_errno = MSE_NOMEM);
+  if ((str = strchr (path, '?')) != NULL) {
+    *str = '\0';
+    if ((*query = strdup (str + 1)) == NULL) {
+      free (path);
+      return (MS_errno = MSE_NOMEM);
+    }
+  }
 
-  if ((str = strstr (resource, "/songsearch/")) == NULL
-      || str != resource) {
-    if ((*song = strdup (resource)) == NULL)
+  if (!strcmp (path, "/status")) {
+    free (path);
+    return __REQUESTED_STATUS__;
+  }
+  if (!strcmp (path, "/cluster/digest")) {
+    free (path);
+    return __REQUESTED_DIGEST__;
+  }
+  if (!strncmp (path, "/suggest/", strlen ("/suggest/"))) {
+    *search = strdup (path + strlen ("/suggest/"));
+    free (path);
+    if (*search == NULL)
+      return (MS_errno = MSE_NOMEM);
+    return __REQUESTED_SUGGEST__;
+  }
+  if (!strncmp (path, "/browse/", strlen ("/browse/"))) {
+    *search = strdup (path + strlen ("/browse"));
+    free (path);
+    if (*search == NULL)
       return (MS_errno = MSE_NOMEM);
+    return __REQUESTED_BROWSE__;
+  }
+  if (!strncmp (path, "/radio/", strlen ("/radio/"))) {
+    *search = strdup (path + strlen ("/radio/"));
+    free (path);
+    if (*search == NULL)
+      return (MS_errno = MSE_NOMEM);
+    return __REQUESTED_RADIO__;
+  }
+  if ((str = strstr (path, "/songsearch/")) == NULL
+      || str != path) {
+    *song = path;
     return __REQUESTED_SONG__;
   }
-  str = resource + strlen ("/songsearch/");
+  str = path + strlen ("/songsearch/");
 
+  if ((*search = strcut (str, ".mp3")) != (char *) -1
+      || (*search = strcut (str, ".ogg")) != (char *) -1) {
+    *song = !strcmp (str + strlen (str) - strlen (".mp3"), ".mp3")
+            ? "audio/mpeg" : "audio/ogg";
+    free (path);
+    if (*search == NULL)
+      return (MS_errno = MSE_NOMEM);
+    if (**search == '\0') { /* every song */
+      free (*search);
+      *search = NULL;
+    }
+    return __REQUESTED_CONCAT__;
+  }
   if (*str == '\0')
     *search = NULL;
-  else if ((*search = strcut (str, ".m3u")) == NULL)
+  else if ((*search = strcut (str, ".m3u")) == NULL) {
+    free (path);
     return (MS_errno = MSE_NOMEM);
+  }
+  free (path);
   if (*search == (char *) -1)
     return (MS_errno = MSE_BADREQUEST);
 
   return __REQUESTED_PLAYLIST__;
 }
 
+/*
+ * find the value of a query parameter. *value is set to NULL if the
+ * parameter is absent, else to a fresh (still url encoded) copy.
+ */
+static int
+__query_param (char *query, char *name, char **value)
+{
+  char *cursor = query, *end;
+  int namelen = strlen (name);
+
+  *value = NULL;
+  while (cursor != NULL && *cursor != '\0') {
+    if ((end = strchr (cursor, '&')) == NULL)
+      end = cursor + strlen (cursor);
+    if (end - cursor > namelen && !strncmp (cursor, name, namelen)
+        && cursor [namelen] == '=') {
+      cursor += namelen + 1;
+      if ((*value = (char *) calloc (end - cursor + 1, sizeof (char)))
+          == NULL)
+        return (MS_errno = MSE_NOMEM);
+      memcpy (*value, cursor, end - cursor);
+      return MSE_OK;
+    }
+    cursor = *end ? end + 1 : end;
+  }
+  return MSE_OK;
+}
+
+/* a non negative number out of a query parameter, def if absent */
+static int
+__query_number (char *query, char *name, int def, int *number)
+{
+  char *value, *endptr;
+  long val;
+
+  if (__query_param (query, name, &value) != MSE_OK)
+    return MS_errno;
+  if (value == NULL) {
+    *number = def;
+    return MSE_OK;
+  }
+  val = strtol (value, &endptr, 10);
+  if (*value == '\0' || *endptr != '\0' || val < 0 || val > INT_MAX) {
+    free (value);
+    return (MS_errno = MSE_BADREQUEST);
+  }
+  free (value);
+  *number = val;
+  return MSE_OK;
+}
+
+/* a time in seconds out of a query parameter, in milliseconds, -1 if absent */
+static int
+__query_time (char *query, char *name, long *msec)
+{
+  char *value, *endptr;
+  double val;
+
+  if (__query_param (query, name, &value) != MSE_OK)
+    return MS_errno;
+  if (value == NULL) {
+    *msec = -1;
+    return MSE_OK;
+  }
+  val = strtod (value, &endptr);
+  if (*value == '\0' || *endptr != '\0' || !(val >= 0) || val > INT_MAX / 1000) {
+    free (value);
+    return (MS_errno = MSE_BADREQUEST);
+  }
+  free (value);
+  *msec = val * 1000;
+  return MSE_OK;
+}
+
+/*
+ * read the paging & ordering parameters of a search:
+ * limit=<n>, offset=<n> and sort=[-]<path|added|artist|...>.
+ */
+static int
+__search_options (char *query, struct SearchOptions *opts)
+{
+  char *value, *name;
+
+  opts -> sort = SORT_NONE;
+  opts -> reverse = 0;
+  if (__query_number (query, "limit", -1, &opts -> limit) != MSE_OK
+      || __query_number (query, "offset", 0, &opts -> offset) != MSE_OK
+      || __query_param (query, "sort", &value) != MSE_OK)
+    return MS_errno;
+  if (value == NULL)
+    return MSE_OK;
+  name = value;
+  if (*name == '-') {
+    opts -> reverse = 1;
+    name ++;
+  }
+  opts -> sort = search_sort_id (name);
+  free (value);
+  if (opts -> sort < 0)
+    return (MS_errno = MSE_BADREQUEST);
+  return MSE_OK;
+}
+
 /* search through headers to find the 'Host:' one */
 static char *
-__get_host (dhlist headers)
+__get_host (vector headers)
 {
   char *head, *str;
-  dhlist cur;
+  int i;
 
-  for (cur = dhlist_first (headers); cur != dhlist_end (headers);
-       cur = dhlist_next (cur)) {
-    head = (char *) dhlist_data (cur);
+  for (i = 0; i < vector_length (headers); i ++) {
+    head = (char *) vector_get (headers, i);
     if ((str = strstr (head, "Host:")) == NULL || str != head)
       continue;
     head += strlen ("Host:");
@@ -284,232 +526,1874 @@ __get_host (dhlist headers)
   return NULL;
 }
 
-/* given an HTTP request form the appropriate HTTP response */
-int
-form_response (HTTPRequest request, HTTPResponse *response)
+/* whether the client asked for icy metadata along with a stream */
+static int
+__icy_metadata (vector headers)
 {
-  char *search, *song, *host;
-  dhlist res, cur;
-  spack songinfo;
+  char *head;
   int i;
 
-  if (request == NULL) { /* if an error occured while processing request */
-    if (__response_init (response, "500 server error", NULL) != MSE_OK)
-      return MS_errno;
-    return MSE_OK;
+  for (i = 0; i < vector_length (headers); i ++) {
+    head = (char *) vector_get (headers, i);
+    if (!strncasecmp (head, "Icy-MetaData:", strlen ("Icy-MetaData:")))
+      return atoi (head + strlen ("Icy-MetaData:")) == 1;
   }
-  if (strcmp (request -> command, "GET")) { /* only GET is supported */
-    if (__response_init (response, "501 not implemented", NULL) != MSE_OK)
-      goto ServerError;
-    return MSE_OK;
+  return 0;
+}
+
+/*
+ * the part of a body of length bytes asked for with a single "Range:
+ * bytes=" header: 1 if there is one, from *from to *to (included), 0 if
+ * there is none (ranges that do not parse are ignored), -1 if it lies
+ * beyond the body
+ */
+static int
+__get_range (vector headers, off_t length, off_t *from, off_t *to)
+{
+  char *head, *endptr;
+  long long first, last;
+  int i;
+
+  for (i = 0; i < vector_length (headers); i ++) {
+    head = (char *) vector_get (headers, i);
+    if (strncasecmp (head, "Range:", strlen ("Range:")))
+      continue;
+    for (head += strlen ("Range:"); *head == ' '; head ++)
+      ;
+    if (strncmp (head, "bytes=", strlen ("bytes="))
+        || strchr (head, ',') != NULL) /* several ranges are not served */
+      return 0;
+    head += strlen ("bytes=");
+    if (*head == '-') { /* the last bytes */
+      last = strtoll (head + 1, &endptr, 10);
+      if (endptr == head + 1 || *endptr != '\0' || last < 0)
+        return 0;
+      if (!last || !length)
+        return -1;
+      *from = last < length ? length - last : 0;
+      *to = length - 1;
+      return 1;
+    }
+    first = strtoll (head, &endptr, 10);
+    if (endptr == head || *endptr != '-' || first < 0)
+      return 0;
+    head = endptr + 1;
+    last = *head == '\0' ? -1 : strtoll (head, &endptr, 10);
+    if (*head != '\0' && (endptr == head || *endptr != '\0' || last < first))
+      return 0;
+    if (first >= length)
+      return -1;
+    *from = first;
+    *to = last >= 0 && last < length ? last : length - 1;
+    return 1;
   }
-  /* http 1.0 & 1.1 currently supported */
-  if ((strcmp (request -> version, "HTTP/1.1") 
-       && strcmp (request -> version, "HTTP/1.0"))
-      || (host = __get_host (request -> headers)) == NULL) {
-    if (__response_init (response, "400 bad request", NULL) != MSE_OK)
-      goto ServerError;
-    return MSE_OK;
+  return 0;
+}
+
+/* append a header (allocated by the caller) to a response */
+static int
+__add_header (HTTPResponse response, char *head)
+{
+  if (head == NULL || !vector_append (response -> headers, head)) {
+    if (head != NULL) free (head);
+    return (MS_errno = MSE_NOMEM);
   }
-  
-  switch (__request_search (request -> resource, &song, &search)) {
-  case __REQUESTED_SONG__: /* if client requested a song */
-    /* find it in the library */
-    if ((res = dhlist_find (library, song, &spack_filter)) == NULL) {
-      if (__response_init (response, "404 not found", NULL) != MSE_OK)
-        goto ServerError;
-      return MSE_OK;
-    }
-    songinfo = (spack) dhlist_data (res);
-    /* inform client about song content */
-    if (__response_init(response, "200 OK", spack_content(songinfo)) != MSE_OK)
-      goto ServerError;
-    /* open the song file to send the actual song data */
-    if (((*response) -> body = malloc (sizeof(int))) == NULL) {
-      MS_errno = MSE_NOMEM;
-      goto ServerError;
-    }
-    * (int*) ((*response) -> body) = 
-               open (spack_server_path (songinfo), O_RDONLY);
-    if (* (int*) ((*response) -> body) < 0) {
-      MS_errno = MSE_OS;
-      goto ServerError;
-    }
-    (*response) -> type = RESPONSE_FD;
-    return MSE_OK;
+  return MSE_OK;
+}
 
-  case __REQUESTED_PLAYLIST__: /* if client requested a playlist */
-    /* search the library for the given string */
-    if (search_library (library, &res, search) != MSE_OK)
-      goto ServerError;
-    if (!dhlist_length (res)) { /* if no matches were found */
-      dhlist_delete (res);
-      if (__response_init (response, "404 not found", NULL) != MSE_OK)
-        goto ServerError;
-      return MSE_OK;
-    }
-    /* initialise response */
-    if (__response_init (response, "200 OK", "audio/x-mpegurl") != MSE_OK)
-      goto ServerError;
-    (*response) -> length = dhlist_length (res);
-    /* and create a string array (will be sent as the message body) */
-    (*response) -> body = calloc (dhlist_length (res), sizeof (char*));
-    if ((*response) -> body == NULL) {
-      MS_errno = MSE_NOMEM;
-      dhlist_delete (res);
-      goto ServerError;
+/*
+ * a playlist generated while it is sent: matches are rendered into a
+ * fixed buffer that is flushed whenever it fills up. the first renderer
+ * of a key renders it in full for the playlist cache before anything is
+ * sent, so that those waiting for it do not wait on this client; a
+ * playlist found too large to be kept then goes on streaming, what was
+ * rendered of it (copy) being sent first.
+ */
+struct PlaylistStream {
+  songtable   songs;      /* the library as it was when the search began */
+  searchiter  matches;
+  int         first;      /* the next match to render, -1 once all were */
+  char       *host;
+  int         chunked;    /* http/1.1: chunked transfer encoding */
+  plbody      body;       /* pending cache entry, NULL if not caching */
+  char       *copy;
+  size_t      copylen, copysize;
+  char        peer [64];  /* the first songs sent, for it to prefetch */
+  int         sent [PREFETCH_SONGS], nsent, prefetched;
+};
+
+/*
+ * render the playlist of a pending cache entry in full, into copy, and
+ * hand it over to the cache: 1 if it was, the entry then being the
+ * caller's to release. one found too large to be kept, or out of memory,
+ * is given up on (0) and left to stream from where rendering stopped.
+ */
+static int
+__stream_render (struct PlaylistStream *stream)
+{
+  char *grown;
+  size_t line, size;
+
+  while (stream -> first >= 0) {
+    if (stream -> copy != NULL
+        && (line = fullpl_line (stream -> copy + stream -> copylen,
+                                stream -> copysize - stream -> copylen,
+                                stream -> host, stream -> songs,
+                                stream -> first))) {
+      stream -> copylen += line;
+      if (stream -> nsent < PREFETCH_SONGS)
+        stream -> sent [stream -> nsent ++] = stream -> first;
+      stream -> first = search_next (stream -> matches);
+      continue;
     }
-    for (i = 0, cur = dhlist_first (res); cur != dhlist_end (res); 
-         cur = dhlist_next (cur), i ++) {
-      songinfo = (spack) dhlist_data (cur);
-      ((char **) ((*response) -> body)) [i] = spack_formal (songinfo, host);
-      if (((char **) ((*response) -> body)) [i] == NULL) {
-        MS_errno = MSE_NOMEM;
-        dhlist_delete (res);
-        goto ServerError;
-      }
+    if (stream -> copysize >= plcache_limit ()) {
+      plcache_toobig (stream -> body);
+      stream -> body = NULL;
+      return 0;
     }
-    dhlist_delete (res);
-    (*response) -> type = RESPONSE_PL;
-    return MSE_OK;
-  default:
-    if (MS_errno == MSE_BADREQUEST) {
-      if (__response_init (response, "400 bad request", NULL) != MSE_OK)
-        goto ServerError;
-      return MSE_OK;
+    size = stream -> copysize ? 2 * stream -> copysize : PLAYLIST_BATCH;
+    if (size > plcache_limit ()) size = plcache_limit ();
+    if ((grown = (char *) realloc (stream -> copy, size)) == NULL) {
+      plcache_abandon (stream -> body);
+      stream -> body = NULL;
+      return 0;
     }
-    goto ServerError;
+    stream -> copy = grown;
+    stream -> copysize = size;
   }
+  plcache_fill (stream -> body, stream -> copy, stream -> copylen);
+  stream -> body = NULL;
+  stream -> copy = NULL;
+  stream -> copylen = stream -> copysize = 0;
+  return 1;
+}
 
- ServerError:
-   if (__response_init (response, "500 server error", NULL) != MSE_OK)
-     return MS_errno;
-   return MSE_OK;
+/* close a stream, abandoning its cache entry if it was not rendered */
+static void
+__stream_free (struct PlaylistStream *stream)
+{
+  if (stream -> body != NULL)
+    plcache_abandon (stream -> body);
+  if (stream -> copy != NULL) free (stream -> copy);
+  search_close (stream -> matches);
+  library_release (stream -> songs);
+  free (stream -> host);
+  free (stream);
+  return;
 }
 
-/* write onto fd "bytes" bytes of "buffer" */
-static int
-Write (int fd, char *buffer, ssize_t bytes)
+/*
+ * tell the prefetcher of the songs of a playlist sent to peer out of the
+ * cache: its lines are "http://" host path, paths being looked up.
+ */
+static void
+__prefetch_body (char *peer, char *data, size_t length)
 {
-  ssize_t bytes_written;
+  int list [PREFETCH_SONGS], count = 0;
+  char path [BUFSIZ], *end, *at;
+  songtable songs;
 
-  while ((bytes_written = write (fd, buffer, bytes)) >= 0)
-    if (!(bytes -= bytes_written))
-      break;
-  if (bytes_written < 0)
-    return (MS_errno = MSE_WRITERESPONSE);
+  songs = library_acquire ();
+  for (end = data + length; data < end && count < PREFETCH_SONGS;
+       data = at + 1) {
+    if ((at = memchr (data, '\n', end - data)) == NULL)
+      at = end;
+    if (at - data > strlen ("http://") && at - data < BUFSIZ
+        && (data = memchr (data + strlen ("http://"), '/',
+                           at - data - strlen ("http://"))) != NULL) {
+      memcpy (path, data, at - data);
+      path [at - data] = '\0';
+      if ((list [count] = songtable_find (songs, path)) >= 0)
+        count ++;
+    }
+  }
+  library_release (songs);
+  prefetch_playlist (peer, list, count);
+  return;
+}
 
+/* a response whose body is some text (handed over) */
+static int
+__text_response (HTTPResponse *response, char *rcode, char *type, char *text)
+{
+  if (__response_init (response, rcode, type) != MSE_OK) {
+    free (text);
+    return MS_errno;
+  }
+  (*response) -> body = text;
+  (*response) -> type = RESPONSE_TEXT;
+  if (__add_header (*response, Sprintf ("Content-Length: %lu",
+                      (unsigned long) strlen (text))) != MSE_OK) {
+    transaction_done (NULL, *response);
+    return MS_errno;
+  }
   return MSE_OK;
 }
 
-/* write the http response upon the accepted connection */
-int
-write_response (int connfd, HTTPResponse response)
+/*
+ * the best completions of a (url encoded) prefix, one per line. limit=<n>
+ * asks for fewer than SUGGEST_MAX.
+ */
+static int
+__suggestions (char *prefix, char *query, char **text)
 {
-  ssize_t bytes_to_write, bytes_read;
-  char *transmit, *head, buffer [BUFFERSIZE];
-  dhlist cur;
-  int i;
+  int found [SUGGEST_MAX], limit, n, i, len = strlen (prefix) + 1;
+  size_t size = 1;
+  songtable songs;
+  char *decoded;
 
-  /* write http version and response code */
-  transmit = Sprintf ("%s %s\r\n", response->version, response->response_code);
-  if (transmit == NULL)
-    return (MS_errno = MSE_NOMEM);
-  bytes_to_write = strlen (transmit);
-  if (Write (connfd, transmit, bytes_to_write) != MSE_OK) {
-    free (transmit);
+  if (__query_number (query, "limit", SUGGEST_MAX, &limit) != MSE_OK)
     return MS_errno;
+  if (limit > SUGGEST_MAX) limit = SUGGEST_MAX;
+  if ((decoded = (char *) malloc (len)) == NULL)
+    return (MS_errno = MSE_NOMEM);
+  if (url_decode (prefix, decoded, len, 0) < 0) {
+    free (decoded);
+    return (MS_errno = MSE_BADREQUEST);
   }
-  free (transmit);
 
-  /* write headers */
-  for (cur = dhlist_first (response -> headers); 
-       cur != dhlist_end (response -> headers); cur = dhlist_next (cur)) {
-    head = (char *) dhlist_data (cur);
-    if ((transmit = Sprintf ("%s\r\n", head)) == NULL) {
-      free (transmit);
-      return (MS_errno = MSE_NOMEM);
-    }
-    bytes_to_write = strlen (transmit);
-    if (Write (connfd, transmit, bytes_to_write) != MSE_OK) {
-      free (transmit);
-      return MS_errno;
-    }
-    free (transmit);
+  songs = library_acquire ();
+  n = suggest_lookup (songtable_suggest (songs), decoded, found, limit);
+  free (decoded);
+  for (i = 0; i < n; i ++)
+    size += strlen (suggest_text (songtable_suggest (songs), found [i])) + 1;
+  if ((*text = (char *) malloc (size)) == NULL) {
+    library_release (songs);
+    return (MS_errno = MSE_NOMEM);
   }
+  for (i = 0, size = 0; i < n; i ++)
+    size += sprintf (*text + size, "%s\n",
+                     suggest_text (songtable_suggest (songs), found [i]));
+  (*text) [size] = '\0';
+  library_release (songs);
+  return MSE_OK;
+}
 
-  if (Write (connfd, "\r\n", strlen ("\r\n")) != MSE_OK)
+/*
+ * list a folder (given by its url encoded path): its subfolders, each
+ * followed by a '/', then its songs, one per line and url encoded, or
+ * with format=m3u a playlist of its songs. *text is NULL if there is no
+ * such folder, or no songs for a playlist.
+ */
+static int
+__browse (char *path, char *query, char *host, char **text, char **type)
+{
+  char *decoded, *format, *name;
+  int f, child, first, own, last, song, m3u;
+  int len = strlen (path) + 1;
+  size_t size = 1, hostlen = strlen (host);
+  songtable songs;
+  folders tree;
+
+  *text = NULL;
+  if (__query_param (query, "format", &format) != MSE_OK)
     return MS_errno;
+  m3u = format != NULL && !strcmp (format, "m3u");
+  if (format != NULL && !m3u && strcmp (format, "list")) {
+    free (format);
+    return (MS_errno = MSE_BADREQUEST);
+  }
+  if (format != NULL) free (format);
+  if ((decoded = (char *) malloc (len)) == NULL)
+    return (MS_errno = MSE_NOMEM);
+  if (url_decode (path, decoded, len, 0) < 0) {
+    free (decoded);
+    return (MS_errno = MSE_BADREQUEST);
+  }
 
-  switch (response -> type) {
-  case RESPONSE_FD: /* if message body is a file */
-    memset (buffer, '\0', BUFFERSIZE);
-    /* transmit file */
-    while ((bytes_read = 
-              read (*(int*) (response -> body), buffer, BUFFERSIZE)) > 0)
-      if (Write (connfd, buffer, bytes_read) != MSE_OK)
-        return MS_errno;
-      else memset (buffer, '\0', bytes_read);
-    if (bytes_read < 0)
-      return (MS_errno = MSE_OS);
+  songs = library_acquire ();
+  tree = songtable_folders (songs);
+  f = folders_find (tree, decoded);
+  free (decoded);
+  if (f < 0) {
+    library_release (songs);
     return MSE_OK;
-
-  case RESPONSE_PL: /* if message body is just a playlist */
-    for (i = 0; i < response -> length; i ++) {
-      bytes_to_write = strlen (((char **) (response -> body)) [i]);
-      if (Write 
-           (connfd, ((char **) (response->body))[i], bytes_to_write) != MSE_OK)
-        return MS_errno;
-    }
+  }
+  folders_songs (tree, f, &first, &own, &last);
+  if (m3u && first == own) { /* no songs of its own */
+    library_release (songs);
     return MSE_OK;
-  case RESPONSE_NO:
-    break;
   }
+
+  /* the size first, then the text: time goes with the folder's size */
+  if (!m3u)
+    for (child = folders_child (tree, f, -1); child >= 0;
+         child = folders_child (tree, f, child))
+      size += 3 * strlen (folders_name (tree, child)) + 2;
+  for (song = first; song < own; song ++)
+    size += m3u ? strlen ("http://") + hostlen
+                  + strlen (songtable_client_path (songs, song)) + 1
+                : strlen (strrchr (songtable_client_path (songs, song), '/'));
+  if ((*text = (char *) malloc (size)) == NULL) {
+    library_release (songs);
+    return (MS_errno = MSE_NOMEM);
+  }
+
+  size = 0;
+  if (!m3u)
+    for (child = folders_child (tree, f, -1); child >= 0;
+         child = folders_child (tree, f, child)) {
+      name = folders_name (tree, child);
+      url_encode (name, *text + size, 3 * strlen (name) + 1, 0);
+      size += strlen (*text + size);
+      (*text) [size ++] = '/';
+      (*text) [size ++] = '\n';
+    }
+  for (song = first; song < own; song ++)
+    if (m3u)
+      size += sprintf (*text + size, "http://%s%s\n", host,
+                       songtable_client_path (songs, song));
+    else
+      size += sprintf (*text + size, "%s\n",
+                       strrchr (songtable_client_path (songs, song), '/') + 1);
+  (*text) [size] = '\0';
+  *type = m3u ? "audio/x-mpegurl" : "text/plain";
+  library_release (songs);
   return MSE_OK;
 }
 
-/* print a response informative message to stdout */
-void
-print_response (char *target, HTTPResponse response)
+/* a response sending the whole library's playlist (handed over) */
+static int
+__full_response (HTTPResponse *response, fullpl full)
 {
-  fprintf (stdout, "[->] sent a %s response to %s under %s.\n",
-                   response -> response_code, target, response -> version);
-  return;
-}
-
-/* free any resources used by HTTP request and response */
+  if (!fullpl_length (full)) { /* an empty library */
+    fullpl_release (full);
+    return __response_init (response, "404 not found", NULL);
+  }
+  if (__response_init (response, "200 OK", "audio/x-mpegurl") != MSE_OK) {
+    fullpl_release (full);
+    return MS_errno;
+  }
+  (*response) -> body = full;
+  (*response) -> type = RESPONSE_FULL;
+  if (__add_header (*response, Sprintf ("Content-Length: %lu",
+                      (unsigned long) fullpl_length (full))) != MSE_OK) {
+    transaction_done (NULL, *response);
+    return MS_errno;
+  }
+  return MSE_OK;
+}
+
+/* let go of a song file, kept open by the fd cache or not */
+static void
+__song_close (int fd, opensong open)
+{
+  if (open != NULL)
+    fdcache_release (open);
+  else close (fd);
+  return;
+}
+
+/*
+ * a response sending the song open at fd (handed over, held in the fd
+ * cache if open is not NULL), with content
+ * type content. asked to start at msec, it is sent from the frame that
+ * plays then: mp3 frames stand on their own, so that is a part of the
+ * file, while flac & ogg frames need the stream headers sent first.
+ * songs that cannot be seeked into are sent whole. otherwise the range
+ * of bytes asked for in headers, if any, is sent.
+ */
+static int
+__song_response (HTTPResponse *response, int fd, opensong open, char *content,
+                 long msec, int oneshot, vector headers)
+{
+  struct SongFile *file;
+  struct stat st;
+  off_t header = 0, start = -1, from, to;
+  unsigned int at;
+  int ranged = 0;
+
+  if (fstat (fd, &st) < 0) {
+    __song_close (fd, open);
+    return (MS_errno = MSE_OS);
+  }
+  if (msec >= 0 && seek_find (fd, msec, &header, &start, &at) != MSE_OK)
+    start = -1;
+  if (msec < 0
+      && (ranged = __get_range (headers, st.st_size, &from, &to)) < 0) {
+    __song_close (fd, open);
+    if (__response_init (response, "416 range not satisfiable", NULL)
+        != MSE_OK)
+      return MS_errno;
+    if (__add_header (*response, Sprintf ("Content-Range: bytes */%llu",
+                        (unsigned long long) st.st_size)) != MSE_OK) {
+      transaction_done (NULL, *response);
+      return MS_errno;
+    }
+    return MSE_OK;
+  }
+  if ((file = (struct SongFile *) malloc (sizeof (struct SongFile))) == NULL) {
+    __song_close (fd, open);
+    return (MS_errno = MSE_NOMEM);
+  }
+  file -> fd = fd;
+  file -> open = open;
+  file -> header = start < 0 ? 0 : header;
+  file -> start = start < 0 ? 0 : start;
+  file -> end = st.st_size;
+  file -> oneshot = oneshot;
+  file -> fill = NULL;
+  if (ranged) {
+    file -> start = from;
+    file -> end = to + 1;
+  }
+  if (__response_init (response, ranged ? "206 Partial Content" : "200 OK",
+                       content) != MSE_OK) {
+    __song_close (fd, open);
+    free (file);
+    return MS_errno;
+  }
+  (*response) -> body = file;
+  (*response) -> type = RESPONSE_FD;
+  if (start < 0) {
+    if (__add_header (*response, Sprintf ("Content-Length: %llu",
+                        (unsigned long long) (file -> end - file -> start)))
+          != MSE_OK
+        || (msec < 0
+            && __add_header (*response, strdup ("Accept-Ranges: bytes"))
+               != MSE_OK)
+        || (ranged
+            && __add_header (*response, Sprintf ("Content-Range: bytes %llu-%llu/%llu",
+                               (unsigned long long) from,
+                               (unsigned long long) to,
+                               (unsigned long long) st.st_size)) != MSE_OK)) {
+      transaction_done (NULL, *response);
+      return MS_errno;
+    }
+    return MSE_OK;
+  }
+
+  if (__add_header (*response, Sprintf ("Content-Length: %llu",
+                      (unsigned long long) (header + st.st_size - start)))
+        != MSE_OK
+      || __add_header (*response, Sprintf ("X-Seek-Time: %u.%03u", at / 1000,
+                                           at % 1000)) != MSE_OK) {
+    transaction_done (NULL, *response);
+    return MS_errno;
+  }
+  return MSE_OK;
+}
+
+/*
+ * a response sending a playlist straight out of the playlist cache
+ * (handed over), or a 404 if it had no songs. its songs are prefetched
+ * for peer, unless it is NULL (an edge has none to prefetch).
+ */
+static int
+__playlist_response (HTTPResponse *response, plbody body, char *peer)
+{
+  if (plcache_data (body) == NULL) { /* if no matches were found */
+    plcache_release (body);
+    return __response_init (response, "404 not found", NULL);
+  }
+  if (__response_init (response, "200 OK", "audio/x-mpegurl") != MSE_OK) {
+    plcache_release (body);
+    return MS_errno;
+  }
+  if (__add_header (*response, Sprintf ("Content-Length: %lu",
+                      (unsigned long) plcache_length (body))) != MSE_OK) {
+    plcache_release (body);
+    transaction_done (NULL, *response);
+    return MS_errno;
+  }
+  (*response) -> body = body;
+  (*response) -> type = RESPONSE_PL;
+  if (peer != NULL)
+    __prefetch_body (peer, plcache_data (body), plcache_length (body));
+  return MSE_OK;
+}
+
+/* a response sending a song out of the song cache (handed over) */
+static int
+__cached_response (HTTPResponse *response, songbody cached, char *content)
+{
+  if (__response_init (response, "200 OK", content) != MSE_OK) {
+    songcache_release (cached);
+    return MS_errno;
+  }
+  (*response) -> body = cached;
+  (*response) -> type = RESPONSE_CACHED;
+  if (__add_header (*response, Sprintf ("Content-Length: %lu",
+                      (unsigned long) songcache_length (cached))) != MSE_OK) {
+    transaction_done (NULL, *response);
+    return MS_errno;
+  }
+  return MSE_OK;
+}
+
+/*
+ * the songs to chain into a stream of type content: the ones named by
+ * the songs parameter (their paths as playlists have them, separated by
+ * commas), or else the matches of search, ordered & paged as playlists
+ * are. at most CONCAT_SONGS of them.
+ */
+static int
+__concat_list (songtable songs, char *search, char *query, char *content,
+               int **list, int *count)
+{
+  struct SearchOptions opts;
+  searchiter matches;
+  char *names, *name, *next;
+  int song;
+
+  if (__query_param (query, "songs", &names) != MSE_OK)
+    return MS_errno;
+  if ((*list = (int *) malloc (CONCAT_SONGS * sizeof (int))) == NULL) {
+    if (names != NULL) free (names);
+    return (MS_errno = MSE_NOMEM);
+  }
+  *count = 0;
+  if (names != NULL) {
+    for (name = names; name != NULL && *count < CONCAT_SONGS; name = next) {
+      if ((next = strchr (name, ',')) != NULL)
+        *next ++ = '\0';
+      if ((song = songtable_find (songs, name)) >= 0)
+        (*list) [(*count) ++] = song;
+    }
+    free (names);
+    return MSE_OK;
+  }
+  if (__search_options (query, &opts) != MSE_OK
+      || search_open (songs, search, &opts, &matches) != MSE_OK) {
+    free (*list);
+    return MS_errno;
+  }
+  while (*count < CONCAT_SONGS && (song = search_next (matches)) >= 0)
+    if (!strcmp (songtable_content (songs, song), content))
+      (*list) [(*count) ++] = song;
+  search_close (matches);
+  return MSE_OK;
+}
+
+/*
+ * a response sending songs chained into one stream of type content
+ * (handed over), or the range of it asked for
+ */
+static int
+__concat_response (HTTPResponse *response, concat chain, char *content,
+                   vector headers)
+{
+  struct ConcatStream *stream;
+  off_t length = concat_length (chain), from = 0, to = length - 1;
+  int ranged;
+
+  if (!concat_songs (chain)) { /* none of the songs is there */
+    concat_close (chain);
+    return __response_init (response, "404 not found", NULL);
+  }
+  if ((ranged = __get_range (headers, length, &from, &to)) < 0) {
+    concat_close (chain);
+    if (__response_init (response, "416 range not satisfiable", NULL)
+        != MSE_OK)
+      return MS_errno;
+    if (__add_header (*response, Sprintf ("Content-Range: bytes */%llu",
+                        (unsigned long long) length)) != MSE_OK) {
+      transaction_done (NULL, *response);
+      return MS_errno;
+    }
+    return MSE_OK;
+  }
+  if ((stream = (struct ConcatStream *)
+                  malloc (sizeof (struct ConcatStream))) == NULL) {
+    concat_close (chain);
+    return (MS_errno = MSE_NOMEM);
+  }
+  stream -> c = chain;
+  stream -> from = from;
+  stream -> to = to;
+  if (__response_init (response, ranged ? "206 Partial Content" : "200 OK",
+                       content) != MSE_OK) {
+    concat_close (chain);
+    free (stream);
+    return MS_errno;
+  }
+  (*response) -> body = stream;
+  (*response) -> type = RESPONSE_CONCAT;
+  if (__add_header (*response, Sprintf ("Content-Length: %llu",
+                      (unsigned long long) (to + 1 - from))) != MSE_OK
+      || __add_header (*response, strdup ("Accept-Ranges: bytes")) != MSE_OK
+      || (ranged
+          && __add_header (*response, Sprintf ("Content-Range: bytes %llu-%llu/%llu",
+                             (unsigned long long) from,
+                             (unsigned long long) to,
+                             (unsigned long long) length)) != MSE_OK)) {
+    transaction_done (NULL, *response);
+    return MS_errno;
+  }
+  return MSE_OK;
+}
+
+/* the node of the cluster a song (by its client path) belongs to */
+static int
+__song_owner (char *path)
+{
+  char *decoded;
+  int owner;
+
+  if ((decoded = (char *) calloc (strlen (path) + 1, sizeof (char))) == NULL
+      || url_decode (path, decoded, strlen (path) + 1, 0) < 0) {
+    if (decoded != NULL) free (decoded);
+    return cluster_self (); /* it is looked up here, in vain */
+  }
+  owner = cluster_owner (decoded);
+  free (decoded);
+  return owner;
+}
+
+/*
+ * a line of a playlist gathered from the nodes of a cluster. sorted by
+ * anything but path, the nodes send the key of each line ahead of it.
+ */
+struct ClusterLine {
+  char      *line;
+  size_t     len;
+  char      *path;    /* of its url, as sorted by path */
+  char      *key;     /* text it is sorted by */
+  long long  number;  /* or number, signed for an ascending order */
+  int        seq;     /* ties keep the order the nodes sent them in */
+};
+
+static int
+__line_cmp (const void *a, const void *b)
+{
+  return strcmp (((struct ClusterLine *) a) -> path,
+                 ((struct ClusterLine *) b) -> path);
+}
+
+static int
+__line_rcmp (const void *a, const void *b)
+{
+  return __line_cmp (b, a);
+}
+
+static int
+__seq_cmp (const struct ClusterLine *a, const struct ClusterLine *b)
+{
+  return a -> seq - b -> seq;
+}
+
+/* by a text key, lines without any last (as orders_compare has it) */
+static int
+__key_order (const struct ClusterLine *a, const struct ClusterLine *b)
+{
+  if (*a -> key == '\0' || *b -> key == '\0')
+    return (*a -> key == '\0') - (*b -> key == '\0');
+  return strcasecmp (a -> key, b -> key);
+}
+
+static int
+__key_cmp (const void *a, const void *b)
+{
+  int res = __key_order (a, b);
+
+  return res ? res : __seq_cmp (a, b);
+}
+
+static int
+__key_rcmp (const void *a, const void *b)
+{
+  int res = __key_order (b, a);
+
+  return res ? res : __seq_cmp (a, b);
+}
+
+static int
+__number_cmp (const void *a, const void *b)
+{
+  const struct ClusterLine *la = a, *lb = b;
+
+  if (la -> number != lb -> number)
+    return la -> number < lb -> number ? -1 : 1;
+  return __seq_cmp (la, lb);
+}
+
+/*
+ * the key a song is sorted by, written into buf followed by a tab: the
+ * number or the text of the sort's field (its tabs & newlines turned to
+ * spaces). 0 if it does not fit in room bytes.
+ */
+static size_t
+__sort_key (songtable songs, int song, int sort, char *buf, size_t room)
+{
+  stags tags = songtable_tags (songs, song);
+  char number [24], *key = number;
+  size_t len, i;
+
+  switch (sort) {
+  case SORT_ADDED:
+    sprintf (number, "%u", tags_added (tags));
+    break;
+  case SORT_DURATION:
+    sprintf (number, "%d", tags_duration (tags));
+    break;
+  case SORT_BITRATE:
+    sprintf (number, "%d", tags_bitrate (tags));
+    break;
+  default:
+    key = tags_field (tags, sort - SORT_ARTIST + TAG_ARTIST);
+  }
+  if ((len = strlen (key)) + 1 > room)
+    return 0;
+  for (i = 0; i < len; i ++)
+    buf [i] = key [i] == '\t' || key [i] == '\n' || key [i] == '\r' ? ' '
+              : key [i];
+  buf [len] = '\t';
+  return len + 1;
+}
+
+/*
+ * the matches of this node alone, rendered under host, each after its
+ * sort key if keyed. *text is NULL if nothing matched, else *len long
+ * (and nul terminated).
+ */
+static int
+__local_playlist (char *search, struct SearchOptions *opts, char *host,
+                  int keyed, char **text, size_t *len)
+{
+  char *out = NULL, *grown;
+  size_t size = 0, line, keylen;
+  songtable songs;
+  searchiter matches;
+  int song;
+
+  *text = NULL;
+  *len = 0;
+  songs = library_acquire ();
+  if (search_open (songs, search, opts, &matches) != MSE_OK) {
+    library_release (songs);
+    return MS_errno;
+  }
+  while ((song = search_next (matches)) >= 0) {
+    /* room is left for the nul */
+    for (keylen = line = 0;
+         out == NULL
+         || (keyed && !(keylen = __sort_key (songs, song, opts -> sort,
+                                             out + *len, size - *len - 1)))
+         || !(line = fullpl_line (out + *len + keylen,
+                                  size - *len - keylen - 1, host, songs,
+                                  song)); ) {
+      size = size ? 2 * size : 4096;
+      if ((grown = (char *) realloc (out, size)) == NULL) {
+        if (out != NULL) free (out);
+        search_close (matches);
+        library_release (songs);
+        *len = 0;
+        return (MS_errno = MSE_NOMEM);
+      }
+      out = grown;
+    }
+    *len += keylen + line;
+  }
+  search_close (matches);
+  library_release (songs);
+  if (out != NULL)
+    out [*len] = '\0';
+  *text = out;
+  return MSE_OK;
+}
+
+/*
+ * a playlist of the whole cluster: the matches of this node and those
+ * the others send back (asked for with local=1, from their first match
+ * on). they come in node order, or merged on their sort keys when they
+ * are sorted (by path, or by the key each node sends ahead of each line
+ * with keys=1), and the page asked for is cut out of them. *text is NULL
+ * if nothing matched, *answered is the number of nodes that answered.
+ */
+static int
+__cluster_playlist (char *search, char *query, char *host, char **text,
+                    int *answered)
+{
+  struct SearchOptions opts, local;
+  char *bodies [CLUSTER_NODES], *resource, *sort, *cursor, *end, *out, *tab;
+  char limit [24] = "";
+  size_t lengths [CLUSTER_NODES], size, len;
+  struct ClusterLine *lines = NULL, *grown;
+  int nlines = 0, room = 0, i, first, last, keyed;
+
+  *text = NULL;
+  if (__search_options (query, &opts) != MSE_OK)
+    return MS_errno;
+  local = opts;
+  local.offset = 0;
+  if (opts.limit >= 0)
+    local.limit = opts.offset > INT_MAX - opts.limit ? -1
+                  : opts.offset + opts.limit;
+  keyed = opts.sort != SORT_NONE && opts.sort != SORT_PATH;
+
+  /* this node's matches first, rendered as the others render theirs */
+  if (__local_playlist (search, &local, host, keyed, &out, &len) != MSE_OK)
+    return MS_errno;
+
+  /* then the others' */
+  if (local.limit >= 0)
+    sprintf (limit, "&limit=%d", local.limit);
+  if (__query_param (query, "sort", &sort) != MSE_OK
+      || (resource = Sprintf ("/songsearch/%s.m3u?local=1%s%s%s%s",
+                              search == NULL ? "" : search, limit,
+                              sort == NULL ? "" : "&sort=",
+                              sort == NULL ? "" : sort,
+                              keyed ? "&keys=1" : "")) == NULL) {
+    if (sort != NULL) free (sort);
+    if (out != NULL) free (out);
+    return (MS_errno = MSE_NOMEM);
+  }
+  if (sort != NULL) free (sort);
+  *answered = cluster_gather (resource, search, bodies, lengths);
+  free (resource);
+  if (*answered < 0) {
+    if (out != NULL) free (out);
+    return MS_errno;
+  }
+  bodies [cluster_self ()] = out;
+  lengths [cluster_self ()] = len;
+
+  /* split them in lines (a last one cut short is left out) */
+  for (i = 0; i < cluster_nodes (); i ++)
+    for (cursor = bodies [i]; cursor != NULL
+         && (end = memchr (cursor, '\n', bodies [i] + lengths [i] - cursor))
+            != NULL; cursor = end + 1) {
+      if (nlines == room) {
+        room = room ? 2 * room : 256;
+        if ((grown = (struct ClusterLine *)
+                       realloc (lines, room * sizeof (struct ClusterLine)))
+            == NULL) {
+          MS_errno = MSE_NOMEM;
+          goto Done;
+        }
+        lines = grown;
+      }
+      *end = '\0';
+      lines [nlines] . key = "";
+      lines [nlines] . number = 0;
+      lines [nlines] . seq = nlines;
+      if (keyed && (tab = memchr (cursor, '\t', end - cursor)) != NULL) {
+        *tab = '\0';
+        lines [nlines] . key = cursor;
+        lines [nlines] . number = strtoll (cursor, NULL, 10);
+        if (opts.sort == SORT_ADDED) /* newest first */
+          lines [nlines] . number = - lines [nlines] . number;
+        if (opts.reverse)
+          lines [nlines] . number = - lines [nlines] . number;
+        cursor = tab + 1;
+      }
+      lines [nlines] . line = cursor;
+      lines [nlines] . len = end - cursor;
+      if (strncmp (cursor, "http://", strlen ("http://"))
+          || (lines [nlines] . path = strchr (cursor + strlen ("http://"),
+                                              '/')) == NULL)
+        lines [nlines] . path = cursor;
+      nlines ++;
+    }
+  if (opts.sort == SORT_PATH)
+    qsort (lines, nlines, sizeof (struct ClusterLine),
+           opts.reverse ? &__line_rcmp : &__line_cmp);
+  else if (opts.sort >= SORT_ARTIST && opts.sort <= SORT_TITLE)
+    qsort (lines, nlines, sizeof (struct ClusterLine),
+           opts.reverse ? &__key_rcmp : &__key_cmp);
+  else if (keyed)
+    qsort (lines, nlines, sizeof (struct ClusterLine), &__number_cmp);
+
+  /* and cut the page out */
+  first = opts.offset < nlines ? opts.offset : nlines;
+  last = opts.limit >= 0 && opts.limit < nlines - first ? first + opts.limit
+         : nlines;
+  for (i = first, size = 1; i < last; i ++)
+    size += lines [i] . len + 1;
+  if (first < last) {
+    if ((*text = (char *) malloc (size)) == NULL) {
+      MS_errno = MSE_NOMEM;
+      goto Done;
+    }
+    for (i = first, len = 0; i < last; i ++) {
+      memcpy (*text + len, lines [i] . line, lines [i] . len);
+      len += lines [i] . len;
+      (*text) [len ++] = '\n';
+    }
+    (*text) [len] = '\0';
+  }
+  MS_errno = MSE_OK;
+
+ Done:
+  if (lines != NULL) free (lines);
+  for (i = 0; i < cluster_nodes (); i ++)
+    if (bodies [i] != NULL) free (bodies [i]);
+  return MS_errno;
+}
+
+/*
+ * pass a request on to the origin of the edge, answering with what it
+ * answered: its type, body & status (502 if it cannot be reached)
+ */
+static int
+__edge_proxy (HTTPResponse *response, char *resource, char *host)
+{
+  struct FetchReply reply;
+  char *text, *rcode;
+  size_t len;
+
+  if (fetch_get (edge_origin (), resource, host, &reply, &text, &len)
+      != MSE_OK) {
+    if (MS_errno == MSE_NOMEM)
+      return MS_errno;
+    return __response_init (response, "502 bad gateway", NULL);
+  }
+  switch (reply.status) {
+  case 200: rcode = "200 OK"; break;
+  case 400: rcode = "400 bad request"; break;
+  case 404: rcode = "404 not found"; break;
+  case 503: rcode = "503 service unavailable"; break;
+  default:  rcode = "502 bad gateway";
+  }
+  if (text == NULL || reply.status != 200) {
+    if (text != NULL) free (text);
+    return __response_init (response, rcode, NULL);
+  }
+  return __text_response (response, rcode, *reply.type ? reply.type
+                                                       : "text/plain", text);
+}
+
+/*
+ * a playlist of the origin, asked for under host: kept in the playlist
+ * cache for EDGE_TTL seconds, and fetched once by concurrent requests
+ */
+static int
+__edge_playlist (HTTPResponse *response, char *resource, char *host)
+{
+  struct FetchReply reply;
+  plbody body;
+  char *text;
+  size_t len;
+
+  switch (plcache_lookup (resource, host, time (NULL) / EDGE_TTL + 1,
+                          &body)) {
+  case PLCACHE_HIT:
+    return __playlist_response (response, body, NULL);
+  case PLCACHE_MISS:
+    break;
+  case PLCACHE_STREAM: /* too large to be cached */
+    return __edge_proxy (response, resource, host);
+  default:
+    return MS_errno;
+  }
+  if (fetch_get (edge_origin (), resource, host, &reply, &text, &len)
+      != MSE_OK) {
+    plcache_abandon (body);
+    if (MS_errno == MSE_NOMEM)
+      return MS_errno;
+    return __response_init (response, "502 bad gateway", NULL);
+  }
+  if (reply.status != 200 && reply.status != 404) { /* not to be kept */
+    plcache_abandon (body);
+    if (text != NULL) free (text);
+    return __response_init (response, reply.status == 400 ? "400 bad request"
+                                      : "502 bad gateway", NULL);
+  }
+  if (reply.status == 404 && text != NULL) { /* remember there is none */
+    free (text);
+    text = NULL;
+    len = 0;
+  }
+  plcache_fill (body, text, len);
+  return __playlist_response (response, body, NULL);
+}
+
+/*
+ * a song of the origin of an edge, by its client path. whole songs are
+ * sent out of their files; the others as they arrive, once the origin
+ * told how long they are, the range of bytes asked for only. seeking
+ * into a song waits for it to be whole.
+ */
+static int
+__edge_song (HTTPResponse *response, char *path, long msec, vector headers)
+{
+  struct EdgeStream *stream;
+  edgesong s;
+  char *content;
+  off_t length, from = 0, to = -1;
+  int fd, ranged = 0;
+
+  if ((content = songtable_type (path)) == NULL)
+    return __response_init (response, "404 not found", NULL);
+  if (edge_open (path, &s) != MSE_OK) {
+    if (MS_errno != MSE_SOCKET)
+      return MS_errno;
+    return __response_init (response, "502 bad gateway", NULL);
+  }
+  if (s == NULL)
+    return __response_init (response, "404 not found", NULL);
+  if (msec >= 0 && edge_wait (s) != MSE_OK) {
+    edge_release (s);
+    return __response_init (response, "502 bad gateway", NULL);
+  }
+  if (edge_complete (s)) {
+    fd = edge_file (s);
+    edge_release (s);
+    if (fd < 0)
+      return (MS_errno = MSE_OS);
+    return __song_response (response, fd, NULL, content, msec, 0, headers);
+  }
+
+  if ((length = edge_length (s)) >= 0) {
+    to = length - 1;
+    if ((ranged = __get_range (headers, length, &from, &to)) < 0) {
+      edge_release (s);
+      if (__response_init (response, "416 range not satisfiable", NULL)
+          != MSE_OK)
+        return MS_errno;
+      if (__add_header (*response, Sprintf ("Content-Range: bytes */%llu",
+                          (unsigned long long) length)) != MSE_OK) {
+        transaction_done (NULL, *response);
+        return MS_errno;
+      }
+      return MSE_OK;
+    }
+  }
+  if ((stream = (struct EdgeStream *)
+                  malloc (sizeof (struct EdgeStream))) == NULL) {
+    edge_release (s);
+    return (MS_errno = MSE_NOMEM);
+  }
+  stream -> s = s;
+  stream -> from = from;
+  stream -> to = to;
+  if (__response_init (response, ranged ? "206 Partial Content" : "200 OK",
+                       content) != MSE_OK) {
+    edge_release (s);
+    free (stream);
+    return MS_errno;
+  }
+  (*response) -> body = stream;
+  (*response) -> type = RESPONSE_EDGE;
+  if (length >= 0
+      && (__add_header (*response, Sprintf ("Content-Length: %llu",
+                          (unsigned long long) (to + 1 - from))) != MSE_OK
+          || __add_header (*response, strdup ("Accept-Ranges: bytes"))
+             != MSE_OK
+          || (ranged
+              && __add_header (*response, Sprintf ("Content-Range: bytes %llu-%llu/%llu",
+                                 (unsigned long long) from,
+                                 (unsigned long long) to,
+                                 (unsigned long long) length)) != MSE_OK))) {
+    transaction_done (NULL, *response);
+    return MS_errno;
+  }
+  return MSE_OK;
+}
+
+/*
+ * the response of an edge: songs are sent out of its disk, playlists out
+ * of its memory, folders & completions as the origin sends them, and
+ * streams (radio stations & chained songs) by the origin itself
+ */
+static int
+__edge_request (HTTPRequest request, char *host, HTTPResponse *response)
+{
+  char *song = NULL, *search = NULL, *query = NULL, *text;
+  struct EdgeStats stats;
+  long msec;
+  int kind, i;
+
+  kind = __request_search (request -> resource, &song, &search, &query);
+  if (kind == __REQUESTED_SONG__) {
+    i = __query_time (query, "t", &msec);
+    if (query != NULL) free (query);
+    if (i == MSE_OK)
+      i = __edge_song (response, song, msec, request -> headers);
+    else if (MS_errno == MSE_BADREQUEST)
+      i = __response_init (response, "400 bad request", NULL);
+    free (song);
+    return i;
+  }
+  if (query != NULL) free (query);
+  if (kind > 0 && search != NULL) free (search);
+
+  switch (kind) {
+  case __REQUESTED_PLAYLIST__:
+    return __edge_playlist (response, request -> resource, host);
+  case __REQUESTED_SUGGEST__:
+  case __REQUESTED_BROWSE__:
+    return __edge_proxy (response, request -> resource, host);
+  case __REQUESTED_RADIO__:
+  case __REQUESTED_CONCAT__:
+    if (__response_init (response, "307 temporary redirect", NULL) != MSE_OK)
+      return MS_errno;
+    if (__add_header (*response, Sprintf ("Location: http://%s%s",
+                                          edge_origin (),
+                                          request -> resource)) != MSE_OK) {
+      transaction_done (NULL, *response);
+      return MS_errno;
+    }
+    return MSE_OK;
+  case __REQUESTED_STATUS__:
+    edge_stats (&stats);
+    if ((text = Sprintf ("edge\norigin: %s\ncached songs: %d\n"
+                         "filling songs: %d\ncached bytes: %llu\n"
+                         "cache hits: %lu\ncache misses: %lu\n"
+                         "shared fetches: %lu\nbytes fetched: %llu\n",
+                         edge_origin (), stats.songs, stats.filling,
+                         stats.used, stats.hits, stats.misses, stats.shared,
+                         stats.fetched)) == NULL)
+      return (MS_errno = MSE_NOMEM);
+    return __text_response (response, "200 OK", "text/plain", text);
+  case __REQUESTED_DIGEST__: /* an edge is no node of a cluster */
+    return __response_init (response, "404 not found", NULL);
+  default:
+    if (MS_errno == MSE_BADREQUEST)
+      return __response_init (response, "400 bad request", NULL);
+    return MS_errno;
+  }
+}
+
+/* given an HTTP request form the appropriate HTTP response */
+int
+form_response (HTTPRequest request, HTTPResponse *response)
+{
+  char *search, *song, *host, *query, *key, *content, *text;
+  unsigned char *digest;
+  struct SearchOptions opts;
+  struct LibraryProgress progress;
+  songtable songs;
+  int songinfo, fd, whole, gone = 0;
+  long msec;
+  off_t from, to;
+  size_t len;
+  plbody body = NULL;
+  fullpl full;
+  songbody cached, fill;
+  opensong open;
+  station tuned;
+  struct RadioTuning *tuning;
+  concat chain;
+  int *list, count;
+  struct SongCacheStats cache;
+  struct PlaylistStream *stream;
+  int i;
+
+  if (request == NULL) { /* if an error occured while processing request */
+    if (__response_init (response, "500 server error", NULL) != MSE_OK)
+      return MS_errno;
+    return MSE_OK;
+  }
+  if (strcmp (request -> command, "GET")) { /* only GET is supported */
+    if (__response_init (response, "501 not implemented", NULL) != MSE_OK)
+      goto ServerError;
+    return MSE_OK;
+  }
+  /* http 1.0 & 1.1 currently supported */
+  if ((strcmp (request -> version, "HTTP/1.1") 
+       && strcmp (request -> version, "HTTP/1.0"))
+      || (host = __get_host (request -> headers)) == NULL) {
+    if (__response_init (response, "400 bad request", NULL) != MSE_OK)
+      goto ServerError;
+    return MSE_OK;
+  }
+  /* an edge passes requests on to its origin */
+  if (edge_origin () != NULL) {
+    i = __edge_request (request, host, response);
+    free (host);
+    if (i != MSE_OK)
+      goto ServerError;
+    return MSE_OK;
+  }
+  
+  switch (__request_search (request -> resource, &song, &search, &query)) {
+  case __REQUESTED_SONG__: /* if client requested a song */
+    /* t=<seconds> has it start playing that far in */
+    i = __query_time (query, "t", &msec);
+    if (query != NULL) free (query);
+    if (i != MSE_OK) {
+      free (song);
+      if (MS_errno != MSE_BADREQUEST)
+        goto ServerError;
+      if (__response_init (response, "400 bad request", NULL) != MSE_OK)
+        goto ServerError;
+      return MSE_OK;
+    }
+    /* songs of other nodes of the cluster are for them to send */
+    if (cluster_nodes () > 1 && (i = __song_owner (song)) != cluster_self ()) {
+      free (song);
+      if (__response_init (response, "307 temporary redirect", NULL)
+          != MSE_OK)
+        goto ServerError;
+      if (__add_header (*response, Sprintf ("Location: http://%s%s",
+                                            cluster_node (i),
+                                            request -> resource)) != MSE_OK) {
+        transaction_done (NULL, *response);
+        goto ServerError;
+      }
+      return MSE_OK;
+    }
+    /* find it in the library, or on the disk while the library is built */
+    songs = library_acquire ();
+    cached = fill = NULL;
+    /* whole songs played often are sent out of memory, ranges of them
+       out of their files */
+    whole = msec < 0 && !__get_range (request -> headers, (off_t) LLONG_MAX,
+                                      &from, &to);
+    if ((songinfo = songtable_find (songs, song)) >= 0) {
+      content = songtable_content (songs, songinfo);
+      prefetch_next (request -> peer, songinfo);
+      if (whole)
+        cached = songcache_lookup (songs, songinfo);
+      open = cached != NULL ? NULL : fdcache_open (songs, songinfo);
+      gone = cached == NULL && open == NULL && errno == ENOENT;
+      fd = open != NULL ? fdcache_fd (open) : -1;
+      /* a song let into memory is sent from its file this once */
+      if (whole && open != NULL)
+        fill = songcache_admit (songinfo, fd);
+    }
+    else {
+      library_progress (&progress);
+      open = NULL;
+      fd = progress.ready ? -1 : songtable_open_file (songs, song, &content);
+    }
+    library_release (songs);
+    free (song);
+    if (cached != NULL) {
+      if (__cached_response (response, cached, content) != MSE_OK)
+        goto ServerError;
+      return MSE_OK;
+    }
+    if ((songinfo < 0 || gone) && fd < 0) { /* or removed since the scan */
+      if (__response_init (response, "404 not found", NULL) != MSE_OK)
+        goto ServerError;
+      return MSE_OK;
+    }
+    if (fd < 0) {
+      MS_errno = MSE_OS;
+      goto ServerError;
+    }
+    if (__song_response (response, fd, open, content, msec,
+                         songinfo >= 0 && songcache_frequency (songinfo) <= 1,
+                         request -> headers) != MSE_OK) {
+      if (fill != NULL)
+        songcache_release (fill);
+      goto ServerError;
+    }
+    if (fill != NULL) {
+      if ((*response) -> type == RESPONSE_FD)
+        ((struct SongFile *) (*response) -> body) -> fill = fill;
+      else songcache_release (fill);
+    }
+    return MSE_OK;
+
+  case __REQUESTED_STATUS__: /* health checks: is the library built yet */
+    if (query != NULL) free (query);
+    free (host);
+    library_progress (&progress);
+    songcache_stats (&cache);
+    if ((text = Sprintf ("%s\nsongs: %d\nsearchable: %d\ndirectories: %d\n"
+                         "seconds: %.1f\ncached songs: %d\ncached bytes: %lu\n"
+                         "cache hits: %lu\ncache misses: %lu\n"
+                         "cache hit ratio: %.3f\ncache bytes saved: %llu\n"
+                         "open songs: %d\n",
+                         progress.ready ? "ready" : "warming",
+                         progress.songs, progress.published,
+                         progress.directories, progress.seconds, cache.songs,
+                         (unsigned long) cache.used, cache.hits, cache.misses,
+                         cache.hits + cache.misses
+                           ? (double) cache.hits / (cache.hits + cache.misses)
+                           : 0.0, cache.saved, fdcache_count ())) == NULL) {
+      MS_errno = MSE_NOMEM;
+      goto ServerError;
+    }
+    if (__text_response (response, progress.ready ? "200 OK"
+                         : "503 service unavailable", "text/plain", text)
+        != MSE_OK)
+      goto ServerError;
+    return MSE_OK;
+
+  case __REQUESTED_DIGEST__: /* what the songs of this node look like */
+    free (host);
+    if (query != NULL) free (query);
+    if (cluster_digest (&digest) != MSE_OK)
+      goto ServerError;
+    if (digest == NULL) { /* not until the library is complete */
+      if (__response_init (response, "503 service unavailable", NULL)
+          != MSE_OK)
+        goto ServerError;
+      return MSE_OK;
+    }
+    if (__response_init (response, "200 OK", "application/octet-stream")
+        != MSE_OK) {
+      free (digest);
+      goto ServerError;
+    }
+    (*response) -> body = digest;
+    (*response) -> type = RESPONSE_DIGEST;
+    if (__add_header (*response, Sprintf ("Content-Length: %d",
+                                          CLUSTER_DIGEST)) != MSE_OK) {
+      transaction_done (NULL, *response);
+      goto ServerError;
+    }
+    return MSE_OK;
+
+  case __REQUESTED_CONCAT__: /* the songs of a search, as one stream */
+    free (host);
+    songs = library_acquire ();
+    i = __concat_list (songs, search, query, song, &list, &count);
+    if (search != NULL) free (search);
+    if (query != NULL) free (query);
+    if (i != MSE_OK) {
+      library_release (songs);
+      if (MS_errno != MSE_BADREQUEST)
+        goto ServerError;
+      if (__response_init (response, "400 bad request", NULL) != MSE_OK)
+        goto ServerError;
+      return MSE_OK;
+    }
+    chain = concat_open (songs, list, count, song);
+    library_release (songs);
+    free (list);
+    if (chain == NULL
+        || __concat_response (response, chain, song, request -> headers)
+           != MSE_OK)
+      goto ServerError;
+    return MSE_OK;
+
+  case __REQUESTED_RADIO__: /* a station, played to all its listeners */
+    free (host);
+    if (query != NULL) free (query);
+    i = radio_tune (search, &tuned);
+    free (search);
+    if (i != MSE_OK)
+      goto ServerError;
+    if (tuned == NULL) {
+      if (__response_init (response, "404 not found", NULL) != MSE_OK)
+        goto ServerError;
+      return MSE_OK;
+    }
+    if ((tuning = (struct RadioTuning *)
+                    malloc (sizeof (struct RadioTuning))) == NULL) {
+      MS_errno = MSE_NOMEM;
+      goto ServerError;
+    }
+    tuning -> s = tuned;
+    tuning -> icy = __icy_metadata (request -> headers);
+    if (__response_init (response, "200 OK", "audio/mpeg") != MSE_OK) {
+      free (tuning);
+      goto ServerError;
+    }
+    (*response) -> body = tuning;
+    (*response) -> type = RESPONSE_RADIO;
+    if (__add_header (*response, Sprintf ("icy-name: %s",
+                                          radio_name (tuned))) != MSE_OK
+        || __add_header (*response, strdup ("Cache-Control: no-cache"))
+             != MSE_OK
+        || (tuning -> icy
+            && __add_header (*response, Sprintf ("icy-metaint: %d",
+                                                 RADIO_METAINT)) != MSE_OK)) {
+      transaction_done (NULL, *response);
+      goto ServerError;
+    }
+    return MSE_OK;
+
+  case __REQUESTED_SUGGEST__: /* completions of what is being typed */
+    free (host);
+    i = __suggestions (search, query, &text);
+    free (search);
+    if (query != NULL) free (query);
+    if (i != MSE_OK) {
+      if (MS_errno != MSE_BADREQUEST)
+        goto ServerError;
+      if (__response_init (response, "400 bad request", NULL) != MSE_OK)
+        goto ServerError;
+      return MSE_OK;
+    }
+    if (__text_response (response, "200 OK", "text/plain", text) != MSE_OK)
+      goto ServerError;
+    return MSE_OK;
+
+  case __REQUESTED_BROWSE__: /* a folder of the library */
+    i = __browse (search, query, host, &text, &content);
+    free (search);
+    if (query != NULL) free (query);
+    free (host);
+    if (i != MSE_OK) {
+      if (MS_errno != MSE_BADREQUEST)
+        goto ServerError;
+      if (__response_init (response, "400 bad request", NULL) != MSE_OK)
+        goto ServerError;
+      return MSE_OK;
+    }
+    if (text == NULL) { /* no such folder, or no songs to play */
+      if (__response_init (response, "404 not found", NULL) != MSE_OK)
+        goto ServerError;
+      return MSE_OK;
+    }
+    if (__text_response (response, "200 OK", content, text) != MSE_OK)
+      goto ServerError;
+    return MSE_OK;
+
+  case __REQUESTED_PLAYLIST__: /* if client requested a playlist */
+    /* in a cluster, all of its nodes are searched, but by the nodes
+       asking each other (local=1) */
+    if (cluster_nodes () > 1
+        && __query_number (query, "local", 0, &i) == MSE_OK && !i) {
+      i = __cluster_playlist (search, query, host, &text, &count);
+      if (search != NULL) free (search);
+      if (query != NULL) free (query);
+      free (host);
+      if (i != MSE_OK) {
+        if (MS_errno != MSE_BADREQUEST)
+          goto ServerError;
+        if (__response_init (response, "400 bad request", NULL) != MSE_OK)
+          goto ServerError;
+        return MSE_OK;
+      }
+      if (text == NULL) { /* if no matches were found */
+        if (__response_init (response, "404 not found", NULL) != MSE_OK)
+          goto ServerError;
+        return MSE_OK;
+      }
+      __prefetch_body (request -> peer, text, strlen (text));
+      if (__text_response (response, "200 OK", "audio/x-mpegurl", text)
+          != MSE_OK)
+        goto ServerError;
+      if (__add_header (*response, Sprintf ("X-Cluster-Nodes: %d/%d", count,
+                                            cluster_nodes ())) != MSE_OK) {
+        transaction_done (NULL, *response);
+        goto ServerError;
+      }
+      return MSE_OK;
+    }
+    /* and a node asking for its matches with their keys, to merge them */
+    if (cluster_nodes () > 1
+        && __query_number (query, "keys", 0, &i) == MSE_OK && i) {
+      i = __search_options (query, &opts);
+      if (i == MSE_OK)
+        i = __local_playlist (search, &opts, host, 1, &text, &len);
+      if (search != NULL) free (search);
+      if (query != NULL) free (query);
+      free (host);
+      if (i != MSE_OK) {
+        if (MS_errno != MSE_BADREQUEST)
+          goto ServerError;
+        if (__response_init (response, "400 bad request", NULL) != MSE_OK)
+          goto ServerError;
+        return MSE_OK;
+      }
+      if (text == NULL) { /* if no matches were found */
+        if (__response_init (response, "404 not found", NULL) != MSE_OK)
+          goto ServerError;
+        return MSE_OK;
+      }
+      if (__text_response (response, "200 OK", "audio/x-mpegurl", text)
+          != MSE_OK)
+        goto ServerError;
+      return MSE_OK;
+    }
+    /* the whole library's is kept rendered, once asked for under host */
+    if (query == NULL && (search == NULL || *search == '\0')) {
+      songs = library_acquire ();
+      full = fullpl_lookup (host, songs);
+      library_release (songs);
+      if (full != NULL) {
+        if (search != NULL) free (search);
+        free (host);
+        if (__full_response (response, full) != MSE_OK)
+          goto ServerError;
+        prefetch_playlist (request -> peer, NULL, -1);
+        return MSE_OK;
+      }
+    }
+    /* a playlist rendered lately for the same key & host will do */
+    if (__search_options (query, &opts) != MSE_OK
+        || (query != NULL && (key = Sprintf ("%s?%s", search == NULL ? ""
+                                             : search, query)) == NULL)) {
+      if (search != NULL) free (search);
+      if (query != NULL) free (query);
+      free (host);
+      if (MS_errno != MSE_BADREQUEST)
+        goto ServerError;
+      if (__response_init (response, "400 bad request", NULL) != MSE_OK)
+        goto ServerError;
+      return MSE_OK;
+    }
+    if (query == NULL)
+      key = search == NULL ? "" : search;
+    i = plcache_lookup (key, host, library_generation (), &body);
+    if (query != NULL) {
+      free (query);
+      free (key);
+    }
+    switch (i) {
+    case PLCACHE_HIT:
+      if (search != NULL) free (search);
+      free (host);
+      if (__playlist_response (response, body, request -> peer) != MSE_OK)
+        goto ServerError;
+      return MSE_OK;
+    case PLCACHE_MISS:   /* render it, keeping a copy for the cache */
+    case PLCACHE_STREAM: /* too large to be cached, just render it */
+      break;
+    default:
+      if (search != NULL) free (search);
+      free (host);
+      goto ServerError;
+    }
+
+    /* generate the playlist while sending it */
+    if ((stream = (struct PlaylistStream *)
+                    calloc (1, sizeof (struct PlaylistStream))) == NULL) {
+      MS_errno = MSE_NOMEM;
+      if (body != NULL) plcache_abandon (body);
+      if (search != NULL) free (search);
+      free (host);
+      goto ServerError;
+    }
+    stream -> host = host;
+    stream -> body = body;
+    strcpy (stream -> peer, request -> peer);
+    stream -> chunked = !strcmp (request -> version, "HTTP/1.1");
+    stream -> songs = library_acquire ();
+    i = search_open (stream -> songs, search, &opts, &stream -> matches);
+    if (search != NULL) free (search);
+    if (i != MSE_OK) {
+      if (body != NULL) plcache_abandon (body);
+      library_release (stream -> songs);
+      free (host);
+      free (stream);
+      if (MS_errno != MSE_BADREQUEST)
+        goto ServerError;
+      if (__response_init (response, "400 bad request", NULL) != MSE_OK)
+        goto ServerError;
+      return MSE_OK;
+    }
+    if ((stream -> first = search_next (stream -> matches)) < 0) {
+      if (body != NULL) { /* remember there were no matches */
+        plcache_fill (body, NULL, 0);
+        plcache_release (body);
+        stream -> body = NULL;
+      }
+      __stream_free (stream);
+      if (__response_init (response, "404 not found", NULL) != MSE_OK)
+        goto ServerError;
+      return MSE_OK;
+    }
+    /* rendered for the cache, it is sent out of it as a hit would be */
+    if (body != NULL && __stream_render (stream)) {
+      __stream_free (stream);
+      if (__playlist_response (response, body, request -> peer) != MSE_OK)
+        goto ServerError;
+      return MSE_OK;
+    }
+    if (__response_init (response, "200 OK", "audio/x-mpegurl") != MSE_OK) {
+      __stream_free (stream);
+      goto ServerError;
+    }
+    if (stream -> chunked
+        && __add_header (*response,
+                         strdup ("Transfer-Encoding: chunked")) != MSE_OK) {
+      __stream_free (stream);
+      transaction_done (NULL, *response);
+      goto ServerError;
+    }
+    (*response) -> body = stream;
+    (*response) -> type = RESPONSE_STREAM;
+    return MSE_OK;
+  default:
+    if (MS_errno == MSE_BADREQUEST) {
+      if (__response_init (response, "400 bad request", NULL) != MSE_OK)
+        goto ServerError;
+      return MSE_OK;
+    }
+    goto ServerError;
+  }
+
+ ServerError:
+   if (__response_init (response, "500 server error", NULL) != MSE_OK)
+     return MS_errno;
+   return MSE_OK;
+}
+
+/* write onto fd "bytes" bytes of "buffer" */
+static int
+Write (int fd, char *buffer, ssize_t bytes)
+{
+  ssize_t bytes_written;
+
+  while ((bytes_written = write (fd, buffer, bytes)) >= 0)
+    if (!(bytes -= bytes_written))
+      break;
+  if (bytes_written < 0)
+    return (MS_errno = MSE_WRITERESPONSE);
+
+  return MSE_OK;
+}
+
+/*
+ * generate & send a playlist in batches of PLAYLIST_BATCH bytes, after
+ * what was rendered of it already if any. room is left in front of each
+ * batch for its chunk size and after it for the closing CRLF, so that
+ * each batch goes out with a single write.
+ */
+static int
+__write_stream (int connfd, struct PlaylistStream *stream)
+{
+  char *batch, *data, head [24];
+  size_t len, line;
+  int song = stream -> first, headlen;
+
+  if (stream -> copylen) {
+    headlen = sprintf (head, "%lx\r\n", (unsigned long) stream -> copylen);
+    if ((stream -> chunked && Write (connfd, head, headlen) != MSE_OK)
+        || Write (connfd, stream -> copy, stream -> copylen) != MSE_OK
+        || (stream -> chunked && Write (connfd, "\r\n", 2) != MSE_OK))
+      return MS_errno;
+  }
+  if ((batch = (char *) malloc (PLAYLIST_BATCH + 16)) == NULL)
+    return (MS_errno = MSE_NOMEM);
+  data = batch + 16;
+
+  for (; ;) {
+    /* its first songs are known by now, or all of them are */
+    if (!stream -> prefetched
+        && (stream -> nsent == PREFETCH_SONGS || song < 0)) {
+      prefetch_playlist (stream -> peer, stream -> sent, stream -> nsent);
+      stream -> prefetched = 1;
+    }
+    if (song < 0)
+      break;
+
+    /* fill up a batch */
+    for (len = 0; song >= 0; song = search_next (stream -> matches)) {
+      line = fullpl_line (data + len, PLAYLIST_BATCH - 2 - len,
+                          stream -> host, stream -> songs, song);
+      if (!line) {
+        if (!len) /* a single line longer than a batch: skip it */
+          continue;
+        break;
+      }
+      len += line;
+      if (stream -> nsent < PREFETCH_SONGS)
+        stream -> sent [stream -> nsent ++] = song;
+    }
+    if (!len)
+      continue;
+
+    /* and send it */
+    if (stream -> chunked) {
+      headlen = sprintf (head, "%lx\r\n", (unsigned long) len);
+      memcpy (data - headlen, head, headlen);
+      memcpy (data + len, "\r\n", 2);
+      if (Write (connfd, data - headlen, headlen + len + 2) != MSE_OK) {
+        free (batch);
+        return MS_errno;
+      }
+    }
+    else if (Write (connfd, data, len) != MSE_OK) {
+      free (batch);
+      return MS_errno;
+    }
+  }
+  free (batch);
+
+  if (stream -> chunked && Write (connfd, "0\r\n\r\n", 5) != MSE_OK)
+    return MS_errno;
+  return MSE_OK;
+}
+
+/* write the http response upon the accepted connection */
+int
+write_response (int connfd, HTTPResponse response)
+{
+  ssize_t bytes_to_write, bytes_read;
+  char *transmit, *head, buffer [BUFFERSIZE];
+  off_t offset, length, ahead, dropped, window;
+  struct SongFile *file;
+  int i;
+
+  /* write http version and response code */
+  transmit = Sprintf ("%s %s\r\n", response->version, response->response_code);
+  if (transmit == NULL)
+    return (MS_errno = MSE_NOMEM);
+  bytes_to_write = strlen (transmit);
+  if (Write (connfd, transmit, bytes_to_write) != MSE_OK) {
+    free (transmit);
+    return MS_errno;
+  }
+  free (transmit);
+
+  /* write headers */
+  for (i = 0; i < vector_length (response -> headers); i ++) {
+    head = (char *) vector_get (response -> headers, i);
+    if ((transmit = Sprintf ("%s\r\n", head)) == NULL) {
+      free (transmit);
+      return (MS_errno = MSE_NOMEM);
+    }
+    bytes_to_write = strlen (transmit);
+    if (Write (connfd, transmit, bytes_to_write) != MSE_OK) {
+      free (transmit);
+      return MS_errno;
+    }
+    free (transmit);
+  }
+
+  if (Write (connfd, "\r\n", strlen ("\r\n")) != MSE_OK)
+    return MS_errno;
+
+  switch (response -> type) {
+  case RESPONSE_FD: /* if message body is a file */
+    file = (struct SongFile *) response -> body;
+    /* stream headers go ahead of a song sent from some frame on */
+    for (offset = 0; offset < file -> header; offset += bytes_read) {
+      length = file -> header - offset;
+      if ((bytes_read = pread (file -> fd, buffer, length < BUFFERSIZE
+                                 ? length : BUFFERSIZE, offset)) <= 0)
+        return (MS_errno = MSE_OS);
+      if (Write (connfd, buffer, bytes_read) != MSE_OK)
+        return MS_errno;
+    }
+    /*
+     * the kernel is told to read ahead, further as the stream goes on,
+     * and songs played once drop behind them what was sent
+     */
+    posix_fadvise (file -> fd, file -> start, 0, POSIX_FADV_SEQUENTIAL);
+    offset = ahead = dropped = file -> start;
+    window = READAHEAD_MIN;
+    /* a song for the song cache is read into it, and sent out of it */
+    if (file -> fill != NULL && (file -> header || file -> start
+                                 || file -> end
+                                    != songcache_length (file -> fill))) {
+      songcache_release (file -> fill);
+      file -> fill = NULL;
+    }
+    /* transmit file, from an offset of its own: the fd may be shared */
+    while (offset < file -> end) {
+      if (offset + window / 2 >= ahead) {
+        posix_fadvise (file -> fd, ahead, window, POSIX_FADV_WILLNEED);
+        ahead += window;
+        if (window < READAHEAD_MAX) window *= 2;
+      }
+      length = file -> end - offset < window ? file -> end - offset : window;
+      if (file -> fill != NULL) {
+        head = songcache_data (file -> fill) + offset;
+        if ((bytes_read = pread (file -> fd, head, length, offset)) < 0)
+          return (MS_errno = MSE_OS);
+        if (bytes_read && Write (connfd, head, bytes_read) != MSE_OK)
+          return MS_errno;
+        offset += bytes_read;
+      }
+      else if ((bytes_read = sendfile (connfd, file -> fd, &offset, length))
+               < 0)
+        return (MS_errno = MSE_WRITERESPONSE);
+      if (!bytes_read) /* the file shrank meanwhile */
+        return (MS_errno = MSE_OS);
+      if (file -> oneshot && offset - dropped >= DROP_BEHIND) {
+        posix_fadvise (file -> fd, dropped, offset - dropped,
+                       POSIX_FADV_DONTNEED);
+        dropped = offset;
+      }
+    }
+    if (file -> fill != NULL)
+      songcache_fill (file -> fill);
+    return MSE_OK;
+
+  case RESPONSE_PL: /* if message body is just a playlist */
+    if (Write (connfd, plcache_data ((plbody) response -> body),
+               plcache_length ((plbody) response -> body)) != MSE_OK)
+      return MS_errno;
+    return MSE_OK;
+  case RESPONSE_STREAM: /* if message body is a playlist to generate */
+    return __write_stream (connfd, (struct PlaylistStream *) response -> body);
+  case RESPONSE_FULL: /* the whole library's, out of its memory file */
+    length = fullpl_length ((fullpl) response -> body);
+    for (offset = 0; offset < length; )
+      if (sendfile (connfd, fullpl_fd ((fullpl) response -> body), &offset,
+                    length - offset) <= 0)
+        return (MS_errno = MSE_WRITERESPONSE);
+    return MSE_OK;
+  case RESPONSE_CACHED: /* if message body is a song kept in memory */
+    return Write (connfd, songcache_data ((songbody) response -> body),
+                  songcache_length ((songbody) response -> body));
+  case RESPONSE_RADIO: /* the station sends the stream from now on */
+    if ((i = dup (connfd)) < 0)
+      return (MS_errno = MSE_OS);
+    return radio_listen (((struct RadioTuning *) response -> body) -> s, i,
+                         ((struct RadioTuning *) response -> body) -> icy);
+  case RESPONSE_CONCAT: /* songs chained, straight out of their files */
+    return concat_send (connfd, ((struct ConcatStream *) response -> body) -> c,
+                        ((struct ConcatStream *) response -> body) -> from,
+                        ((struct ConcatStream *) response -> body) -> to);
+  case RESPONSE_EDGE: /* a song of the origin, as it arrives */
+    return edge_send (connfd, ((struct EdgeStream *) response -> body) -> s,
+                      ((struct EdgeStream *) response -> body) -> from,
+                      ((struct EdgeStream *) response -> body) -> to);
+  case RESPONSE_DIGEST: /* the bits of the digest of the library */
+    return Write (connfd, (char *) response -> body, CLUSTER_DIGEST);
+  case RESPONSE_TEXT: /* if message body is some text */
+    return Write (connfd, (char *) response -> body,
+                  strlen ((char *) response -> body));
+  case RESPONSE_NO:
+    break;
+  }
+  return MSE_OK;
+}
+
+/* print a response informative message to stdout */
+void
+print_response (char *target, HTTPResponse response)
+{
+  fprintf (stdout, "[->] sent a %s response to %s under %s.\n",
+                   response -> response_code, target, response -> version);
+  return;
+}
+
+/* free any resources used by HTTP request and response */
 void
 transaction_done (HTTPRequest request, HTTPResponse response)
 {
-  dhlist cur;
   int i;
 
   if (request != NULL) {
     free (request -> command);
     free (request -> resource);
     free (request -> version);
-    for (cur = dhlist_first (request -> headers);
-         cur != dhlist_end (request -> headers); cur = dhlist_next (cur))
-      free (dhlist_data (cur));
-    dhlist_delete (request -> headers);
+    for (i = 0; i < vector_length (request -> headers); i ++)
+      free (vector_get (request -> headers, i));
+    vector_delete (request -> headers);
     free (request);
   }
 
   if (response != NULL) {
     free (response -> version);
     free (response -> response_code);
-    for (cur = dhlist_first (response -> headers);
-         cur != dhlist_end (response -> headers); cur = dhlist_next (cur))
-      free (dhlist_data (cur));
-    dhlist_delete (response -> headers);
+    for (i = 0; i < vector_length (response -> headers); i ++)
+      free (vector_get (response -> headers, i));
+    vector_delete (response -> headers);
     switch (response -> type) {
     case RESPONSE_PL:
-      for (i = 0; i < response -> length; i ++)
-        free (((char **) response -> body) [i]);
-      free (response -> body);
+      plcache_release ((plbody) response -> body);
+      break;
+    case RESPONSE_STREAM:
+      __stream_free ((struct PlaylistStream *) response -> body);
+      break;
+    case RESPONSE_FULL:
+      fullpl_release ((fullpl) response -> body);
+      break;
+    case RESPONSE_CACHED:
+      songcache_release ((songbody) response -> body);
       break;
     case RESPONSE_FD:
-      close (* (int *) (response -> body));
+      __song_close (((struct SongFile *) response -> body) -> fd,
+                    ((struct SongFile *) response -> body) -> open);
+      if (((struct SongFile *) response -> body) -> fill != NULL)
+        songcache_release (((struct SongFile *) response -> body) -> fill);
+      free (response -> body);
+      break;
+    case RESPONSE_CONCAT:
+      concat_close (((struct ConcatStream *) response -> body) -> c);
+      free (response -> body);
+      break;
+    case RESPONSE_EDGE:
+      edge_release (((struct EdgeStream *) response -> body) -> s);
+      free (response -> body);
+      break;
+    case RESPONSE_TEXT:
+    case RESPONSE_RADIO:
+    case RESPONSE_DIGEST:
       free (response -> body);
       break;
     case RESPONSE_NO:
@@ -0,0 +1,297 @@
+/* plcache.c: cache of rendered playlists, keyed by search key & host */
+# include <stdlib.h>
+# include <string.h>
+# include <pthread.h>
+
+# include "../mstream/mserrors.h"
+# include "plcache.h"
+
+# define PLCACHE_BUCKETS 1024
+
+  /* state of an entry */
+# define ENTRY_PENDING 0  /* a thread is rendering it, others wait */
+# define ENTRY_READY   1
+# define ENTRY_FAILED  2
+# define ENTRY_TOOBIG  3  /* too large to keep: stream it, do not wait */
+
+/*
+ * a rendered playlist. entries live in a hash table and in an lru list,
+ * and are reference counted so that a body can be sent while it is
+ * evicted. an entry out of the table is freed with its last reference.
+ */
+struct PlaylistBody {
+  char         *key, *host;
+  unsigned int  generation;   /* library generation it was rendered from */
+  unsigned int  hash;
+  char         *data;         /* the body, NULL if nothing matched */
+  size_t        length;
+  size_t        cost;         /* bytes charged to the budget */
+  int           state;
+  int           refs;
+  int           linked;       /* still in the table */
+  plbody        chain;        /* next entry of the bucket */
+  plbody        newer, older; /* lru list */
+};
+
+static pthread_mutex_t plcache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  plcache_cond = PTHREAD_COND_INITIALIZER;
+
+static plbody *table = NULL;
+static plbody  newest = NULL, oldest = NULL;
+static size_t  budget = 0, used = 0;
+
+int
+plcache_init (size_t bytes)
+{
+  if ((table = (plbody *) calloc (PLCACHE_BUCKETS, sizeof (plbody))) == NULL)
+    return (MS_errno = MSE_NOMEM);
+  budget = bytes;
+  return MSE_OK;
+}
+
+static unsigned int
+__hash (char *key, char *host)
+{
+  unsigned int h = 5381;
+
+  while (*key) h = h * 33 + (unsigned char) *key ++;
+  h = h * 33 + '\n';
+  while (*host) h = h * 33 + (unsigned char) *host ++;
+  return h;
+}
+
+static size_t
+__cost (plbody entry)
+{
+  return sizeof (struct PlaylistBody) + entry -> length
+         + strlen (entry -> key) + strlen (entry -> host) + 2;
+}
+
+static void
+__destroy (plbody entry)
+{
+  free (entry -> key);
+  free (entry -> host);
+  if (entry -> data != NULL) free (entry -> data);
+  free (entry);
+  return;
+}
+
+/* take an entry off the table and the lru list (lock held) */
+static void
+__unlink (plbody entry)
+{
+  plbody *link;
+
+  for (link = &table [entry -> hash % PLCACHE_BUCKETS]; *link != entry;
+       link = &(*link) -> chain)
+    ;
+  *link = entry -> chain;
+  if (entry -> newer != NULL) entry -> newer -> older = entry -> older;
+  else newest = entry -> older;
+  if (entry -> older != NULL) entry -> older -> newer = entry -> newer;
+  else oldest = entry -> newer;
+  entry -> linked = 0;
+  used -= entry -> cost;
+  entry -> cost = 0;
+  if (!entry -> refs)
+    __destroy (entry);
+  return;
+}
+
+/* move an entry to the front of the lru list (lock held) */
+static void
+__touch (plbody entry)
+{
+  if (entry == newest)
+    return;
+  entry -> newer -> older = entry -> older;
+  if (entry -> older != NULL) entry -> older -> newer = entry -> newer;
+  else oldest = entry -> newer;
+  entry -> older = newest;
+  entry -> newer = NULL;
+  newest -> newer = entry;
+  newest = entry;
+  return;
+}
+
+/*
+ * look for the playlist of key under host, rendered from the given
+ * library generation. on a hit *body holds a reference to the entry.
+ * on a miss *body is a fresh pending entry: the caller must render it
+ * and hand it over with plcache_fill (or give up with plcache_abandon
+ * or plcache_toobig). concurrent lookups of a pending entry wait for its
+ * outcome. PLCACHE_STREAM means the playlist is known to be too large
+ * to be cached. returns an error code if no memory is available.
+ */
+int
+plcache_lookup (char *key, char *host, unsigned int generation, plbody *body)
+{
+  plbody entry;
+  unsigned int hash = __hash (key, host);
+
+  pthread_mutex_lock (&plcache_lock);
+ Retry:
+  for (entry = table [hash % PLCACHE_BUCKETS]; entry != NULL;
+       entry = entry -> chain)
+    if (entry -> hash == hash && !strcmp (entry -> key, key)
+        && !strcmp (entry -> host, host))
+      break;
+
+  if (entry != NULL && entry -> generation < generation
+      && entry -> state != ENTRY_PENDING) { /* library changed since */
+    __unlink (entry);
+    entry = NULL;
+  }
+  if (entry != NULL) {
+    if (entry -> state == ENTRY_PENDING) {
+      entry -> refs ++;
+      while (entry -> state == ENTRY_PENDING)
+        pthread_cond_wait (&plcache_cond, &plcache_lock);
+      entry -> refs --;
+      if (entry -> state == ENTRY_FAILED
+          || entry -> generation < generation) {
+        if (!entry -> linked && !entry -> refs)
+          __destroy (entry);
+        goto Retry;
+      }
+    }
+    if (entry -> state == ENTRY_TOOBIG) {
+      if (!entry -> linked && !entry -> refs)
+        __destroy (entry);
+      else if (entry -> linked)
+        __touch (entry);
+      pthread_mutex_unlock (&plcache_lock);
+      return PLCACHE_STREAM;
+    }
+    entry -> refs ++;
+    if (entry -> linked)
+      __touch (entry);
+    pthread_mutex_unlock (&plcache_lock);
+    *body = entry;
+    return PLCACHE_HIT;
+  }
+
+  /* a miss: this thread renders the playlist */
+  if ((entry = (plbody) calloc (1, sizeof (struct PlaylistBody))) == NULL
+      || (entry -> key = strdup (key)) == NULL
+      || (entry -> host = strdup (host)) == NULL) {
+    if (entry != NULL) {
+      if (entry -> key != NULL) free (entry -> key);
+      free (entry);
+    }
+    pthread_mutex_unlock (&plcache_lock);
+    return (MS_errno = MSE_NOMEM);
+  }
+  entry -> hash = hash;
+  entry -> generation = generation;
+  entry -> state = ENTRY_PENDING;
+  entry -> refs = 1;
+  entry -> linked = 1;
+  entry -> chain = table [hash % PLCACHE_BUCKETS];
+  table [hash % PLCACHE_BUCKETS] = entry;
+  entry -> older = newest;
+  if (newest != NULL) newest -> newer = entry;
+  else oldest = entry;
+  newest = entry;
+  pthread_mutex_unlock (&plcache_lock);
+
+  *body = entry;
+  return PLCACHE_MISS;
+}
+
+/*
+ * hand over the rendered body of a pending entry (data is now owned by
+ * the cache) and wake up anyone waiting for it. bodies that would not
+ * fit in the budget are given to the waiters but not kept.
+ */
+void
+plcache_fill (plbody entry, char *data, size_t length)
+{
+  plbody victim, next;
+
+  pthread_mutex_lock (&plcache_lock);
+  entry -> data = data;
+  entry -> length = length;
+  entry -> state = ENTRY_READY;
+  if (__cost (entry) > plcache_limit ())
+    __unlink (entry);
+  else {
+    entry -> cost = __cost (entry);
+    used += entry -> cost;
+    /* evict the least recently used playlists until it all fits */
+    for (victim = oldest; used > budget && victim != NULL; victim = next) {
+      next = victim -> newer;
+      if (victim != entry && victim -> state != ENTRY_PENDING)
+        __unlink (victim);
+    }
+  }
+  pthread_cond_broadcast (&plcache_cond);
+  pthread_mutex_unlock (&plcache_lock);
+  return;
+}
+
+/*
+ * the playlist of a pending entry is too large to be kept: remember so
+ * (until the library changes), so that lookups stream it on their own
+ * instead of waiting. drops the caller's reference.
+ */
+void
+plcache_toobig (plbody entry)
+{
+  pthread_mutex_lock (&plcache_lock);
+  entry -> state = ENTRY_TOOBIG;
+  entry -> refs --;
+  if (entry -> linked) {
+    entry -> cost = __cost (entry);
+    used += entry -> cost;
+  }
+  else if (!entry -> refs)
+    __destroy (entry);
+  pthread_cond_broadcast (&plcache_cond);
+  pthread_mutex_unlock (&plcache_lock);
+  return;
+}
+
+/* largest body the cache will keep */
+size_t
+plcache_limit (void)
+{
+  return budget / 4;
+}
+
+/* give up rendering a pending entry; one of the waiters will retry */
+void
+plcache_abandon (plbody entry)
+{
+  pthread_mutex_lock (&plcache_lock);
+  entry -> state = ENTRY_FAILED;
+  entry -> refs --;
+  __unlink (entry);
+  pthread_cond_broadcast (&plcache_cond);
+  pthread_mutex_unlock (&plcache_lock);
+  return;
+}
+
+/* drop a reference taken by plcache_lookup */
+void
+plcache_release (plbody entry)
+{
+  pthread_mutex_lock (&plcache_lock);
+  if (!-- entry -> refs && !entry -> linked)
+    __destroy (entry);
+  pthread_mutex_unlock (&plcache_lock);
+  return;
+}
+
+char *
+plcache_data (plbody entry)
+{
+  return entry -> data;
+}
+
+size_t
+plcache_length (plbody entry)
+{
+  return entry -> length;
+}
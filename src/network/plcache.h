@@ -0,0 +1,23 @@
+# ifndef __PLAYLIST_CACHE_LIB__
+# define __PLAYLIST_CACHE_LIB__
+
+# include <stddef.h>
+
+typedef struct PlaylistBody *plbody;
+
+  /* outcome of a lookup */
+# define PLCACHE_HIT    1
+# define PLCACHE_MISS   2
+# define PLCACHE_STREAM 3
+
+int    plcache_init     (size_t);
+int    plcache_lookup   (char *, char *, unsigned int, plbody *);
+void   plcache_fill     (plbody, char *, size_t);
+void   plcache_abandon  (plbody);
+void   plcache_toobig   (plbody);
+size_t plcache_limit    (void);
+void   plcache_release  (plbody);
+char*  plcache_data     (plbody);
+size_t plcache_length   (plbody);
+
+# endif
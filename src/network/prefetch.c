@@ -0,0 +1,161 @@
+/* prefetch.c: reading ahead the next tracks of the playlists sent */
+# include <string.h>
+# include <time.h>
+# include <unistd.h>
+# include <fcntl.h>
+# include <pthread.h>
+
+# include "../mstream/mserrors.h"
+# include "../playlist/songtable.h"
+# include "../playlist/playlist.h"
+# include "prefetch.h"
+
+  /* clients whose last playlist is remembered */
+# define PREFETCH_CLIENTS 64
+# define PREFETCH_PEERLEN 64
+  /* tracks read ahead of the one playing */
+# define PREFETCH_TRACKS  3
+  /* bytes read ahead of each */
+# define PREFETCH_BYTES   (256 * 1024)
+  /* songs waiting to be read ahead, more are dropped */
+# define PREFETCH_QUEUE   64
+
+/* the last playlist sent to a client */
+struct PrefetchClient {
+  char    peer [PREFETCH_PEERLEN];
+  int     songs [PREFETCH_SONGS];
+  int     count;   /* -1: the whole library, in library order */
+  time_t  used;
+};
+
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  prefetch_cond = PTHREAD_COND_INITIALIZER;
+static struct PrefetchClient clients [PREFETCH_CLIENTS];
+static int queue [PREFETCH_QUEUE], queued = 0, head = 0;
+
+/* queue a song to be read ahead, unless it already is (lock held) */
+static void
+__queue (int song)
+{
+  int i;
+
+  if (song < 0 || queued == PREFETCH_QUEUE)
+    return;
+  for (i = 0; i < queued; i ++)
+    if (queue [(head + i) % PREFETCH_QUEUE] == song)
+      return;
+  queue [(head + queued ++) % PREFETCH_QUEUE] = song;
+  pthread_cond_signal (&prefetch_cond);
+  return;
+}
+
+/* the reader: hints the kernel to read in the start of queued songs */
+static void *
+__prefetcher (void *arg)
+{
+  songtable songs;
+  int song, fd;
+
+  for (; ;) {
+    pthread_mutex_lock (&prefetch_lock);
+    while (!queued)
+      pthread_cond_wait (&prefetch_cond, &prefetch_lock);
+    song = queue [head];
+    head = (head + 1) % PREFETCH_QUEUE;
+    queued --;
+    pthread_mutex_unlock (&prefetch_lock);
+
+    /* opening may block as well on slow disks: it is done here too */
+    songs = library_acquire ();
+    if (song < songtable_length (songs)
+        && (fd = songtable_open (songs, song)) >= 0) {
+      posix_fadvise (fd, 0, PREFETCH_BYTES, POSIX_FADV_WILLNEED);
+      close (fd);
+    }
+    library_release (songs);
+  }
+  return NULL;
+}
+
+/* start the reader thread */
+int
+prefetch_init (void)
+{
+  pthread_attr_t attr;
+  pthread_t tid;
+
+  if ((MS_pthread_errno = pthread_attr_init (&attr))
+      || (MS_pthread_errno =
+            pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED))
+      || (MS_pthread_errno = pthread_create (&tid, &attr, &__prefetcher,
+                                             NULL))) {
+    pthread_attr_destroy (&attr);
+    return (MS_errno = MSE_PTHREAD);
+  }
+  pthread_attr_destroy (&attr);
+  return MSE_OK;
+}
+
+/* the playlist remembered for peer, NULL if there is none (lock held) */
+static struct PrefetchClient *
+__client (char *peer)
+{
+  int i;
+
+  for (i = 0; i < PREFETCH_CLIENTS; i ++)
+    if (clients [i] . used && !strcmp (clients [i] . peer, peer))
+      return &clients [i];
+  return NULL;
+}
+
+/*
+ * remember the first songs of a playlist just sent to peer (count -1:
+ * the whole library), and read ahead its first tracks
+ */
+void
+prefetch_playlist (char *peer, int *songs, int count)
+{
+  struct PrefetchClient *client;
+  int i;
+
+  if (*peer == '\0' || strlen (peer) >= PREFETCH_PEERLEN)
+    return;
+  pthread_mutex_lock (&prefetch_lock);
+  if ((client = __client (peer)) == NULL) { /* replace the oldest one */
+    client = &clients [0];
+    for (i = 1; i < PREFETCH_CLIENTS; i ++)
+      if (clients [i] . used < client -> used)
+        client = &clients [i];
+    strcpy (client -> peer, peer);
+  }
+  client -> used = time (NULL);
+  client -> count = count > PREFETCH_SONGS ? PREFETCH_SONGS : count;
+  if (count > 0)
+    memcpy (client -> songs, songs, client -> count * sizeof (int));
+  for (i = 0; i < PREFETCH_TRACKS; i ++)
+    __queue (count < 0 ? i : i < count ? songs [i] : -1);
+  pthread_mutex_unlock (&prefetch_lock);
+  return;
+}
+
+/* peer asked for song: read ahead the tracks after it in its playlist */
+void
+prefetch_next (char *peer, int song)
+{
+  struct PrefetchClient *client;
+  int i, at;
+
+  pthread_mutex_lock (&prefetch_lock);
+  if ((client = __client (peer)) != NULL) {
+    if (client -> count < 0)
+      at = song;
+    else
+      for (at = 0; at < client -> count && client -> songs [at] != song; at ++)
+        ;
+    for (i = 1; i <= PREFETCH_TRACKS; i ++)
+      __queue (client -> count < 0 ? at + i
+               : at + i < client -> count ? client -> songs [at + i] : -1);
+  }
+  pthread_mutex_unlock (&prefetch_lock);
+  return;
+}
@@ -0,0 +1,17 @@
+# ifndef __PREFETCH_LIB__
+# define __PREFETCH_LIB__
+
+/*
+ * the last playlist each client was sent is remembered, and the first
+ * bytes of the tracks it is likely to play next are read in the
+ * background, so that the next track starts without waiting on the disk.
+ */
+
+  /* songs of a playlist remembered */
+# define PREFETCH_SONGS 256
+
+int  prefetch_init     (void);
+void prefetch_playlist (char *, int *, int);
+void prefetch_next     (char *, int);
+
+# endif
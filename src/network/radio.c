@@ -0,0 +1,470 @@
+/* radio.c: stations playing server side playlists to many listeners */
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <errno.h>
+# include <limits.h>
+# include <time.h>
+# include <unistd.h>
+# include <fcntl.h>
+# include <pthread.h>
+# include <sys/types.h>
+# include <sys/stat.h>
+# include <sys/socket.h>
+
+# include "../mstream/mserrors.h"
+# include "../sharedlib/strmod.h"
+# include "../sharedlib/url_codec.h"
+# include "../playlist/songtable.h"
+# include "../playlist/playlist.h"
+# include "../playlist/tags.h"
+# include "../playlist/seek.h"
+# include "radio.h"
+
+  /* bytes of a station kept for its listeners, laggards further behind
+     are dropped */
+# define RADIO_RING   (512 * 1024)
+  /* bytes sent at once to listeners tuning in, for players to fill up */
+# define RADIO_BURST  (64 * 1024)
+  /* milliseconds between two reads of a station */
+# define RADIO_TICK   100
+  /* most bytes read at once */
+# define RADIO_CHUNK  (64 * 1024)
+  /* frame starts remembered, where listeners tuning in may start from */
+# define RADIO_SYNCS  64
+# define RADIO_TITLE  256
+
+/* a listener, sent the stream from its own position on */
+struct Listener {
+  int                 fd;
+  unsigned long long  pos;        /* of the next byte to send */
+  int                 icy;        /* wants metadata every RADIO_METAINT */
+  int                 until;      /* audio bytes left before the next */
+  unsigned char       meta [1 + 16 * 255];
+  int                 metalen, metasent;
+  unsigned int        titled;     /* title last sent */
+  struct Listener    *next;
+};
+
+struct Station {
+  char               *name;
+  char              **paths;      /* the playlist: client paths */
+  int                 count, track;
+  pthread_mutex_t     lock;
+  pthread_cond_t      cond;
+  struct Listener    *listeners;
+  unsigned char       ring [RADIO_RING];
+  unsigned long long  head;       /* bytes of the stream read so far */
+  unsigned long long  syncs [RADIO_SYNCS];
+  int                 nsyncs;
+  char                title [RADIO_TITLE];
+  unsigned int        titled;     /* bumped with every title */
+  station             next;
+};
+
+/* the song playing on a station */
+struct Track {
+  int                 fd;
+  off_t               off, end;
+  int                 rate;       /* kbit/s */
+  struct timespec     started;    /* when reading at rate started */
+  unsigned long long  read;       /* since then */
+};
+
+static pthread_mutex_t radio_lock = PTHREAD_MUTEX_INITIALIZER;
+static char   *radio_dir = NULL;
+static station stations = NULL;
+
+/* stations are looked for in dir, NULL for none */
+int
+radio_init (char *dir)
+{
+  if (dir != NULL && (radio_dir = strdup (dir)) == NULL)
+    return (MS_errno = MSE_NOMEM);
+  return MSE_OK;
+}
+
+static long
+__elapsed (struct timespec *since)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - since -> tv_sec) * 1000
+         + (now.tv_nsec - since -> tv_nsec) / 1000000;
+}
+
+/*
+ * read the playlist of a station: lines as the playlists of the server
+ * have them ("http://" host path), or bare paths. NULL if there is no
+ * such station.
+ */
+static station
+__load (char *name)
+{
+  station s;
+  char *path, *text, *line, *end, **grown;
+  struct stat st;
+  int fd;
+
+  if ((path = Sprintf ("%s/%s.m3u", radio_dir, name)) == NULL)
+    return NULL;
+  fd = open (path, O_RDONLY);
+  free (path);
+  if (fd < 0 || fstat (fd, &st) < 0
+      || (text = (char *) malloc (st.st_size + 1)) == NULL) {
+    if (fd >= 0) close (fd);
+    MS_errno = fd < 0 ? MSE_OK : MSE_NOMEM;
+    return NULL;
+  }
+  if (read (fd, text, st.st_size) != st.st_size) {
+    close (fd);
+    free (text);
+    MS_errno = MSE_OS;
+    return NULL;
+  }
+  close (fd);
+  text [st.st_size] = '\0';
+
+  if ((s = (station) calloc (1, sizeof (struct Station))) == NULL
+      || (s -> name = strdup (name)) == NULL) {
+    if (s != NULL) free (s);
+    free (text);
+    MS_errno = MSE_NOMEM;
+    return NULL;
+  }
+  for (line = text; *line != '\0'; line = end) {
+    if ((end = strchr (line, '\n')) != NULL) *end ++ = '\0';
+    else end = line + strlen (line);
+    if (*line != '\0' && line [strlen (line) - 1] == '\r')
+      line [strlen (line) - 1] = '\0';
+    if (!strncmp (line, "http://", strlen ("http://"))
+        && (line = strchr (line + strlen ("http://"), '/')) == NULL)
+      continue;
+    if (*line != '/')
+      continue;
+    if ((grown = (char **) realloc (s -> paths, (s -> count + 1)
+                                                * sizeof (char *))) == NULL
+        || (grown [s -> count] = strdup (line)) == NULL) {
+      if (grown != NULL) s -> paths = grown;
+      break;
+    }
+    s -> paths = grown;
+    s -> count ++;
+  }
+  free (text);
+  pthread_mutex_init (&s -> lock, NULL);
+  pthread_cond_init (&s -> cond, NULL);
+  return s;
+}
+
+static void
+__free (station s)
+{
+  while (s -> count)
+    free (s -> paths [-- s -> count]);
+  if (s -> paths != NULL) free (s -> paths);
+  pthread_mutex_destroy (&s -> lock);
+  pthread_cond_destroy (&s -> cond);
+  free (s -> name);
+  free (s);
+  return;
+}
+
+/* set the title of a station, as artist - title or its file's name */
+static void
+__title (station s, songtable songs, int song)
+{
+  stags tags = songtable_tags (songs, song);
+  char *artist = tags_field (tags, TAG_ARTIST), *title, *cursor;
+
+  title = tags_field (tags, TAG_TITLE);
+  if (*title == '\0') {
+    title = strrchr (songtable_client_path (songs, song), '/') + 1;
+    artist = "";
+  }
+  snprintf (s -> title, RADIO_TITLE, "%s%s%s", artist,
+            *artist != '\0' ? " - " : "", title);
+  /* quotes would end the title of the metadata */
+  for (cursor = s -> title; (cursor = strchr (cursor, '\'')) != NULL; )
+    *cursor = '`';
+  s -> titled ++;
+  return;
+}
+
+/*
+ * open the next mp3 of a station's playlist, skipping its tags, songs
+ * gone from the library and songs of other formats (they could not be
+ * played as one stream). -1 if none of them is there.
+ */
+static int
+__next (station s, struct Track *t)
+{
+  songtable songs = library_acquire ();
+  unsigned char h [4];
+  int tries, song, bitrate, samplerate, samples;
+  struct stat st;
+
+  t -> fd = -1;
+  for (tries = 0; tries < s -> count && t -> fd < 0; tries ++) {
+    song = songtable_find (songs, s -> paths [s -> track]);
+    s -> track = (s -> track + 1) % s -> count;
+    if (song < 0 || strcmp (songtable_content (songs, song), "audio/mpeg")
+        || (t -> fd = songtable_open (songs, song)) < 0)
+      continue;
+    if (fstat (t -> fd, &st) < 0) {
+      close (t -> fd);
+      t -> fd = -1;
+      continue;
+    }
+    seek_mpeg_frames (t -> fd, st.st_size, &t -> off, &t -> end);
+    /* played at its average bitrate, or at its first frame's */
+    if (!(t -> rate = tags_bitrate (songtable_tags (songs, song))))
+      t -> rate = pread (t -> fd, h, 4, t -> off) == 4
+                  && seek_mpeg_header (h, &bitrate, &samplerate, &samples)
+                  ? bitrate : 128;
+    clock_gettime (CLOCK_MONOTONIC, &t -> started);
+    t -> read = 0;
+    pthread_mutex_lock (&s -> lock);
+    __title (s, songs, song);
+    pthread_mutex_unlock (&s -> lock);
+  }
+  library_release (songs);
+  return t -> fd;
+}
+
+/* append to the ring of a station what was read, noting a frame start */
+static void
+__append (station s, unsigned char *data, size_t len)
+{
+  size_t at = s -> head % RADIO_RING, i;
+  int bitrate, samplerate, samples;
+
+  for (i = 0; i + 4 <= len; i ++)
+    if (data [i] == 0xff
+        && seek_mpeg_header (data + i, &bitrate, &samplerate, &samples)) {
+      s -> syncs [s -> nsyncs ++ % RADIO_SYNCS] = s -> head + i;
+      break;
+    }
+  if (at + len > RADIO_RING) {
+    memcpy (s -> ring + at, data, RADIO_RING - at);
+    memcpy (s -> ring, data + RADIO_RING - at, len - (RADIO_RING - at));
+  }
+  else memcpy (s -> ring + at, data, len);
+  s -> head += len;
+  return;
+}
+
+/* the metadata block a listener is to be sent next */
+static void
+__metadata (station s, struct Listener *l)
+{
+  int len;
+
+  l -> metasent = 0;
+  if (l -> titled == s -> titled) { /* nothing new: an empty block */
+    l -> meta [0] = 0;
+    l -> metalen = 1;
+    return;
+  }
+  memset (l -> meta, '\0', sizeof (l -> meta));
+  len = snprintf ((char *) l -> meta + 1, sizeof (l -> meta) - 1,
+                  "StreamTitle='%s';", s -> title);
+  l -> meta [0] = (len + 15) / 16;
+  l -> metalen = 1 + 16 * l -> meta [0];
+  l -> titled = s -> titled;
+  return;
+}
+
+/*
+ * send a listener as much of the stream as its socket takes without
+ * blocking. -1 if it is to be dropped: gone, or too far behind.
+ */
+static int
+__send (station s, struct Listener *l)
+{
+  size_t at, len;
+  ssize_t sent;
+
+  for (; ;) {
+    if (l -> metalen) {
+      if ((sent = send (l -> fd, l -> meta + l -> metasent,
+                        l -> metalen - l -> metasent,
+                        MSG_DONTWAIT | MSG_NOSIGNAL)) < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+      if ((l -> metasent += sent) < l -> metalen)
+        return 0;
+      l -> metalen = 0;
+    }
+    if (l -> pos == s -> head)
+      return 0;
+    if (l -> pos + RADIO_RING < s -> head)
+      return -1;
+    at = l -> pos % RADIO_RING;
+    len = s -> head - l -> pos;
+    if (len > RADIO_RING - at) len = RADIO_RING - at;
+    if (l -> icy && len > l -> until) len = l -> until;
+    if ((sent = send (l -> fd, s -> ring + at, len,
+                      MSG_DONTWAIT | MSG_NOSIGNAL)) < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    l -> pos += sent;
+    if (l -> icy && !(l -> until -= sent)) {
+      __metadata (s, l);
+      l -> until = RADIO_METAINT;
+    }
+  }
+}
+
+/*
+ * the thread of a station: reads its songs at their bitrate, a tick at
+ * a time, and sends what was read to every listener. it pauses while
+ * nobody listens.
+ */
+static void *
+__broadcast (void *arg)
+{
+  station s = (station) arg;
+  struct Listener *l, **link;
+  struct Track track;
+  struct timespec tick = {0, RADIO_TICK * 1000000L};
+  unsigned char *chunk;
+  long long due;
+  ssize_t got;
+
+  if ((chunk = (unsigned char *) malloc (RADIO_CHUNK)) == NULL)
+    return NULL;
+  track.fd = -1;
+  for (; ;) {
+    pthread_mutex_lock (&s -> lock);
+    if (s -> listeners == NULL) {
+      while (s -> listeners == NULL)
+        pthread_cond_wait (&s -> cond, &s -> lock);
+      clock_gettime (CLOCK_MONOTONIC, &track.started);
+      track.read = 0;
+    }
+    pthread_mutex_unlock (&s -> lock);
+
+    if (track.fd < 0 && __next (s, &track) < 0) {
+      nanosleep (&tick, NULL); /* nothing to play, for now */
+      continue;
+    }
+    /* read what is due by now */
+    due = (long long) __elapsed (&track.started) * track.rate / 8
+          - track.read;
+    if (due > RADIO_CHUNK) due = RADIO_CHUNK;
+    if (due > track.end - track.off) due = track.end - track.off;
+    got = due > 0 ? pread (track.fd, chunk, due, track.off) : 0;
+    if (got < 0 || (due > 0 && !got) || track.off + got >= track.end) {
+      close (track.fd);
+      track.fd = -1;
+    }
+    if (got < 0)
+      got = 0;
+    track.off += got;
+    track.read += got;
+
+    pthread_mutex_lock (&s -> lock);
+    __append (s, chunk, got);
+    for (link = &s -> listeners; (l = *link) != NULL; )
+      if (__send (s, l) < 0) {
+        *link = l -> next;
+        close (l -> fd);
+        free (l);
+      }
+      else link = &l -> next;
+    pthread_mutex_unlock (&s -> lock);
+
+    if (track.fd >= 0)
+      nanosleep (&tick, NULL);
+  }
+  return NULL;
+}
+
+/*
+ * the station called name (url encoded), started if it was not playing
+ * yet. *s is set to NULL if there is no such station.
+ */
+int
+radio_tune (char *name, station *s)
+{
+  char decoded [NAME_MAX + 1];
+  pthread_attr_t attr;
+  pthread_t tid;
+
+  *s = NULL;
+  if (radio_dir == NULL)
+    return MSE_OK;
+  if (url_decode (name, decoded, NAME_MAX + 1 - strlen (".m3u"), 0) < 0
+      || *decoded == '\0' || *decoded == '.' || strchr (decoded, '/') != NULL)
+    return MSE_OK;
+
+  pthread_mutex_lock (&radio_lock);
+  for (*s = stations; *s != NULL && strcmp ((*s) -> name, decoded);
+       *s = (*s) -> next)
+    ;
+  if (*s != NULL) {
+    pthread_mutex_unlock (&radio_lock);
+    return MSE_OK;
+  }
+  MS_errno = MSE_OK;
+  if ((*s = __load (decoded)) == NULL) {
+    pthread_mutex_unlock (&radio_lock);
+    return MS_errno;
+  }
+  if ((MS_pthread_errno = pthread_attr_init (&attr))
+      || (MS_pthread_errno =
+            pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED))
+      || (MS_pthread_errno = pthread_create (&tid, &attr, &__broadcast, *s))) {
+    pthread_attr_destroy (&attr);
+    pthread_mutex_unlock (&radio_lock);
+    __free (*s);
+    *s = NULL;
+    return (MS_errno = MSE_PTHREAD);
+  }
+  pthread_attr_destroy (&attr);
+  (*s) -> next = stations;
+  stations = *s;
+  pthread_mutex_unlock (&radio_lock);
+  return MSE_OK;
+}
+
+char *
+radio_name (station s)
+{
+  return s -> name;
+}
+
+/*
+ * have the station send its stream to fd (handed over), from a frame
+ * start up to RADIO_BURST bytes back, so that players start at once.
+ * icy: metadata is to be sent along.
+ */
+int
+radio_listen (station s, int fd, int icy)
+{
+  struct Listener *l;
+  int i;
+
+  if ((l = (struct Listener *) calloc (1, sizeof (struct Listener))) == NULL) {
+    close (fd);
+    return (MS_errno = MSE_NOMEM);
+  }
+  l -> fd = fd;
+  l -> icy = icy;
+  l -> until = RADIO_METAINT;
+
+  pthread_mutex_lock (&s -> lock);
+  l -> pos = s -> head;
+  for (i = s -> nsyncs > RADIO_SYNCS ? s -> nsyncs - RADIO_SYNCS : 0;
+       i < s -> nsyncs; i ++)
+    if (s -> syncs [i % RADIO_SYNCS] + RADIO_BURST >= s -> head) {
+      l -> pos = s -> syncs [i % RADIO_SYNCS];
+      break;
+    }
+  l -> titled = s -> titled - 1; /* the title goes with the first block */
+  l -> next = s -> listeners;
+  s -> listeners = l;
+  pthread_cond_signal (&s -> cond);
+  pthread_mutex_unlock (&s -> lock);
+  return MSE_OK;
+}
@@ -0,0 +1,20 @@
+# ifndef __RADIO_LIB__
+# define __RADIO_LIB__
+
+/*
+ * radio stations: server side playlists (<station>.m3u files in the
+ * directory given with -r) played in real time, every listener of a
+ * station hearing the same thing at once. a station reads its songs once,
+ * into a ring that a single thread sends to all of its listeners.
+ */
+typedef struct Station *station;
+
+  /* audio bytes between two icy metadata blocks */
+# define RADIO_METAINT 16000
+
+int   radio_init   (char *);
+int   radio_tune   (char *, station *);
+char* radio_name   (station);
+int   radio_listen (station, int, int);
+
+# endif
@@ -3,6 +3,9 @@
 # include <stdlib.h>
 # include <string.h>
 # include <unistd.h>
+# include <errno.h>
+# include <fcntl.h>
+# include <poll.h>
 # include <sys/types.h>
 # include <sys/socket.h>
 # include <netdb.h>
@@ -20,10 +23,14 @@ extern int listenfd; /* the listening socket descriptor */
 int addrlen = sizeof (struct sockaddr_in);
   /* a mutex used to lock acceptance of connections between threads */
 pthread_mutex_t mlock = PTHREAD_MUTEX_INITIALIZER;
+  /* written to once the threads are to stop accepting connections */
+static int drainfds [2] = {-1, -1};
 
 /*
  * open up port #portid and start listening to it for incoming connections.
  * return a socket descriptor if succesfull, an error code otherwise.
+ * the socket is nonblocking: it may be handed over to a new server, and
+ * shared with it while this one finishes its streams.
  */
 int
 network_init (int portid)
@@ -57,6 +64,7 @@ network_init (int portid)
     close (sockfd);
     return (MS_errno = MSE_LISTEN);
   }
+  fcntl (sockfd, F_SETFL, fcntl (sockfd, F_GETFL) | O_NONBLOCK);
 
   return sockfd;
 }
@@ -95,6 +103,7 @@ serve_client (void *arg)
 {
   struct sockaddr *cliaddr;
   socklen_t        clilen;
+  struct pollfd    ready [2];
   int              connfd;
   char            *peername;
   HTTPRequest      request;
@@ -111,8 +120,25 @@ serve_client (void *arg)
     clilen = addrlen;
     memset (cliaddr, '\0', addrlen);
 
-    pthread_mutex_lock (&mlock); /* lock connection acceptance */
-    connfd = accept (listenfd, cliaddr, &clilen);
+    /*
+     * lock connection acceptance. a connection may be taken by another
+     * server sharing the socket first: wait for the next one then, or
+     * else for the server to drain.
+     */
+    pthread_mutex_lock (&mlock);
+    ready [0].fd = listenfd;
+    ready [1].fd = drainfds [0];
+    ready [0].events = ready [1].events = POLLIN;
+    do {
+      if (poll (ready, 2, -1) > 0 && ready [1].revents) {
+        pthread_mutex_unlock (&mlock);
+        free (cliaddr);
+        return NULL;
+      }
+      clilen = addrlen;
+      connfd = accept (listenfd, cliaddr, &clilen);
+    } while (connfd < 0
+             && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR));
     pthread_mutex_unlock (&mlock); /* unlock it */
 
     /* if an error happened report it and go on */
@@ -174,6 +200,10 @@ create_threadpool (pthread_t **thread_tids, int thread_tnum)
   *thread_tids = (pthread_t *) calloc (thread_tnum, sizeof (pthread_t));
   if (*thread_tids == NULL)
     return (MS_errno = MSE_NOMEM);
+  if (pipe (drainfds) < 0) {
+    free (*thread_tids);
+    return (MS_errno = MSE_OS);
+  }
 
   for (i = 0; i < thread_tnum; i ++)
     /* 
@@ -189,3 +219,19 @@ create_threadpool (pthread_t **thread_tids, int thread_tnum)
   return MSE_OK;
 }
 
+
+/*
+ * stop accepting connections (a new server took over the socket) and
+ * wait for the thread_tnum threads of the pool to finish serving theirs
+ */
+int
+network_drain (pthread_t *thread_tids, int thread_tnum)
+{
+  int i;
+
+  if (write (drainfds [1], "", 1) != 1)
+    return (MS_errno = MSE_OS);
+  for (i = 0; i < thread_tnum; i ++)
+    pthread_join (thread_tids [i], NULL);
+  return MSE_OK;
+}
@@ -3,5 +3,6 @@
 
 int network_init (int);
 int create_threadpool (pthread_t **, int);
+int network_drain (pthread_t *, int);
 
 # endif
@@ -0,0 +1,374 @@
+/* songcache.c: cache of song files, keyed by their index in the library */
+# include <stdlib.h>
+# include <string.h>
+# include <unistd.h>
+# include <time.h>
+# include <pthread.h>
+# include <sys/types.h>
+# include <sys/stat.h>
+
+# include "../mstream/mserrors.h"
+# include "songcache.h"
+
+# define SONGCACHE_BUCKETS 1024
+  /* counters per row of the popularity sketch, a power of 2 */
+# define SKETCH_WIDTH      4096
+# define SKETCH_ROWS       4
+  /* plays counted before every count is halved, so that popularity fades */
+# define SKETCH_WINDOW     (10 * SKETCH_WIDTH)
+  /* seconds a song kept is trusted to be its file before it is looked at */
+# define SONGCACHE_CHECK   2
+
+/*
+ * a song file kept in memory. entries live in a hash table and in an lru
+ * list, and are reference counted so that a body can be sent while it
+ * is evicted. an entry out of the table is freed with its last reference.
+ * entries are filled as their song is sent, before they are let in. a
+ * file replaced or removed on the disk is told by its inode, size & time,
+ * checked every SONGCACHE_CHECK seconds at most.
+ */
+struct SongBody {
+  int       song;
+  char     *data;
+  size_t    length;
+  dev_t     dev;
+  ino_t     ino;
+  time_t    mtime;
+  time_t    checked;
+  int       refs;
+  int       linked;       /* still in the table */
+  int       filling;      /* not let in yet */
+  songbody  chain;        /* next entry of the bucket */
+  songbody  newer, older; /* lru list */
+};
+
+static pthread_mutex_t songcache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static songbody *table = NULL;
+static songbody  newest = NULL, oldest = NULL;
+static size_t    budget = 0;
+static size_t    filling = 0; /* bytes of the entries being filled */
+static struct SongCacheStats stats;
+
+/*
+ * how often songs were asked for lately, songs kept or not: a count-min
+ * sketch, where a song's count is the least of its counters (tinylfu)
+ */
+static unsigned char sketch [SKETCH_ROWS][SKETCH_WIDTH];
+static int sketched = 0;
+
+int
+songcache_init (size_t bytes)
+{
+  if ((table = (songbody *) calloc (SONGCACHE_BUCKETS, sizeof (songbody)))
+      == NULL)
+    return (MS_errno = MSE_NOMEM);
+  budget = bytes;
+  return MSE_OK;
+}
+
+/* the counter of song in a row of the sketch */
+static unsigned char *
+__counter (int song, int row)
+{
+  static const unsigned int seeds [SKETCH_ROWS] =
+    {0x9e3779b1, 0x85ebca6b, 0xc2b2ae35, 0x27d4eb2f};
+  unsigned int h = (song + 1) * seeds [row];
+
+  h ^= h >> 15;
+  h *= 0x2c1b3c6d;
+  h ^= h >> 12;
+  return &sketch [row][h & (SKETCH_WIDTH - 1)];
+}
+
+/* count a request for song (lock held) */
+static void
+__count (int song)
+{
+  unsigned char *c;
+  int row, i;
+
+  for (row = 0; row < SKETCH_ROWS; row ++)
+    if (*(c = __counter (song, row)) < 255)
+      (*c) ++;
+  if (++ sketched < SKETCH_WINDOW)
+    return;
+  for (row = 0; row < SKETCH_ROWS; row ++)
+    for (i = 0; i < SKETCH_WIDTH; i ++)
+      sketch [row][i] >>= 1;
+  sketched = 0;
+  return;
+}
+
+/* how often song was asked for lately (lock held) */
+static int
+__frequency (int song)
+{
+  int row, least = 255;
+
+  for (row = 0; row < SKETCH_ROWS; row ++)
+    if (*__counter (song, row) < least)
+      least = *__counter (song, row);
+  return least;
+}
+
+static songbody
+__find (int song)
+{
+  songbody entry;
+
+  for (entry = table [song % SONGCACHE_BUCKETS]; entry != NULL;
+       entry = entry -> chain)
+    if (entry -> song == song)
+      break;
+  return entry;
+}
+
+static void
+__destroy (songbody entry)
+{
+  free (entry -> data);
+  free (entry);
+  return;
+}
+
+/* take an entry off the table and the lru list (lock held) */
+static void
+__unlink (songbody entry)
+{
+  songbody *link;
+
+  for (link = &table [entry -> song % SONGCACHE_BUCKETS]; *link != entry;
+       link = &(*link) -> chain)
+    ;
+  *link = entry -> chain;
+  if (entry -> newer != NULL) entry -> newer -> older = entry -> older;
+  else newest = entry -> older;
+  if (entry -> older != NULL) entry -> older -> newer = entry -> newer;
+  else oldest = entry -> newer;
+  entry -> linked = 0;
+  stats.used -= entry -> length;
+  stats.songs --;
+  if (!entry -> refs)
+    __destroy (entry);
+  return;
+}
+
+/* move an entry to the front of the lru list (lock held) */
+static void
+__touch (songbody entry)
+{
+  if (entry == newest)
+    return;
+  entry -> newer -> older = entry -> older;
+  if (entry -> older != NULL) entry -> older -> newer = entry -> newer;
+  else oldest = entry -> newer;
+  entry -> older = newest;
+  entry -> newer = NULL;
+  newest -> newer = entry;
+  newest = entry;
+  return;
+}
+
+/*
+ * whether a song of that length and frequency deserves a place: there
+ * is room for it, or the least recently used songs it would push out
+ * are asked for less often (lock held)
+ */
+static int
+__admits (size_t length, int frequency)
+{
+  songbody victim;
+  size_t freed = budget - stats.used;
+
+  for (victim = oldest; freed < length && victim != NULL;
+       victim = victim -> newer) {
+    if (__frequency (victim -> song) >= frequency)
+      return 0;
+    freed += victim -> length;
+  }
+  return freed >= length;
+}
+
+/*
+ * the file of song in songs, if it is kept (held until songcache_release),
+ * NULL otherwise. either way the request is counted.
+ */
+songbody
+songcache_lookup (songtable songs, int song)
+{
+  songbody entry;
+  struct stat st;
+  time_t now = time (NULL);
+  int check = 0, stale;
+
+  pthread_mutex_lock (&songcache_lock);
+  __count (song);
+  if ((entry = __find (song)) == NULL)
+    stats.misses ++;
+  else if (now < entry -> checked + SONGCACHE_CHECK) {
+    entry -> refs ++;
+    __touch (entry);
+    stats.hits ++;
+    stats.saved += entry -> length;
+  }
+  else {
+    entry -> refs ++;
+    entry -> checked = now; /* by this thread alone */
+    check = 1;
+  }
+  pthread_mutex_unlock (&songcache_lock);
+  if (!check)
+    return entry;
+
+  stale = songtable_stat (songs, song, &st) < 0
+          || st.st_dev != entry -> dev || st.st_ino != entry -> ino
+          || (size_t) st.st_size != entry -> length
+          || st.st_mtime != entry -> mtime;
+  pthread_mutex_lock (&songcache_lock);
+  if (stale) { /* replaced or removed since: those sending it keep it */
+    if (entry -> linked)
+      __unlink (entry);
+    stats.misses ++;
+  }
+  else {
+    if (entry -> linked)
+      __touch (entry);
+    stats.hits ++;
+    stats.saved += entry -> length;
+  }
+  pthread_mutex_unlock (&songcache_lock);
+  if (stale) {
+    songcache_release (entry);
+    return NULL;
+  }
+  return entry;
+}
+
+/*
+ * after a miss, an entry for the file of song, open at fd, if it deserves
+ * a place: it is held, to be filled (songcache_data) as the file is sent,
+ * and let in by songcache_fill. NULL if it is not kept.
+ */
+songbody
+songcache_admit (int song, int fd)
+{
+  songbody entry;
+  struct stat st;
+
+  if (budget == 0 || fstat (fd, &st) < 0 || st.st_size == 0
+      || st.st_size > budget / 4)
+    return NULL;
+  pthread_mutex_lock (&songcache_lock);
+  if (__find (song) != NULL || filling + st.st_size > budget
+      || !__admits (st.st_size, __frequency (song))) {
+    pthread_mutex_unlock (&songcache_lock);
+    return NULL;
+  }
+  filling += st.st_size;
+  pthread_mutex_unlock (&songcache_lock);
+
+  if ((entry = (songbody) calloc (1, sizeof (struct SongBody))) == NULL
+      || (entry -> data = (char *) malloc (st.st_size)) == NULL) {
+    if (entry != NULL) free (entry);
+    pthread_mutex_lock (&songcache_lock);
+    filling -= st.st_size;
+    pthread_mutex_unlock (&songcache_lock);
+    return NULL;
+  }
+  entry -> song = song;
+  entry -> length = st.st_size;
+  entry -> dev = st.st_dev;
+  entry -> ino = st.st_ino;
+  entry -> mtime = st.st_mtime;
+  entry -> checked = time (NULL);
+  entry -> refs = 1;
+  entry -> filling = 1;
+  return entry;
+}
+
+/*
+ * let in an entry of songcache_admit, once its data is the whole file,
+ * if it still deserves a place (things may have changed meanwhile). it
+ * stays held.
+ */
+void
+songcache_fill (songbody entry)
+{
+  pthread_mutex_lock (&songcache_lock);
+  if (!entry -> filling) {
+    pthread_mutex_unlock (&songcache_lock);
+    return;
+  }
+  entry -> filling = 0;
+  filling -= entry -> length;
+  if (__find (entry -> song) != NULL
+      || !__admits (entry -> length, __frequency (entry -> song))) {
+    pthread_mutex_unlock (&songcache_lock);
+    return; /* freed once released */
+  }
+  while (budget - stats.used < entry -> length)
+    __unlink (oldest);
+  entry -> linked = 1;
+  entry -> chain = table [entry -> song % SONGCACHE_BUCKETS];
+  table [entry -> song % SONGCACHE_BUCKETS] = entry;
+  entry -> older = newest;
+  if (newest != NULL) newest -> newer = entry;
+  else oldest = entry;
+  newest = entry;
+  stats.used += entry -> length;
+  stats.songs ++;
+  pthread_mutex_unlock (&songcache_lock);
+  return;
+}
+
+/* how often song was asked for lately */
+int
+songcache_frequency (int song)
+{
+  int frequency;
+
+  pthread_mutex_lock (&songcache_lock);
+  frequency = __frequency (song);
+  pthread_mutex_unlock (&songcache_lock);
+  return frequency;
+}
+
+/*
+ * drop a reference taken by songcache_lookup or songcache_admit: an entry
+ * released before it was filled is let go of
+ */
+void
+songcache_release (songbody entry)
+{
+  pthread_mutex_lock (&songcache_lock);
+  if (entry -> filling) {
+    entry -> filling = 0;
+    filling -= entry -> length;
+  }
+  if (!-- entry -> refs && !entry -> linked)
+    __destroy (entry);
+  pthread_mutex_unlock (&songcache_lock);
+  return;
+}
+
+char *
+songcache_data (songbody entry)
+{
+  return entry -> data;
+}
+
+size_t
+songcache_length (songbody entry)
+{
+  return entry -> length;
+}
+
+void
+songcache_stats (struct SongCacheStats *s)
+{
+  pthread_mutex_lock (&songcache_lock);
+  *s = stats;
+  pthread_mutex_unlock (&songcache_lock);
+  return;
+}
@@ -0,0 +1,34 @@
+# ifndef __SONG_CACHE_LIB__
+# define __SONG_CACHE_LIB__
+
+# include <stddef.h>
+
+# include "../playlist/songtable.h"
+
+/*
+ * the files of the songs played most are kept in memory, to be sent
+ * without touching the disk. songs are let in only if they are played
+ * more often than the ones they would push out, and are copied in as
+ * they are sent. files replaced or removed on the disk are let go of,
+ * once noticed.
+ */
+typedef struct SongBody *songbody;
+
+struct SongCacheStats {
+  unsigned long      hits, misses;
+  unsigned long long saved;     /* bytes sent from memory */
+  size_t             used;      /* bytes kept */
+  int                songs;     /* kept */
+};
+
+int      songcache_init    (size_t);
+songbody songcache_lookup  (songtable, int);
+songbody songcache_admit   (int, int);
+void     songcache_fill    (songbody);
+void     songcache_release (songbody);
+int      songcache_frequency (int);
+char*    songcache_data    (songbody);
+size_t   songcache_length  (songbody);
+void     songcache_stats   (struct SongCacheStats *);
+
+# endif
@@ -0,0 +1,143 @@
+/* upgrade.c: handing the server over to a new build of it */
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <unistd.h>
+# include <sys/types.h>
+# include <sys/socket.h>
+# include <sys/resource.h>
+
+# include "../mstream/mserrors.h"
+# include "upgrade.h"
+
+/*
+ * start a new build of the server, as this one was started (argv) but
+ * for the option -U, telling it the unix socket it is handed the
+ * listening socket on, and the library saved in libfd (-1 for none).
+ * returns once the new server serves, an error if it did not start.
+ */
+int
+upgrade_start (char **argv, int listenfd, int libfd)
+{
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec iov;
+  struct rlimit rl;
+  char control [CMSG_SPACE (2 * sizeof (int))], **args, number [16], fds;
+  int sv [2], argc, i, n, fd;
+  pid_t pid;
+
+  for (argc = 0; argv [argc] != NULL; argc ++)
+    ;
+  if ((args = (char **) calloc (argc + 3, sizeof (char *))) == NULL)
+    return (MS_errno = MSE_NOMEM);
+  /* a server upgraded already was handed its socket with -U */
+  for (i = n = 0; i < argc; i ++)
+    if (!strcmp (argv [i], "-U"))
+      i ++;
+    else if (strncmp (argv [i], "-U", strlen ("-U")))
+      args [n ++] = argv [i];
+  if (socketpair (AF_UNIX, SOCK_STREAM, 0, sv) < 0) {
+    free (args);
+    return (MS_errno = MSE_SOCKET);
+  }
+  sprintf (number, "%d", sv [1]);
+  args [n ++] = "-U";
+  args [n] = number;
+
+  fflush (stdout); /* or the child would print it again */
+  if ((pid = fork ()) < 0) {
+    close (sv [0]);
+    close (sv [1]);
+    free (args);
+    return (MS_errno = MSE_FORK);
+  }
+  if (pid == 0) {
+    /* streams of this server are not the new one's to hold open */
+    if (getrlimit (RLIMIT_NOFILE, &rl) < 0)
+      rl.rlim_cur = 1024;
+    for (fd = 3; fd < rl.rlim_cur; fd ++)
+      if (fd != sv [1])
+        close (fd);
+    execvp (args [0], args);
+    perror ("[--] Unable to start the new server");
+    _exit (EXIT_FAILURE);
+  }
+  close (sv [1]);
+  free (args);
+
+  /* the descriptors go along a byte telling how many they are */
+  fds = libfd >= 0 ? 2 : 1;
+  memset (&msg, 0, sizeof (msg));
+  memset (control, 0, sizeof (control));
+  iov.iov_base = &fds;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = CMSG_SPACE (fds * sizeof (int));
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg -> cmsg_level = SOL_SOCKET;
+  cmsg -> cmsg_type = SCM_RIGHTS;
+  cmsg -> cmsg_len = CMSG_LEN (fds * sizeof (int));
+  memcpy (CMSG_DATA (cmsg), &listenfd, sizeof (int));
+  if (libfd >= 0)
+    memcpy (CMSG_DATA (cmsg) + sizeof (int), &libfd, sizeof (int));
+  if (sendmsg (sv [0], &msg, MSG_NOSIGNAL) != 1) {
+    close (sv [0]);
+    return (MS_errno = MSE_UPGRADE);
+  }
+
+  /* a byte once it serves, the end of the stream if it exited */
+  if (read (sv [0], &fds, 1) != 1) {
+    close (sv [0]);
+    return (MS_errno = MSE_UPGRADE);
+  }
+  close (sv [0]);
+  return MSE_OK;
+}
+
+/*
+ * the new server's side: take the listening socket, and the library if
+ * one was saved (else *libfd is -1), handed over on sock
+ */
+int
+upgrade_receive (int sock, int *listenfd, int *libfd)
+{
+  struct msghdr msg;
+  struct cmsghdr *cmsg;
+  struct iovec iov;
+  char control [CMSG_SPACE (2 * sizeof (int))], fds;
+
+  *listenfd = *libfd = -1;
+  memset (&msg, 0, sizeof (msg));
+  iov.iov_base = &fds;
+  iov.iov_len = 1;
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control;
+  msg.msg_controllen = sizeof (control);
+  if (recvmsg (sock, &msg, 0) != 1
+      || (cmsg = CMSG_FIRSTHDR (&msg)) == NULL
+      || cmsg -> cmsg_level != SOL_SOCKET || cmsg -> cmsg_type != SCM_RIGHTS
+      || cmsg -> cmsg_len < CMSG_LEN (sizeof (int)))
+    return (MS_errno = MSE_UPGRADE);
+  memcpy (listenfd, CMSG_DATA (cmsg), sizeof (int));
+  if (fds == 2 && cmsg -> cmsg_len >= CMSG_LEN (2 * sizeof (int)))
+    memcpy (libfd, CMSG_DATA (cmsg) + sizeof (int), sizeof (int));
+  return MSE_OK;
+}
+
+/* tell the old server this one serves: it is to drain now */
+int
+upgrade_ready (int sock)
+{
+  char ready = 1;
+
+  if (write (sock, &ready, 1) != 1) {
+    close (sock);
+    return (MS_errno = MSE_UPGRADE);
+  }
+  close (sock);
+  return MSE_OK;
+}
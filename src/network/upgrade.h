@@ -0,0 +1,14 @@
+# ifndef __UPGRADE_LIB__
+# define __UPGRADE_LIB__
+
+/*
+ * a server is upgraded by starting a new build of it (SIGUSR2), which
+ * is handed the listening socket, and the songs of the library if it is
+ * built, on a unix socket. the new server tells when it serves; the old
+ * one then stops accepting connections and finishes those it has.
+ */
+int upgrade_start   (char **, int, int);
+int upgrade_receive (int, int *, int *);
+int upgrade_ready   (int);
+
+# endif
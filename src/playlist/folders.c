@@ -0,0 +1,225 @@
+/* folders.c: the folder tree of the library */
+# include <stdlib.h>
+# include <string.h>
+
+# include "../mstream/mserrors.h"
+# include "songtable.h"
+# include "folders.h"
+
+/*
+ * folders are kept in the order they were scanned: each one is followed
+ * by the folders below it, its subfolders first among them. its songs
+ * are contiguous too, its own ones coming first.
+ */
+struct Folders {
+  int            count, size;
+  unsigned int  *name;          /* pool offset of the (raw) name */
+  int           *descendants;   /* folders below, that follow it */
+  int           *first;         /* songs: [first, own) are its own, */
+  int           *own;           /* [first, last) are all below it */
+  int           *last;
+  char          *pool;
+  size_t         poollen, poolsize;
+};
+
+/* add a folder named name [0, len) under parent, its songs from song on */
+static int
+__open (folders tree, char *name, int len, int parent, int song)
+{
+  char *grown;
+  void *column;
+  size_t poolsize;
+  int size, f = tree -> count;
+
+  if (tree -> count == tree -> size) {
+    size = tree -> size ? 2 * tree -> size : 256;
+    if ((column = realloc (tree -> name, size * sizeof (int))) == NULL)
+      return (MS_errno = MSE_NOMEM);
+    tree -> name = column;
+    if ((column = realloc (tree -> descendants, size * sizeof (int))) == NULL)
+      return (MS_errno = MSE_NOMEM);
+    tree -> descendants = column;
+    if ((column = realloc (tree -> first, size * sizeof (int))) == NULL)
+      return (MS_errno = MSE_NOMEM);
+    tree -> first = column;
+    if ((column = realloc (tree -> own, size * sizeof (int))) == NULL)
+      return (MS_errno = MSE_NOMEM);
+    tree -> own = column;
+    if ((column = realloc (tree -> last, size * sizeof (int))) == NULL)
+      return (MS_errno = MSE_NOMEM);
+    tree -> last = column;
+    tree -> size = size;
+  }
+  if (tree -> poollen + len + 1 > tree -> poolsize) {
+    poolsize = 2 * tree -> poolsize + len + 1 + 4096;
+    if ((grown = (char *) realloc (tree -> pool, poolsize)) == NULL)
+      return (MS_errno = MSE_NOMEM);
+    tree -> pool = grown;
+    tree -> poolsize = poolsize;
+  }
+  memcpy (tree -> pool + tree -> poollen, name, len);
+  tree -> pool [tree -> poollen + len] = '\0';
+  tree -> name [f] = tree -> poollen;
+  tree -> poollen += len + 1;
+
+  tree -> first [f] = song;
+  tree -> own [f] = -1;
+  if (parent >= 0 && tree -> own [parent] < 0) /* its own songs end here */
+    tree -> own [parent] = song;
+  tree -> count ++;
+  return MSE_OK;
+}
+
+/* the open folders deeper than level are complete, up to song */
+static void
+__close (folders tree, int *open, int *depth, int level, int song)
+{
+  int f;
+
+  while (*depth > level) {
+    f = open [-- *depth];
+    tree -> last [f] = song;
+    if (tree -> own [f] < 0)
+      tree -> own [f] = song;
+    tree -> descendants [f] = tree -> count - f - 1;
+  }
+  return;
+}
+
+/*
+ * rebuild the folder tree out of the songs of a (sealed) library, which
+ * were added folder by folder: going through their paths, folders open
+ * as they are entered and close as they are left.
+ */
+folders
+folders_build (songtable songs)
+{
+  folders tree;
+  char *path, *prev = NULL, *name, *end, *folder;
+  int *open, *grown, size = 64, depth = 0, song, count, d, len, prevlen = 0;
+
+  if ((tree = (folders) calloc (1, sizeof (struct Folders))) == NULL
+      || (open = (int *) malloc (size * sizeof (int))) == NULL) {
+    if (tree != NULL) free (tree);
+    MS_errno = MSE_NOMEM;
+    return NULL;
+  }
+  if (__open (tree, "", 0, -1, 0) != MSE_OK)
+    goto ErrorEpilogue;
+  open [depth ++] = 0;
+
+  for (song = 0, count = songtable_length (songs); song < count; song ++) {
+    path = songtable_server_path (songs, song);
+    len = strrchr (path, '/') - path;
+    if (prev != NULL && len == prevlen && !memcmp (path, prev, len))
+      continue; /* still in the same folder */
+    prev = path;
+    prevlen = len;
+
+    /* follow the open folders as long as the path does */
+    for (d = 1, name = path + 1; name <= path + len; d ++, name = end + 1) {
+      if ((end = memchr (name, '/', path + len - name)) == NULL)
+        end = path + len;
+      folder = d < depth ? tree -> pool + tree -> name [open [d]] : NULL;
+      if (folder != NULL && strlen (folder) == end - name
+          && !memcmp (folder, name, end - name))
+        continue;
+      __close (tree, open, &depth, d, song);
+      if (depth == size) {
+        size *= 2;
+        if ((grown = (int *) realloc (open, size * sizeof (int))) == NULL) {
+          MS_errno = MSE_NOMEM;
+          goto ErrorEpilogue;
+        }
+        open = grown;
+      }
+      if (__open (tree, name, end - name, open [depth - 1], song) != MSE_OK)
+        goto ErrorEpilogue;
+      open [depth ++] = tree -> count - 1;
+    }
+    __close (tree, open, &depth, d, song);
+  }
+  __close (tree, open, &depth, 0, songtable_length (songs));
+  free (open);
+  return tree;
+
+ ErrorEpilogue:
+  free (open);
+  folders_free (tree);
+  return NULL;
+}
+
+/*
+ * the subfolder of f after child (the first one if child < 0), -1 when
+ * there are no more.
+ */
+int
+folders_child (folders tree, int f, int child)
+{
+  child = child < 0 ? f + 1 : child + tree -> descendants [child] + 1;
+  return child <= f + tree -> descendants [f] ? child : -1;
+}
+
+/*
+ * the folder at a (decoded) path under the music directory, eg
+ * "/Artist/Album", -1 if there is none. "" and "/" are the root.
+ */
+int
+folders_find (folders tree, char *path)
+{
+  char *end;
+  int f = 0, child, len;
+
+  for (; *path != '\0'; path = *end ? end + 1 : end) {
+    if ((end = strchr (path, '/')) == NULL)
+      end = path + strlen (path);
+    if ((len = end - path) == 0)
+      continue;
+    for (child = folders_child (tree, f, -1); child >= 0;
+         child = folders_child (tree, f, child))
+      if (!strncmp (tree -> pool + tree -> name [child], path, len)
+          && tree -> pool [tree -> name [child] + len] == '\0')
+        break;
+    if ((f = child) < 0)
+      return -1;
+  }
+  return f;
+}
+
+/* the name of a folder, as it is on the disk */
+char *
+folders_name (folders tree, int f)
+{
+  return tree -> pool + tree -> name [f];
+}
+
+/* the songs of a folder: [first, own) its own, [first, last) all below */
+void
+folders_songs (folders tree, int f, int *first, int *own, int *last)
+{
+  *first = tree -> first [f];
+  *own = tree -> own [f];
+  *last = tree -> last [f];
+  return;
+}
+
+/* memory used by the folder tree */
+size_t
+folders_bytes (folders tree)
+{
+  return sizeof (struct Folders) + tree -> poolsize
+         + tree -> size * 5 * sizeof (int);
+}
+
+void
+folders_free (folders tree)
+{
+  if (tree -> name != NULL) free (tree -> name);
+  if (tree -> descendants != NULL) free (tree -> descendants);
+  if (tree -> first != NULL) free (tree -> first);
+  if (tree -> own != NULL) free (tree -> own);
+  if (tree -> last != NULL) free (tree -> last);
+  if (tree -> pool != NULL) free (tree -> pool);
+  free (tree);
+  return;
+}
@@ -0,0 +1,22 @@
+# ifndef __FOLDER_TREE_LIB__
+# define __FOLDER_TREE_LIB__
+
+# include <stddef.h>
+# include "songtable.h"
+
+/*
+ * the folders of the library, as they were scanned: each one holds a
+ * range of songs (its own, then its subfolders'), for songs are added
+ * folder by folder. folder 0 is the music directory itself.
+ */
+typedef struct Folders *folders;
+
+folders folders_build (songtable);
+int     folders_find  (folders, char *);
+int     folders_child (folders, int, int);
+char*   folders_name  (folders, int);
+void    folders_songs (folders, int, int *, int *, int *);
+size_t  folders_bytes (folders);
+void    folders_free  (folders);
+
+# endif
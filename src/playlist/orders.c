@@ -0,0 +1,213 @@
+/* orders.c: the library sorted by each field, shared by searches */
+# include <stdlib.h>
+# include <string.h>
+# include <strings.h>
+# include <pthread.h>
+
+# include "../mstream/mserrors.h"
+# include "songtable.h"
+# include "tags.h"
+# include "shards.h"
+# include "playlist.h"
+# include "orders.h"
+
+/*
+ * order [sort] holds the songs as that sort returns them, and rank
+ * [sort] [song] where the songs tying with song start in it: comparing
+ * two songs is comparing their ranks.
+ */
+struct Orders {
+  songtable        songs;
+  pthread_mutex_t  lock;
+  int             *order [SORT_COUNT];
+  int             *rank [SORT_COUNT];
+};
+
+/* a sort of the library, its shards sorted in parallel */
+struct OrderSort {
+  songtable songs;
+  int       sort;
+  int      *order, *spare;
+  int       ends [SHARD_MAX];  /* where each sorted shard ends */
+};
+
+orders
+orders_init (songtable songs)
+{
+  orders all;
+
+  if ((all = (orders) calloc (1, sizeof (struct Orders))) == NULL) {
+    MS_errno = MSE_NOMEM;
+    return NULL;
+  }
+  all -> songs = songs;
+  pthread_mutex_init (&all -> lock, NULL);
+  return all;
+}
+
+/* order two songs by a sort field alone, 0 when they tie */
+int
+orders_compare (songtable songs, int a, int b, int sort)
+{
+  stags ta, tb;
+  char *fa, *fb;
+
+  if (sort == SORT_PATH)
+    return strcmp (songtable_client_path (songs, a),
+                   songtable_client_path (songs, b));
+  ta = songtable_tags (songs, a);
+  tb = songtable_tags (songs, b);
+  switch (sort) {
+  case SORT_ADDED: /* newest first */
+    return tags_added (ta) < tags_added (tb) ? 1
+           : tags_added (ta) > tags_added (tb) ? -1 : 0;
+  case SORT_DURATION:
+    return tags_duration (ta) - tags_duration (tb);
+  case SORT_BITRATE:
+    return tags_bitrate (ta) - tags_bitrate (tb);
+  default: /* a text field, songs without it go last */
+    fa = tags_field (ta, sort - SORT_ARTIST + TAG_ARTIST);
+    fb = tags_field (tb, sort - SORT_ARTIST + TAG_ARTIST);
+    if (*fa == '\0' || *fb == '\0')
+      return (*fa == '\0') - (*fb == '\0');
+    return strcasecmp (fa, fb);
+  }
+}
+
+/* merge the sorted src [lo, mid) & [mid, hi) into dst, ties from the left */
+static void
+__merge (struct OrderSort *s, int *src, int *dst, int lo, int mid, int hi)
+{
+  int i = lo, j = mid, m = lo;
+
+  while (i < mid && j < hi)
+    dst [m ++] = orders_compare (s -> songs, src [j], src [i], s -> sort) < 0
+                 ? src [j ++] : src [i ++];
+  while (i < mid)
+    dst [m ++] = src [i ++];
+  while (j < hi)
+    dst [m ++] = src [j ++];
+  return;
+}
+
+/* sort a shard of the library in place (a merge sort, so it is stable) */
+static void
+__sort_shard (void *arg, int shard, int first, int last)
+{
+  struct OrderSort *s = (struct OrderSort *) arg;
+  int *src = s -> order, *dst = s -> spare, *tmp, width, lo, mid, hi;
+
+  for (lo = first; lo < last; lo ++)
+    src [lo] = lo;
+  for (width = 1; width < last - first; width *= 2) {
+    for (lo = first; lo < last; lo += 2 * width) {
+      mid = lo + width < last ? lo + width : last;
+      hi = mid + width < last ? mid + width : last;
+      __merge (s, src, dst, lo, mid, hi);
+    }
+    tmp = src;
+    src = dst;
+    dst = tmp;
+  }
+  if (src != s -> order)
+    memcpy (s -> order + first, src + first, (last - first) * sizeof (int));
+  s -> ends [shard] = last;
+  return;
+}
+
+/* the library in a sort order, and the ranks of its songs in it */
+static int
+__build (orders all, int sort)
+{
+  struct OrderSort s;
+  int count = songtable_length (all -> songs), runs, i, r, lo, *tmp, *rank;
+
+  s.songs = all -> songs;
+  s.sort = sort;
+  s.order = (int *) malloc ((count + 1) * sizeof (int));
+  s.spare = (int *) malloc ((count + 1) * sizeof (int));
+  if (s.order == NULL || s.spare == NULL) {
+    if (s.order != NULL) free (s.order);
+    if (s.spare != NULL) free (s.spare);
+    return (MS_errno = MSE_NOMEM);
+  }
+  runs = shards_count (count);
+  shards_run (count, __sort_shard, &s);
+
+  /* then merge the shards, two by two */
+  while (runs > 1) {
+    for (r = i = 0, lo = 0; r < runs; r += 2, i ++) {
+      if (r + 1 < runs)
+        __merge (&s, s.order, s.spare, lo, s.ends [r], s.ends [r + 1]);
+      else
+        memcpy (s.spare + lo, s.order + lo, (s.ends [r] - lo) * sizeof (int));
+      lo = s.ends [i] = s.ends [r + 1 < runs ? r + 1 : r];
+    }
+    runs = i;
+    tmp = s.order;
+    s.order = s.spare;
+    s.spare = tmp;
+  }
+
+  /* the spare room now holds the ranks */
+  rank = s.spare;
+  for (i = 0; i < count; i ++)
+    rank [s.order [i]] = i > 0 && !orders_compare (all -> songs,
+                                                   s.order [i - 1],
+                                                   s.order [i], sort)
+                         ? rank [s.order [i - 1]] : i;
+  all -> order [sort] = s.order;
+  all -> rank [sort] = rank;
+  return MSE_OK;
+}
+
+/*
+ * the songs in a sort order, and in *rank where the ties of each one
+ * start in it. NULL while the order may still change, that is until the
+ * tags it sorts by are all extracted, or if it could not be built.
+ */
+int *
+orders_get (orders all, int sort, int **rank)
+{
+  int *order = NULL;
+
+  if (all == NULL || sort <= SORT_NONE || sort >= SORT_COUNT
+      || (sort != SORT_PATH && !tags_complete (all -> songs)))
+    return NULL;
+  pthread_mutex_lock (&all -> lock);
+  if (all -> order [sort] != NULL || __build (all, sort) == MSE_OK) {
+    order = all -> order [sort];
+    *rank = all -> rank [sort];
+  }
+  pthread_mutex_unlock (&all -> lock);
+  return order;
+}
+
+/* memory used by the orders built so far */
+size_t
+orders_bytes (orders all)
+{
+  size_t bytes = sizeof (struct Orders);
+  int sort;
+
+  pthread_mutex_lock (&all -> lock);
+  for (sort = 0; sort < SORT_COUNT; sort ++)
+    if (all -> order [sort] != NULL)
+      bytes += 2 * (songtable_length (all -> songs) + 1) * sizeof (int);
+  pthread_mutex_unlock (&all -> lock);
+  return bytes;
+}
+
+void
+orders_free (orders all)
+{
+  int sort;
+
+  for (sort = 0; sort < SORT_COUNT; sort ++) {
+    if (all -> order [sort] != NULL) free (all -> order [sort]);
+    if (all -> rank [sort] != NULL) free (all -> rank [sort]);
+  }
+  pthread_mutex_destroy (&all -> lock);
+  free (all);
+  return;
+}
@@ -0,0 +1,20 @@
+# ifndef __SORT_ORDERS_LIB__
+# define __SORT_ORDERS_LIB__
+
+# include <stddef.h>
+# include "songtable.h"
+
+/*
+ * the songs of a (sealed) library in each sort order, built the first
+ * time one is asked for and then shared, read-only, by every search of
+ * that library. the songs tying in an order keep library order.
+ */
+typedef struct Orders *orders;
+
+orders  orders_init    (songtable);
+int*    orders_get     (orders, int, int **);
+int     orders_compare (songtable, int, int, int);
+size_t  orders_bytes   (orders);
+void    orders_free    (orders);
+
+# endif
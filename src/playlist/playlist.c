@@ -1,12 +1,32 @@
 /* playlist.c: build & search library */
+# define _GNU_SOURCE
+# include <stdio.h>
 # include <stdlib.h>
 # include <string.h>
+# include <limits.h>
+# include <time.h>
+# include <unistd.h>
 # include <dirent.h>
+# include <pthread.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
 
-# include "../sharedlib/dhlist.h"
 # include "../sharedlib/strmod.h"
+# include "../sharedlib/url_codec.h"
+# include "../sharedlib/fold.h"
 # include "../mstream/mserrors.h"
-# include "spack.h"
+# include "songtable.h"
+# include "tags.h"
+# include "wordindex.h"
+# include "query.h"
+# include "shards.h"
+# include "suggest.h"
+# include "folders.h"
+# include "orders.h"
+# include "playlist.h"
+
+  /* at least that many seconds between two snapshots of the library */
+# define SNAPSHOT_INTERVAL 1.0
 
 static int
 __eliminate_dots (const struct dirent *entry)
@@ -36,157 +56,1009 @@ issong (char *filename)
 }
 
 /*
- * scan the given directory: save each directory entry in the directories
- * list and each song in the files list.
+ * the library is scanned in the background while clients are served:
+ * songs are added to a table being built, and sealed copies of it are
+ * published as directories complete. songs are always added in the
+ * same order (each directory's songs, then its subdirectories'), so a
+ * song keeps its index from one snapshot to the next.
  */
+static songtable building = NULL;   /* the table songs are added to */
+static songtable current = NULL;    /* the latest snapshot published */
+static pthread_mutex_t current_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct LibraryProgress progress;
+static struct timespec started, last_published;
+static double publish_cost;          /* seconds the last snapshot took */
+static int snapshot_huge;
+
+static double
+__elapsed (struct timespec *since)
+{
+  struct timespec now;
+
+  clock_gettime (CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - since -> tv_sec)
+         + (now.tv_nsec - since -> tv_nsec) / 1e9;
+}
+
+/* index a sealed table and make it the library searches & lookups see */
+static int
+__publish (songtable snapshot)
+{
+  songtable old;
+  wordindex words;
+  suggest completions;
+  folders tree;
+  orders sorted;
+
+  if ((words = wordindex_build (snapshot)) == NULL) {
+    songtable_free (snapshot);
+    return MS_errno;
+  }
+  songtable_set_words (snapshot, words);
+  if ((completions = suggest_build (snapshot, words)) == NULL) {
+    songtable_free (snapshot);
+    return MS_errno;
+  }
+  songtable_set_suggest (snapshot, completions);
+  if ((tree = folders_build (snapshot)) == NULL) {
+    songtable_free (snapshot);
+    return MS_errno;
+  }
+  songtable_set_folders (snapshot, tree);
+  if ((sorted = orders_init (snapshot)) == NULL) {
+    songtable_free (snapshot);
+    return MS_errno;
+  }
+  songtable_set_orders (snapshot, sorted);
+
+  pthread_mutex_lock (&current_lock);
+  old = current;
+  current = snapshot;
+  pthread_mutex_unlock (&current_lock);
+  if (old != NULL) songtable_free (old);
+
+  progress.published = songtable_length (snapshot);
+  library_changed ();
+  return MSE_OK;
+}
+
+/*
+ * publish what was scanned so far, if it is worth it: once the songs
+ * found doubled, or every SNAPSHOT_INTERVAL seconds and at least four
+ * times the last snapshot's cost, so that snapshots take a small part
+ * of the scan whatever the size of the library.
+ */
+static int
+__snapshot (void)
+{
+  struct timespec start;
+  songtable snapshot;
+  double since = __elapsed (&last_published);
+
+  if (progress.songs == progress.published
+      || (progress.songs < 2 * progress.published
+          && (since < SNAPSHOT_INTERVAL || since < 4 * publish_cost)))
+    return MSE_OK;
+
+  clock_gettime (CLOCK_MONOTONIC, &start);
+  if ((snapshot = songtable_snapshot (building, snapshot_huge)) == NULL
+      || __publish (snapshot) != MSE_OK)
+    return MS_errno;
+  publish_cost = __elapsed (&start);
+  clock_gettime (CLOCK_MONOTONIC, &last_published);
+  return MSE_OK;
+}
+
+/*
+ * songs may be left out of the library: those whose path (relative to
+ * the root, as on the disk) keep rejects, eg belonging to other nodes
+ */
+static int (*keep) (char *) = NULL;
+
+void
+library_partition (int (*keeping) (char *))
+{
+  keep = keeping;
+  return;
+}
+
+/* add the songs under a directory, then consider publishing them */
 static int
-__get_dir_entries (char *directory, dhlist directories, dhlist files)
+__scan_directory (char *directory)
 {
   struct dirent **namelist;
-  char *songpath;
-  int i, length;
+  char *path;
+  int i, length, err = MSE_OK;
 
   length = scandir (directory, &namelist, __eliminate_dots, alphasort);
   if (length < 0)
     return (MS_errno = MSE_OS);
 
-  for (i = 0; i < length; i ++)
-    if (DT_DIR == namelist [i] -> d_type) { /* if entry is a directory */
-      if (!dhlist_append (directories, namelist [i])) {
-        MS_errno = MSE_NOMEM;
-        goto ErrorEpilogue;
-      }
+  /* its songs first */
+  for (i = 0; i < length && err == MSE_OK; i ++) {
+    if (DT_DIR == namelist [i] -> d_type
+        || !issong (namelist [i] -> d_name))
+      continue;
+    if ((path = Sprintf ("%s/%s", directory, namelist [i] -> d_name))
+        == NULL)
+      err = (MS_errno = MSE_NOMEM);
+    else {
+      if ((keep == NULL || keep (path + strlen (songtable_root (building))))
+          && (err = songtable_add (building, path)) == MSE_OK)
+        progress.songs ++;
+      free (path);
     }
-    else if (issong (namelist [i] -> d_name)) {
-      songpath = Sprintf ("%s/%s", directory, namelist [i] -> d_name);
-      if (songpath == NULL
-          || !dhlist_append (files, songpath)) {
-        MS_errno = MSE_NOMEM;
-        goto ErrorEpilogue;
-      }
+  }
+  /* then its subdirectories */
+  for (i = 0; i < length && err == MSE_OK; i ++) {
+    if (DT_DIR != namelist [i] -> d_type)
+      continue;
+    if ((path = Sprintf ("%s/%s", directory, namelist [i] -> d_name))
+        == NULL)
+      err = (MS_errno = MSE_NOMEM);
+    else {
+      err = __scan_directory (path);
+      free (path);
     }
-
-  return MSE_OK;
-
- ErrorEpilogue: /* free every resource used in case of error */
+  }
   for (i = 0; i < length; i ++)
     free (namelist [i]);
   free (namelist);
-  while (dhlist_length (directories))
-    dhlist_remove (directories, dhlist_first (directories));
-  while (dhlist_length (files))
-    dhlist_remove (files, dhlist_first (files));
-  return MS_errno;
+
+  if (err != MSE_OK)
+    return err;
+  progress.directories ++;
+  return __snapshot ();
 }
 
-/* get every song contained in a given directory and its subdirectories */
+/*
+ * start a library of the songs under directory: until it is built
+ * (build_library) an empty one is published.
+ */
+int
+library_init (char *directory)
+{
+  songtable empty;
+
+  clock_gettime (CLOCK_MONOTONIC, &started);
+  last_published = started;
+  if ((building = songtable_init (directory)) == NULL)
+    return MS_errno;
+  if ((empty = songtable_snapshot (building, 0)) == NULL
+      || __publish (empty) != MSE_OK) {
+    songtable_free (building);
+    building = NULL;
+    return MS_errno;
+  }
+  return MSE_OK;
+}
+
+/* seal the library once every song was added, and publish it for good */
 static int
-__get_all_songs (char *directory, dhlist *songs)
+__built (int huge)
 {
-  dhlist dirs, cur, subsongs;
-  struct dirent *dir;
-  char *name;
+  songtable songs;
 
-  if (!dhlist_init (songs) || !dhlist_init (&dirs))
-    return (MS_errno = MSE_NOMEM);
+  if (songtable_seal (building, huge) != MSE_OK)
+    return MS_errno;
+  songs = building;
+  building = NULL;
+  if (__publish (songs) != MSE_OK)
+    return MS_errno;
+  progress.ready = 1;
+  progress.seconds = __elapsed (&started);
+  return MSE_OK;
+}
 
-  if (__get_dir_entries (directory, dirs, *songs) != MSE_OK) {
-    dhlist_delete (dirs);
-    dhlist_delete (*songs);
+/*
+ * build the library by tracking each song under its directory, then
+ * seal it (huge: back it with huge pages). partial snapshots are
+ * published meanwhile.
+ */
+int
+build_library (int huge)
+{
+  snapshot_huge = huge;
+  if (__scan_directory (songtable_root (building)) != MSE_OK)
     return MS_errno;
-  }
+  return __built (huge);
+}
 
-  if (!dhlist_length (dirs)) {
-    dhlist_delete (dirs);
+/*
+ * save the songs of the library, once it is built, for a new server to
+ * take over (library_restore): the music directory, then the path of
+ * each song under it, each NUL terminated. *fd is a memory file holding
+ * them, -1 if the library is not built yet.
+ */
+int
+library_save (int *fd)
+{
+  songtable songs;
+  FILE *saved;
+  int i, dupfd;
+
+  *fd = -1;
+  if (!progress.ready)
     return MSE_OK;
+  if ((*fd = memfd_create ("library", MFD_CLOEXEC)) < 0
+      || (dupfd = dup (*fd)) < 0) {
+    if (*fd >= 0) close (*fd);
+    *fd = -1;
+    return (MS_errno = MSE_OS);
+  }
+  if ((saved = fdopen (dupfd, "w")) == NULL) {
+    close (dupfd);
+    close (*fd);
+    *fd = -1;
+    return (MS_errno = MSE_OS);
   }
+  songs = library_acquire ();
+  fwrite (songtable_root (songs), strlen (songtable_root (songs)) + 1, 1,
+          saved);
+  for (i = 0; i < songtable_length (songs); i ++)
+    fwrite (songtable_server_path (songs, i),
+            strlen (songtable_server_path (songs, i)) + 1, 1, saved);
+  library_release (songs);
+  if (fclose (saved) == EOF) {
+    close (*fd);
+    *fd = -1;
+    return (MS_errno = MSE_OS);
+  }
+  return MSE_OK;
+}
 
-  /* for each subdirectory */
-  for (cur = dhlist_first (dirs); cur != dhlist_end (dirs);
-       cur = dhlist_next (cur)) {
-    dir = (struct dirent *) dhlist_data (cur);
-    if ((name = Sprintf ("%s/%s", directory, dir -> d_name)) == NULL) {
-      dhlist_delete (dirs);
-      dhlist_delete (*songs);
-      return (MS_errno = MSE_NOMEM);
+/*
+ * build the library out of the songs saved by library_save in fd (by
+ * the server this one took over from), without scanning the disk: the
+ * songs are those of the same music directory, unless it changed, in
+ * which case it is scanned after all. fd is closed.
+ */
+int
+library_restore (int fd, int huge)
+{
+  struct stat st;
+  char *saved, *end, *path, *full;
+  char *root = songtable_root (building);
+  int err = MSE_OK;
+
+  if (fstat (fd, &st) < 0 || !st.st_size
+      || (saved = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0))
+         == MAP_FAILED) {
+    close (fd);
+    return build_library (huge);
+  }
+  close (fd);
+  end = saved + st.st_size;
+  if (end [-1] != '\0' || strcmp (saved, root)) { /* not these songs */
+    munmap (saved, st.st_size);
+    return build_library (huge);
+  }
+
+  snapshot_huge = huge;
+  for (path = saved + strlen (saved) + 1; path < end && err == MSE_OK;
+       path += strlen (path) + 1) {
+    if (keep != NULL && !keep (path))
+      continue;
+    if ((full = Sprintf ("%s%s", root, path)) == NULL)
+      err = (MS_errno = MSE_NOMEM);
+    else {
+      if ((err = songtable_add (building, full)) == MSE_OK)
+        progress.songs ++;
+      free (full);
     }
-    /* find recursively its songs */
-    if (__get_all_songs (name, &subsongs) != MSE_OK) {
-      free (name);
-      dhlist_delete (dirs);
-      dhlist_delete (*songs);
-      return MS_errno;
+  }
+  munmap (saved, st.st_size);
+  if (err != MSE_OK)
+    return err;
+  return __built (huge);
+}
+
+/* the library as published last, to be let go with library_release */
+songtable
+library_acquire (void)
+{
+  songtable songs;
+
+  pthread_mutex_lock (&current_lock);
+  songs = songtable_hold (current);
+  pthread_mutex_unlock (&current_lock);
+  return songs;
+}
+
+void
+library_release (songtable songs)
+{
+  songtable_free (songs);
+  return;
+}
+
+/*
+ * sort the library every way searches may order it, rather than when
+ * the first search asking for each order comes. the tags must all be
+ * read by then.
+ */
+int
+library_presort (void)
+{
+  songtable songs = library_acquire ();
+  int sort, *rank;
+
+  for (sort = SORT_PATH; sort < SORT_COUNT; sort ++)
+    if (orders_get (songtable_orders (songs), sort, &rank) == NULL) {
+      library_release (songs);
+      return (MS_errno = MSE_NOMEM);
     }
-    free (dir);
-    free (name);
-    dhlist_merge (*songs, subsongs);
+  library_release (songs);
+  return MSE_OK;
+}
+
+/* how far the scan of the library got */
+void
+library_progress (struct LibraryProgress *p)
+{
+  *p = progress;
+  if (!p -> ready)
+    p -> seconds = __elapsed (&started);
+  return;
+}
+
+  /* bumped whenever search results may have changed */
+static volatile unsigned int generation = 1;
+
+unsigned int
+library_generation (void)
+{
+  return generation;
+}
+
+void
+library_changed (void)
+{
+  __sync_fetch_and_add (&generation, 1);
+  return;
+}
+
+/* a search key, possibly scoped to a single tag field */
+struct SearchKey {
+  int   field;    /* a tag field, -1 for any field, -2 for the path only */
+  char *folded;   /* the (url decoded) key, folded */
+  int   len;
+  int   fuzzy;    /* "~key": the words of key, give or take a typo */
+  query query;    /* a boolean query over the words of paths, or NULL */
+  unsigned char *hits; /* indexed sorted searches: a bit per matching song */
+};
+
+/*
+ * keys are matched against folded text, so that "bjork" finds "Björk"
+ * in any of the places searched.
+ */
+static int
+match_search (songtable songs, int song, struct SearchKey *key)
+{
+  stags tags;
+  char *text;
+  int len;
+
+  if (key -> hits != NULL)
+    return key -> hits [song / 8] & (1 << (song % 8));
+  if (key -> field < 0) {
+    text = songtable_folded_path (songs, song, &len);
+    if (fold_find (text, len, key -> folded, key -> len) >= 0)
+      return 1;
+  }
+  if (key -> field == -2 || (tags = songtable_tags (songs, song)) == NULL)
+    return 0;
+  text = tags_folded (tags, key -> field, &len);
+  return fold_find (text, len, key -> folded, key -> len) >= 0;
+}
+
+/*
+ * split a "field:value" key. unscoped keys match the path or any tag,
+ * "path:" keys match only the path. "~" keys are fuzzy, and unscoped
+ * keys of several words are boolean queries.
+ */
+static int
+__parse_key (char *key, struct SearchKey *search)
+{
+  char *colon = NULL, *decoded;
+  int len = strlen (key) + 1;
+
+  search -> field = -1;
+  search -> query = NULL;
+  search -> hits = NULL;
+  if ((decoded = (char *) calloc (len, sizeof (char))) == NULL)
+    return (MS_errno = MSE_NOMEM);
+  if (url_decode (key, decoded, len, 0) < 0) {
+    free (decoded);
+    return (MS_errno = MSE_BADREQUEST);
+  }
+
+  if ((search -> fuzzy = decoded [0] == '~'))
+    memmove (decoded, decoded + 1, strlen (decoded));
+  else if ((colon = strchr (decoded, ':')) != NULL) {
+    *colon = '\0';
+    if (!strcmp (decoded, "path"))
+      search -> field = -2;
+    else if ((search -> field = tags_field_id (decoded)) < 0)
+      search -> field = -1;
+    *colon = ':';
+  }
+  if (search -> field != -1) /* keep only the value */
+    memmove (decoded, colon + 1, strlen (colon + 1) + 1);
+  else if (!search -> fuzzy && query_wanted (decoded)
+           && (search -> query = query_parse (decoded)) == NULL) {
+    free (decoded);
+    return MS_errno;
   }
 
-  dhlist_delete (dirs);
+  /* folding never lengthens it, so it is done in place */
+  search -> folded = decoded;
+  search -> len = fold_text (decoded, decoded, strlen (decoded) + 1);
+
   return MSE_OK;
 }
 
 /*
- * given a directory build the music library by tracking each
- * available song in a list.
+ * a search walked one match at a time, so that callers need not keep
+ * the whole result in memory. sorted searches keep only the best
+ * offset + limit matches (song indices), ranked up front; scans split
+ * in shards keep the first ones. sorted searches of every song are
+ * views of the library's order, shared by all of them.
  */
+struct SearchIter {
+  songtable            songs;
+  int                  cursor;
+  struct SearchKey     key;
+  int                  all;      /* empty key: every song matches */
+  struct SearchOptions opts;
+  int                  skipped, returned;
+  int                  upfront;  /* the page was ranked by search_open */
+  int                 *ranked;   /* and here it is */
+  int                  nranked, next;
+  int                 *order;    /* the library in the sort order, and */
+  int                 *rank;     /* where each song's ties start, or NULL */
+  int                  view;     /* the page is walked in order */
+  int                  start, stop; /* the ties walked, when reversed */
+};
+
+static char *sort_names [] = {"", "path", "added", "artist", "album",
+                              "title", "duration", "bitrate", NULL};
+
+/* map a sort name (eg "added") to its id, -1 if unknown */
 int
-build_library (char *directory, dhlist songs)
+search_sort_id (char *name)
 {
-  dhlist dirent_songs, cur;
-  char *songpath;
-  spack songinfo;
+  int i;
 
-  if (__get_all_songs (directory, &dirent_songs) != MSE_OK)
-    return MS_errno;
+  for (i = SORT_PATH; sort_names [i] != NULL; i ++)
+    if (!strcmp (name, sort_names [i]))
+      return i;
+  return -1;
+}
 
-  for (cur = dhlist_first (dirent_songs); cur != dhlist_end (dirent_songs);
-       cur = dhlist_next (cur)) {
-    songpath = (char *) dhlist_data (cur);
-    if ((songinfo = (spack) spack_init (songpath, directory)) == NULL) {
-      dhlist_delete (dirent_songs);
-      return MS_errno;
+/* order two matches: < 0 if a is to be returned before b */
+static int
+__rank_cmp (searchiter iter, int a, int b)
+{
+  int res;
+
+  if (iter -> rank != NULL)
+    res = iter -> rank [a] - iter -> rank [b];
+  else
+    res = orders_compare (iter -> songs, a, b, iter -> opts.sort);
+  if (iter -> opts.reverse)
+    res = -res;
+  return res ? res : a - b; /* ties keep library order */
+}
+
+/* restore the heap property (worst match on top) below node i */
+static void
+__rank_sift (searchiter iter, int *heap, int n, int i)
+{
+  int child, tmp;
+
+  while ((child = 2 * i + 1) < n) {
+    if (child + 1 < n && __rank_cmp (iter, heap [child + 1], heap [child]) > 0)
+      child ++;
+    if (__rank_cmp (iter, heap [child], heap [i]) <= 0)
+      break;
+    tmp = heap [i];
+    heap [i] = heap [child];
+    heap [child] = tmp;
+    i = child;
+  }
+  return;
+}
+
+/* the matches of one shard of the library, err is set on failure */
+struct ShardMatches {
+  int *songs, n, err;
+};
+
+/* a search scanned in shards */
+struct ShardScan {
+  searchiter           iter;
+  int                  k;
+  struct ShardMatches *shard;
+};
+
+/* room for one more match, up to k */
+static int
+__shard_grow (struct ShardMatches *m, int *size, int k)
+{
+  int *grown;
+
+  if (m -> n < *size)
+    return MSE_OK;
+  *size = *size ? 2 * *size : 64;
+  if (*size > k) *size = k;
+  if ((grown = (int *) realloc (m -> songs, *size * sizeof (int))) == NULL)
+    return (m -> err = MSE_NOMEM);
+  m -> songs = grown;
+  return MSE_OK;
+}
+
+/*
+ * keep the best k matches of songs [first, last) in a heap whose top is
+ * the worst one kept, so that each further match costs at most a log k
+ * replacement. the heap is then sorted in place.
+ */
+static void
+__rank_range (searchiter iter, int first, int last, int k,
+              struct ShardMatches *m)
+{
+  int i, tmp, size = 0, song, *heap;
+
+  for (song = first; song < last && k > 0; song ++) {
+    if (!iter -> all && !match_search (iter -> songs, song, &iter -> key))
+      continue;
+
+    if (m -> n < k) { /* room left: sift it up */
+      if (__shard_grow (m, &size, k) != MSE_OK)
+        return;
+      heap = m -> songs;
+      for (i = m -> n ++; i > 0
+           && __rank_cmp (iter, song, heap [(i - 1) / 2]) > 0;
+           i = (i - 1) / 2)
+        heap [i] = heap [(i - 1) / 2];
+      heap [i] = song;
     }
-    if (!dhlist_append (songs, songinfo)) {
-      dhlist_delete (dirent_songs);
-      return MS_errno;
+    else if (__rank_cmp (iter, song, m -> songs [0]) < 0) {
+      m -> songs [0] = song;
+      __rank_sift (iter, m -> songs, m -> n, 0);
     }
-    free (songpath);
   }
 
-  dhlist_delete (dirent_songs);
+  for (i = m -> n - 1; i > 0; i --) { /* heapsort */
+    tmp = m -> songs [0];
+    m -> songs [0] = m -> songs [i];
+    m -> songs [i] = tmp;
+    __rank_sift (iter, m -> songs, i, 0);
+  }
+  return;
+}
+
+/* the first k matches of songs [first, last), in library order */
+static void
+__first_range (searchiter iter, int first, int last, int k,
+               struct ShardMatches *m)
+{
+  int size = 0, song;
+
+  for (song = first; song < last && m -> n < k; song ++) {
+    if (!iter -> all && !match_search (iter -> songs, song, &iter -> key))
+      continue;
+    if (__shard_grow (m, &size, k) != MSE_OK)
+      return;
+    m -> songs [m -> n ++] = song;
+  }
+  return;
+}
+
+static void
+__scan_shard (void *arg, int shard, int first, int last)
+{
+  struct ShardScan *scan = (struct ShardScan *) arg;
+
+  if (scan -> iter -> opts.sort != SORT_NONE)
+    __rank_range (scan -> iter, first, last, scan -> k, &scan -> shard [shard]);
+  else
+    __first_range (scan -> iter, first, last, scan -> k,
+                   &scan -> shard [shard]);
+  return;
+}
+
+/*
+ * join the matches of a shard to those of the shards before it, keeping
+ * k: sorted matches are merged, others follow in library order.
+ */
+static int
+__shard_join (searchiter iter, struct ShardMatches *into,
+              struct ShardMatches *from, int k)
+{
+  int n = into -> n + from -> n, *joined, i = 0, j = 0, m = 0;
+
+  if (n > k) n = k;
+  if (from -> n == 0)
+    return MSE_OK;
+  if ((joined = (int *) malloc (n * sizeof (int))) == NULL)
+    return (into -> err = MSE_NOMEM);
+  if (iter -> opts.sort != SORT_NONE)
+    while (m < n && i < into -> n && j < from -> n)
+      joined [m ++] = __rank_cmp (iter, into -> songs [i],
+                                  from -> songs [j]) < 0
+                      ? into -> songs [i ++] : from -> songs [j ++];
+  while (m < n && i < into -> n)
+    joined [m ++] = into -> songs [i ++];
+  while (m < n && j < from -> n)
+    joined [m ++] = from -> songs [j ++];
+  if (into -> songs != NULL) free (into -> songs);
+  into -> songs = joined;
+  into -> n = n;
   return MSE_OK;
 }
 
-char *__match_key;
+/*
+ * scan the library for the page of a search up front: its best k
+ * matches when sorted, its first k otherwise. large libraries are
+ * scanned in shards, in parallel, and the shards joined in order.
+ */
+static int
+__rank (searchiter iter, int k)
+{
+  struct ShardScan scan;
+  int count = songtable_length (iter -> songs), n = shards_count (count), i;
 
-int
-match_search (void *tomatch)
+  iter -> ranked = NULL;
+  iter -> nranked = 0;
+  scan.iter = iter;
+  scan.k = k;
+  scan.shard = (struct ShardMatches *) calloc (n, sizeof (struct ShardMatches));
+  if (scan.shard == NULL)
+    return (MS_errno = MSE_NOMEM);
+  shards_run (count, __scan_shard, &scan);
+
+  for (i = 1; i < n && scan.shard [0] . err == 0; i ++)
+    if ((scan.shard [0] . err = scan.shard [i] . err) == 0)
+      __shard_join (iter, &scan.shard [0], &scan.shard [i], k);
+  for (i = 1; i < n; i ++)
+    if (scan.shard [i] . songs != NULL) free (scan.shard [i] . songs);
+  if ((i = scan.shard [0] . err) != 0) {
+    if (scan.shard [0] . songs != NULL) free (scan.shard [0] . songs);
+    free (scan.shard);
+    return (MS_errno = i);
+  }
+
+  iter -> ranked = scan.shard [0] . songs;
+  iter -> nranked = scan.shard [0] . n;
+  iter -> next = iter -> opts.offset;
+  iter -> upfront = 1;
+  free (scan.shard);
+  return MSE_OK;
+}
+
+/* a song matching a fuzzy key, and how far off it is */
+struct Scored {
+  int song, distance;
+};
+
+static int
+__by_song (const void *a, const void *b)
 {
-  return strstr (spack_client_path ((spack) tomatch), __match_key) != NULL;
+  const struct Scored *x = a, *y = b;
+
+  return x -> song != y -> song ? x -> song - y -> song
+                                : x -> distance - y -> distance;
+}
+
+static int
+__by_distance (const void *a, const void *b)
+{
+  const struct Scored *x = a, *y = b;
+
+  return x -> distance != y -> distance ? x -> distance - y -> distance
+                                        : x -> song - y -> song;
 }
 
 /*
- * given the list of available songs, find every song
- * whose path contains key.
+ * take the matches of an indexed search, in the order they are to be
+ * returned (songs is handed over). without a sort the first k are the
+ * page; with one they are sorted by rank if the order was built, else
+ * marked for __rank to order.
  */
-int
-search_library (dhlist songs, dhlist *search, char *key)
+static int
+__matched (searchiter iter, int *songs, int n, int k)
 {
-  if (key == NULL) { /* if searchstring is empty */
-    /* return the whole library */
-    if (!dhlist_copy (search, songs))
+  struct Scored *ranked;
+  int i;
+
+  if (iter -> opts.sort != SORT_NONE && iter -> rank != NULL) {
+    if ((ranked = (struct Scored *) malloc ((n + 1)
+                                            * sizeof (struct Scored)))
+        == NULL) {
+      free (songs);
       return (MS_errno = MSE_NOMEM);
+    }
+    for (i = 0; i < n; i ++) { /* the rank stands for the distance */
+      ranked [i] . song = songs [i];
+      ranked [i] . distance = iter -> opts.reverse ? - iter -> rank [songs [i]]
+                                                   : iter -> rank [songs [i]];
+    }
+    qsort (ranked, n, sizeof (struct Scored), __by_distance);
+    for (i = 0; i < n; i ++)
+      songs [i] = ranked [i] . song;
+    free (ranked);
+  }
+  if (iter -> opts.sort == SORT_NONE || iter -> rank != NULL) {
+    iter -> ranked = songs;
+    iter -> nranked = n < k ? n : k;
+    iter -> next = iter -> opts.offset;
+    iter -> upfront = 1;
     return MSE_OK;
   }
+  iter -> key.hits = (unsigned char *) calloc (songtable_length
+                                               (iter -> songs) / 8 + 1, 1);
+  if (iter -> key.hits == NULL) {
+    free (songs);
+    return (MS_errno = MSE_NOMEM);
+  }
+  for (i = 0; i < n; i ++)
+    iter -> key.hits [songs [i] / 8] |= 1 << (songs [i] % 8);
+  free (songs);
+  return MSE_OK;
+}
+
+/*
+ * the songs holding a word close to the given one, by song, each with
+ * its closest distance. returns how many, -1 on error.
+ */
+static int
+__fuzzy_word (wordindex words, char *word, int len, struct Scored **scored)
+{
+  struct WordMatch *matches;
+  int n, i, j, total = 0, count, *songs;
+
+  /* one typo in short words, two in longer ones */
+  if ((n = wordindex_similar (words, word, len, len < 5 ? 1 : 2, &matches))
+      < 0)
+    return -1;
+  for (i = 0; i < n; i ++) {
+    wordindex_postings (words, matches [i] . word, &count);
+    total += count;
+  }
+  if ((*scored = (struct Scored *) malloc ((total + 1)
+                                           * sizeof (struct Scored)))
+      == NULL) {
+    if (matches != NULL) free (matches);
+    return (MS_errno = MSE_NOMEM, -1);
+  }
+  for (i = total = 0; i < n; i ++) {
+    songs = wordindex_postings (words, matches [i] . word, &count);
+    for (j = 0; j < count; j ++) {
+      (*scored) [total] . song = songs [j];
+      (*scored) [total ++] . distance = matches [i] . distance;
+    }
+  }
+  if (matches != NULL) free (matches);
 
-  __match_key = key;
-  if ((*search = dhlist_subset (songs, match_search)) == NULL) {
-    __match_key = NULL;
+  if (n > 1) { /* a song may hold several of the words: keep the closest */
+    qsort (*scored, total, sizeof (struct Scored), __by_song);
+    for (i = j = 0; i < total; i ++)
+      if (j == 0 || (*scored) [j - 1] . song != (*scored) [i] . song)
+        (*scored) [j ++] = (*scored) [i];
+    total = j;
+  }
+  return total;
+}
+
+/*
+ * match a fuzzy key: every word of it must be close to a word of the
+ * song's path, and songs are ranked by the edits summed over the words.
+ */
+static int
+__fuzzy (searchiter iter, int k)
+{
+  struct Scored *all = NULL, *next, *merged;
+  char *cursor = iter -> key.folded, *end = cursor + iter -> key.len, *word;
+  int n = 0, m, i, j, len, first = 1, *songs;
+
+  while ((word = wordindex_token (&cursor, end, &len)) != NULL) {
+    if ((m = __fuzzy_word (songtable_words (iter -> songs), word, len,
+                           &next)) < 0)
+      goto ErrorEpilogue;
+    if (first) {
+      all = next;
+      n = m;
+      first = 0;
+      continue;
+    }
+    /* intersect, both are by song */
+    for (i = j = len = 0, merged = all; i < n && j < m; )
+      if (all [i] . song < next [j] . song)
+        i ++;
+      else if (all [i] . song > next [j] . song)
+        j ++;
+      else {
+        merged [len] . song = all [i] . song;
+        merged [len ++] . distance = all [i ++] . distance
+                                     + next [j ++] . distance;
+      }
+    n = len;
+    free (next);
+  }
+
+  /* closest first, then just the songs (in place) */
+  qsort (all, n, sizeof (struct Scored), __by_distance);
+  songs = (int *) all;
+  for (i = 0; i < n; i ++)
+    songs [i] = all [i] . song;
+  if (songs == NULL && (songs = (int *) malloc (sizeof (int))) == NULL)
+    return (MS_errno = MSE_NOMEM);
+  return __matched (iter, songs, n, k);
+
+ ErrorEpilogue:
+  if (all != NULL) free (all);
+  return MS_errno;
+}
+
+/* match a boolean query, through the word index */
+static int
+__boolean (searchiter iter, int k)
+{
+  int *songs, n;
+
+  if ((n = query_run (iter -> key.query, songtable_words (iter -> songs),
+                      iter -> songs, &songs)) < 0)
+    return MS_errno;
+  if (songs == NULL && (songs = (int *) malloc (sizeof (int))) == NULL)
     return (MS_errno = MSE_NOMEM);
+  return __matched (iter, songs, n, k);
+}
+
+/*
+ * unsorted searches are otherwise scanned as they are walked, stopping
+ * once the page is complete: scan them up front only when that spreads
+ * over several shards.
+ */
+static int
+__sharded (searchiter iter)
+{
+  return !iter -> all && !iter -> key.fuzzy && iter -> key.query == NULL
+         && shards_count (songtable_length (iter -> songs)) > 1;
+}
+
+/*
+ * move a view to the run of ties before the one it walked, which the
+ * rank of its last song starts. 0 when there are none.
+ */
+static int
+__view_run (searchiter iter)
+{
+  iter -> stop = iter -> start;
+  if (iter -> stop > 0)
+    iter -> start = iter -> rank [iter -> order [iter -> stop - 1]];
+  iter -> next = iter -> start;
+  return iter -> stop > iter -> start;
+}
+
+/*
+ * every song, sorted: the page is read off the library's order, nothing
+ * is scanned nor kept. reversed orders are walked from their end, a run
+ * of ties at a time, for ties keep library order.
+ */
+static void
+__view (searchiter iter)
+{
+  int count = songtable_length (iter -> songs), skip = iter -> opts.offset;
+
+  iter -> view = 1;
+  if (!iter -> opts.reverse) { /* a single run */
+    iter -> start = 0;
+    iter -> stop = count;
+    iter -> next = skip < count ? skip : count;
+    return;
+  }
+  iter -> start = iter -> stop = iter -> next = count;
+  while (skip > 0 && (iter -> next < iter -> stop || __view_run (iter))) {
+    if (skip < iter -> stop - iter -> next) {
+      iter -> next += skip;
+      return;
+    }
+    skip -= iter -> stop - iter -> next;
+    iter -> next = iter -> stop;
+  }
+  return;
+}
+
+/*
+ * start searching songs for key (NULL or "" for every song). opts may
+ * ask for a page of the results and for an order; NULL gives every
+ * match in library order.
+ */
+int
+search_open (songtable songs, char *key, struct SearchOptions *opts,
+             searchiter *iter)
+{
+  int k;
+
+  if ((*iter = (searchiter) calloc (1, sizeof (struct SearchIter))) == NULL)
+    return (MS_errno = MSE_NOMEM);
+  (*iter) -> songs = songs;
+  (*iter) -> all = key == NULL || *key == '\0';
+  if (opts != NULL)
+    (*iter) -> opts = *opts;
+  else
+    (*iter) -> opts.limit = -1;
+  if (!(*iter) -> all && __parse_key (key, &(*iter) -> key) != MSE_OK) {
+    free (*iter);
+    return MS_errno;
   }
-  __match_key = NULL;
 
+  k = (*iter) -> opts.limit < 0 ? INT_MAX
+      : (*iter) -> opts.offset + (*iter) -> opts.limit;
+  if (k < 0) k = INT_MAX; /* overflow */
+  if ((*iter) -> opts.sort != SORT_NONE)
+    (*iter) -> order = orders_get (songtable_orders (songs),
+                                   (*iter) -> opts.sort, &(*iter) -> rank);
+  if ((*iter) -> all && (*iter) -> order != NULL)
+    __view (*iter);
+  else if ((key != NULL && (*iter) -> key.fuzzy
+            && __fuzzy (*iter, k) != MSE_OK)
+           || (key != NULL && (*iter) -> key.query != NULL
+               && __boolean (*iter, k) != MSE_OK)
+           || (!(*iter) -> upfront
+               && ((*iter) -> opts.sort != SORT_NONE || __sharded (*iter))
+               && __rank (*iter, k) != MSE_OK)) {
+    search_close (*iter);
+    return MS_errno;
+  }
   return MSE_OK;
 }
 
+/* the next matching song, -1 when there are no more */
+int
+search_next (searchiter iter)
+{
+  int song;
+
+  if (iter -> upfront)
+    return iter -> next < iter -> nranked
+           ? iter -> ranked [iter -> next ++] : -1;
+  if (iter -> view) {
+    if (iter -> opts.limit >= 0 && iter -> returned >= iter -> opts.limit)
+      return -1;
+    if (iter -> next == iter -> stop && !__view_run (iter))
+      return -1;
+    iter -> returned ++;
+    return iter -> order [iter -> next ++];
+  }
+
+  /* stop scanning as soon as the page is complete */
+  if (iter -> opts.limit >= 0 && iter -> returned >= iter -> opts.limit)
+    return -1;
+  while (iter -> cursor < songtable_length (iter -> songs)) {
+    song = iter -> cursor ++;
+    if (!iter -> all && !match_search (iter -> songs, song, &iter -> key))
+      continue;
+    if (iter -> skipped < iter -> opts.offset) {
+      iter -> skipped ++;
+      continue;
+    }
+    iter -> returned ++;
+    return song;
+  }
+  return -1;
+}
+
+void
+search_close (searchiter iter)
+{
+  if (!iter -> all) {
+    free (iter -> key.folded);
+    if (iter -> key.hits != NULL) free (iter -> key.hits);
+    if (iter -> key.query != NULL) query_free (iter -> key.query);
+  }
+  if (iter -> ranked != NULL) free (iter -> ranked);
+  free (iter);
+  return;
+}
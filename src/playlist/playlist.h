@@ -1,9 +1,51 @@
 # ifndef __PLAYLIST_HANDLING_LIB__
 # define __PLAYLIST_HANDLING_LIB__
 
-# include "../sharedlib/dhlist.h"
+# include "songtable.h"
 
-int build_library (char *, dhlist);
-int search_library (dhlist, dhlist *, char *);
+typedef struct SearchIter *searchiter;
+
+  /* orders of search results */
+# define SORT_NONE     0  /* library order */
+# define SORT_PATH     1
+# define SORT_ADDED    2  /* most recent first */
+# define SORT_ARTIST   3
+# define SORT_ALBUM    4
+# define SORT_TITLE    5
+# define SORT_DURATION 6
+# define SORT_BITRATE  7
+# define SORT_COUNT    8
+
+struct SearchOptions {
+  int sort;     /* one of SORT_* */
+  int reverse;  /* reverse the order of sort */
+  int offset;   /* matches to skip */
+  int limit;    /* matches to return, -1 for no limit */
+};
+
+/* how far the (background) scan of the library got */
+struct LibraryProgress {
+  int    ready;        /* every song was found */
+  int    directories;  /* scanned */
+  int    songs;        /* found */
+  int    published;    /* of which searches & lookups see */
+  double seconds;      /* the scan took (so far) */
+};
+
+int library_init (char *);
+void library_partition (int (*) (char *));
+int build_library (int);
+int library_save (int *);
+int library_restore (int, int);
+songtable library_acquire (void);
+void library_release (songtable);
+void library_progress (struct LibraryProgress *);
+int library_presort (void);
+int search_open (songtable, char *, struct SearchOptions *, searchiter *);
+int search_sort_id (char *);
+int search_next (searchiter);
+void search_close (searchiter);
+unsigned int library_generation (void);
+void library_changed (void);
 
 # endif
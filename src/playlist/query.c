@@ -0,0 +1,438 @@
+/* query.c: boolean queries over the word index */
+# include <stdlib.h>
+# include <string.h>
+# include <ctype.h>
+
+# include "../sharedlib/fold.h"
+# include "../mstream/mserrors.h"
+# include "songtable.h"
+# include "wordindex.h"
+# include "query.h"
+
+/* terms that may match instead of one another, all folded */
+struct Clause {
+  int    negated;
+  int    nterms;
+  char **terms;
+};
+
+struct Query {
+  int            nclauses;
+  struct Clause *clauses;
+};
+
+/* whether a key asks for a boolean query rather than a plain substring */
+int
+query_wanted (char *key)
+{
+  char *p;
+
+  if (key [0] == '-' && key [1] != '\0')
+    return 1;
+  for (p = key; *p; p ++)
+    if (isspace ((unsigned char) *p) || *p == '"' || *p == '|')
+      return 1;
+  return 0;
+}
+
+/* append a (folded) term to the query, in a new clause or in the last */
+static int
+__add_term (query q, char *term, int join, int negated)
+{
+  struct Clause *clauses, *clause;
+  char **terms;
+
+  if (!join || q -> nclauses == 0 || negated) {
+    clauses = realloc (q -> clauses, (q -> nclauses + 1)
+                                     * sizeof (struct Clause));
+    if (clauses == NULL)
+      return (MS_errno = MSE_NOMEM);
+    q -> clauses = clauses;
+    clause = &q -> clauses [q -> nclauses ++];
+    clause -> negated = negated;
+    clause -> nterms = 0;
+    clause -> terms = NULL;
+  }
+  clause = &q -> clauses [q -> nclauses - 1];
+  if ((terms = realloc (clause -> terms, (clause -> nterms + 1)
+                                         * sizeof (char *))) == NULL)
+    return (MS_errno = MSE_NOMEM);
+  clause -> terms = terms;
+  clause -> terms [clause -> nterms ++] = term;
+  return MSE_OK;
+}
+
+/* parse a (url decoded) key, NULL if memory ran out */
+query
+query_parse (char *key)
+{
+  char *p = key, *start, *term, *cursor;
+  int join = 0, negated = 0, len;
+  query q;
+
+  if ((q = (query) calloc (1, sizeof (struct Query))) == NULL) {
+    MS_errno = MSE_NOMEM;
+    return NULL;
+  }
+  while (*p) {
+    while (isspace ((unsigned char) *p))
+      p ++;
+    if (*p == '\0')
+      break;
+
+    if (*p == '"') { /* a phrase, up to the closing quote */
+      start = ++ p;
+      while (*p && *p != '"')
+        p ++;
+      len = p - start;
+      if (*p) p ++;
+    }
+    else {
+      start = p;
+      while (*p && !isspace ((unsigned char) *p) && *p != '"')
+        p ++;
+      len = p - start;
+      if ((len == 2 && !strncmp (start, "OR", 2))
+          || (len == 1 && *start == '|')) {
+        join = 1;
+        continue;
+      }
+      if (len == 3 && !strncmp (start, "AND", 3))
+        continue;
+      if (len == 3 && !strncmp (start, "NOT", 3)) {
+        negated = 1;
+        continue;
+      }
+      if (len == 1 && *start == '-' && *p == '"') { /* -"a phrase" */
+        negated = 1;
+        continue;
+      }
+      if (len > 1 && *start == '-') {
+        negated = 1;
+        start ++;
+        len --;
+      }
+    }
+
+    if ((term = strndup (start, len)) == NULL) {
+      query_free (q);
+      MS_errno = MSE_NOMEM;
+      return NULL;
+    }
+    len = fold_text (term, term, len + 1);
+    cursor = term;
+    if (wordindex_token (&cursor, term + len, &len) == NULL) {
+      free (term); /* nothing to look for, eg a lone '-' */
+      continue;
+    }
+    if (__add_term (q, term, join, negated) != MSE_OK) {
+      free (term);
+      query_free (q);
+      return NULL;
+    }
+    join = negated = 0;
+  }
+
+  return q;
+}
+
+/*
+ * the first position from i on whose song is not below target. lists
+ * are walked with skip pointers: every stride-th entry is looked at
+ * first, and only the last stretch one by one.
+ */
+static int
+__advance (int *list, int n, int i, int stride, int target)
+{
+  while (i + stride < n && list [i + stride] <= target)
+    i += stride;
+  while (i < n && list [i] < target)
+    i ++;
+  return i;
+}
+
+static int
+__stride (int n)
+{
+  int s = 1;
+
+  while (s * s < n)
+    s ++;
+  return s;
+}
+
+/* whether the words of a phrase follow one another in a song's path */
+static int
+__adjacent (songtable songs, int song, char *phrase, int plen, char **buff,
+            int *size)
+{
+  char *cursor, *end, *word, *grown;
+  int len, blen = 0;
+
+  cursor = songtable_folded_path (songs, song, &len);
+  end = cursor + len;
+  if (len + 2 + FOLD_PADDING > *size) {
+    if ((grown = (char *) realloc (*buff, len + 2 + FOLD_PADDING)) == NULL)
+      return (MS_errno = MSE_NOMEM, -1);
+    *buff = grown;
+    *size = len + 2 + FOLD_PADDING;
+  }
+  (*buff) [blen ++] = ' ';
+  while ((word = wordindex_token (&cursor, end, &len)) != NULL) {
+    memcpy (*buff + blen, word, len);
+    blen += len;
+    (*buff) [blen ++] = ' ';
+  }
+  return fold_find (*buff, blen, phrase, plen) >= 0;
+}
+
+/*
+ * a term being matched: the postings of its words, rarest first, each
+ * with a cursor. candidates are offered in ascending order, so that the
+ * cursors only move forward.
+ */
+struct Term {
+  int   nwords;         /* 0 if some word is in no song */
+  int **postings;
+  int  *n, *at, *stride;
+  char *phrase;         /* " word word " when there are several words */
+  int   plen;
+};
+
+static int
+__term_init (char *term, wordindex words, struct Term *t)
+{
+  char *cursor = term, *end = term + strlen (term), *word;
+  int len, id, max = end - term + 1, i, j, tmp, *swap;
+
+  memset (t, 0, sizeof (struct Term));
+  t -> postings = (int **) malloc (max * sizeof (int *));
+  t -> n = (int *) malloc (3 * max * sizeof (int));
+  t -> phrase = (char *) malloc (max + 2);
+  if (t -> postings == NULL || t -> n == NULL || t -> phrase == NULL)
+    return (MS_errno = MSE_NOMEM);
+  t -> at = t -> n + max;
+  t -> stride = t -> at + max;
+
+  t -> phrase [t -> plen ++] = ' ';
+  while ((word = wordindex_token (&cursor, end, &len)) != NULL) {
+    if ((id = wordindex_find (words, word, len)) < 0) {
+      t -> nwords = 0; /* nothing can match */
+      return MSE_OK;
+    }
+    t -> postings [t -> nwords] = wordindex_postings (words, id,
+                                                      &t -> n [t -> nwords]);
+    t -> nwords ++;
+    memcpy (t -> phrase + t -> plen, word, len);
+    t -> plen += len;
+    t -> phrase [t -> plen ++] = ' ';
+  }
+  for (i = 1; i < t -> nwords; i ++) /* rarest first, they are few */
+    for (j = i; j > 0 && t -> n [j] < t -> n [j - 1]; j --) {
+      tmp = t -> n [j], t -> n [j] = t -> n [j - 1], t -> n [j - 1] = tmp;
+      swap = t -> postings [j];
+      t -> postings [j] = t -> postings [j - 1];
+      t -> postings [j - 1] = swap;
+    }
+  for (i = 0; i < t -> nwords; i ++) {
+    t -> at [i] = 0;
+    t -> stride [i] = __stride (t -> n [i]);
+  }
+  return MSE_OK;
+}
+
+/* whether a song matches a term: 1 if it does, 0 if not, -1 on error */
+static int
+__term_has (struct Term *t, int song, songtable songs, char **buff,
+            int *size)
+{
+  int i;
+
+  if (t -> nwords == 0)
+    return 0;
+  for (i = 0; i < t -> nwords; i ++) {
+    t -> at [i] = __advance (t -> postings [i], t -> n [i], t -> at [i],
+                             t -> stride [i], song);
+    if (t -> at [i] == t -> n [i] || t -> postings [i] [t -> at [i]] != song)
+      return 0;
+  }
+  return t -> nwords == 1 ? 1
+         : __adjacent (songs, song, t -> phrase, t -> plen, buff, size);
+}
+
+static void
+__term_free (struct Term *t)
+{
+  if (t -> postings != NULL) free (t -> postings);
+  if (t -> n != NULL) free (t -> n);
+  if (t -> phrase != NULL) free (t -> phrase);
+  return;
+}
+
+/* the terms of a clause, and a bound on how many songs it matches */
+struct Terms {
+  struct Term *terms;
+  int          n, bound;
+};
+
+static int
+__clause_init (struct Clause *clause, wordindex words, struct Terms *terms)
+{
+  int i;
+
+  terms -> n = terms -> bound = 0;
+  if ((terms -> terms = (struct Term *) calloc (clause -> nterms,
+                                                sizeof (struct Term)))
+      == NULL)
+    return (MS_errno = MSE_NOMEM);
+  for (i = 0; i < clause -> nterms; i ++) {
+    terms -> n ++;
+    if (__term_init (clause -> terms [i], words, &terms -> terms [i])
+        != MSE_OK)
+      return MS_errno;
+    if (terms -> terms [i] . nwords > 0)
+      terms -> bound += terms -> terms [i] . n [0];
+  }
+  return MSE_OK;
+}
+
+static void
+__clause_free (struct Terms *terms)
+{
+  int i;
+
+  for (i = 0; i < terms -> n; i ++)
+    __term_free (&terms -> terms [i]);
+  if (terms -> terms != NULL) free (terms -> terms);
+  return;
+}
+
+static int
+__ascending (const void *a, const void *b)
+{
+  return *(int *) a - *(int *) b;
+}
+
+/*
+ * the songs matching a clause, in library order: the candidates of each
+ * term are the songs of its rarest word.
+ */
+static int
+__clause_songs (struct Terms *terms, songtable songs, int **result,
+                char **buff, int *size)
+{
+  struct Term *t;
+  int i, j, n = 0, has;
+
+  if ((*result = (int *) malloc ((terms -> bound + 1) * sizeof (int)))
+      == NULL)
+    return (MS_errno = MSE_NOMEM, -1);
+  for (i = 0; i < terms -> n; i ++) {
+    t = &terms -> terms [i];
+    for (j = 0; t -> nwords > 0 && j < t -> n [0]; j ++) {
+      if ((has = __term_has (t, t -> postings [0] [j], songs, buff, size))
+          < 0) {
+        free (*result);
+        return -1;
+      }
+      if (has)
+        (*result) [n ++] = t -> postings [0] [j];
+    }
+  }
+  if (terms -> n > 1) { /* the terms may share songs */
+    qsort (*result, n, sizeof (int), __ascending);
+    for (i = j = 0; i < n; i ++)
+      if (j == 0 || (*result) [j - 1] != (*result) [i])
+        (*result) [j ++] = (*result) [i];
+    n = j;
+  }
+  return n;
+}
+
+/*
+ * run a query, giving back the matching songs in library order (to be
+ * freed by the caller). returns how many they are, -1 on error.
+ * the rarest positive clause gives the candidates, which are then
+ * checked against the other clauses by skipping through their postings;
+ * phrases are verified only for the candidates that reach them.
+ */
+int
+query_run (query q, wordindex words, songtable songs, int **result)
+{
+  struct Terms *clauses;
+  char *buff = NULL;
+  int i, j, k, m, n = -1, driver = -1, size = 0, has;
+
+  *result = NULL;
+  if (q -> nclauses == 0)
+    return 0;
+  if ((clauses = (struct Terms *) calloc (q -> nclauses,
+                                          sizeof (struct Terms))) == NULL)
+    return (MS_errno = MSE_NOMEM, -1);
+  for (i = 0; i < q -> nclauses; i ++) {
+    if (__clause_init (&q -> clauses [i], words, &clauses [i]) != MSE_OK)
+      goto Done;
+    if (!q -> clauses [i] . negated
+        && (driver < 0 || clauses [i] . bound < clauses [driver] . bound))
+      driver = i;
+  }
+
+  if (driver >= 0) {
+    if ((n = __clause_songs (&clauses [driver], songs, result, &buff, &size))
+        < 0)
+      goto Done;
+  }
+  else { /* only negated clauses: start from every song */
+    n = songtable_length (songs);
+    if ((*result = (int *) malloc ((n + 1) * sizeof (int))) == NULL) {
+      MS_errno = MSE_NOMEM;
+      n = -1;
+      goto Done;
+    }
+    for (i = 0; i < n; i ++)
+      (*result) [i] = i;
+  }
+
+  /* each candidate must match every other clause, or none if negated */
+  for (i = m = 0; i < n; i ++) {
+    for (j = 0; j < q -> nclauses; j ++) {
+      if (j == driver)
+        continue;
+      for (k = has = 0; k < clauses [j] . n && !has; k ++)
+        if ((has = __term_has (&clauses [j] . terms [k], (*result) [i],
+                               songs, &buff, &size)) < 0) {
+          free (*result);
+          *result = NULL;
+          n = -1;
+          goto Done;
+        }
+      if (has == q -> clauses [j] . negated)
+        break;
+    }
+    if (j == q -> nclauses)
+      (*result) [m ++] = (*result) [i];
+  }
+  n = m;
+
+ Done:
+  for (i = 0; i < q -> nclauses; i ++)
+    __clause_free (&clauses [i]);
+  free (clauses);
+  if (buff != NULL) free (buff);
+  return n;
+}
+
+void
+query_free (query q)
+{
+  int i, j;
+
+  for (i = 0; i < q -> nclauses; i ++) {
+    for (j = 0; j < q -> clauses [i] . nterms; j ++)
+      free (q -> clauses [i] . terms [j]);
+    free (q -> clauses [i] . terms);
+  }
+  if (q -> clauses != NULL) free (q -> clauses);
+  free (q);
+  return;
+}
@@ -0,0 +1,20 @@
+# ifndef __BOOLEAN_QUERY_LIB__
+# define __BOOLEAN_QUERY_LIB__
+
+# include "songtable.h"
+# include "wordindex.h"
+
+/*
+ * a boolean query over the words of song paths: space separated terms
+ * must all match, terms joined by OR (or '|') may match instead of one
+ * another, a term after NOT (or starting with '-') must not match, and
+ * "quoted words" must appear one after the other.
+ */
+typedef struct Query *query;
+
+int   query_wanted (char *);
+query query_parse  (char *);
+int   query_run    (query, wordindex, songtable, int **);
+void  query_free   (query);
+
+# endif
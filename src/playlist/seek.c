@@ -0,0 +1,749 @@
+/* seek.c: indexes of the places songs may start playing from */
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <errno.h>
+# include <limits.h>
+# include <unistd.h>
+# include <fcntl.h>
+# include <pthread.h>
+# include <sys/types.h>
+# include <sys/stat.h>
+
+# include "../mstream/mserrors.h"
+# include "seek.h"
+
+  /* bytes read from a song at a time while it is indexed */
+# define SEEK_BLOCK 65536
+  /* bytes looked through for a frame, from where one should be */
+# define SEEK_SYNC  8192
+# define SEEK_MAGIC "mzqseek1"
+  /* bytes of indexes kept in memory */
+# define SEEK_CACHE (4 * 1024 * 1024)
+
+/* a place playback may start from, and when that is */
+struct SeekPoint {
+  long long     offset;
+  unsigned int  msec;
+  unsigned int  pad;
+};
+
+/*
+ * an index, as kept on the disk: the song it was built from, how many
+ * bytes of it (flac & ogg stream headers) are sent ahead of any point,
+ * followed by the points themselves.
+ */
+struct SeekHead {
+  char          magic [8];
+  long long     size, mtime;
+  long long     header;
+  unsigned int  count;
+  unsigned int  pad;
+};
+
+struct SeekIndex {
+  struct SeekHead   head;
+  struct SeekPoint *points;
+  unsigned int      room;
+};
+
+/* a song read a block at a time, mostly forwards */
+struct SeekReader {
+  int            fd;
+  off_t          size;
+  off_t          start;   /* offset of the block in the song */
+  ssize_t        len;
+  unsigned char  block [SEEK_BLOCK];
+};
+
+static char *seek_dir = NULL;  /* NULL: indexes are not kept on disk */
+
+/*
+ * the indexes built or loaded lately, most recently used first, by the
+ * song's inode (its size & time are in their head). songs that cannot
+ * be seeked into are kept too, as empty indexes.
+ */
+struct SeekCached {
+  dev_t               dev;
+  ino_t               ino;
+  struct SeekIndex    index;
+  struct SeekCached  *next;
+};
+
+static struct SeekCached *cached = NULL;
+static pthread_mutex_t seek_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* len (at most SEEK_SYNC) bytes at offset off, NULL past the end */
+static unsigned char *
+__seek_at (struct SeekReader *reader, off_t off, size_t len)
+{
+  if (off < 0 || off + len > reader -> size)
+    return NULL;
+  if (off < reader -> start || off + len > reader -> start + reader -> len) {
+    reader -> start = off;
+    if ((reader -> len = pread (reader -> fd, reader -> block, SEEK_BLOCK,
+                                off)) < (ssize_t) len) {
+      reader -> len = 0;
+      return NULL;
+    }
+  }
+  return reader -> block + (off - reader -> start);
+}
+
+/* the offset of the first 0xff byte from off up to limit, -1 if none */
+static off_t
+__seek_ff (struct SeekReader *reader, off_t off, off_t limit)
+{
+  unsigned char *p, *ff;
+  size_t len;
+
+  for (; off < limit; off += len) {
+    len = limit - off < SEEK_SYNC ? limit - off : SEEK_SYNC;
+    if ((p = __seek_at (reader, off, len)) == NULL)
+      return -1;
+    if ((ff = memchr (p, 0xff, len)) != NULL)
+      return off + (ff - p);
+  }
+  return -1;
+}
+
+static unsigned int
+__be32 (unsigned char *p)
+{
+  return (p [0] << 24) | (p [1] << 16) | (p [2] << 8) | p [3];
+}
+
+static unsigned long long
+__be64 (unsigned char *p)
+{
+  return ((unsigned long long) __be32 (p) << 32) | __be32 (p + 4);
+}
+
+static unsigned int
+__le32 (unsigned char *p)
+{
+  return p [0] | (p [1] << 8) | (p [2] << 16) | ((unsigned int) p [3] << 24);
+}
+
+static unsigned long long
+__le64 (unsigned char *p)
+{
+  return ((unsigned long long) __le32 (p + 4) << 32) | __le32 (p);
+}
+
+static unsigned int
+__syncsafe (unsigned char *p)
+{
+  return ((p [0] & 0x7f) << 21) | ((p [1] & 0x7f) << 14)
+         | ((p [2] & 0x7f) << 7) | (p [3] & 0x7f);
+}
+
+/* add a point, unless it is less than SEEK_STEP after the last one */
+static int
+__seek_point (struct SeekIndex *index, off_t offset, unsigned int msec)
+{
+  struct SeekPoint *grown, *last;
+
+  if (index -> head.count) {
+    last = index -> points + index -> head.count - 1;
+    if (offset <= last -> offset || msec < last -> msec + SEEK_STEP)
+      return MSE_OK;
+  }
+  if (index -> head.count == index -> room) {
+    if ((grown = (struct SeekPoint *)
+           realloc (index -> points, (index -> room ? 2 * index -> room : 64)
+                                     * sizeof (struct SeekPoint))) == NULL)
+      return (MS_errno = MSE_NOMEM);
+    index -> points = grown;
+    index -> room = index -> room ? 2 * index -> room : 64;
+  }
+  index -> points [index -> head.count] . offset = offset;
+  index -> points [index -> head.count] . msec = msec;
+  index -> points [index -> head.count ++] . pad = 0;
+  return MSE_OK;
+}
+
+/* mpeg audio frame header: return frame bitrate & samplerate, 0 if invalid */
+int
+seek_mpeg_header (unsigned char *h, int *bitrate, int *samplerate, int *samples)
+{
+  static const short rates [2][3][16] = {
+    { /* mpeg 1 */
+      {0,32,64,96,128,160,192,224,256,288,320,352,384,416,448,0},
+      {0,32,48,56,64,80,96,112,128,160,192,224,256,320,384,0},
+      {0,32,40,48,56,64,80,96,112,128,160,192,224,256,320,0} },
+    { /* mpeg 2 & 2.5 */
+      {0,32,48,56,64,80,96,112,128,144,160,176,192,224,256,0},
+      {0,8,16,24,32,40,48,56,64,80,96,112,128,144,160,0},
+      {0,8,16,24,32,40,48,56,64,80,96,112,128,144,160,0} } };
+  static const int freqs [3] = {44100, 48000, 32000};
+  int version, layer, lsf;
+
+  if (h [0] != 0xff || (h [1] & 0xe0) != 0xe0)
+    return 0;
+  version = (h [1] >> 3) & 3;    /* 0: 2.5, 2: 2, 3: 1 */
+  layer = 4 - ((h [1] >> 1) & 3);
+  if (version == 1 || layer == 4 || (h [2] >> 2 & 3) == 3)
+    return 0;
+  lsf = version != 3;
+  *bitrate = rates [lsf][layer - 1][h [2] >> 4];
+  *samplerate = freqs [(h [2] >> 2) & 3] >> (version == 3 ? 0 : version == 2 ? 1 : 2);
+  *samples = layer == 1 ? 384 : (layer == 3 && lsf) ? 576 : 1152;
+
+  return *bitrate != 0;
+}
+
+/*
+ * the part of an mp3 file of size bytes, open at fd, that holds its
+ * frames: from *start to *end, its id3 tags left out
+ */
+void
+seek_mpeg_frames (int fd, off_t size, off_t *start, off_t *end)
+{
+  unsigned char h [10];
+
+  *start = 0;
+  *end = size;
+  if (pread (fd, h, 10, 0) == 10 && !memcmp (h, "ID3", 3))
+    *start = 10 + ((h [6] & 0x7f) << 21 | (h [7] & 0x7f) << 14
+                   | (h [8] & 0x7f) << 7 | (h [9] & 0x7f));
+  if (size >= 128 && pread (fd, h, 3, size - 128) == 3
+      && !memcmp (h, "TAG", 3))
+    *end -= 128;
+  if (*start > *end)
+    *start = *end;
+  return;
+}
+
+/* the length of the mpeg frame with header h, 0 if it is not one */
+static int
+__mpeg_frame (unsigned char *h, int *samples, int *samplerate)
+{
+  int bitrate, padding = (h [2] >> 1) & 1;
+
+  if (!seek_mpeg_header (h, &bitrate, samplerate, samples))
+    return 0;
+  if (*samples == 384)
+    return (12 * bitrate * 1000 / *samplerate + padding) * 4;
+  return *samples / 8 * bitrate * 1000 / *samplerate + padding;
+}
+
+/*
+ * the first mpeg frame within SEEK_SYNC bytes from off that is followed
+ * by a frame of the same stream (or by the end of the song), -1 if none
+ */
+static off_t
+__mpeg_sync (struct SeekReader *reader, off_t off)
+{
+  unsigned char *h, first [4];
+  off_t limit = off + SEEK_SYNC;
+  int len, samples, rate;
+
+  if (limit > reader -> size)
+    limit = reader -> size;
+  for (; (off = __seek_ff (reader, off, limit)) >= 0; off ++) {
+    if ((h = __seek_at (reader, off, 4)) == NULL
+        || !(len = __mpeg_frame (h, &samples, &rate)))
+      continue;
+    memcpy (first, h, 4);
+    if (off + len == reader -> size
+        || ((h = __seek_at (reader, off + len, 4)) != NULL
+            && __mpeg_frame (h, &samples, &rate)
+            && h [1] == first [1] && (h [2] & 0x0c) == (first [2] & 0x0c)))
+      return off;
+  }
+  return -1;
+}
+
+/*
+ * the points of the table of contents of a xing header, found at the
+ * frame at base: one per percent of the song, moved to the next frame.
+ */
+static int
+__mpeg_xing (struct SeekReader *reader, struct SeekIndex *index,
+             unsigned char *xing, off_t base, off_t first, int samples,
+             int rate)
+{
+  unsigned int flags = __be32 (xing + 4), frames, bytes;
+  unsigned long long msec;
+  unsigned char *toc = xing + 12;
+  off_t off;
+  int i;
+
+  if (!(flags & 1) || !(flags & 4) || !(frames = __be32 (xing + 8)))
+    return MSE_OK;
+  if (flags & 2) {
+    bytes = __be32 (xing + 12);
+    toc += 4;
+  }
+  else bytes = reader -> size - base;
+  msec = (unsigned long long) frames * samples * 1000 / rate;
+
+  for (i = 0; i < 100; i ++) {
+    off = base + (unsigned long long) toc [i] * bytes / 256;
+    if ((off = __mpeg_sync (reader, off < first ? first : off)) < 0)
+      break;
+    if (__seek_point (index, off, msec * i / 100) != MSE_OK)
+      return MS_errno;
+  }
+  return MSE_OK;
+}
+
+/* every frame of the mp3 stream starting around off */
+static int
+__seek_mpeg (struct SeekReader *reader, struct SeekIndex *index, off_t off)
+{
+  unsigned char *h, xing [120];
+  unsigned long long played = 0;  /* samples before the frame at off */
+  int len, samples, rate, side;
+
+  if ((off = __mpeg_sync (reader, off)) < 0)
+    return MSE_OK;
+  h = __seek_at (reader, off, 4);
+  len = __mpeg_frame (h, &samples, &rate);
+
+  /* a xing/info frame holds no sound, maybe a table of contents instead */
+  if (((h [1] >> 3) & 3) == 3)
+    side = ((h [3] >> 6) == 3) ? 17 : 32;
+  else
+    side = ((h [3] >> 6) == 3) ? 9 : 17;
+  if ((h = __seek_at (reader, off + 4 + side, 120)) != NULL
+      && (!memcmp (h, "Xing", 4) || !memcmp (h, "Info", 4))) {
+    memcpy (xing, h, 120);
+    if (__mpeg_xing (reader, index, xing, off, off + len, samples, rate)
+        != MSE_OK)
+      return MS_errno;
+    if (index -> head.count)
+      return MSE_OK;
+    off += len;
+  }
+
+  for (; ;) {
+    if ((h = __seek_at (reader, off, 4)) == NULL
+        || !(len = __mpeg_frame (h, &samples, &rate))) {
+      if ((off = __mpeg_sync (reader, off)) < 0)
+        break;
+      continue;
+    }
+    if (__seek_point (index, off, played * 1000 / rate) != MSE_OK)
+      return MS_errno;
+    played += samples;
+    off += len;
+  }
+  return MSE_OK;
+}
+
+static unsigned char
+__crc8 (unsigned char *p, int len)
+{
+  unsigned char crc = 0;
+  int i;
+
+  while (len -- > 0) {
+    crc ^= *p ++;
+    for (i = 0; i < 8; i ++)
+      crc = crc & 0x80 ? (crc << 1) ^ 0x07 : crc << 1;
+  }
+  return crc;
+}
+
+/*
+ * the header of the flac frame at off: the first sample of the frame and
+ * how many there are. 0 if there is no frame at off. fixed is the block
+ * size of streams numbering frames rather than samples.
+ */
+static int
+__flac_frame (struct SeekReader *reader, off_t off, int fixed,
+              unsigned long long *sample, int *block)
+{
+  unsigned char *h;
+  unsigned long long number;
+  int n, i, len, code;
+
+  if ((h = __seek_at (reader, off, 16)) == NULL
+      || h [0] != 0xff || (h [1] & 0xfe) != 0xf8 || !(h [2] >> 4)
+      || (h [2] & 0x0f) == 0x0f || (h [3] >> 4) > 10
+      || ((h [3] >> 1) & 7) == 3 || (h [3] & 1))
+    return 0;
+
+  /* the frame or sample number, coded the way utf-8 codes characters */
+  for (n = 0; n < 8 && (h [4] & (0x80 >> n)); n ++)
+    ;
+  if (n == 1 || n == 8)
+    return 0;
+  number = h [4] & (0x7f >> n);
+  for (i = 1, len = 5; i < n; i ++, len ++) {
+    if ((h [4 + i] & 0xc0) != 0x80)
+      return 0;
+    number = (number << 6) | (h [4 + i] & 0x3f);
+  }
+
+  code = h [2] >> 4;
+  if (code == 1)
+    *block = 192;
+  else if (code <= 5)
+    *block = 576 << (code - 2);
+  else if (code == 6)
+    *block = h [len ++] + 1;
+  else if (code == 7) {
+    *block = ((h [len] << 8) | h [len + 1]) + 1;
+    len += 2;
+  }
+  else *block = 256 << (code - 8);
+  if ((h [2] & 0x0f) == 12)
+    len ++;
+  else if ((h [2] & 0x0f) == 13 || (h [2] & 0x0f) == 14)
+    len += 2;
+
+  if (__crc8 (h, len) != h [len])
+    return 0;
+  *sample = (h [1] & 1) ? number : number * fixed;
+  return 1;
+}
+
+/*
+ * a flac stream, from its "fLaC" marker at off: the points of its seek
+ * table, or else of its frames. the metadata blocks make the header.
+ */
+static int
+__seek_flac (struct SeekReader *reader, struct SeekIndex *index, off_t off)
+{
+  unsigned char *h;
+  unsigned long long sample, expected = 0;
+  unsigned int rate = 0, minframe = 0, fixed = 0, len;
+  off_t table = 0, entries = 0, first;
+  int last = 0, type, block, i;
+
+  for (off += 4; !last && (h = __seek_at (reader, off, 4)) != NULL;
+       off += 4 + len) {
+    last = h [0] & 0x80;
+    type = h [0] & 0x7f;
+    len = (h [1] << 16) | (h [2] << 8) | h [3];
+    if (type == 0 && len >= 18
+        && (h = __seek_at (reader, off + 4, 18)) != NULL) { /* streaminfo */
+      fixed = (h [2] << 8) | h [3];
+      minframe = (h [4] << 16) | (h [5] << 8) | h [6];
+      rate = (h [10] << 12) | (h [11] << 4) | (h [12] >> 4);
+    }
+    else if (type == 3) { /* seektable */
+      table = off + 4;
+      entries = len / 18;
+    }
+  }
+  if (!last || !rate)
+    return MSE_OK;
+  index -> head.header = first = off;
+
+  /* placeholder points have all their sample number bits set */
+  for (i = 0; i < entries; i ++) {
+    if ((h = __seek_at (reader, table + 18 * i, 18)) == NULL)
+      break;
+    if ((sample = __be64 (h)) == ~0ULL
+        || first + __be64 (h + 8) >= reader -> size)
+      continue;
+    if (__seek_point (index, first + __be64 (h + 8), sample * 1000 / rate)
+        != MSE_OK)
+      return MS_errno;
+  }
+  if (index -> head.count)
+    return MSE_OK;
+
+  /*
+   * no table: look for frames, taking only those starting within a
+   * second of where the previous one ended, as random bytes might look
+   * like a frame header.
+   */
+  while ((off = __seek_ff (reader, off, reader -> size)) >= 0) {
+    if (!__flac_frame (reader, off, fixed, &sample, &block)
+        || sample < expected || sample > expected + rate) {
+      off ++;
+      continue;
+    }
+    if (__seek_point (index, off, sample * 1000 / rate) != MSE_OK)
+      return MS_errno;
+    expected = sample + block;
+    off += minframe > 1 ? minframe : 1;
+  }
+  return MSE_OK;
+}
+
+/*
+ * an ogg vorbis or opus stream: its pages, each starting when the
+ * previous one ended. pages up to the first one ending some sound make
+ * the header, those carrying the rest of a packet are left out.
+ */
+static int
+__seek_ogg (struct SeekReader *reader, struct SeekIndex *index)
+{
+  unsigned char *h;
+  unsigned long long granule, played = 0;
+  unsigned int rate, skip = 0, serial, msec;
+  int segs, flags, i;
+  off_t off, len;
+
+  if ((h = __seek_at (reader, 0, 27)) == NULL)
+    return MSE_OK;
+  serial = __le32 (h + 14);
+  if ((h = __seek_at (reader, 27 + h [26], 19)) == NULL)
+    return MSE_OK;
+  if (!memcmp (h, "\001vorbis", 7))
+    rate = __le32 (h + 12);
+  else if (!memcmp (h, "OpusHead", 8)) {
+    rate = 48000;  /* opus granules always count at 48kHz */
+    skip = h [10] | (h [11] << 8);
+  }
+  else return MSE_OK;
+  if (!rate)
+    return MSE_OK;
+
+  for (off = 0; (h = __seek_at (reader, off, 27)) != NULL; off += len) {
+    if (memcmp (h, "OggS", 4) || __le32 (h + 14) != serial)
+      break; /* damaged, or chained to another stream */
+    granule = __le64 (h + 6);
+    flags = h [5];
+    segs = h [26];
+    if ((h = __seek_at (reader, off + 27, segs)) == NULL)
+      break;
+    for (i = 0, len = 27 + segs; i < segs; i ++)
+      len += h [i];
+
+    if (!index -> head.header) {
+      if (granule == 0 || granule == ~0ULL)
+        continue;
+      index -> head.header = off;
+    }
+    if (granule == ~0ULL)
+      continue;
+    msec = played > skip ? (played - skip) * 1000 / rate : 0;
+    if (!(flags & 1) && __seek_point (index, off, msec) != MSE_OK)
+      return MS_errno;
+    played = granule;
+  }
+  return MSE_OK;
+}
+
+/* index the song open at fd, of size & time st */
+static int
+__seek_build (int fd, struct stat *st, struct SeekIndex *index)
+{
+  struct SeekReader *reader;
+  unsigned char *h;
+  off_t off = 0;
+  int ret = MSE_OK;
+
+  if ((reader = (struct SeekReader *) malloc (sizeof (struct SeekReader)))
+      == NULL)
+    return (MS_errno = MSE_NOMEM);
+  reader -> fd = fd;
+  reader -> size = st -> st_size;
+  reader -> start = 0;
+  reader -> len = 0;
+
+  if ((h = __seek_at (reader, 0, 10)) != NULL && !memcmp (h, "ID3", 3))
+    off = 10 + __syncsafe (h + 6) + ((h [5] & 0x10) ? 10 : 0);
+  if ((h = __seek_at (reader, off, 8)) == NULL
+      || !memcmp (h + 4, "ftyp", 4)) /* mp4 files are not indexed */
+    ;
+  else if (!memcmp (h, "fLaC", 4))
+    ret = __seek_flac (reader, index, off);
+  else if (!memcmp (h, "OggS", 4))
+    ret = __seek_ogg (reader, index);
+  else
+    ret = __seek_mpeg (reader, index, off);
+
+  free (reader);
+  return ret;
+}
+
+/* the index kept at path, if it was built from the song as it is now */
+static int
+__seek_load (char *path, struct stat *st, struct SeekIndex *index)
+{
+  size_t size;
+  int fd;
+
+  if ((fd = open (path, O_RDONLY)) < 0)
+    return 0;
+  if (read (fd, &index -> head, sizeof (struct SeekHead))
+        != sizeof (struct SeekHead)
+      || memcmp (index -> head.magic, SEEK_MAGIC, 8)
+      || index -> head.size != st -> st_size
+      || index -> head.mtime != st -> st_mtime
+      || !index -> head.count || index -> head.count > st -> st_size) {
+    close (fd);
+    return 0;
+  }
+  size = index -> head.count * sizeof (struct SeekPoint);
+  if ((index -> points = (struct SeekPoint *) malloc (size)) == NULL
+      || read (fd, index -> points, size) != size) {
+    close (fd);
+    return 0;
+  }
+  close (fd);
+  index -> room = index -> head.count;
+  return 1;
+}
+
+/* keep an index at path: written aside, then renamed over any old one */
+static void
+__seek_save (char *path, struct SeekIndex *index)
+{
+  char temp [PATH_MAX];
+  size_t size = index -> head.count * sizeof (struct SeekPoint);
+  int fd;
+
+  if (snprintf (temp, PATH_MAX, "%s/.seekXXXXXX", seek_dir) >= PATH_MAX
+      || (fd = mkstemp (temp)) < 0)
+    return;
+  if (write (fd, &index -> head, sizeof (struct SeekHead))
+        != sizeof (struct SeekHead)
+      || write (fd, index -> points, size) != size
+      || close (fd) < 0
+      || rename (temp, path) < 0)
+    unlink (temp);
+  return;
+}
+
+/* the last point of an index not after msec */
+static void
+__seek_point_at (struct SeekIndex *index, unsigned int msec, off_t *header,
+                 off_t *start, unsigned int *at)
+{
+  int lo, hi, mid;
+
+  if (!index -> head.count)
+    return;
+  for (lo = 0, hi = index -> head.count - 1; lo < hi; ) {
+    mid = (lo + hi + 1) / 2;
+    if (index -> points [mid] . msec <= msec)
+      lo = mid;
+    else hi = mid - 1;
+  }
+  *header = index -> head.header;
+  *start = index -> points [lo] . offset;
+  *at = index -> points [lo] . msec;
+  return;
+}
+
+/* seek into a song whose index is in memory: 0 if it is not */
+static int
+__seek_cached (struct stat *st, unsigned int msec, off_t *header,
+               off_t *start, unsigned int *at)
+{
+  struct SeekCached *c, **link;
+
+  pthread_mutex_lock (&seek_lock);
+  for (link = &cached; (c = *link) != NULL; link = &c -> next)
+    if (c -> dev == st -> st_dev && c -> ino == st -> st_ino
+        && c -> index.head.size == st -> st_size
+        && c -> index.head.mtime == st -> st_mtime)
+      break;
+  if (c != NULL) {
+    *link = c -> next;
+    c -> next = cached;
+    cached = c;
+    __seek_point_at (&c -> index, msec, header, start, at);
+  }
+  pthread_mutex_unlock (&seek_lock);
+  return c != NULL;
+}
+
+/*
+ * keep the index of a song in memory (its points are handed over), in
+ * place of any older one of it. the least recently used indexes are let
+ * go of beyond SEEK_CACHE bytes.
+ */
+static void
+__seek_keep (struct stat *st, struct SeekIndex *index)
+{
+  struct SeekCached *c, **link;
+  size_t used;
+
+  if ((c = (struct SeekCached *) malloc (sizeof (struct SeekCached)))
+      == NULL) {
+    if (index -> points != NULL)
+      free (index -> points);
+    return;
+  }
+  c -> dev = st -> st_dev;
+  c -> ino = st -> st_ino;
+  c -> index = *index;
+  used = sizeof (struct SeekCached)
+         + index -> head.count * sizeof (struct SeekPoint);
+  pthread_mutex_lock (&seek_lock);
+  c -> next = cached;
+  cached = c;
+  for (link = &c -> next; (c = *link) != NULL; ) {
+    used += sizeof (struct SeekCached)
+            + c -> index.head.count * sizeof (struct SeekPoint);
+    if (used > SEEK_CACHE
+        || (c -> dev == st -> st_dev && c -> ino == st -> st_ino)) {
+      *link = c -> next;
+      if (c -> index.points != NULL)
+        free (c -> index.points);
+      free (c);
+    }
+    else link = &c -> next;
+  }
+  pthread_mutex_unlock (&seek_lock);
+  return;
+}
+
+/* keep indexes in dir (created if needed) too, NULL for memory only */
+int
+seek_init (char *dir)
+{
+  if (dir == NULL)
+    return MSE_OK;
+  if (mkdir (dir, 0755) < 0 && errno != EEXIST)
+    return (MS_errno = MSE_OS);
+  if ((seek_dir = strdup (dir)) == NULL)
+    return (MS_errno = MSE_NOMEM);
+  return MSE_OK;
+}
+
+/*
+ * where to send the song open at fd from, for it to start playing at
+ * msec, or as little earlier as can be: its first *header bytes, then
+ * everything from *start on. *at tells when playback starts. *start is
+ * set to -1 for songs that cannot be seeked into.
+ */
+int
+seek_find (int fd, unsigned int msec, off_t *header, off_t *start,
+           unsigned int *at)
+{
+  struct SeekIndex index;
+  struct stat st;
+  char path [PATH_MAX];
+
+  *start = -1;
+  if (fstat (fd, &st) < 0)
+    return (MS_errno = MSE_OS);
+  if (__seek_cached (&st, msec, header, start, at))
+    return MSE_OK;
+  memset (&index, '\0', sizeof (struct SeekIndex));
+
+  /* indexes are named after the song's inode, checked by size & time */
+  if (seek_dir == NULL
+      || snprintf (path, PATH_MAX, "%s/%llx-%llx.seek", seek_dir,
+                   (unsigned long long) st.st_dev,
+                   (unsigned long long) st.st_ino) >= PATH_MAX
+      || !__seek_load (path, &st, &index)) {
+    if (index.points != NULL)
+      free (index.points);
+    memset (&index, '\0', sizeof (struct SeekIndex));
+    memcpy (index.head.magic, SEEK_MAGIC, 8);
+    index.head.size = st.st_size;
+    index.head.mtime = st.st_mtime;
+    if (__seek_build (fd, &st, &index) != MSE_OK) {
+      if (index.points != NULL)
+        free (index.points);
+      return MS_errno;
+    }
+    if (seek_dir != NULL && index.head.count)
+      __seek_save (path, &index);
+  }
+  __seek_point_at (&index, msec, header, start, at);
+  __seek_keep (&st, &index);
+  return MSE_OK;
+}
@@ -0,0 +1,22 @@
+# ifndef __SEEK_INDEX_LIB__
+# define __SEEK_INDEX_LIB__
+
+# include <sys/types.h>
+
+/*
+ * seek indexes tell where, in a song file, playback may start close to
+ * a given time: mp3 frames, flac frames & ogg pages, every SEEK_STEP
+ * milliseconds. they are built the first time a song is seeked, kept
+ * in memory for the songs seeked lately, and on the disk if there is a
+ * directory for them.
+ */
+
+  /* milliseconds between two points of an index */
+# define SEEK_STEP 500
+
+int seek_init         (char *);
+int seek_find         (int, unsigned int, off_t *, off_t *, unsigned int *);
+int seek_mpeg_header  (unsigned char *, int *, int *, int *);
+void seek_mpeg_frames (int, off_t, off_t *, off_t *);
+
+# endif
@@ -0,0 +1,190 @@
+/* shards.c: parallel scans of the library */
+# include <stdlib.h>
+# include <unistd.h>
+# include <pthread.h>
+# include <sys/resource.h>
+# include <sys/syscall.h>
+
+# include "../mstream/mserrors.h"
+# include "shards.h"
+
+  /* fewer songs than this are not worth another thread */
+# define SHARD_MIN_SONGS  16384
+  /* scanning threads yield to the ones streaming songs */
+# define SHARD_NICE       5
+
+/* a shard waiting to be scanned */
+struct ShardJob {
+  void (*scan) (void *, int, int, int);
+  void *arg;
+  int shard, first, last;
+  struct ShardBatch *batch;
+  struct ShardJob *next;
+};
+
+/* the shards of one scan, the caller waits for all of them */
+struct ShardBatch {
+  struct ShardJob jobs [SHARD_MAX];
+  int pending;
+};
+
+static pthread_mutex_t shard_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shard_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t shard_done = PTHREAD_COND_INITIALIZER;
+static struct ShardJob *queue = NULL, *queue_tail = NULL;
+static int shard_threads = 0, shard_forks = 0;
+
+/* take the first job queued, of a given batch (or of any if NULL) */
+static struct ShardJob *
+__dequeue (struct ShardBatch *batch)
+{
+  struct ShardJob *job, *prev = NULL;
+
+  for (job = queue; job != NULL && batch != NULL && job -> batch != batch;
+       job = job -> next)
+    prev = job;
+  if (job == NULL)
+    return NULL;
+  if (prev == NULL)
+    queue = job -> next;
+  else
+    prev -> next = job -> next;
+  if (queue_tail == job)
+    queue_tail = prev;
+  return job;
+}
+
+/* run a job, the lock held on entry & exit */
+static void
+__run (struct ShardJob *job)
+{
+  pthread_mutex_unlock (&shard_lock);
+  job -> scan (job -> arg, job -> shard, job -> first, job -> last);
+  pthread_mutex_lock (&shard_lock);
+  if (-- job -> batch -> pending == 0)
+    pthread_cond_broadcast (&shard_done);
+  return;
+}
+
+static void *
+__shard_worker (void *arg)
+{
+  struct ShardJob *job;
+
+  setpriority (PRIO_PROCESS, syscall (SYS_gettid), SHARD_NICE);
+  pthread_mutex_lock (&shard_lock);
+  for (;;) {
+    while ((job = __dequeue (NULL)) == NULL)
+      pthread_cond_wait (&shard_work, &shard_lock);
+    __run (job);
+  }
+  return NULL;
+}
+
+/*
+ * threads do not survive a fork: the child starts without any, with
+ * fresh locks, and may start its own with shards_init
+ */
+static void
+__shards_forked (void)
+{
+  pthread_mutex_init (&shard_lock, NULL);
+  pthread_cond_init (&shard_work, NULL);
+  pthread_cond_init (&shard_done, NULL);
+  queue = queue_tail = NULL;
+  shard_threads = 0;
+  return;
+}
+
+/*
+ * start the pool with the given number of threads, 0 for one per cpu
+ * but one (the thread asking for a scan takes a shard as well).
+ */
+int
+shards_init (int threads)
+{
+  pthread_attr_t attr;
+  pthread_t tid;
+
+  if (threads <= 0)
+    threads = sysconf (_SC_NPROCESSORS_ONLN) - 1;
+  if (threads > SHARD_MAX - 1)
+    threads = SHARD_MAX - 1;
+
+  if (!shard_forks
+      && (MS_pthread_errno = pthread_atfork (NULL, NULL, &__shards_forked)))
+    return (MS_errno = MSE_PTHREAD);
+  shard_forks = 1;
+  if ((MS_pthread_errno = pthread_attr_init (&attr))
+      || (MS_pthread_errno =
+            pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED)))
+    return (MS_errno = MSE_PTHREAD);
+  for (; shard_threads < threads; shard_threads ++)
+    if ((MS_pthread_errno =
+           pthread_create (&tid, &attr, &__shard_worker, NULL))) {
+      pthread_attr_destroy (&attr);
+      return (MS_errno = MSE_PTHREAD);
+    }
+  pthread_attr_destroy (&attr);
+
+  return MSE_OK;
+}
+
+/* the number of shards a scan of that many songs is split in */
+int
+shards_count (int songs)
+{
+  int n = songs / SHARD_MIN_SONGS;
+
+  if (n > shard_threads + 1)
+    n = shard_threads + 1;
+  return n < 1 ? 1 : n;
+}
+
+/*
+ * scan songs [0, songs) in shards: scan (arg, shard, first, last) is
+ * called once for each, in parallel, and all are done on return. the
+ * caller scans the first shard, and any other nobody got to yet.
+ */
+int
+shards_run (int songs, void (*scan) (void *, int, int, int), void *arg)
+{
+  struct ShardBatch batch;
+  struct ShardJob *job;
+  int n = shards_count (songs), i;
+
+  if (n == 1) {
+    scan (arg, 0, 0, songs);
+    return MSE_OK;
+  }
+
+  pthread_mutex_lock (&shard_lock);
+  batch.pending = n;
+  for (i = 0; i < n; i ++) {
+    job = &batch.jobs [i];
+    job -> scan = scan;
+    job -> arg = arg;
+    job -> shard = i;
+    job -> first = (long long) songs * i / n;
+    job -> last = (long long) songs * (i + 1) / n;
+    job -> batch = &batch;
+    job -> next = NULL;
+    if (i == 0)
+      continue;
+    if (queue_tail == NULL)
+      queue = job;
+    else
+      queue_tail -> next = job;
+    queue_tail = job;
+  }
+  pthread_cond_broadcast (&shard_work);
+
+  __run (&batch.jobs [0]);
+  while ((job = __dequeue (&batch)) != NULL)
+    __run (job);
+  while (batch.pending > 0)
+    pthread_cond_wait (&shard_done, &shard_lock);
+  pthread_mutex_unlock (&shard_lock);
+
+  return MSE_OK;
+}
@@ -0,0 +1,15 @@
+# ifndef __LIBRARY_SHARDS_LIB__
+# define __LIBRARY_SHARDS_LIB__
+
+  /* at most that many shards per scan */
+# define SHARD_MAX 64
+
+/*
+ * scans of the whole library are split in shards, contiguous ranges of
+ * songs, scanned in parallel by a pool of threads kept for the purpose.
+ */
+int shards_init  (int);
+int shards_count (int);
+int shards_run   (int, void (*) (void *, int, int, int), void *);
+
+# endif
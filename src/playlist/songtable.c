@@ -0,0 +1,625 @@
+/* songtable.c: compact music library */
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <unistd.h>
+# include <errno.h>
+# include <fcntl.h>
+# include <sys/syscall.h>
+# include <sys/mman.h>
+# include <sys/stat.h>
+# ifdef SYS_openat2
+# include <linux/openat2.h>
+# endif
+
+# include "../sharedlib/url_codec.h"
+# include "../sharedlib/fold.h"
+# include "../mstream/mserrors.h"
+# include "tags.h"
+# include "songtable.h"
+# include "wordindex.h"
+# include "suggest.h"
+# include "folders.h"
+# include "orders.h"
+
+  /* arenas backed by huge pages are rounded up to this */
+# define HUGE_PAGE (2 * 1024 * 1024)
+
+/* the content types, each stored once and referred to by index */
+static char *content_types [] = {
+  "audio/mpeg", "audio/ogg", "audio/aac", "audio/x-ms-wma",
+  "audio/mp4a-latm", "audio/x-mpegurl", "audio/x-flac"
+};
+static char *extensions [] = {
+  ".mp3", ".ogg", ".aac", ".wma", ".m4a", ".m4p", ".m3u", NULL
+};
+static unsigned char extension_types [] = {0, 1, 2, 3, 4, 4, 5};
+
+/* strings, NUL terminated and one after the other */
+struct Pool {
+  char   *data;
+  size_t  len, size;
+};
+
+/*
+ * while the library is built the columns grow on the heap; once it is
+ * sealed they are packed, together with a hash index of client paths,
+ * in one read-only arena.
+ */
+struct SongTable {
+  int            count, size;   /* songs & room for songs */
+  unsigned int  *client;        /* offset of the url encoded path */
+  unsigned int  *server;        /* offset of the path under root */
+  unsigned int  *folded;        /* offset of the folded path */
+  unsigned short *foldlen;      /* and its length */
+  unsigned char *content;       /* index in content_types */
+  stags         *tags;          /* metadata, filled in the background */
+  struct Pool    paths;         /* client & server paths */
+  struct Pool    folds;         /* folded paths, scanned by searches */
+  int           *slots;         /* hash of client paths: index + 1 */
+  unsigned int   nslots;
+  void          *arena;         /* NULL until sealed */
+  size_t         arenalen;
+  char          *root;          /* the music directory */
+  int            rootfd;
+  wordindex      words;         /* of the sealed paths, or NULL */
+  suggest        completions;   /* of search prefixes, or NULL */
+  folders        tree;          /* the folders songs are in, or NULL */
+  orders         sorted;        /* the songs in each sort order, or NULL */
+  int            refs;          /* holders of a sealed table */
+};
+
+/* initialise an empty library of the songs under the root directory */
+songtable
+songtable_init (char *root)
+{
+  songtable table;
+
+  if ((table = (songtable) calloc (1, sizeof (struct SongTable))) == NULL
+      || (table -> root = strdup (root)) == NULL) {
+    if (table != NULL) free (table);
+    MS_errno = MSE_NOMEM;
+    return NULL;
+  }
+  if ((table -> rootfd = open (root, O_RDONLY | O_DIRECTORY)) < 0) {
+    free (table -> root);
+    free (table);
+    MS_errno = MSE_OS;
+    return NULL;
+  }
+  table -> refs = 1;
+  return table;
+}
+
+/* append a string to a pool, return its offset */
+static int
+__pool_add (struct Pool *pool, char *str, size_t len, unsigned int *offset)
+{
+  char *grown;
+  size_t size;
+
+  if (pool -> len + len + 1 > pool -> size) {
+    size = 2 * pool -> size + len + 1 + 4096;
+    if ((grown = (char *) realloc (pool -> data, size)) == NULL)
+      return (MS_errno = MSE_NOMEM);
+    pool -> data = grown;
+    pool -> size = size;
+  }
+  memcpy (pool -> data + pool -> len, str, len);
+  pool -> data [pool -> len + len] = '\0';
+  *offset = pool -> len;
+  pool -> len += len + 1;
+  return MSE_OK;
+}
+
+/* content type of a song, out of its extension, -1 if not a song */
+static int
+__content (char *path)
+{
+  int i, len = strlen (path);
+
+  for (i = 0; extensions [i] != NULL; i ++)
+    if (len >= 4 && !strcmp (path + len - 4, extensions [i]))
+      return extension_types [i];
+  if (len >= 5 && !strcmp (path + len - 5, ".flac"))
+    return 6;
+  return -1;
+}
+
+/* add the song at path (under the root directory) to an unsealed table */
+int
+songtable_add (songtable table, char *path)
+{
+  char *relative = path + strlen (table -> root), *encoded;
+  unsigned int *client, *server, *folded;
+  unsigned short *foldlen;
+  unsigned char *content;
+  int len, size;
+
+  if (table -> count == table -> size) {
+    size = table -> size ? 2 * table -> size : 1024;
+    if ((client = realloc (table -> client, size * sizeof (int))) == NULL)
+      return (MS_errno = MSE_NOMEM);
+    table -> client = client;
+    if ((server = realloc (table -> server, size * sizeof (int))) == NULL)
+      return (MS_errno = MSE_NOMEM);
+    table -> server = server;
+    if ((folded = realloc (table -> folded, size * sizeof (int))) == NULL)
+      return (MS_errno = MSE_NOMEM);
+    table -> folded = folded;
+    if ((foldlen = realloc (table -> foldlen, size * sizeof (short))) == NULL)
+      return (MS_errno = MSE_NOMEM);
+    table -> foldlen = foldlen;
+    if ((content = realloc (table -> content, size)) == NULL)
+      return (MS_errno = MSE_NOMEM);
+    table -> content = content;
+    table -> size = size;
+  }
+
+  /*
+   * the client path is saved in a url encoded format, so that each
+   * request is handled in a direct manner (no decoding takes place).
+   */
+  len = 3 * strlen (relative) + 1; /* every byte may become %XX */
+  if ((encoded = calloc (len, sizeof (char))) == NULL)
+    return (MS_errno = MSE_NOMEM);
+  url_encode (relative, encoded, len, 1);
+
+  if (__pool_add (&table -> paths, encoded, strlen (encoded),
+                  &table -> client [table -> count]) != MSE_OK
+      || __pool_add (&table -> paths, relative, strlen (relative),
+                     &table -> server [table -> count]) != MSE_OK) {
+    free (encoded);
+    return MS_errno;
+  }
+
+  /* searches look at the folded path, it fits where the encoded was */
+  len = fold_text (relative, encoded, len);
+  if (__pool_add (&table -> folds, encoded, len,
+                  &table -> folded [table -> count]) != MSE_OK) {
+    free (encoded);
+    return MS_errno;
+  }
+  table -> foldlen [table -> count] = len;
+  free (encoded);
+  table -> content [table -> count] = __content (path);
+  table -> count ++;
+
+  return MSE_OK;
+}
+
+static unsigned int
+__hash (char *str)
+{
+  unsigned int h = 2166136261u;
+
+  while (*str)
+    h = (h ^ (unsigned char) *str ++) * 16777619u;
+  return h;
+}
+
+/* move (or copy) a column into the arena, return where it went */
+static void *
+__pack (char *arena, size_t *off, void *column, size_t len, int keep)
+{
+  void *to = arena + *off;
+
+  memcpy (to, column, len);
+  if (!keep) free (column);
+  *off += len;
+  return to;
+}
+
+/*
+ * pack the table in its arena: the columns, the hash index and the pools
+ * in a single mapping, optionally backed by (transparent) huge pages.
+ * the folded paths come last, followed by padding for the vector search
+ * kernels, so that searches stream through them. keep: copy the
+ * columns & pools, which still belong to the table being built.
+ */
+static int
+__seal (songtable table, int huge, int keep)
+{
+  size_t columns, len, off = 0;
+  unsigned int i, slot;
+  char *arena;
+
+  for (table -> nslots = 16; table -> nslots < 2 * table -> count;
+       table -> nslots *= 2)
+    ;
+  columns = table -> count * (3 * sizeof (int) + sizeof (short) + 1);
+  columns = (columns + sizeof (int) - 1) & ~(sizeof (int) - 1);
+  len = columns + table -> nslots * sizeof (int) + table -> paths.len
+        + table -> folds.len + FOLD_PADDING;
+  len = huge ? (len + HUGE_PAGE - 1) & ~((size_t) HUGE_PAGE - 1)
+             : (len + getpagesize () - 1) & ~((size_t) getpagesize () - 1);
+
+  arena = mmap (NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (arena == MAP_FAILED)
+    return (MS_errno = MSE_NOMEM);
+# ifdef MADV_HUGEPAGE
+  if (huge)
+    madvise (arena, len, MADV_HUGEPAGE); /* a hint, failure is fine */
+# endif
+  if ((table -> tags = (stags *) calloc (table -> count + 1, sizeof (stags)))
+      == NULL) {
+    munmap (arena, len);
+    return (MS_errno = MSE_NOMEM);
+  }
+
+  /* move the columns & pools in, widest first to keep them aligned */
+  table -> client = __pack (arena, &off, table -> client,
+                            table -> count * sizeof (int), keep);
+  table -> server = __pack (arena, &off, table -> server,
+                            table -> count * sizeof (int), keep);
+  table -> folded = __pack (arena, &off, table -> folded,
+                            table -> count * sizeof (int), keep);
+  table -> foldlen = __pack (arena, &off, table -> foldlen,
+                             table -> count * sizeof (short), keep);
+  table -> content = __pack (arena, &off, table -> content, table -> count,
+                             keep);
+  table -> slots = (int *) (arena + columns);
+  off = columns + table -> nslots * sizeof (int);
+  table -> paths.data = __pack (arena, &off, table -> paths.data,
+                                table -> paths.len, keep);
+  table -> folds.data = __pack (arena, &off, table -> folds.data,
+                                table -> folds.len, keep);
+  table -> paths.size = table -> paths.len;
+  table -> folds.size = table -> folds.len;
+  table -> size = table -> count;
+
+  /* index client paths (linear probing) */
+  for (i = 0; i < table -> count; i ++) {
+    slot = __hash (table -> paths.data + table -> client [i]);
+    while (table -> slots [slot & (table -> nslots - 1)])
+      slot ++;
+    table -> slots [slot & (table -> nslots - 1)] = i + 1;
+  }
+
+  mprotect (arena, len, PROT_READ);
+  table -> arena = arena;
+  table -> arenalen = len;
+  return MSE_OK;
+}
+
+/* seal a table once built: no songs may be added afterwards */
+int
+songtable_seal (songtable table, int huge)
+{
+  return __seal (table, huge, 0);
+}
+
+/*
+ * a sealed copy of the songs added so far to a table still being built,
+ * which may go on growing. NULL on error.
+ */
+songtable
+songtable_snapshot (songtable table, int huge)
+{
+  songtable copy;
+
+  if ((copy = (songtable) malloc (sizeof (struct SongTable))) == NULL) {
+    MS_errno = MSE_NOMEM;
+    return NULL;
+  }
+  *copy = *table; /* __seal copies the columns & pools in */
+  copy -> words = NULL;
+  copy -> completions = NULL;
+  copy -> tree = NULL;
+  copy -> sorted = NULL;
+  copy -> refs = 1;
+  if ((copy -> root = strdup (table -> root)) == NULL) {
+    free (copy);
+    MS_errno = MSE_NOMEM;
+    return NULL;
+  }
+  if ((copy -> rootfd = dup (table -> rootfd)) < 0) {
+    free (copy -> root);
+    free (copy);
+    MS_errno = MSE_OS;
+    return NULL;
+  }
+  if (__seal (copy, huge, 1) != MSE_OK) {
+    close (copy -> rootfd);
+    free (copy -> root);
+    free (copy);
+    return NULL;
+  }
+  return copy;
+}
+
+/* one more holder of a sealed table, songtable_free lets go of it */
+songtable
+songtable_hold (songtable table)
+{
+  __sync_fetch_and_add (&table -> refs, 1);
+  return table;
+}
+
+int
+songtable_length (songtable table)
+{
+  return table -> count;
+}
+
+char *
+songtable_root (songtable table)
+{
+  return table -> root;
+}
+
+char *
+songtable_client_path (songtable table, int song)
+{
+  return table -> paths.data + table -> client [song];
+}
+
+/* path of a song relative to the music directory (starts with '/') */
+char *
+songtable_server_path (songtable table, int song)
+{
+  return table -> paths.data + table -> server [song];
+}
+
+/* the folded path, for fold_find (it is followed by padding) */
+char *
+songtable_folded_path (songtable table, int song, int *len)
+{
+  *len = table -> foldlen [song];
+  return table -> folds.data + table -> folded [song];
+}
+
+char *
+songtable_content (songtable table, int song)
+{
+  return content_types [table -> content [song]];
+}
+
+/* the content type of a song by its path, NULL if it is not a song */
+char *
+songtable_type (char *path)
+{
+  int type = __content (path);
+
+  return type < 0 ? NULL : content_types [type];
+}
+
+/* find a song by its client path, -1 if it is not in the library */
+int
+songtable_find (songtable table, char *path)
+{
+  unsigned int slot;
+  int song;
+
+  if (table -> arena == NULL)
+    return -1;
+  for (slot = __hash (path); (song = table -> slots [slot
+                                       & (table -> nslots - 1)]); slot ++)
+    if (!strcmp (table -> paths.data + table -> client [song - 1], path))
+      return song - 1;
+  return -1;
+}
+
+/* open a song for reading */
+int
+songtable_open (songtable table, int song)
+{
+  return openat (table -> rootfd, songtable_server_path (table, song) + 1,
+                 O_RDONLY);
+}
+
+/* stat a song's file as it is on the disk now, -1 if it is gone */
+int
+songtable_stat (songtable table, int song, struct stat *st)
+{
+  return fstatat (table -> rootfd, songtable_server_path (table, song) + 1,
+                  st, 0);
+}
+
+/*
+ * open path below rootfd without following a symlink anywhere along it,
+ * so a linked directory cannot lead out of the music root. path is cut
+ * at each '/' while it is walked, and put back.
+ */
+static int
+__open_beneath (int rootfd, char *path)
+{
+  char *end;
+  int dirfd = rootfd, next, fd, saved;
+# ifdef SYS_openat2
+  struct open_how how;
+
+  memset (&how, 0, sizeof (how));
+  how.flags = O_RDONLY;
+  how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+  if ((fd = syscall (SYS_openat2, rootfd, path, &how, sizeof (how))) >= 0
+      || errno != ENOSYS)
+    return fd;
+# endif
+
+  /* kernels before 5.6: one component at a time */
+  for (; (end = strchr (path, '/')) != NULL; path = end + 1) {
+    *end = '\0';
+    next = openat (dirfd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+    saved = errno;
+    *end = '/';
+    if (dirfd != rootfd)
+      close (dirfd);
+    if ((dirfd = next) < 0) {
+      errno = saved;
+      return -1;
+    }
+  }
+  fd = openat (dirfd, path, O_RDONLY | O_NOFOLLOW);
+  saved = errno;
+  if (dirfd != rootfd)
+    close (dirfd);
+  errno = saved;
+  return fd;
+}
+
+/*
+ * open a song that may not be in the table yet, by its client path: once
+ * decoded it must name a song file under the root directory, with no
+ * empty, "." or ".." components. returns a descriptor and sets the
+ * content type, -1 if there is no such song.
+ */
+int
+songtable_open_file (songtable table, char *path, char **content)
+{
+  char *decoded, *name, *end;
+  struct stat st;
+  int len = strlen (path) + 1, type, fd = -1;
+
+  if ((decoded = (char *) malloc (len)) == NULL)
+    return -1;
+  if (url_decode (path, decoded, len, 0) < 0 || *decoded != '/'
+      || (type = __content (decoded)) < 0)
+    goto Epilogue;
+  for (name = decoded; *name == '/'; name = end) {
+    if ((end = strchr (++ name, '/')) == NULL)
+      end = name + strlen (name);
+    if (end == name || (end - name == 1 && name [0] == '.')
+        || (end - name == 2 && name [0] == '.' && name [1] == '.'))
+      goto Epilogue;
+  }
+
+  if ((fd = __open_beneath (table -> rootfd, decoded + 1)) >= 0
+      && (fstat (fd, &st) < 0 || !S_ISREG (st.st_mode))) {
+    close (fd);
+    fd = -1;
+  }
+  *content = content_types [type];
+
+ Epilogue:
+  free (decoded);
+  return fd;
+}
+
+stags
+songtable_tags (songtable table, int song)
+{
+  stags tags = table -> tags [song];
+
+  __sync_synchronize (); /* pairs with songtable_set_tags */
+  return tags;
+}
+
+/* the word index of a sealed table, NULL if it has none */
+wordindex
+songtable_words (songtable table)
+{
+  return table -> words;
+}
+
+/* attach a word index to a sealed table, freed along with it */
+void
+songtable_set_words (songtable table, wordindex words)
+{
+  table -> words = words;
+  return;
+}
+
+/* the completions of search prefixes, NULL if there are none */
+suggest
+songtable_suggest (songtable table)
+{
+  return table -> completions;
+}
+
+/* attach completions to a sealed table, freed along with it */
+void
+songtable_set_suggest (songtable table, suggest completions)
+{
+  table -> completions = completions;
+  return;
+}
+
+/* the folders of a sealed table, NULL if they are not known */
+folders
+songtable_folders (songtable table)
+{
+  return table -> tree;
+}
+
+/* attach the folder tree to a sealed table, freed along with it */
+void
+songtable_set_folders (songtable table, folders tree)
+{
+  table -> tree = tree;
+  return;
+}
+
+/* the sort orders of a sealed table, NULL if it has none */
+orders
+songtable_orders (songtable table)
+{
+  return table -> sorted;
+}
+
+/* attach sort orders to a sealed table, freed along with it */
+void
+songtable_set_orders (songtable table, orders sorted)
+{
+  table -> sorted = sorted;
+  return;
+}
+
+/* publish the metadata of a song, readers may be looking at it */
+void
+songtable_set_tags (songtable table, int song, stags tags)
+{
+  __sync_synchronize ();
+  table -> tags [song] = tags;
+  return;
+}
+
+/* memory used by the library, metadata excluded */
+size_t
+songtable_bytes (songtable table)
+{
+  if (table -> arena == NULL)
+    return sizeof (struct SongTable)
+           + table -> size * (3 * sizeof (int) + sizeof (short) + 1)
+           + table -> paths.size + table -> folds.size;
+  return sizeof (struct SongTable) + table -> arenalen
+         + (table -> count + 1) * sizeof (stags);
+}
+
+/* let go of a table, it is freed along with its last holder */
+void
+songtable_free (songtable table)
+{
+  int i;
+
+  if (__sync_sub_and_fetch (&table -> refs, 1) > 0)
+    return;
+  if (table -> words != NULL)
+    wordindex_free (table -> words);
+  if (table -> completions != NULL)
+    suggest_free (table -> completions);
+  if (table -> tree != NULL)
+    folders_free (table -> tree);
+  if (table -> sorted != NULL)
+    orders_free (table -> sorted);
+  if (table -> arena != NULL) {
+    munmap (table -> arena, table -> arenalen);
+    for (i = 0; i < table -> count; i ++)
+      if (table -> tags [i] != NULL) tags_free (table -> tags [i]);
+    free (table -> tags);
+  }
+  else {
+    if (table -> client != NULL) free (table -> client);
+    if (table -> server != NULL) free (table -> server);
+    if (table -> folded != NULL) free (table -> folded);
+    if (table -> foldlen != NULL) free (table -> foldlen);
+    if (table -> content != NULL) free (table -> content);
+    if (table -> paths.data != NULL) free (table -> paths.data);
+    if (table -> folds.data != NULL) free (table -> folds.data);
+  }
+  close (table -> rootfd);
+  free (table -> root);
+  free (table);
+  return;
+}
@@ -0,0 +1,47 @@
+# ifndef __SONG_TABLE_LIB__
+# define __SONG_TABLE_LIB__
+
+# include <stddef.h>
+# include "tags.h"
+
+/*
+ * the music library: songs are indices into a table whose columns are
+ * contiguous arrays, and whose strings live in a single pool.
+ */
+typedef struct SongTable *songtable;
+struct WordIndex;
+struct Suggest;
+struct Folders;
+struct Orders;
+struct stat;
+
+songtable songtable_init        (char *);
+int       songtable_add         (songtable, char *);
+int       songtable_seal        (songtable, int);
+songtable songtable_snapshot    (songtable, int);
+songtable songtable_hold        (songtable);
+int       songtable_length      (songtable);
+char*     songtable_root        (songtable);
+char*     songtable_client_path (songtable, int);
+char*     songtable_server_path (songtable, int);
+char*     songtable_folded_path (songtable, int, int *);
+char*     songtable_content     (songtable, int);
+char*     songtable_type        (char *);
+int       songtable_find        (songtable, char *);
+int       songtable_open        (songtable, int);
+int       songtable_stat        (songtable, int, struct stat *);
+int       songtable_open_file   (songtable, char *, char **);
+stags     songtable_tags        (songtable, int);
+void      songtable_set_tags    (songtable, int, stags);
+struct WordIndex* songtable_words (songtable);
+void      songtable_set_words   (songtable, struct WordIndex *);
+struct Suggest* songtable_suggest (songtable);
+void      songtable_set_suggest (songtable, struct Suggest *);
+struct Folders* songtable_folders (songtable);
+void      songtable_set_folders (songtable, struct Folders *);
+struct Orders* songtable_orders (songtable);
+void      songtable_set_orders  (songtable, struct Orders *);
+size_t    songtable_bytes       (songtable);
+void      songtable_free        (songtable);
+
+# endif
@@ -0,0 +1,504 @@
+/* suggest.c: completions of search prefixes, out of a radix tree */
+# include <stdlib.h>
+# include <string.h>
+
+# include "../sharedlib/fold.h"
+# include "../mstream/mserrors.h"
+# include "songtable.h"
+# include "wordindex.h"
+# include "suggest.h"
+
+  /* longer names are left out */
+# define SUGGEST_MAXLEN 255
+  /* directories deeper than this under the root are left out */
+# define SUGGEST_DEPTH   32
+
+/* something a prefix may complete to */
+struct Completion {
+  unsigned int  key;      /* pool offset of the folded text */
+  unsigned int  text;     /* and of the text shown */
+  int           songs;    /* it appears in, the best completions first */
+};
+
+/*
+ * a compressed radix tree of the folded completions. each node is
+ * reached through a label of one or more bytes, its children are
+ * contiguous & sorted by their first byte, and it keeps the best
+ * completions below it, so that a lookup is only a walk down the prefix.
+ * node 0 is the root, its label is empty.
+ */
+struct Suggest {
+  struct Completion *completion;  /* sorted by key */
+  int                ncompletions, size;
+  char              *pool;
+  size_t             poollen, poolsize;
+  int               *slots;       /* while building: hash of keys, id + 1 */
+  unsigned int       nslots;
+  int                nnodes, nodesize;
+  unsigned int      *label;       /* pool offset of the label */
+  unsigned char     *labellen;
+  int               *child;       /* the first child */
+  unsigned short    *nchild;
+  int               *entry;       /* while building: completion, or -1 */
+  unsigned int      *top;         /* the best completions below: tops */
+  unsigned char     *ntop;        /* offset & how many */
+  int               *tops;
+  int                ntops, topsize;
+};
+
+static unsigned int
+__hash (char *key)
+{
+  unsigned int h = 2166136261u;
+
+  while (*key)
+    h = (h ^ (unsigned char) *key ++) * 16777619u;
+  return h;
+}
+
+static int
+__pool_add (suggest tree, char *str, unsigned int *offset)
+{
+  size_t len = strlen (str) + 1, size;
+  char *grown;
+
+  if (tree -> poollen + len > tree -> poolsize) {
+    size = 2 * tree -> poolsize + len + 4096;
+    if ((grown = (char *) realloc (tree -> pool, size)) == NULL)
+      return (MS_errno = MSE_NOMEM);
+    tree -> pool = grown;
+    tree -> poolsize = size;
+  }
+  memcpy (tree -> pool + tree -> poollen, str, len);
+  *offset = tree -> poollen;
+  tree -> poollen += len;
+  return MSE_OK;
+}
+
+/* double the hash of keys */
+static int
+__rehash (suggest tree)
+{
+  unsigned int i, slot, nslots = tree -> nslots ? 2 * tree -> nslots : 1024;
+  int *slots;
+
+  if ((slots = (int *) calloc (nslots, sizeof (int))) == NULL)
+    return (MS_errno = MSE_NOMEM);
+  for (i = 0; i < tree -> ncompletions; i ++) {
+    slot = __hash (tree -> pool + tree -> completion [i] . key);
+    while (slots [slot & (nslots - 1)])
+      slot ++;
+    slots [slot & (nslots - 1)] = i + 1;
+  }
+  if (tree -> slots != NULL) free (tree -> slots);
+  tree -> slots = slots;
+  tree -> nslots = nslots;
+  return MSE_OK;
+}
+
+/*
+ * find (or add, with no songs yet) the completion of text [0, len) and
+ * set *id to it, -1 if the text is left out.
+ */
+static int
+__add (suggest tree, char *text, int len, int *id)
+{
+  char raw [SUGGEST_MAXLEN + 1], key [SUGGEST_MAXLEN + 1];
+  struct Completion *grown;
+  unsigned int slot;
+  int size, i;
+
+  *id = -1;
+  if (len > SUGGEST_MAXLEN)
+    return MSE_OK;
+  memcpy (raw, text, len);
+  raw [len] = '\0';
+  if (fold_text (raw, key, sizeof (key)) == 0)
+    return MSE_OK;
+
+  for (slot = __hash (key); (i = tree -> slots [slot
+                                   & (tree -> nslots - 1)]); slot ++)
+    if (!strcmp (tree -> pool + tree -> completion [i - 1] . key, key)) {
+      *id = i - 1;
+      return MSE_OK;
+    }
+
+  if (tree -> ncompletions == tree -> size) {
+    size = tree -> size ? 2 * tree -> size : 1024;
+    if ((grown = (struct Completion *)
+           realloc (tree -> completion, size * sizeof (struct Completion)))
+        == NULL)
+      return (MS_errno = MSE_NOMEM);
+    tree -> completion = grown;
+    tree -> size = size;
+  }
+  i = tree -> ncompletions;
+  if (__pool_add (tree, key, &tree -> completion [i] . key) != MSE_OK)
+    return MS_errno;
+  if (!strcmp (raw, key))
+    tree -> completion [i] . text = tree -> completion [i] . key;
+  else if (__pool_add (tree, raw, &tree -> completion [i] . text) != MSE_OK)
+    return MS_errno;
+  tree -> completion [i] . songs = 0;
+  tree -> slots [slot & (tree -> nslots - 1)] = i + 1;
+  *id = tree -> ncompletions ++;
+
+  if (2 * tree -> ncompletions >= tree -> nslots)
+    return __rehash (tree);
+  return MSE_OK;
+}
+
+/* the directories songs are in, each named as many times as its songs */
+static int
+__add_directories (suggest tree, songtable songs)
+{
+  char *path, *name, *end, *prev = NULL;
+  int song, count = songtable_length (songs), ids [SUGGEST_DEPTH];
+  int n = 0, i, len, prevlen = 0;
+
+  for (song = 0; song < count; song ++) {
+    path = songtable_server_path (songs, song);
+    len = strrchr (path, '/') - path;
+    /* songs of a directory are one after the other */
+    if (prev == NULL || len != prevlen || memcmp (path, prev, len)) {
+      for (n = 0, name = path + 1; name <= path + len && n < SUGGEST_DEPTH;
+           name = end + 1) {
+        if ((end = memchr (name, '/', path + len - name)) == NULL)
+          end = path + len;
+        if (__add (tree, name, end - name, &ids [n]) != MSE_OK)
+          return MS_errno;
+        if (ids [n] >= 0)
+          n ++;
+      }
+      prev = path;
+      prevlen = len;
+    }
+    for (i = 0; i < n; i ++)
+      tree -> completion [ids [i]] . songs ++;
+  }
+  return MSE_OK;
+}
+
+/* words of every path, not worth completing to */
+static char *extensions [] = {
+  "mp3", "ogg", "aac", "wma", "m4a", "m4p", "m3u", "flac", NULL
+};
+
+/* the words of the paths, numbers & single letters left out */
+static int
+__add_words (suggest tree, wordindex words)
+{
+  char *word;
+  int i, j, id, len, n, count = wordindex_words (words);
+
+  for (i = 0; i < count; i ++) {
+    word = wordindex_word (words, i, &len);
+    for (j = 0; j < len && word [j] >= '0' && word [j] <= '9'; j ++)
+      ;
+    if (len < 2 || j == len)
+      continue;
+    for (j = 0; extensions [j] != NULL && strcmp (word, extensions [j]); j ++)
+      ;
+    if (extensions [j] != NULL)
+      continue;
+    if (__add (tree, word, len, &id) != MSE_OK)
+      return MS_errno;
+    wordindex_postings (words, i, &n);
+    if (id >= 0 && n > tree -> completion [id] . songs)
+      tree -> completion [id] . songs = n;
+  }
+  return MSE_OK;
+}
+
+/* sort the completions by key */
+struct Sorted {
+  char *key;
+  int   id;
+};
+
+static int
+__by_key (const void *a, const void *b)
+{
+  return strcmp (((struct Sorted *) a) -> key, ((struct Sorted *) b) -> key);
+}
+
+static int
+__sort (suggest tree)
+{
+  struct Completion *sorted;
+  struct Sorted *order;
+  int i;
+
+  if ((order = (struct Sorted *) malloc ((tree -> ncompletions + 1)
+                                         * sizeof (struct Sorted))) == NULL
+      || (sorted = (struct Completion *)
+                     malloc ((tree -> ncompletions + 1)
+                             * sizeof (struct Completion))) == NULL) {
+    if (order != NULL) free (order);
+    return (MS_errno = MSE_NOMEM);
+  }
+  for (i = 0; i < tree -> ncompletions; i ++) {
+    order [i] . key = tree -> pool + tree -> completion [i] . key;
+    order [i] . id = i;
+  }
+  qsort (order, tree -> ncompletions, sizeof (struct Sorted), __by_key);
+  for (i = 0; i < tree -> ncompletions; i ++)
+    sorted [i] = tree -> completion [order [i] . id];
+  free (order);
+  free (tree -> completion);
+  tree -> completion = sorted;
+  tree -> size = tree -> ncompletions;
+  return MSE_OK;
+}
+
+/* room for n more nodes */
+static int
+__grow_nodes (suggest tree, int n)
+{
+  int size = tree -> nodesize;
+  void *grown;
+
+  if (tree -> nnodes + n <= size)
+    return MSE_OK;
+  while (tree -> nnodes + n > size)
+    size = size ? 2 * size : 1024;
+  /* the arrays grown already are kept if the next one cannot grow */
+  if ((grown = realloc (tree -> label, size * sizeof (int))) == NULL)
+    return (MS_errno = MSE_NOMEM);
+  tree -> label = grown;
+  if ((grown = realloc (tree -> labellen, size)) == NULL)
+    return (MS_errno = MSE_NOMEM);
+  tree -> labellen = grown;
+  if ((grown = realloc (tree -> child, size * sizeof (int))) == NULL)
+    return (MS_errno = MSE_NOMEM);
+  tree -> child = grown;
+  if ((grown = realloc (tree -> nchild, size * sizeof (short))) == NULL)
+    return (MS_errno = MSE_NOMEM);
+  tree -> nchild = grown;
+  if ((grown = realloc (tree -> entry, size * sizeof (int))) == NULL)
+    return (MS_errno = MSE_NOMEM);
+  tree -> entry = grown;
+  tree -> nodesize = size;
+  return MSE_OK;
+}
+
+/*
+ * make node n out of the completions [lo, hi), whose keys share their
+ * first "from" bytes: its label runs on as long as they all agree, then
+ * they are split by their next byte among its children.
+ */
+static int
+__node (suggest tree, int n, int lo, int hi, int from)
+{
+  char *first, *last, *key;
+  int depth = from, groups, glo, c;
+
+  tree -> label [n] = 0;
+  tree -> labellen [n] = 0;
+  tree -> child [n] = tree -> nnodes;
+  tree -> nchild [n] = 0;
+  tree -> entry [n] = -1;
+  if (lo == hi) /* an empty library */
+    return MSE_OK;
+
+  first = tree -> pool + tree -> completion [lo] . key;
+  last = tree -> pool + tree -> completion [hi - 1] . key;
+  if (n > 0) /* keys are sorted: what first & last share, all do */
+    while (first [depth] != '\0' && first [depth] == last [depth])
+      depth ++;
+  tree -> label [n] = tree -> completion [lo] . key + from;
+  tree -> labellen [n] = depth - from;
+  if (first [depth] == '\0')
+    tree -> entry [n] = lo ++;
+
+  for (groups = 0, c = lo; c < hi; c ++)
+    if (c == lo || tree -> pool [tree -> completion [c] . key + depth]
+                   != tree -> pool [tree -> completion [c - 1] . key + depth])
+      groups ++;
+  if (__grow_nodes (tree, groups) != MSE_OK)
+    return MS_errno;
+  tree -> child [n] = tree -> nnodes;
+  tree -> nchild [n] = groups;
+  tree -> nnodes += groups;
+
+  for (groups = 0, glo = lo; glo < hi; glo = c, groups ++) {
+    key = tree -> pool + tree -> completion [glo] . key;
+    for (c = glo + 1; c < hi
+         && tree -> pool [tree -> completion [c] . key + depth] == key [depth];
+         c ++)
+      ;
+    if (__node (tree, tree -> child [n] + groups, glo, c, depth) != MSE_OK)
+      return MS_errno;
+  }
+  return MSE_OK;
+}
+
+/* more songs first, then by key */
+static int
+__best (suggest tree, int a, int b)
+{
+  if (tree -> completion [a] . songs != tree -> completion [b] . songs)
+    return tree -> completion [a] . songs > tree -> completion [b] . songs;
+  return a < b;
+}
+
+/*
+ * keep the best completions below each node, out of its own and of its
+ * children's (children come after their parent, so they are done first).
+ */
+static int
+__tops (suggest tree)
+{
+  int n, c, i, k, cand [SUGGEST_MAX + 1], ncand, id, *grown, size;
+
+  if ((tree -> top = malloc (tree -> nnodes * sizeof (int))) == NULL
+      || (tree -> ntop = malloc (tree -> nnodes)) == NULL)
+    return (MS_errno = MSE_NOMEM);
+  for (n = tree -> nnodes - 1; n >= 0; n --) {
+    /* insertion into a short sorted list, the worst dropped */
+    ncand = 0;
+    for (c = -1; c < tree -> nchild [n]; c ++)
+      for (i = 0; i < (c < 0 ? tree -> entry [n] >= 0
+                             : tree -> ntop [tree -> child [n] + c]); i ++) {
+        id = c < 0 ? tree -> entry [n]
+                   : tree -> tops [tree -> top [tree -> child [n] + c] + i];
+        for (k = ncand; k > 0 && __best (tree, id, cand [k - 1]); k --)
+          cand [k] = cand [k - 1];
+        if (k == SUGGEST_MAX)
+          break; /* children's tops are sorted, the rest are worse */
+        cand [k] = id;
+        if (ncand < SUGGEST_MAX) ncand ++;
+      }
+
+    if (tree -> ntops + ncand > tree -> topsize) {
+      size = 2 * tree -> topsize + ncand + 1024;
+      if ((grown = (int *) realloc (tree -> tops, size * sizeof (int)))
+          == NULL)
+        return (MS_errno = MSE_NOMEM);
+      tree -> tops = grown;
+      tree -> topsize = size;
+    }
+    tree -> top [n] = tree -> ntops;
+    tree -> ntop [n] = ncand;
+    memcpy (tree -> tops + tree -> ntops, cand, ncand * sizeof (int));
+    tree -> ntops += ncand;
+  }
+  return MSE_OK;
+}
+
+/* build the completions of a (sealed) library */
+suggest
+suggest_build (songtable songs, wordindex words)
+{
+  suggest tree;
+
+  if ((tree = (suggest) calloc (1, sizeof (struct Suggest))) == NULL) {
+    MS_errno = MSE_NOMEM;
+    return NULL;
+  }
+  if (__rehash (tree) != MSE_OK
+      || __add_directories (tree, songs) != MSE_OK
+      || __add_words (tree, words) != MSE_OK
+      || __sort (tree) != MSE_OK
+      || __grow_nodes (tree, 1) != MSE_OK)
+    goto ErrorEpilogue;
+  free (tree -> slots);
+  tree -> slots = NULL;
+
+  tree -> nnodes = 1;
+  if (__node (tree, 0, 0, tree -> ncompletions, 0) != MSE_OK
+      || __tops (tree) != MSE_OK)
+    goto ErrorEpilogue;
+  free (tree -> entry);
+  tree -> entry = NULL;
+  return tree;
+
+ ErrorEpilogue:
+  suggest_free (tree);
+  return NULL;
+}
+
+/*
+ * the best completions (at most max) of a prefix, folded as the keys
+ * are. returns how many were found, their ids are set in found.
+ */
+int
+suggest_lookup (suggest tree, char *prefix, int *found, int max)
+{
+  char key [SUGGEST_MAXLEN + 1], *label;
+  int len, pos = 0, node = 0, lo, hi, mid, n;
+
+  if (strlen (prefix) > SUGGEST_MAXLEN)
+    return 0;
+  len = fold_text (prefix, key, sizeof (key));
+
+  while (pos < len) {
+    /* the child whose label starts with the next byte */
+    for (lo = tree -> child [node], hi = lo + tree -> nchild [node];
+         lo < hi; ) {
+      mid = (lo + hi) / 2;
+      if ((unsigned char) tree -> pool [tree -> label [mid]]
+          < (unsigned char) key [pos])
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    if (lo == tree -> child [node] + tree -> nchild [node]
+        || tree -> pool [tree -> label [lo]] != key [pos])
+      return 0;
+    node = lo;
+    label = tree -> pool + tree -> label [node];
+    n = tree -> labellen [node] < len - pos ? tree -> labellen [node]
+                                            : len - pos;
+    if (memcmp (label, key + pos, n))
+      return 0;
+    pos += n;
+  }
+
+  n = tree -> ntop [node] < max ? tree -> ntop [node] : max;
+  memcpy (found, tree -> tops + tree -> top [node], n * sizeof (int));
+  return n;
+}
+
+/* the text of a completion, as it is to be shown */
+char *
+suggest_text (suggest tree, int id)
+{
+  return tree -> pool + tree -> completion [id] . text;
+}
+
+/* the songs a completion appears in */
+int
+suggest_songs (suggest tree, int id)
+{
+  return tree -> completion [id] . songs;
+}
+
+/* memory used by the completions */
+size_t
+suggest_bytes (suggest tree)
+{
+  return sizeof (struct Suggest) + tree -> poolsize
+         + tree -> size * sizeof (struct Completion)
+         + tree -> nodesize * (3 * sizeof (int) + sizeof (short) + 1)
+         + tree -> nnodes * (sizeof (int) + 1)
+         + tree -> topsize * sizeof (int);
+}
+
+void
+suggest_free (suggest tree)
+{
+  if (tree -> completion != NULL) free (tree -> completion);
+  if (tree -> pool != NULL) free (tree -> pool);
+  if (tree -> slots != NULL) free (tree -> slots);
+  if (tree -> label != NULL) free (tree -> label);
+  if (tree -> labellen != NULL) free (tree -> labellen);
+  if (tree -> child != NULL) free (tree -> child);
+  if (tree -> nchild != NULL) free (tree -> nchild);
+  if (tree -> entry != NULL) free (tree -> entry);
+  if (tree -> top != NULL) free (tree -> top);
+  if (tree -> ntop != NULL) free (tree -> ntop);
+  if (tree -> tops != NULL) free (tree -> tops);
+  free (tree);
+  return;
+}
@@ -0,0 +1,25 @@
+# ifndef __SUGGEST_LIB__
+# define __SUGGEST_LIB__
+
+# include <stddef.h>
+# include "songtable.h"
+# include "wordindex.h"
+
+  /* completions kept for each prefix */
+# define SUGGEST_MAX 10
+
+/*
+ * completions of search prefixes: the names of the directories songs
+ * are in (artists, albums) and the words of their paths, the ones most
+ * songs have first.
+ */
+typedef struct Suggest *suggest;
+
+suggest suggest_build  (songtable, wordindex);
+int     suggest_lookup (suggest, char *, int *, int);
+char*   suggest_text   (suggest, int);
+int     suggest_songs  (suggest, int);
+size_t  suggest_bytes  (suggest);
+void    suggest_free   (suggest);
+
+# endif
@@ -0,0 +1,728 @@
+/* tags.c: song metadata (id3v2, vorbis comments, flac & mp4 atoms) */
+# include <stdio.h>
+# include <stdlib.h>
+# include <string.h>
+# include <strings.h>
+# include <unistd.h>
+# include <fcntl.h>
+# include <pthread.h>
+# include <sys/types.h>
+# include <sys/stat.h>
+
+# include "../mstream/mserrors.h"
+# include "../sharedlib/fold.h"
+# include "songtable.h"
+# include "playlist.h"
+# include "tags.h"
+# include "seek.h"
+
+  /* bytes read from the start of each file, most tags fit in here */
+# define TAG_WINDOW    16384
+  /* largest single block fetched outside the window */
+# define TAG_SCRATCH    4096
+  /* longest value kept for a field */
+# define TAG_MAXLEN      255
+  /* stop walking frames / atoms after that many */
+# define TAG_MAXSTEPS    512
+  /* songs tagged between two library generations */
+# define TAG_BATCH      1024
+
+struct SongTags {                        /* metadata of a song */
+  unsigned int   added;                  /* modification time of the file */
+  unsigned int   duration;               /* length in seconds */
+  unsigned short bitrate;                /* average bitrate in kbit/s */
+  unsigned char  length [TAG_FIELDS];    /* length of each field */
+  unsigned char  folded [TAG_FIELDS];    /* length of each folded field */
+  char           text [];                /* fields, then folded fields */
+};
+
+/*
+ * a reader keeps the first bytes of the file in memory and fetches
+ * anything else on demand, a small block at a time.
+ */
+struct TagReader {
+  int            fd;
+  off_t          size;
+  ssize_t        wlen;
+  unsigned char  window [TAG_WINDOW];
+  unsigned char  scratch [TAG_SCRATCH];
+  char          *field [TAG_FIELDS];
+  unsigned int   added, duration, bitrate;
+};
+
+static char *field_names [TAG_FIELDS] = {"artist", "album", "title"};
+
+/* get len bytes at offset off, either from the window or from the disk */
+static unsigned char *
+__tag_at (struct TagReader *reader, off_t off, size_t len)
+{
+  if (off < 0 || len > TAG_SCRATCH || off + len > reader -> size)
+    return NULL;
+  if (off + len <= reader -> wlen)
+    return reader -> window + off;
+  if (pread (reader -> fd, reader -> scratch, len, off) != len)
+    return NULL;
+  return reader -> scratch;
+}
+
+static unsigned int
+__be32 (unsigned char *p)
+{
+  return (p [0] << 24) | (p [1] << 16) | (p [2] << 8) | p [3];
+}
+
+static unsigned int
+__le32 (unsigned char *p)
+{
+  return p [0] | (p [1] << 8) | (p [2] << 16) | ((unsigned int) p [3] << 24);
+}
+
+static unsigned int
+__syncsafe (unsigned char *p)
+{
+  return ((p [0] & 0x7f) << 21) | ((p [1] & 0x7f) << 14)
+         | ((p [2] & 0x7f) << 7) | (p [3] & 0x7f);
+}
+
+/* append the utf-8 encoding of code point c, if there is room */
+static int
+__put_utf8 (char *out, int len, unsigned int c)
+{
+  if (c < 0x80 && len < TAG_MAXLEN) {
+    out [len ++] = c;
+  }
+  else if (c < 0x800 && len + 1 < TAG_MAXLEN) {
+    out [len ++] = 0xc0 | (c >> 6);
+    out [len ++] = 0x80 | (c & 0x3f);
+  }
+  else if (c < 0x10000 && len + 2 < TAG_MAXLEN) {
+    out [len ++] = 0xe0 | (c >> 12);
+    out [len ++] = 0x80 | ((c >> 6) & 0x3f);
+    out [len ++] = 0x80 | (c & 0x3f);
+  }
+  else if (c >= 0x10000 && len + 3 < TAG_MAXLEN) {
+    out [len ++] = 0xf0 | (c >> 18);
+    out [len ++] = 0x80 | ((c >> 12) & 0x3f);
+    out [len ++] = 0x80 | ((c >> 6) & 0x3f);
+    out [len ++] = 0x80 | (c & 0x3f);
+  }
+  return len;
+}
+
+/*
+ * save a field value, converting it to utf-8. encoding follows the
+ * id3v2 convention: 0 latin-1, 1 utf-16 with bom, 2 utf-16be, 3 utf-8.
+ * the first value found for a field wins.
+ */
+static void
+__tag_set (struct TagReader *reader, int field, unsigned char *data,
+           int datalen, int encoding)
+{
+  char *out;
+  int i, len = 0, bigendian = 1;
+  unsigned int c, lo;
+
+  if (field < 0 || reader -> field [field] != NULL || datalen <= 0)
+    return;
+  if ((out = (char *) malloc (TAG_MAXLEN + 1)) == NULL)
+    return;
+
+  switch (encoding) {
+  case 0:
+    for (i = 0; i < datalen && data [i] != '\0'; i ++)
+      len = __put_utf8 (out, len, data [i]);
+    break;
+  case 1:
+  case 2:
+    i = 0;
+    if (encoding == 1 && datalen >= 2) {
+      bigendian = !(data [0] == 0xff && data [1] == 0xfe);
+      if ((data [0] == 0xff && data [1] == 0xfe)
+          || (data [0] == 0xfe && data [1] == 0xff))
+        i = 2;
+    }
+    for (; i + 1 < datalen; i += 2) {
+      c = bigendian ? (data [i] << 8) | data [i+1] : data [i] | (data [i+1] << 8);
+      if (!c) break;
+      if (c >= 0xd800 && c < 0xdc00 && i + 3 < datalen) {
+        lo = bigendian ? (data [i+2] << 8) | data [i+3]
+                       : data [i+2] | (data [i+3] << 8);
+        c = 0x10000 + ((c - 0xd800) << 10) + (lo - 0xdc00);
+        i += 2;
+      }
+      len = __put_utf8 (out, len, c);
+    }
+    break;
+  default:
+    for (i = 0; i < datalen && data [i] != '\0' && len < TAG_MAXLEN; i ++)
+      out [len ++] = data [i];
+    /* do not cut a multibyte character in half */
+    if (i < datalen && data [i] != '\0')
+      while (len > 0 && (out [len - 1] & 0xc0) == 0x80) len --;
+    if (len > 0 && (out [len - 1] & 0xc0) == 0xc0) len --;
+    break;
+  }
+  /* trim trailing blanks (id3v1 pads with spaces) */
+  while (len > 0 && out [len - 1] == ' ') len --;
+  if (!len) {
+    free (out);
+    return;
+  }
+  out [len] = '\0';
+  reader -> field [field] = out;
+  return;
+}
+
+/* duration & bitrate of an mp3 stream starting at offset start */
+static void
+__tag_mpeg (struct TagReader *reader, off_t start)
+{
+  unsigned char *h;
+  int bitrate, samplerate, samples, side, i;
+  unsigned int frames;
+
+  /* look for the first frame within the window */
+  for (i = 0; i < 4096; i ++) {
+    if ((h = __tag_at (reader, start + i, 4)) == NULL)
+      return;
+    if (seek_mpeg_header (h, &bitrate, &samplerate, &samples))
+      break;
+  }
+  if (i == 4096)
+    return;
+  start += i;
+
+  /* a xing/info header gives the exact frame count of vbr files */
+  if (((h [1] >> 3) & 3) == 3)
+    side = ((h [3] >> 6) == 3) ? 17 : 32;
+  else
+    side = ((h [3] >> 6) == 3) ? 9 : 17;
+  if ((h = __tag_at (reader, start + 4 + side, 12)) != NULL
+      && (!memcmp (h, "Xing", 4) || !memcmp (h, "Info", 4))
+      && (__be32 (h + 4) & 1) && (frames = __be32 (h + 8)) > 0) {
+    reader -> duration = (unsigned long long) frames * samples / samplerate;
+    if (reader -> duration)
+      reader -> bitrate = (reader -> size - start) * 8 / 1000
+                          / reader -> duration;
+    return;
+  }
+  reader -> bitrate = bitrate;
+  reader -> duration = (reader -> size - start) * 8 / 1000 / bitrate;
+  return;
+}
+
+/* id3v2 text frames, followed by the audio stream */
+static void
+__tag_id3v2 (struct TagReader *reader)
+{
+  unsigned char *h, major;
+  off_t off, end;
+  unsigned int size;
+  int idlen, steps, field;
+  char id [5];
+
+  h = reader -> window;
+  major = h [3];
+  end = 10 + __syncsafe (h + 6) + ((h [5] & 0x10) ? 10 : 0);
+  idlen = major == 2 ? 3 : 4;
+  off = 10;
+  if ((h [5] & 0x40) && major > 2) { /* skip the extended header */
+    if ((h = __tag_at (reader, off, 4)) == NULL)
+      return;
+    off += major == 3 ? __be32 (h) + 4 : __syncsafe (h);
+  }
+
+  for (steps = 0; steps < TAG_MAXSTEPS && off + idlen * 2 < end; steps ++) {
+    if ((h = __tag_at (reader, off, idlen == 3 ? 6 : 10)) == NULL
+        || h [0] == '\0') /* padding */
+      break;
+    memcpy (id, h, idlen);
+    id [idlen] = '\0';
+    if (idlen == 3) {
+      size = (h [3] << 16) | (h [4] << 8) | h [5];
+      off += 6;
+    }
+    else {
+      size = major == 4 ? __syncsafe (h + 4) : __be32 (h + 4);
+      off += 10;
+    }
+
+    field = -1;
+    if (!strcmp (id, "TPE1") || !strcmp (id, "TP1")) field = TAG_ARTIST;
+    else if (!strcmp (id, "TALB") || !strcmp (id, "TAL")) field = TAG_ALBUM;
+    else if (!strcmp (id, "TIT2") || !strcmp (id, "TT2")) field = TAG_TITLE;
+
+    if (field >= 0 && size > 1
+        && (h = __tag_at (reader, off, size < TAG_SCRATCH ? size
+                                                          : TAG_SCRATCH)))
+      __tag_set (reader, field, h + 1,
+                 (size < TAG_SCRATCH ? size : TAG_SCRATCH) - 1, h [0]);
+    else if ((!strcmp (id, "TLEN") || !strcmp (id, "TLE")) && size > 1
+             && size < 32 && (h = __tag_at (reader, off, size)) != NULL)
+      reader -> duration = strtol ((char *) h + 1, NULL, 10) / 1000;
+    off += size;
+  }
+
+  __tag_mpeg (reader, end);
+  return;
+}
+
+/* id3v1 trailer, used when nothing else was found */
+static void
+__tag_id3v1 (struct TagReader *reader)
+{
+  unsigned char *h;
+
+  if ((h = __tag_at (reader, reader -> size - 128, 128)) == NULL
+      || memcmp (h, "TAG", 3))
+    return;
+  __tag_set (reader, TAG_TITLE, h + 3, 30, 0);
+  __tag_set (reader, TAG_ARTIST, h + 33, 30, 0);
+  __tag_set (reader, TAG_ALBUM, h + 63, 30, 0);
+  return;
+}
+
+/* a vorbis comment block: vendor string, then "NAME=value" entries */
+static void
+__tag_vorbis_comment (struct TagReader *reader, unsigned char *p, int len)
+{
+  unsigned int n, count, i, eq;
+  int field;
+  char name [16];
+
+  if (len < 8 || (n = __le32 (p)) > len - 8)
+    return;
+  p += 4 + n;
+  len -= 4 + n;
+  count = __le32 (p);
+  p += 4;
+  len -= 4;
+  for (i = 0; i < count && len >= 4; i ++) {
+    if ((n = __le32 (p)) > len - 4)
+      return;
+    p += 4;
+    for (eq = 0; eq < n && eq < sizeof (name) - 1 && p [eq] != '='; eq ++)
+      name [eq] = p [eq];
+    name [eq] = '\0';
+    if (eq < n && p [eq] == '=') {
+      field = -1;
+      if (!strcasecmp (name, "ARTIST")) field = TAG_ARTIST;
+      else if (!strcasecmp (name, "ALBUM")) field = TAG_ALBUM;
+      else if (!strcasecmp (name, "TITLE")) field = TAG_TITLE;
+      __tag_set (reader, field, p + eq + 1, n - eq - 1, 3);
+    }
+    p += n;
+    len -= 4 + n;
+  }
+  return;
+}
+
+/* flac metadata blocks: streaminfo & vorbis comment */
+static void
+__tag_flac (struct TagReader *reader, off_t off)
+{
+  unsigned char *h;
+  unsigned int len, rate;
+  unsigned long long total;
+  int steps, last = 0;
+
+  off += 4;
+  for (steps = 0; steps < TAG_MAXSTEPS && !last; steps ++) {
+    if ((h = __tag_at (reader, off, 4)) == NULL)
+      return;
+    last = h [0] & 0x80;
+    len = (h [1] << 16) | (h [2] << 8) | h [3];
+    off += 4;
+    switch (h [0] & 0x7f) {
+    case 0: /* streaminfo */
+      if ((h = __tag_at (reader, off, 18)) == NULL)
+        return;
+      rate = (h [10] << 12) | (h [11] << 4) | (h [12] >> 4);
+      total = ((unsigned long long) (h [13] & 0x0f) << 32) | __be32 (h + 14);
+      if (rate && total / rate)
+        reader -> duration = total / rate;
+      break;
+    case 4: /* vorbis comment */
+      if ((h = __tag_at (reader, off, len < TAG_SCRATCH ? len
+                                                        : TAG_SCRATCH)))
+        __tag_vorbis_comment (reader, h, len < TAG_SCRATCH ? len
+                                                           : TAG_SCRATCH);
+      break;
+    }
+    off += len;
+  }
+  if (reader -> duration)
+    reader -> bitrate = (reader -> size - off) * 8 / 1000
+                        / reader -> duration;
+  return;
+}
+
+/* ogg: identification & comment packets, last granule for the duration */
+static void
+__tag_ogg (struct TagReader *reader)
+{
+  unsigned char *packet, *p, *page, *end;
+  unsigned int rate = 0, segs, i, plen = 0, npackets = 0, preskip = 0;
+  long long granule = -1;
+  off_t tail;
+  ssize_t tlen;
+
+  if ((packet = (unsigned char *) malloc (TAG_WINDOW)) == NULL)
+    return;
+
+  /* reassemble the first packets of the stream out of the window */
+  page = reader -> window;
+  end = reader -> window + reader -> wlen;
+  while (npackets < 2 && page + 27 < end && !memcmp (page, "OggS", 4)) {
+    segs = page [26];
+    p = page + 27 + segs;
+    if (p > end) break;
+    for (i = 0; i < segs && npackets < 2; i ++) {
+      if (p + page [27 + i] > end || plen + page [27 + i] > TAG_WINDOW)
+        break;
+      memcpy (packet + plen, p, page [27 + i]);
+      plen += page [27 + i];
+      p += page [27 + i];
+      if (page [27 + i] == 255) continue;
+      /* a packet is complete */
+      if (npackets == 0 && plen >= 28 && !memcmp (packet, "\001vorbis", 7)) {
+        rate = __le32 (packet + 12);
+        reader -> bitrate = (int) __le32 (packet + 20) > 0
+                            ? __le32 (packet + 20) / 1000 : 0;
+      }
+      else if (npackets == 0 && plen >= 19 && !memcmp (packet, "OpusHead", 8)) {
+        rate = 48000;
+        preskip = packet [10] | (packet [11] << 8);
+      }
+      else if (npackets == 1 && plen > 7 && !memcmp (packet, "\003vorbis", 7))
+        __tag_vorbis_comment (reader, packet + 7, plen - 7);
+      else if (npackets == 1 && plen > 8 && !memcmp (packet, "OpusTags", 8))
+        __tag_vorbis_comment (reader, packet + 8, plen - 8);
+      npackets ++;
+      plen = 0;
+    }
+    page = p;
+  }
+
+  /* the granule position of the last page tells the length */
+  tail = reader -> size > TAG_WINDOW ? reader -> size - TAG_WINDOW : 0;
+  if (rate && (tlen = pread (reader -> fd, packet, TAG_WINDOW, tail)) > 27)
+    for (p = packet + tlen - 27; p >= packet; p --)
+      if (!memcmp (p, "OggS", 4)) {
+        granule = (long long) __le32 (p + 6)
+                  | ((long long) __le32 (p + 10) << 32);
+        break;
+      }
+  if (granule > preskip) {
+    reader -> duration = (granule - preskip) / rate;
+    if (!reader -> bitrate && reader -> duration)
+      reader -> bitrate = reader -> size * 8 / 1000 / reader -> duration;
+  }
+
+  free (packet);
+  return;
+}
+
+/* walk the mp4 atoms under [off, end) looking for metadata */
+static void
+__tag_atoms (struct TagReader *reader, off_t off, off_t end, int depth)
+{
+  unsigned char *h;
+  unsigned long long size;
+  unsigned int timescale, hlen;
+  char type [5];
+  int steps, field;
+
+  for (steps = 0; steps < TAG_MAXSTEPS && off + 8 <= end; steps ++) {
+    if ((h = __tag_at (reader, off, 8)) == NULL)
+      return;
+    size = __be32 (h);
+    memcpy (type, h + 4, 4);
+    type [4] = '\0';
+    hlen = 8;
+    if (size == 1) { /* 64 bit size */
+      if ((h = __tag_at (reader, off + 8, 8)) == NULL)
+        return;
+      size = ((unsigned long long) __be32 (h) << 32) | __be32 (h + 4);
+      hlen = 16;
+    }
+    else if (size == 0)
+      size = end - off;
+    if (size < hlen || off + size > end)
+      return;
+
+    if (!strcmp (type, "moov") || !strcmp (type, "udta")
+        || !strcmp (type, "ilst"))
+      __tag_atoms (reader, off + hlen, off + size, depth + 1);
+    else if (!strcmp (type, "meta"))  /* a full atom: skip version/flags */
+      __tag_atoms (reader, off + hlen + 4, off + size, depth + 1);
+    else if (!strcmp (type, "mvhd")
+             && (h = __tag_at (reader, off + hlen, 32)) != NULL) {
+      if (h [0] == 1) {
+        timescale = __be32 (h + 20);
+        if (timescale)
+          reader -> duration = (((unsigned long long) __be32 (h + 24) << 32)
+                                | __be32 (h + 28)) / timescale;
+      }
+      else if ((timescale = __be32 (h + 12)))
+        reader -> duration = __be32 (h + 16) / timescale;
+    }
+    else if (depth > 0 && size > hlen + 16 && size < TAG_SCRATCH
+             && ((unsigned char) type [0] == 0xa9 || !strcmp (type, "aART"))
+             && (h = __tag_at (reader, off + hlen, size - hlen)) != NULL
+             && !memcmp (h + 4, "data", 4)) {
+      field = -1;
+      if (!strcmp (type + 1, "ART")) field = TAG_ARTIST;
+      else if (!strcmp (type + 1, "alb")) field = TAG_ALBUM;
+      else if (!strcmp (type + 1, "nam")) field = TAG_TITLE;
+      /* data atom: header, type, locale, then the value */
+      __tag_set (reader, field, h + 16, size - hlen - 16, 3);
+    }
+    off += size;
+  }
+  return;
+}
+
+/* pack the fields of a reader into a compact tags entry */
+static stags
+__tags_pack (struct TagReader *reader)
+{
+  stags tags;
+  int i, len = 0;
+  char *cursor;
+
+  /* folded fields are no longer than the fields, and padded for searches */
+  for (i = 0; i < TAG_FIELDS; i ++)
+    len += (reader -> field [i] ? strlen (reader -> field [i]) : 0) + 1;
+  if ((tags = (stags) malloc (sizeof (struct SongTags) + 2 * len
+                              + FOLD_PADDING)) == NULL) {
+    MS_errno = MSE_NOMEM;
+    return NULL;
+  }
+  tags -> added = reader -> added;
+  tags -> duration = reader -> duration;
+  tags -> bitrate = reader -> bitrate > 0xffff ? 0xffff : reader -> bitrate;
+  for (i = 0, cursor = tags -> text; i < TAG_FIELDS; i ++) {
+    tags -> length [i] = reader -> field [i] ? strlen (reader -> field [i])
+                                             : 0;
+    memcpy (cursor, reader -> field [i] ? reader -> field [i] : "",
+            tags -> length [i] + 1);
+    cursor += tags -> length [i] + 1;
+  }
+  for (i = 0; i < TAG_FIELDS; i ++) {
+    tags -> folded [i] = fold_text (tags_field (tags, i), cursor,
+                                    tags -> length [i] + 1);
+    cursor += tags -> folded [i] + 1;
+  }
+  memset (cursor, '\0', FOLD_PADDING);
+
+  return tags;
+}
+
+/*
+ * read the metadata of the song open at fd. only the first bytes of the
+ * file and the few blocks they point to are read.
+ */
+stags
+tags_read (int fd)
+{
+  struct TagReader *reader;
+  struct stat st;
+  unsigned char *h, *flac;
+  stags tags;
+  int i;
+
+  if ((reader = (struct TagReader *) malloc (sizeof (struct TagReader)))
+      == NULL) {
+    MS_errno = MSE_NOMEM;
+    return NULL;
+  }
+  memset (reader -> field, '\0', sizeof (reader -> field));
+  reader -> duration = reader -> bitrate = 0;
+  reader -> fd = fd;
+  if (fstat (reader -> fd, &st) < 0
+      || (reader -> wlen = pread (reader -> fd, reader -> window,
+                                  TAG_WINDOW, 0)) < 0) {
+    free (reader);
+    MS_errno = MSE_OS;
+    return NULL;
+  }
+  reader -> size = st.st_size;
+  reader -> added = st.st_mtime;
+  h = reader -> window;
+
+  if (reader -> wlen >= 10 && !memcmp (h, "ID3", 3)) {
+    /* the tag may well be larger than the window (cover art) */
+    if ((flac = __tag_at (reader, 10 + __syncsafe (h + 6), 4)) != NULL
+        && !memcmp (flac, "fLaC", 4))
+      __tag_flac (reader, 10 + __syncsafe (h + 6));
+    else
+      __tag_id3v2 (reader);
+  }
+  else if (reader -> wlen >= 8 && !memcmp (h, "fLaC", 4))
+    __tag_flac (reader, 0);
+  else if (reader -> wlen >= 28 && !memcmp (h, "OggS", 4))
+    __tag_ogg (reader);
+  else if (reader -> wlen >= 8 && !memcmp (h + 4, "ftyp", 4))
+    __tag_atoms (reader, 0, reader -> size, 0);
+  else if (reader -> wlen >= 4)
+    __tag_mpeg (reader, 0);
+  if (reader -> field [TAG_ARTIST] == NULL && reader -> field [TAG_TITLE] == NULL)
+    __tag_id3v1 (reader);
+  if (reader -> duration && !reader -> bitrate) /* a rough estimate */
+    reader -> bitrate = reader -> size * 8 / 1000 / reader -> duration;
+
+  tags = __tags_pack (reader);
+  for (i = 0; i < TAG_FIELDS; i ++)
+    if (reader -> field [i] != NULL) free (reader -> field [i]);
+  free (reader);
+
+  return tags;
+}
+
+/* get a field of the tags, the empty string if it is not known */
+char *
+tags_field (stags tags, int field)
+{
+  char *cursor;
+  int i;
+
+  if (tags == NULL || field < 0 || field >= TAG_FIELDS)
+    return "";
+  for (i = 0, cursor = tags -> text; i < field; i ++)
+    cursor += tags -> length [i] + 1;
+  return cursor;
+}
+
+/*
+ * get a folded field and its length, or all of them (NUL separated) if
+ * field is -1. the result may be searched with fold_find.
+ */
+char *
+tags_folded (stags tags, int field, int *len)
+{
+  char *cursor;
+  int i;
+
+  *len = 0;
+  if (tags == NULL || field < -1 || field >= TAG_FIELDS)
+    return "";
+  for (i = 0, cursor = tags -> text; i < TAG_FIELDS; i ++)
+    cursor += tags -> length [i] + 1;
+  for (i = 0; i < field; i ++)
+    cursor += tags -> folded [i] + 1;
+  if (field >= 0)
+    *len = tags -> folded [field];
+  else
+    for (i = 0; i < TAG_FIELDS; i ++)
+      *len += tags -> folded [i] + (i > 0);
+  return cursor;
+}
+
+/* map a field name (eg "artist") to its id, -1 if unknown */
+int
+tags_field_id (char *name)
+{
+  int i;
+
+  for (i = 0; i < TAG_FIELDS; i ++)
+    if (!strcmp (name, field_names [i]))
+      return i;
+  return -1;
+}
+
+unsigned int
+tags_added (stags tags)
+{
+  return tags == NULL ? 0 : tags -> added;
+}
+
+int
+tags_duration (stags tags)
+{
+  return tags == NULL ? 0 : tags -> duration;
+}
+
+int
+tags_bitrate (stags tags)
+{
+  return tags == NULL ? 0 : tags -> bitrate;
+}
+
+void
+tags_free (stags tags)
+{
+  free (tags);
+  return;
+}
+
+/*
+ * the extraction pool: a few threads share a cursor over the library and
+ * tag one song at a time. the number of threads bounds the I/O going on.
+ */
+static songtable tags_songs;
+static int tags_cursor = 0, tags_done = 0, tags_running = 0;
+
+static void *
+__tags_worker (void *arg)
+{
+  stags tags;
+  int song, fd;
+
+  while ((song = __sync_fetch_and_add (&tags_cursor, 1))
+         < songtable_length (tags_songs)) {
+    if ((fd = songtable_open (tags_songs, song)) < 0)
+      continue;
+    if ((tags = tags_read (fd)) != NULL)
+      songtable_set_tags (tags_songs, song, tags);
+    close (fd);
+    /* let cached search results notice the new tags, now and then */
+    if (!(__sync_add_and_fetch (&tags_done, 1) % TAG_BATCH))
+      library_changed ();
+  }
+
+  if (!__sync_sub_and_fetch (&tags_running, 1)) /* the last one out */
+    library_changed ();
+  return NULL;
+}
+
+/*
+ * start extracting the metadata of every song in the library in the
+ * background, using thread_num threads. returns at once.
+ */
+int
+tags_extract (songtable songs, int thread_num)
+{
+  pthread_attr_t attr;
+  pthread_t tid;
+  int i;
+
+  tags_cursor = 0;
+  tags_running = thread_num;
+  __sync_synchronize (); /* running before tags_complete sees the songs */
+  tags_songs = songs;
+
+  if ((MS_pthread_errno = pthread_attr_init (&attr))
+      || (MS_pthread_errno =
+            pthread_attr_setdetachstate (&attr, PTHREAD_CREATE_DETACHED)))
+    return (MS_errno = MSE_PTHREAD);
+  for (i = 0; i < thread_num; i ++)
+    if ((MS_pthread_errno =
+           pthread_create (&tid, &attr, &__tags_worker, NULL))) {
+      pthread_attr_destroy (&attr);
+      /* those that did not start are out already */
+      if (!__sync_sub_and_fetch (&tags_running, thread_num - i))
+        library_changed ();
+      return (MS_errno = MSE_PTHREAD);
+    }
+  pthread_attr_destroy (&attr);
+
+  return MSE_OK;
+}
+
+/* whether the metadata of every song of songs was extracted */
+int
+tags_complete (songtable songs)
+{
+  return songs == tags_songs && !__sync_fetch_and_add (&tags_running, 0);
+}
@@ -0,0 +1,24 @@
+# ifndef __SONG_TAGS_LIB__
+# define __SONG_TAGS_LIB__
+
+typedef struct SongTags *stags;
+struct SongTable;
+
+  /* searchable tag fields */
+# define TAG_ARTIST 0
+# define TAG_ALBUM  1
+# define TAG_TITLE  2
+# define TAG_FIELDS 3
+
+stags  tags_read      (int);
+char*  tags_field     (stags, int);
+char*  tags_folded    (stags, int, int *);
+int    tags_field_id  (char *);
+unsigned int tags_added (stags);
+int    tags_duration  (stags);
+int    tags_bitrate   (stags);
+void   tags_free      (stags);
+int    tags_extract   (struct SongTable *, int);
+int    tags_complete  (struct SongTable *);
+
+# endif
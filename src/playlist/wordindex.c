@@ -0,0 +1,450 @@
+/* wordindex.c: inverted index & bk-tree of the words in song paths */
+# include <stdlib.h>
+# include <string.h>
+
+# include "../mstream/mserrors.h"
+# include "songtable.h"
+# include "wordindex.h"
+
+  /* longer words are left out of the index */
+# define WORD_MAXLEN 255
+  /* words shorter than this are only ever matched exactly */
+# define WORD_FUZZY    3
+
+struct WordIndex {
+  int             nwords, size;
+  unsigned int   *word;       /* pool offset of each word */
+  unsigned char  *length;     /* and its length */
+  char           *pool;       /* the words, NUL terminated */
+  size_t          poollen, poolsize;
+  int            *slots;      /* hash of the words: id + 1 */
+  unsigned int    nslots;
+  unsigned int   *first;      /* word i: postings first [i] .. first [i+1] */
+  int            *postings;   /* songs, ascending for each word */
+  int            *child;      /* bk-tree: first child, -1 if none */
+  int            *sibling;    /* next child of the same parent */
+  unsigned char  *distance;   /* distance to the parent */
+  int             root;
+  int            *count;      /* while building: postings of each word */
+  int            *last;       /* and the last song it was seen in */
+};
+
+static int
+__word_char (unsigned char c)
+{
+  return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+/*
+ * the next word of the (folded) text between *cursor and end: a run of
+ * letters & digits. returns NULL when there are no more.
+ */
+char *
+wordindex_token (char **cursor, char *end, int *len)
+{
+  char *p = *cursor, *start;
+
+  while (p < end && !__word_char (*p))
+    p ++;
+  if (p == end) {
+    *cursor = p;
+    return NULL;
+  }
+  for (start = p; p < end && __word_char (*p); p ++)
+    ;
+  *cursor = p;
+  *len = p - start;
+  return start;
+}
+
+static unsigned int
+__hash (char *word, int len)
+{
+  unsigned int h = 2166136261u;
+
+  while (len --)
+    h = (h ^ (unsigned char) *word ++) * 16777619u;
+  return h;
+}
+
+/* the id of a word, -1 if it is not in the index */
+int
+wordindex_find (wordindex index, char *word, int len)
+{
+  unsigned int slot;
+  int id;
+
+  if (index -> nslots == 0)
+    return -1;
+  for (slot = __hash (word, len); (id = index -> slots [slot
+                                       & (index -> nslots - 1)]); slot ++)
+    if (index -> length [id - 1] == len
+        && !memcmp (index -> pool + index -> word [id - 1], word, len))
+      return id - 1;
+  return -1;
+}
+
+/* double the hash, re-inserting every word */
+static int
+__rehash (wordindex index)
+{
+  unsigned int nslots = index -> nslots ? 2 * index -> nslots : 1024, slot;
+  int *slots, i;
+
+  if ((slots = (int *) calloc (nslots, sizeof (int))) == NULL)
+    return (MS_errno = MSE_NOMEM);
+  for (i = 0; i < index -> nwords; i ++) {
+    slot = __hash (index -> pool + index -> word [i], index -> length [i]);
+    while (slots [slot & (nslots - 1)])
+      slot ++;
+    slots [slot & (nslots - 1)] = i + 1;
+  }
+  if (index -> slots != NULL) free (index -> slots);
+  index -> slots = slots;
+  index -> nslots = nslots;
+  return MSE_OK;
+}
+
+/* the id of a word, adding it if it is new (-1 on error) */
+static int
+__intern (wordindex index, char *word, int len)
+{
+  unsigned int slot, *offsets;
+  unsigned char *lengths;
+  int id, size, *grown;
+  char *pool;
+
+  if ((id = wordindex_find (index, word, len)) >= 0)
+    return id;
+
+  if (index -> nwords == index -> size) {
+    size = index -> size ? 2 * index -> size : 1024;
+    if ((offsets = realloc (index -> word, size * sizeof (int))) == NULL)
+      return -1;
+    index -> word = offsets;
+    if ((lengths = realloc (index -> length, size)) == NULL)
+      return -1;
+    index -> length = lengths;
+    if ((grown = realloc (index -> count, size * sizeof (int))) == NULL)
+      return -1;
+    index -> count = grown;
+    if ((grown = realloc (index -> last, size * sizeof (int))) == NULL)
+      return -1;
+    index -> last = grown;
+    index -> size = size;
+  }
+  if (index -> poollen + len + 1 > index -> poolsize) {
+    size = 2 * index -> poolsize + len + 1 + 4096;
+    if ((pool = realloc (index -> pool, size)) == NULL)
+      return -1;
+    index -> pool = pool;
+    index -> poolsize = size;
+  }
+  if (2 * (index -> nwords + 1) > index -> nslots
+      && __rehash (index) != MSE_OK)
+    return -1;
+
+  id = index -> nwords ++;
+  memcpy (index -> pool + index -> poollen, word, len);
+  index -> pool [index -> poollen + len] = '\0';
+  index -> word [id] = index -> poollen;
+  index -> length [id] = len;
+  index -> poollen += len + 1;
+  index -> count [id] = 0;
+  index -> last [id] = -1;
+  slot = __hash (word, len);
+  while (index -> slots [slot & (index -> nslots - 1)])
+    slot ++;
+  index -> slots [slot & (index -> nslots - 1)] = id + 1;
+  return id;
+}
+
+/*
+ * edit distance of two words, or max + 1 as soon as it is known to be
+ * larger than max.
+ */
+static int
+__distance (char *a, int alen, char *b, int blen, int max)
+{
+  int row [2][WORD_MAXLEN + 1], *prev = row [0], *cur = row [1], *tmp;
+  int i, j, best, cost;
+
+  if (alen - blen > max || blen - alen > max)
+    return max + 1;
+  for (j = 0; j <= blen; j ++)
+    prev [j] = j;
+  for (i = 1; i <= alen; i ++) {
+    cur [0] = best = i;
+    for (j = 1; j <= blen; j ++) {
+      cost = prev [j - 1] + (a [i - 1] != b [j - 1]);
+      if (prev [j] + 1 < cost) cost = prev [j] + 1;
+      if (cur [j - 1] + 1 < cost) cost = cur [j - 1] + 1;
+      cur [j] = cost;
+      if (cost < best) best = cost;
+    }
+    if (best > max)
+      return max + 1;
+    tmp = prev;
+    prev = cur;
+    cur = tmp;
+  }
+  return prev [blen] > max ? max + 1 : prev [blen];
+}
+
+/* words worth a fuzzy match: long enough, and not just a number */
+static int
+__fuzzy_word (char *word, int len)
+{
+  int i;
+
+  if (len < WORD_FUZZY)
+    return 0;
+  for (i = 0; i < len; i ++)
+    if (word [i] < '0' || word [i] > '9')
+      return 1;
+  return 0;
+}
+
+static void
+__bk_insert (wordindex index, int id)
+{
+  char *word = index -> pool + index -> word [id];
+  int node = index -> root, d, c;
+
+  if (node < 0) {
+    index -> root = id;
+    return;
+  }
+  for (;;) {
+    d = __distance (index -> pool + index -> word [node],
+                    index -> length [node], word, index -> length [id],
+                    WORD_MAXLEN);
+    for (c = index -> child [node]; c >= 0 && index -> distance [c] != d;
+         c = index -> sibling [c])
+      ;
+    if (c < 0) {
+      index -> distance [id] = d;
+      index -> sibling [id] = index -> child [node];
+      index -> child [node] = id;
+      return;
+    }
+    node = c;
+  }
+}
+
+/*
+ * walk the words of every song, counting them (pass 0) or filing them
+ * in the postings (pass 1, count then holds where each goes next).
+ */
+static int
+__scan (wordindex index, songtable songs, int pass)
+{
+  char *text, *end, *word;
+  int song, len, id;
+
+  for (song = 0; song < songtable_length (songs); song ++) {
+    text = songtable_folded_path (songs, song, &len);
+    end = text + len;
+    while ((word = wordindex_token (&text, end, &len)) != NULL) {
+      if (len > WORD_MAXLEN)
+        continue;
+      id = pass ? wordindex_find (index, word, len)
+                : __intern (index, word, len);
+      if (id < 0)
+        return (MS_errno = MSE_NOMEM);
+      if (index -> last [id] == song) /* a word is filed once per song */
+        continue;
+      index -> last [id] = song;
+      if (pass)
+        index -> postings [index -> count [id] ++] = song;
+      else
+        index -> count [id] ++;
+    }
+  }
+  return MSE_OK;
+}
+
+/*
+ * index the words of every song in a sealed table. the index does not
+ * change afterwards, so it may be searched by any number of threads.
+ */
+wordindex
+wordindex_build (songtable songs)
+{
+  wordindex index;
+  int i, total;
+
+  if ((index = (wordindex) calloc (1, sizeof (struct WordIndex))) == NULL) {
+    MS_errno = MSE_NOMEM;
+    return NULL;
+  }
+  index -> root = -1;
+  if (__scan (index, songs, 0) != MSE_OK)
+    goto ErrorEpilogue;
+
+  /* lay the postings out one word after the other */
+  if ((index -> first = (unsigned int *) malloc ((index -> nwords + 1)
+                                                 * sizeof (int))) == NULL)
+    goto NoMemory;
+  for (i = total = 0; i < index -> nwords; i ++) {
+    index -> first [i] = total;
+    total += index -> count [i];
+    index -> count [i] = index -> first [i];
+    index -> last [i] = -1;
+  }
+  index -> first [index -> nwords] = total;
+  if ((index -> postings = (int *) malloc ((total + 1) * sizeof (int)))
+      == NULL)
+    goto NoMemory;
+  if (__scan (index, songs, 1) != MSE_OK)
+    goto ErrorEpilogue;
+  free (index -> count);
+  free (index -> last);
+  index -> count = index -> last = NULL;
+
+  /* and the names in the bk-tree */
+  index -> child = (int *) malloc ((index -> nwords + 1) * sizeof (int));
+  index -> sibling = (int *) malloc ((index -> nwords + 1) * sizeof (int));
+  index -> distance = (unsigned char *) malloc (index -> nwords + 1);
+  if (index -> child == NULL || index -> sibling == NULL
+      || index -> distance == NULL)
+    goto NoMemory;
+  for (i = 0; i < index -> nwords; i ++)
+    index -> child [i] = index -> sibling [i] = -1;
+  for (i = 0; i < index -> nwords; i ++)
+    if (__fuzzy_word (index -> pool + index -> word [i], index -> length [i]))
+      __bk_insert (index, i);
+
+  return index;
+
+ NoMemory:
+  MS_errno = MSE_NOMEM;
+ ErrorEpilogue:
+  wordindex_free (index);
+  return NULL;
+}
+
+/* how many words the index holds, their ids are 0 .. n - 1 */
+int
+wordindex_words (wordindex index)
+{
+  return index -> nwords;
+}
+
+/* a word of the index (NUL terminated), and its length */
+char *
+wordindex_word (wordindex index, int word, int *len)
+{
+  *len = index -> length [word];
+  return index -> pool + index -> word [word];
+}
+
+/* the songs a word appears in (ascending), and how many they are */
+int *
+wordindex_postings (wordindex index, int word, int *n)
+{
+  *n = index -> first [word + 1] - index -> first [word];
+  return index -> postings + index -> first [word];
+}
+
+/*
+ * find the words at most maxdist edits away from word, in no particular
+ * order. returns how many were found, or -1 if memory ran out. words too
+ * short (or numbers) are only looked for as they are.
+ */
+int
+wordindex_similar (wordindex index, char *word, int len, int maxdist,
+                   struct WordMatch **matches)
+{
+  int *stack = NULL, *grown, depth = 0, size = 0, n = 0, room = 0;
+  struct WordMatch *more;
+  int node, d, c;
+
+  *matches = NULL;
+  if (len > WORD_MAXLEN)
+    return 0;
+  if (!__fuzzy_word (word, len) || maxdist == 0) {
+    if ((node = wordindex_find (index, word, len)) < 0)
+      return 0;
+    if ((*matches = (struct WordMatch *) malloc (sizeof (struct WordMatch)))
+        == NULL)
+      return (MS_errno = MSE_NOMEM, -1);
+    (*matches) [0] . word = node;
+    (*matches) [0] . distance = 0;
+    return 1;
+  }
+
+  if (index -> root >= 0) {
+    if ((stack = (int *) malloc (64 * sizeof (int))) == NULL)
+      return (MS_errno = MSE_NOMEM, -1);
+    size = 64;
+    stack [depth ++] = index -> root;
+  }
+  while (depth > 0) {
+    node = stack [-- depth];
+    d = __distance (index -> pool + index -> word [node],
+                    index -> length [node], word, len, WORD_MAXLEN);
+    if (d <= maxdist) {
+      if (n == room) {
+        room = room ? 2 * room : 16;
+        if ((more = realloc (*matches, room * sizeof (struct WordMatch)))
+            == NULL)
+          goto NoMemory;
+        *matches = more;
+      }
+      (*matches) [n] . word = node;
+      (*matches) [n ++] . distance = d;
+    }
+    /* only subtrees within maxdist of d may hold a match */
+    for (c = index -> child [node]; c >= 0; c = index -> sibling [c])
+      if (index -> distance [c] >= d - maxdist
+          && index -> distance [c] <= d + maxdist) {
+        if (depth == size) {
+          size *= 2;
+          if ((grown = realloc (stack, size * sizeof (int))) == NULL)
+            goto NoMemory;
+          stack = grown;
+        }
+        stack [depth ++] = c;
+      }
+  }
+  if (stack != NULL) free (stack);
+  return n;
+
+ NoMemory:
+  free (stack);
+  if (*matches != NULL) free (*matches);
+  *matches = NULL;
+  MS_errno = MSE_NOMEM;
+  return -1;
+}
+
+/* memory used by the index */
+size_t
+wordindex_bytes (wordindex index)
+{
+  return sizeof (struct WordIndex) + index -> poolsize
+         + index -> size * (sizeof (int) + 1)
+         + index -> nslots * sizeof (int)
+         + (index -> nwords + 1) * (3 * sizeof (int) + 1)
+         + (index -> first ? index -> first [index -> nwords] : 0)
+           * sizeof (int);
+}
+
+void
+wordindex_free (wordindex index)
+{
+  if (index -> word != NULL) free (index -> word);
+  if (index -> length != NULL) free (index -> length);
+  if (index -> pool != NULL) free (index -> pool);
+  if (index -> slots != NULL) free (index -> slots);
+  if (index -> first != NULL) free (index -> first);
+  if (index -> postings != NULL) free (index -> postings);
+  if (index -> child != NULL) free (index -> child);
+  if (index -> sibling != NULL) free (index -> sibling);
+  if (index -> distance != NULL) free (index -> distance);
+  if (index -> count != NULL) free (index -> count);
+  if (index -> last != NULL) free (index -> last);
+  free (index);
+  return;
+}
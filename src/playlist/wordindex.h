@@ -0,0 +1,30 @@
+# ifndef __WORD_INDEX_LIB__
+# define __WORD_INDEX_LIB__
+
+# include <stddef.h>
+# include "songtable.h"
+
+/*
+ * an inverted index of the words in the (folded) song paths: each word
+ * maps to the sorted list of songs it appears in. words that look like
+ * names are also kept in a bk-tree, to find the ones close to a typo.
+ */
+typedef struct WordIndex *wordindex;
+
+struct WordMatch {
+  int word;
+  int distance;   /* edits away from the word looked for */
+};
+
+wordindex wordindex_build     (songtable);
+char*     wordindex_token     (char **, char *, int *);
+int       wordindex_find      (wordindex, char *, int);
+int       wordindex_words     (wordindex);
+char*     wordindex_word      (wordindex, int, int *);
+int*      wordindex_postings  (wordindex, int, int *);
+int       wordindex_similar   (wordindex, char *, int, int,
+                               struct WordMatch **);
+size_t    wordindex_bytes     (wordindex);
+void      wordindex_free      (wordindex);
+
+# endif
@@ -0,0 +1,267 @@
+/* fold.c: case & accent folding, and a substring search over folded text */
+# include <stdlib.h>
+# include <string.h>
+# if defined (__x86_64__) || defined (__i386__)
+# include <immintrin.h>
+# endif
+# include "fold.h"
+
+/* latin letters with diacritics, and what they fold to */
+static struct {
+  unsigned short first, last;
+  char *to;
+} latin [] = {
+  {0xc0, 0xc5, "a"}, {0xc6, 0xc6, "ae"}, {0xc7, 0xc7, "c"},
+  {0xc8, 0xcb, "e"}, {0xcc, 0xcf, "i"}, {0xd0, 0xd0, "d"},
+  {0xd1, 0xd1, "n"}, {0xd2, 0xd6, "o"}, {0xd8, 0xd8, "o"},
+  {0xd9, 0xdc, "u"}, {0xdd, 0xdd, "y"}, {0xde, 0xde, "th"},
+  {0xdf, 0xdf, "ss"}, {0xe0, 0xe5, "a"}, {0xe6, 0xe6, "ae"},
+  {0xe7, 0xe7, "c"}, {0xe8, 0xeb, "e"}, {0xec, 0xef, "i"},
+  {0xf0, 0xf0, "d"}, {0xf1, 0xf1, "n"}, {0xf2, 0xf6, "o"},
+  {0xf8, 0xf8, "o"}, {0xf9, 0xfc, "u"}, {0xfd, 0xfd, "y"},
+  {0xfe, 0xfe, "th"}, {0xff, 0xff, "y"},
+  {0x100, 0x105, "a"}, {0x106, 0x10d, "c"}, {0x10e, 0x111, "d"},
+  {0x112, 0x11b, "e"}, {0x11c, 0x123, "g"}, {0x124, 0x127, "h"},
+  {0x128, 0x131, "i"}, {0x132, 0x133, "ij"}, {0x134, 0x135, "j"},
+  {0x136, 0x138, "k"}, {0x139, 0x142, "l"}, {0x143, 0x14b, "n"},
+  {0x14c, 0x151, "o"}, {0x152, 0x153, "oe"}, {0x154, 0x159, "r"},
+  {0x15a, 0x161, "s"}, {0x162, 0x167, "t"}, {0x168, 0x173, "u"},
+  {0x174, 0x175, "w"}, {0x176, 0x178, "y"}, {0x179, 0x17e, "z"},
+  {0x17f, 0x17f, "s"}, {0, 0, NULL}
+};
+
+/* decode one utf-8 sequence, return its length (0 if it is not valid) */
+static int
+__utf8 (const unsigned char *s, unsigned int *code)
+{
+  int len, i;
+
+  if (s [0] < 0x80) {
+    *code = s [0];
+    return 1;
+  }
+  if (s [0] >= 0xc2 && s [0] < 0xe0)
+    len = 2, *code = s [0] & 0x1f;
+  else if (s [0] >= 0xe0 && s [0] < 0xf0)
+    len = 3, *code = s [0] & 0x0f;
+  else if (s [0] >= 0xf0 && s [0] < 0xf5)
+    len = 4, *code = s [0] & 0x07;
+  else
+    return 0;
+  for (i = 1; i < len; i ++) {
+    if ((s [i] & 0xc0) != 0x80)
+      return 0;
+    *code = (*code << 6) | (s [i] & 0x3f);
+  }
+  return len;
+}
+
+/*
+ * fold a (utf-8) string into buff, return the length of the result or
+ * -1 if buff is too short. a buffer as long as the string always does.
+ * bytes that are not valid utf-8 are copied as they are. str and buff
+ * may be the same string.
+ */
+int
+fold_text (const char *str, char *buff, int buflen)
+{
+  const unsigned char *s = (const unsigned char *) str;
+  unsigned int code;
+  int len, out = 0, i;
+  char *to;
+
+  while (*s) {
+    if (*s < 0x80) { /* the common case */
+      if (out + 1 >= buflen)
+        return -1;
+      buff [out ++] = (*s >= 'A' && *s <= 'Z') ? *s + 32 : *s;
+      s ++;
+      continue;
+    }
+    if ((len = __utf8 (s, &code)) == 0) {
+      if (out + 1 >= buflen)
+        return -1;
+      buff [out ++] = *s ++;
+      continue;
+    }
+
+    to = NULL;
+    if (code >= 0x300 && code <= 0x36f) { /* combining marks are dropped */
+      s += len;
+      continue;
+    }
+    for (i = 0; latin [i] . to != NULL && code >= latin [i] . first; i ++)
+      if (code <= latin [i] . last) {
+        to = latin [i] . to;
+        break;
+      }
+    if (to != NULL) {
+      if (out + (int) strlen (to) >= buflen)
+        return -1;
+      memcpy (buff + out, to, strlen (to));
+      out += strlen (to);
+      s += len;
+      continue;
+    }
+
+    /* greek & cyrillic capitals are lowered, keeping their length */
+    if (code >= 0x391 && code <= 0x3a9 && code != 0x3a2)
+      code += 0x20;
+    else if (code >= 0x410 && code <= 0x42f)
+      code += 0x20;
+    else if (code >= 0x400 && code <= 0x40f)
+      code += 0x50;
+    if (out + len >= buflen)
+      return -1;
+    if (len == 2 && code < 0x800) {
+      buff [out ++] = 0xc0 | (code >> 6);
+      buff [out ++] = 0x80 | (code & 0x3f);
+    }
+    else {
+      memmove (buff + out, s, len);
+      out += len;
+    }
+    s += len;
+  }
+  buff [out] = '\0';
+
+  return out;
+}
+
+/*
+ * the kernels look for the first & last byte of the needle at every
+ * position of the haystack, and compare the rest only where both match.
+ * the vector ones read up to FOLD_PADDING bytes past the haystack.
+ */
+static int
+__find_scalar (const char *hay, int haylen, const char *needle, int nlen)
+{
+  const char *p = hay, *end = hay + haylen - nlen + 1;
+
+  while (p < end && (p = memchr (p, needle [0], end - p)) != NULL) {
+    if (p [nlen - 1] == needle [nlen - 1]
+        && (nlen <= 2 || !memcmp (p + 1, needle + 1, nlen - 2)))
+      return p - hay;
+    p ++;
+  }
+  return -1;
+}
+
+# if defined (__x86_64__) || defined (__i386__)
+__attribute__ ((target ("sse4.2"))) static int
+__find_sse (const char *hay, int haylen, const char *needle, int nlen)
+{
+  __m128i first = _mm_set1_epi8 (needle [0]);
+  __m128i last = _mm_set1_epi8 (needle [nlen - 1]);
+  unsigned int mask;
+  int i, bit, left;
+
+  for (i = 0; i <= haylen - nlen; i += 16) {
+    mask = _mm_movemask_epi8 (_mm_and_si128 (
+      _mm_cmpeq_epi8 (first, _mm_loadu_si128 ((const __m128i *) (hay + i))),
+      _mm_cmpeq_epi8 (last, _mm_loadu_si128 ((const __m128i *)
+                                             (hay + i + nlen - 1)))));
+    if ((left = haylen - nlen - i) < 15) /* positions past the end */
+      mask &= (2u << left) - 1;
+    while (mask) {
+      bit = __builtin_ctz (mask);
+      if (nlen <= 2 || !memcmp (hay + i + bit + 1, needle + 1, nlen - 2))
+        return i + bit;
+      mask &= mask - 1;
+    }
+  }
+  return -1;
+}
+
+__attribute__ ((target ("avx2"))) static int
+__find_avx2 (const char *hay, int haylen, const char *needle, int nlen)
+{
+  __m256i first = _mm256_set1_epi8 (needle [0]);
+  __m256i last = _mm256_set1_epi8 (needle [nlen - 1]);
+  unsigned int mask;
+  int i, bit, left;
+
+  for (i = 0; i <= haylen - nlen; i += 32) {
+    mask = _mm256_movemask_epi8 (_mm256_and_si256 (
+      _mm256_cmpeq_epi8 (first, _mm256_loadu_si256 ((const __m256i *)
+                                                    (hay + i))),
+      _mm256_cmpeq_epi8 (last, _mm256_loadu_si256 ((const __m256i *)
+                                                   (hay + i + nlen - 1)))));
+    if ((left = haylen - nlen - i) < 31)
+      mask &= (2u << left) - 1;
+    while (mask) {
+      bit = __builtin_ctz (mask);
+      if (nlen <= 2 || !memcmp (hay + i + bit + 1, needle + 1, nlen - 2))
+        return i + bit;
+      mask &= mask - 1;
+    }
+  }
+  return -1;
+}
+# endif
+
+static struct {
+  char *name;
+  int (*find) (const char *, int, const char *, int);
+} kernels [] = {
+# if defined (__x86_64__) || defined (__i386__)
+  {"avx2", __find_avx2}, {"sse4.2", __find_sse},
+# endif
+  {"scalar", __find_scalar}, {NULL, NULL}
+};
+static int kernel = -1;
+
+/* whether the cpu can run a kernel */
+static int
+__supported (int i)
+{
+# if defined (__x86_64__) || defined (__i386__)
+  if (!strcmp (kernels [i] . name, "avx2"))
+    return __builtin_cpu_supports ("avx2");
+  if (!strcmp (kernels [i] . name, "sse4.2"))
+    return __builtin_cpu_supports ("sse4.2");
+# endif
+  return 1;
+}
+
+/*
+ * pick the search kernel by name ("avx2", "sse4.2" or "scalar"), or the
+ * fastest the cpu supports if name is NULL. -1 if it cannot be used.
+ */
+int
+fold_kernel (char *name)
+{
+  int i;
+
+  for (i = 0; kernels [i] . name != NULL; i ++)
+    if ((name == NULL || !strcmp (name, kernels [i] . name))
+        && __supported (i)) {
+      kernel = i;
+      return 0;
+    }
+  return -1;
+}
+
+char *
+fold_kernel_name (void)
+{
+  if (kernel < 0)
+    fold_kernel (NULL);
+  return kernels [kernel] . name;
+}
+
+/*
+ * find needle in the first haylen bytes of hay, return its offset or -1.
+ * hay must be followed by FOLD_PADDING readable bytes.
+ */
+int
+fold_find (const char *hay, int haylen, const char *needle, int nlen)
+{
+  if (nlen == 0)
+    return 0;
+  if (nlen > haylen)
+    return -1;
+  if (kernel < 0) /* racing threads pick the same kernel */
+    fold_kernel (NULL);
+  return kernels [kernel] . find (hay, haylen, needle, nlen);
+}
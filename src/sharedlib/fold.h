@@ -0,0 +1,17 @@
+# ifndef __TEXT_FOLDING_LIB__
+# define __TEXT_FOLDING_LIB__
+
+/*
+ * folded text is lower case, with the diacritics of latin letters
+ * stripped (eg "Björk" -> "bjork"), and never longer than the original.
+ */
+
+  /* readable bytes a haystack must be followed by, for vector loads */
+# define FOLD_PADDING 32
+
+int   fold_text        (const char*, char*, int);
+int   fold_find        (const char*, int, const char*, int);
+int   fold_kernel      (char*);
+char* fold_kernel_name (void);
+
+# endif
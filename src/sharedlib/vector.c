@@ -0,0 +1,182 @@
+/* vector.c: a growable array of pointers */
+# include <stdlib.h>
+# include <string.h>
+# include "vector.h"
+
+/*
+ * the items are in local until they outgrow it, then on the heap,
+ * doubling the room every time it runs out.
+ */
+struct Vector {
+  int    length, size;
+  void **items;
+  void  *local [VECTOR_LOCAL];
+};
+
+int
+vector_init (vector *v)
+{
+  if ((*v = (vector) malloc (sizeof (struct Vector))) == NULL)
+    return 0;
+  (*v) -> length = 0;
+  (*v) -> size = VECTOR_LOCAL;
+  (*v) -> items = (*v) -> local;
+  return 1;
+}
+
+int
+vector_length (vector v)
+{
+  if (v == NULL) return 0;
+  return v -> length;
+}
+
+/* the i-th item, NULL if there is none */
+void *
+vector_get (vector v, int i)
+{
+  if (v == NULL || i < 0 || i >= v -> length) return NULL;
+  return v -> items [i];
+}
+
+void
+vector_set (vector v, int i, void *entry)
+{
+  if (v == NULL || i < 0 || i >= v -> length) return;
+  v -> items [i] = entry;
+  return;
+}
+
+/* room for at least size items */
+static int
+__reserve (vector v, int size)
+{
+  void **items;
+  int room = v -> size;
+
+  if (size <= room)
+    return 1;
+  while (room < size)
+    room *= 2;
+  if (v -> items == v -> local) {
+    if ((items = (void **) malloc (room * sizeof (void *))) == NULL)
+      return 0;
+    memcpy (items, v -> local, v -> length * sizeof (void *));
+  }
+  else if ((items = (void **) realloc (v -> items, room * sizeof (void *)))
+           == NULL)
+    return 0;
+  v -> items = items;
+  v -> size = room;
+  return 1;
+}
+
+int
+vector_append (vector v, void *entry)
+{
+  if (v == NULL || !__reserve (v, v -> length + 1))
+    return 0;
+  v -> items [v -> length ++] = entry;
+  return 1;
+}
+
+/* remove the i-th item, the ones after it move up */
+int
+vector_remove (vector v, int i)
+{
+  if (v == NULL || i < 0 || i >= v -> length)
+    return 0;
+  memmove (v -> items + i, v -> items + i + 1,
+           (v -> length - i - 1) * sizeof (void *));
+  v -> length --;
+  return 1;
+}
+
+/* append the items of v2 to v1, leaving v2 empty */
+int
+vector_merge (vector v1, vector v2)
+{
+  if (v1 == NULL || v2 == NULL) return 0;
+  if (!__reserve (v1, v1 -> length + v2 -> length))
+    return 0;
+  memcpy (v1 -> items + v1 -> length, v2 -> items,
+          v2 -> length * sizeof (void *));
+  v1 -> length += v2 -> length;
+  v2 -> length = 0;
+  return 1;
+}
+
+int
+vector_copy (vector *dest, vector src)
+{
+  if (!vector_init (dest))
+    return 0;
+  if (src == NULL)
+    return 1;
+  if (!__reserve (*dest, src -> length)) {
+    vector_delete (*dest);
+    return 0;
+  }
+  memcpy ((*dest) -> items, src -> items, src -> length * sizeof (void *));
+  (*dest) -> length = src -> length;
+  return 1;
+}
+
+/* the index of the item which equals key according to compar, or -1 */
+int
+vector_find (vector v, void *key, int (*compar) (void *, void *))
+{
+  int i;
+
+  if (v == NULL) return -1;
+  for (i = 0; i < v -> length; i ++)
+    /* upon equality compar returns 0 */
+    if (!compar (v -> items [i], key))
+      return i;
+  return -1;
+}
+
+/* a vector of the items satisfying filter, NULL if v is empty */
+vector
+vector_subset (vector v, int (*filter) (void *))
+{
+  vector nv;
+  int i;
+
+  if (v == NULL || v -> length == 0 || !vector_init (&nv))
+    return NULL;
+  for (i = 0; i < v -> length; i ++)
+    if (filter (v -> items [i]) && !vector_append (nv, v -> items [i])) {
+      vector_delete (nv);
+      return NULL;
+    }
+  return nv;
+}
+
+/* same as vector_subset, but filter is also given a key */
+vector
+vector_subset_key (vector v, void *key, int (*filter) (void *, void *))
+{
+  vector nv;
+  int i;
+
+  if (v == NULL || v -> length == 0 || !vector_init (&nv))
+    return NULL;
+  for (i = 0; i < v -> length; i ++)
+    if (filter (v -> items [i], key) && !vector_append (nv, v -> items [i])) {
+      vector_delete (nv);
+      return NULL;
+    }
+  return nv;
+}
+
+/* delete the vector (not the items it points to) */
+int
+vector_delete (vector v)
+{
+  if (v == NULL) return 0;
+  if (v -> items != v -> local)
+    free (v -> items);
+  free (v);
+  return 1;
+}
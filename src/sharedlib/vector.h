@@ -0,0 +1,27 @@
+# ifndef __GROWABLE_VECTOR_LIB__
+# define __GROWABLE_VECTOR_LIB__
+
+  /* items kept in the vector itself, before any other allocation */
+# define VECTOR_LOCAL 8
+
+/*
+ * a growable array of pointers, contiguous so that walking it is not
+ * a pointer chase. short vectors (eg the headers of a request) live in
+ * a single allocation. functions return 0 on failure, as dhlist's do.
+ */
+typedef struct Vector * vector;
+
+int    vector_init       (vector *);
+int    vector_length     (vector);
+void * vector_get        (vector, int);
+void   vector_set        (vector, int, void *);
+int    vector_append     (vector, void *);
+int    vector_remove     (vector, int);
+int    vector_merge      (vector, vector);
+int    vector_copy       (vector *, vector);
+int    vector_find       (vector, void *, int (*compar) (void *, void *));
+vector vector_subset     (vector, int (*filter) (void *));
+vector vector_subset_key (vector, void *, int (*filter) (void *, void *));
+int    vector_delete     (vector);
+
+# endif